@@ -0,0 +1,27 @@
+#pragma once
+#include <memory>
+#include <lua.hpp>
+
+#include "buffer.hpp"
+
+namespace pluto {
+
+// metatable name of buffer.to_shared userdata, see lualib-src/lua-buffer
+inline constexpr const char* BUFFER_SHARED_METANAME = "lbuffer_shr_ptr";
+
+// buffer lightuserdata or buffer.to_shared userdata at index, raises an
+// argument error for anything else
+inline buffer* lua_check_buffer(lua_State* L, int index) {
+    buffer* b = nullptr;
+    if (lua_type(L, index) == LUA_TLIGHTUSERDATA) {
+        b = static_cast<buffer*>(lua_touserdata(L, index));
+    } else if (lua_type(L, index) == LUA_TUSERDATA) {
+        auto shr = static_cast<std::shared_ptr<buffer>*>(luaL_checkudata(L, index, BUFFER_SHARED_METANAME));
+        b = shr->get();
+    }
+    if (nullptr == b)
+        luaL_argerror(L, index, "expected buffer");
+    return b;
+}
+
+} // namespace pluto
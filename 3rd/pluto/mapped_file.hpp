@@ -0,0 +1,142 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace pluto {
+
+// Whole-file memory mapping. Pages are shared with every process mapping the
+// same file; with copy_on_write the mapping may be written in place, and only
+// the written pages become private to this process.
+//
+// Update contract: a mapped file is replaced only by writing a new file and
+// renaming it over the old path (see navmesh_builder). The mapping keeps the
+// old inode, so it stays valid until it is closed. Truncating or rewriting the
+// file in place raises SIGBUS on pages beyond the new end, and the pages not
+// read yet silently come from the new content.
+class mapped_file {
+public:
+    mapped_file() = default;
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+        close();
+    }
+
+    bool open(const std::string& path, bool copy_on_write) {
+        close();
+#ifdef _WIN32
+        file_ = CreateFileA(
+            path.c_str(),
+            GENERIC_READ,
+            // no FILE_SHARE_WRITE, so in place writes fail while it's mapped
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+        );
+        if (file_ == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+            close();
+            return false;
+        }
+
+        mapping_ = CreateFileMappingA(
+            file_,
+            nullptr,
+            copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY,
+            0,
+            0,
+            nullptr
+        );
+        if (nullptr == mapping_) {
+            close();
+            return false;
+        }
+
+        data_ = static_cast<char*>(
+            MapViewOfFile(mapping_, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0)
+        );
+        if (nullptr == data_) {
+            close();
+            return false;
+        }
+        size_ = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+
+        int prot = copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ;
+        // nothing stops writers here, files are updated by rename only (see above)
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), prot, MAP_PRIVATE, fd, 0);
+        // the mapping keeps its own reference to the file
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+
+        data_ = static_cast<char*>(p);
+        size_ = static_cast<size_t>(st.st_size);
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (nullptr != data_)
+            UnmapViewOfFile(data_);
+        if (nullptr != mapping_)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (nullptr != data_)
+            munmap(data_, size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+};
+
+} // namespace pluto
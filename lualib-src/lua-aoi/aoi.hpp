@@ -16,7 +16,8 @@ class aoi {
 public:
     enum mode {
         watcher = 1, //Observer
-        marker = 1 << 1
+        marker = 1 << 1,
+        range = 1 << 2 //marker indexed in every tile its extent(w,h) covers
     };
 
     enum event_type {
@@ -111,27 +112,25 @@ public:
             return false;
         }
 
+        if (range_marker) {
+            mode |= range;
+        }
+
+        if (!(mode & marker) || w <= 0 || h <= 0) {
+            mode &= ~range;
+        }
+
         auto res = objects_.try_emplace(handle, object_type { x, y, w, h, layer, mode, handle });
         if (res.second) {
-            int tile_x = get_tile_x(x);
-            int tile_y = get_tile_y(y);
-
             if (mode & marker) {
-                if (range_marker && w > 0 && h > 0) {
-                    assert(!(mode & watcher) && "unsupport");
-                    auto tile_rect = make_tile_rect(x, y, w, h);
-                    for_each_rect(tile_rect, [this, &res](int x, int y) {
-                        insert_marker(&res.first->second, x, y);
-                    });
-                } else {
-                    insert_marker(&res.first->second, tile_x, tile_y);
-                }
+                insert_marker(&res.first->second);
             }
 
             if (mode & watcher) {
                 auto tile_rect = make_tile_rect(x, y, w, h);
                 auto rc = make_rect(x, y, w, h);
 
+                visited_.clear();
                 for_each_rect(tile_rect, [this, &res, &rc](int x, int y) {
                     tile& t = data_[y * count_ + x];
                     insert_watcher(t, &res.first->second);
@@ -139,7 +138,7 @@ public:
                         std::cout << res.first->first << " watch (" << x << "," << y << ")"
                                   << std::endl;
                     }
-                    update_watcher(t, rect<int> { -1, -1, 0, 0 }, rc, &res.first->second);
+                    update_watcher(t, nullptr, rc, &res.first->second);
                 });
             }
             return true;
@@ -153,10 +152,7 @@ public:
             return;
         }
         object_type* obj = &iter->second;
-        int tile_x = get_tile_x(obj->x);
-        int tile_y = get_tile_y(obj->y);
-        tile& t = data_[tile_y * count_ + tile_x];
-        marker_event(t, obj, eventid);
+        marker_event(obj, eventid, false);
     }
 
     // update pos, view width, view height, layer
@@ -177,6 +173,8 @@ public:
 
         auto old_x = obj->x;
         auto old_y = obj->y;
+        auto old_w = obj->w;
+        auto old_h = obj->h;
         obj->x = x;
         obj->y = y;
         obj->h = h;
@@ -184,7 +182,11 @@ public:
         obj->layer = layer;
 
         if (iter->second.mode & marker) {
-            update_marker(obj, old_x, old_y);
+            if (is_range_marker(obj)) {
+                update_range_marker(obj, old_x, old_y, old_w, old_h);
+            } else {
+                update_marker(obj, old_x, old_y);
+            }
         }
 
         while (iter->second.mode & watcher) {
@@ -192,6 +194,7 @@ public:
             auto new_tile_rect = make_tile_rect(x, y, w, h);
 
             if (old_rect.contains(new_rect)) {
+                visited_.clear();
                 for_each_rect(
                     old_tile_rect,
                     [this, &new_rect, &new_tile_rect, &old_rect, &obj](int x, int y) {
@@ -210,13 +213,14 @@ public:
                             }
                         }
 
-                        update_watcher(t, old_rect, new_rect, obj);
+                        update_watcher(t, &old_rect, new_rect, obj);
                     }
                 );
                 break;
             }
 
             if (old_rect.contains(new_rect)) {
+                visited_.clear();
                 for_each_rect(
                     new_tile_rect,
                     [this, &new_rect, &old_tile_rect, &old_rect, &obj](int x, int y) {
@@ -235,12 +239,13 @@ public:
                             }
                         }
 
-                        update_watcher(t, old_rect, new_rect, obj);
+                        update_watcher(t, &old_rect, new_rect, obj);
                     }
                 );
                 break;
             }
 
+            visited_.clear();
             for_each_rect(
                 old_tile_rect,
                 [this, &new_rect, &new_tile_rect, &old_rect, &obj](int x, int y) {
@@ -259,10 +264,11 @@ public:
                         }
                     }
                     //std::cout << " update_watcher1 (" << x << "," << y << ")" << std::endl;
-                    update_watcher(t, old_rect, new_rect, obj, false, true);
+                    update_watcher(t, &old_rect, new_rect, obj, false, true);
                 }
             );
 
+            visited_.clear();
             for_each_rect(
                 new_tile_rect,
                 [this, &new_rect, &old_tile_rect, &old_rect, &obj](int x, int y) {
@@ -281,7 +287,7 @@ public:
                         }
                     }
                     //std::cout << " update_watcher2 (" << x << "," << y << ")" << std::endl;
-                    update_watcher(t, old_rect, new_rect, obj, true, false);
+                    update_watcher(t, &old_rect, new_rect, obj, true, false);
                 }
             );
             break;
@@ -301,22 +307,27 @@ public:
         int end_index_x = tile_rc.right();
         int end_index_y = tile_rc.top();
 
+        visited_.clear();
         for (int i = start_index_x; i <= end_index_x; ++i) {
             bool is_x_edge = (i == start_index_x) || (i == end_index_x);
             for (int j = start_index_y; j <= end_index_y; ++j) {
                 bool is_edge = is_x_edge || (j == start_index_y) || (j == end_index_y);
                 tile& node = data_[j * count_ + i];
-                if (is_edge) {
-                    for (auto& m: node.markers) {
-                        if (m->inside(rc) && m->check(std::forward<Args>(args)...)) {
-                            out.push_back(m->handle);
+                for (auto& m: node.markers) {
+                    if (is_range_marker(m)) {
+                        // range marker may be indexed in several tiles, report it once
+                        if (!visited_.emplace(m).second) {
+                            continue;
                         }
-                    }
-                } else {
-                    for (auto& m: node.markers) {
-                        if (m->check(std::forward<Args>(args)...)) {
-                            out.push_back(m->handle);
+                        if (is_edge && !rc.intersects(make_rect(m->x, m->y, m->w, m->h))) {
+                            continue;
                         }
+                    } else if (is_edge && !m->inside(rc)) {
+                        continue;
+                    }
+
+                    if (m->check(std::forward<Args>(args)...)) {
+                        out.push_back(m->handle);
                     }
                 }
             }
@@ -338,21 +349,7 @@ public:
         auto iter = objects_.find(handle);
         if (iter != objects_.end()) {
             if (iter->second.mode & marker) {
-                if (iter->second.w > 0 && iter->second.h > 0) {
-                    auto tile_rect = make_tile_rect(
-                        iter->second.x,
-                        iter->second.y,
-                        iter->second.w,
-                        iter->second.h
-                    );
-                    for_each_rect(tile_rect, [this, &iter](int x, int y) {
-                        remove_marker(&iter->second, x, y);
-                    });
-                } else {
-                    int tile_x = get_tile_x(iter->second.x);
-                    int tile_y = get_tile_y(iter->second.y);
-                    remove_marker(&iter->second, tile_x, tile_y);
-                }
+                remove_marker(&iter->second);
             }
 
             if (iter->second.mode & watcher) {
@@ -422,38 +419,56 @@ public:
     }
 
 private:
-    void insert_marker(object_type* obj, int tile_x, int tile_y) {
-        tile& node = data_[tile_y * count_ + tile_x];
-        node.markers.emplace_front(obj);
-
-        for (const auto& w: node.watchers) {
-            if (w->handle == obj->handle)
-                continue;
-
-            auto rc = make_rect(w->x, w->y, w->w, w->h);
-            if (!rc.contains(obj->x, obj->y)) {
-                continue;
-            }
+    static bool is_range_marker(const object_type* obj) {
+        return (obj->mode & range) != 0;
+    }
 
-            event_queue_.emplace_back(static_cast<int>(event_enter), w->handle, obj->handle);
+    // tiles an object is indexed in as a marker
+    rect<int> marker_tile_rect(const object_type* obj, int x, int y, int w, int h) const {
+        if (is_range_marker(obj)) {
+            return make_tile_rect(x, y, w, h);
         }
+        return rect<int> { get_tile_x(x), get_tile_y(y), 0, 0 };
     }
 
-    void remove_marker(object_type* obj, int tile_x, int tile_y) {
-        tile& node = data_[tile_y * count_ + tile_x];
-        node.markers.remove(obj);
-
-        for (const auto& w: node.watchers) {
-            if (w->handle == obj->handle)
-                continue;
+    // is marker(at x,y with extent w,h) visible in view rc
+    bool in_view(const rect<int>& rc, const object_type* obj, int x, int y, int w, int h) const {
+        if (is_range_marker(obj)) {
+            return rc.intersects(make_rect(x, y, w, h));
+        }
+        return rc.contains(x, y);
+    }
 
-            auto rc = make_rect(w->x, w->y, w->w, w->h);
-            if (!rc.contains(obj->x, obj->y)) {
-                continue;
+    // visit each watcher of the tiles in tile_rect once
+    template<typename Handler>
+    void for_each_watcher(const rect<int>& tile_rect, const Handler& hander) {
+        bool single = tile_rect.width == 0 && tile_rect.height == 0;
+        visited_.clear();
+        for_each_rect(tile_rect, [this, single, &hander](int x, int y) {
+            tile& node = data_[y * count_ + x];
+            for (const auto& w: node.watchers) {
+                if (!single && !visited_.emplace(w).second) {
+                    continue;
+                }
+                hander(w);
             }
+        });
+    }
 
-            event_queue_.emplace_back(static_cast<int>(event_leave), w->handle, obj->handle);
-        }
+    void insert_marker(object_type* obj) {
+        auto tile_rect = marker_tile_rect(obj, obj->x, obj->y, obj->w, obj->h);
+        for_each_rect(tile_rect, [this, obj](int x, int y) {
+            data_[y * count_ + x].markers.emplace_front(obj);
+        });
+        marker_event(obj, event_enter, true);
+    }
+
+    void remove_marker(object_type* obj) {
+        auto tile_rect = marker_tile_rect(obj, obj->x, obj->y, obj->w, obj->h);
+        for_each_rect(tile_rect, [this, obj](int x, int y) {
+            data_[y * count_ + x].markers.remove(obj);
+        });
+        marker_event(obj, event_leave, true);
     }
 
     void update_marker(object_type* obj, int old_x, int old_y) {
@@ -500,18 +515,65 @@ private:
         }
     }
 
-    void marker_event(tile& node, object_type* obj, int eventid) {
-        assert(std::find(node.markers.begin(), node.markers.end(), obj) != node.markers.end());
-        for (const auto& w: node.watchers) {
-            //if (w->handle == obj->handle) continue;
+    void update_range_marker(object_type* obj, int old_x, int old_y, int old_w, int old_h) {
+        auto old_tile_rect = make_tile_rect(old_x, old_y, old_w, old_h);
+        auto new_tile_rect = make_tile_rect(obj->x, obj->y, obj->w, obj->h);
+
+        if (!(old_tile_rect == new_tile_rect)) {
+            for_each_rect(old_tile_rect, [this, &new_tile_rect, obj](int x, int y) {
+                if (!new_tile_rect.contains(x, y)) {
+                    data_[y * count_ + x].markers.remove(obj);
+                }
+            });
+            for_each_rect(new_tile_rect, [this, &old_tile_rect, obj](int x, int y) {
+                if (!old_tile_rect.contains(x, y)) {
+                    data_[y * count_ + x].markers.emplace_front(obj);
+                }
+            });
+        }
+
+        auto old_rect = make_rect(old_x, old_y, old_w, old_h);
+        auto new_rect = make_rect(obj->x, obj->y, obj->w, obj->h);
+
+        // watchers of both old and new tiles, each visited once
+        visited_.clear();
+        auto handler = [this, obj, &old_rect, &new_rect](int x, int y) {
+            tile& node = data_[y * count_ + x];
+            for (const auto& w: node.watchers) {
+                if (w->handle == obj->handle || !visited_.emplace(w).second)
+                    continue;
+
+                auto rc = make_rect(w->x, w->y, w->w, w->h);
+                bool in_old_view = rc.intersects(old_rect);
+                bool in_new_view = rc.intersects(new_rect);
+                if (in_old_view && !in_new_view) {
+                    if (enable_leave_event_) {
+                        event_queue_
+                            .emplace_back(static_cast<int>(event_leave), w->handle, obj->handle);
+                    }
+                } else if (!in_old_view && in_new_view) {
+                    event_queue_
+                        .emplace_back(static_cast<int>(event_enter), w->handle, obj->handle);
+                }
+            }
+        };
+        for_each_rect(old_tile_rect, handler);
+        for_each_rect(new_tile_rect, handler);
+    }
+
+    void marker_event(object_type* obj, int eventid, bool skip_self) {
+        auto tile_rect = marker_tile_rect(obj, obj->x, obj->y, obj->w, obj->h);
+        for_each_watcher(tile_rect, [this, obj, eventid, skip_self](object_type* w) {
+            if (skip_self && w->handle == obj->handle)
+                return;
 
             auto rc = make_rect(w->x, w->y, w->w, w->h);
-            if (!rc.contains(obj->x, obj->y)) {
-                continue;
+            if (!in_view(rc, obj, obj->x, obj->y, obj->w, obj->h)) {
+                return;
             }
 
             event_queue_.emplace_back(static_cast<int>(eventid), w->handle, obj->handle);
-        }
+        });
     }
 
     void insert_watcher(tile& node, object_type* obj) {
@@ -524,9 +586,10 @@ private:
         assert(1 == count);
     }
 
+    // old_rect is nullptr for a new watcher, which had no view before
     void update_watcher(
         const tile& t,
-        const rect<int>& old_rect,
+        const rect<int>* old_rect,
         const rect<int>& new_rect,
         object_type* obj,
         bool check_enter = true,
@@ -535,8 +598,10 @@ private:
         for (auto& m: t.markers) {
             if (obj->handle == m->handle)
                 continue;
-            bool in_old_view = old_rect.contains(m->x, m->y);
-            bool in_new_view = new_rect.contains(m->x, m->y);
+            if (is_range_marker(m) && !visited_.emplace(m).second)
+                continue;
+            bool in_old_view = nullptr != old_rect && in_view(*old_rect, m, m->x, m->y, m->w, m->h);
+            bool in_new_view = in_view(new_rect, m, m->x, m->y, m->w, m->h);
             if (in_old_view) {
                 if (enable_leave_event_) {
                     if (!in_new_view && check_leave) {
@@ -572,6 +637,7 @@ private:
     tile* data_; //count * count
     std::unordered_map<object_handle_type, object_type> objects_;
     std::vector<aoi_event> event_queue_;
+    std::unordered_set<object_type*> visited_; //scratch set to de-duplicate multi-tile objects
 };
 
 } // namespace pluto
\ No newline at end of file
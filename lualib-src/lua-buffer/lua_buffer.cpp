@@ -2,6 +2,7 @@
 
 #include "buffer.hpp"
 #include "byte_convert.hpp"
+#include "lua_buffer.hpp"
 #include "string.hpp"
 
 using buffer_ptr_t = std::unique_ptr<pluto::buffer>;
@@ -335,7 +336,7 @@ static int to_shared(lua_State* L) {
 
     void* space = lua_newuserdatauv(L, sizeof(buffer_shr_ptr_t), 0);
     new (space) buffer_shr_ptr_t { b };
-    if (luaL_newmetatable(L, "lbuffer_shr_ptr")) //mt
+    if (luaL_newmetatable(L, pluto::BUFFER_SHARED_METANAME)) //mt
     {
         auto gc = [](lua_State* L) {
             buffer_shr_ptr_t* shr = (buffer_shr_ptr_t*)lua_touserdata(L, 1);
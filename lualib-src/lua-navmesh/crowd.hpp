@@ -0,0 +1,218 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <DetourCrowd.h>
+
+#include "navmesh.hpp"
+
+namespace pluto {
+
+// Crowd simulation (path following + local avoidance) on a navmesh.
+// The crowd holds the mesh it is built on (navmesh::hold_mesh): a static
+// mesh stays alive, and navmesh::load_dynamic fails until the crowds on a
+// dynamic mesh are released.
+class crowd {
+    template<typename T, void (*F)(T*)>
+    struct unique_deleter {
+        void operator()(T* p) {
+            F(p);
+        }
+    };
+
+    using dtCrowdDeleter = unique_deleter<dtCrowd, dtFreeCrowd>;
+
+public:
+    // packed layout of one agent written by get_agents
+    struct agent_state {
+        int32_t idx;
+        int32_t target_state; // MoveRequestState
+        float pos[3];
+        float vel[3];
+    };
+
+    crowd(const navmesh& nav, int max_agents, float max_radius):
+        coord_mask_(nav.coord_mask()),
+        max_radius_(max_radius) {
+        dtNavMesh* mesh = nav.get_mesh();
+        if (nullptr == mesh || max_agents <= 0 || max_radius <= 0.0f)
+            return;
+
+        crowd_ = std::unique_ptr<dtCrowd, dtCrowdDeleter>(dtAllocCrowd());
+        if (nullptr == crowd_)
+            return;
+
+        if (!crowd_->init(max_agents, max_radius, mesh)) {
+            crowd_ = nullptr;
+            return;
+        }
+        mesh_ = nav.hold_mesh();
+
+        dtQueryFilter* filter = crowd_->getEditableFilter(0);
+        filter->setAreaCost(POLYAREA_GROUND, DEFAULT_AREA_COST_GROUND);
+        filter->setAreaCost(POLYAREA_WATER, DEFAULT_AREA_COST_WATER);
+        filter->setAreaCost(POLYAREA_ROAD, DEFAULT_AREA_COST_ROAD);
+        filter->setAreaCost(POLYAREA_DOOR, DEFAULT_AREA_COST_DOOR);
+        filter->setAreaCost(POLYAREA_GRASS, DEFAULT_AREA_COST_GRASS);
+        filter->setAreaCost(POLYAREA_JUMP, DEFAULT_AREA_COST_JUMP);
+        filter->setIncludeFlags(DEFAULT_INCLUDE_FLAGS);
+        filter->setExcludeFlags(DEFAULT_EXCLUDE_FLAGS);
+
+        // medium quality avoidance, see Detour CrowdTool
+        dtObstacleAvoidanceParams params;
+        memcpy(&params, crowd_->getObstacleAvoidanceParams(0), sizeof(dtObstacleAvoidanceParams));
+        params.velBias = 0.5f;
+        params.adaptiveDivs = 5;
+        params.adaptiveRings = 2;
+        params.adaptiveDepth = 1;
+        crowd_->setObstacleAvoidanceParams(0, &params);
+    }
+
+    bool valid() const {
+        return nullptr != crowd_;
+    }
+
+    float max_radius() const {
+        return max_radius_;
+    }
+
+    // returns agent index, -1 on failure. radius is up to the max radius of
+    // the crowd, the proximity grid of dtCrowd is sized for it
+    int add_agent(float x, float y, float z, float max_speed, float max_acceleration, float radius, float height) {
+        if (!crowd_ || radius <= 0.0f || radius > max_radius_ || height <= 0.0f)
+            return -1;
+
+        float pos[3] = { x, y, z };
+        coord_transform(pos);
+
+        dtCrowdAgentParams ap;
+        memset(&ap, 0, sizeof(ap));
+        ap.radius = radius;
+        ap.height = height;
+        ap.maxAcceleration = max_acceleration;
+        ap.maxSpeed = max_speed;
+        ap.collisionQueryRange = ap.radius * 12.0f;
+        ap.pathOptimizationRange = ap.radius * 30.0f;
+        ap.updateFlags = DT_CROWD_ANTICIPATE_TURNS | DT_CROWD_OPTIMIZE_VIS | DT_CROWD_OPTIMIZE_TOPO
+            | DT_CROWD_OBSTACLE_AVOIDANCE | DT_CROWD_SEPARATION;
+        ap.obstacleAvoidanceType = 0;
+        ap.separationWeight = 2.0f;
+        return crowd_->addAgent(pos, &ap);
+    }
+
+    bool remove_agent(int idx) {
+        if (!get_agent(idx))
+            return false;
+        crowd_->removeAgent(idx);
+        return true;
+    }
+
+    bool set_target(int idx, float x, float y, float z) {
+        if (!get_agent(idx))
+            return false;
+
+        float pos[3] = { x, y, z };
+        coord_transform(pos);
+
+        const dtQueryFilter* filter = crowd_->getFilter(0);
+        const float* extents = crowd_->getQueryExtents();
+
+        dtPolyRef ref = 0;
+        float nearest[3];
+        dtStatus status =
+            crowd_->getNavMeshQuery()->findNearestPoly(pos, extents, filter, &ref, nearest);
+        if (!dtStatusSucceed(status) || !ref)
+            return false;
+
+        return crowd_->requestMoveTarget(idx, ref, nearest);
+    }
+
+    bool stop(int idx) {
+        if (!get_agent(idx))
+            return false;
+        return crowd_->resetMoveTarget(idx);
+    }
+
+    bool set_speed(int idx, float max_speed) {
+        const dtCrowdAgent* ag = get_agent(idx);
+        if (nullptr == ag)
+            return false;
+        dtCrowdAgentParams ap = ag->params;
+        ap.maxSpeed = max_speed;
+        crowd_->updateAgentParameters(idx, &ap);
+        return true;
+    }
+
+    void update(float dt) {
+        if (!crowd_)
+            return;
+        crowd_->update(dt, nullptr);
+    }
+
+    // Appends uint32 count followed by count agent_state records
+    template<typename Buffer>
+    size_t get_agents(Buffer& out) {
+        static thread_local std::vector<agent_state> states;
+        states.clear();
+
+        if (crowd_) {
+            int n = crowd_->getAgentCount();
+            for (int i = 0; i < n; ++i) {
+                const dtCrowdAgent* ag = crowd_->getAgent(i);
+                if (!ag->active)
+                    continue;
+
+                agent_state& st = states.emplace_back();
+                st.idx = i;
+                st.target_state = ag->targetState;
+                dtVcopy(st.pos, ag->npos);
+                dtVcopy(st.vel, ag->vel);
+                coord_transform(st.pos);
+                coord_transform(st.vel);
+            }
+        }
+
+        out.write_back(static_cast<uint32_t>(states.size()));
+        if (!states.empty()) {
+            out.write_back(std::string_view { reinterpret_cast<const char*>(states.data()),
+                                              states.size() * sizeof(agent_state) });
+        }
+        return states.size();
+    }
+
+    bool get_position(int idx, float* pos) {
+        const dtCrowdAgent* ag = get_agent(idx);
+        if (nullptr == ag)
+            return false;
+        dtVcopy(pos, ag->npos);
+        coord_transform(pos);
+        return true;
+    }
+
+private:
+    const dtCrowdAgent* get_agent(int idx) {
+        if (!crowd_ || idx < 0 || idx >= crowd_->getAgentCount())
+            return nullptr;
+        const dtCrowdAgent* ag = crowd_->getAgent(idx);
+        return ag->active ? ag : nullptr;
+    }
+
+    void coord_transform(float* p) const {
+        if ((coord_mask_ & navmesh::negative_x_axis))
+            p[0] = -p[0];
+        if ((coord_mask_ & navmesh::negative_y_axis))
+            p[1] = -p[1];
+        if ((coord_mask_ & navmesh::negative_z_axis))
+            p[2] = -p[2];
+    }
+
+private:
+    int coord_mask_ = 0;
+    float max_radius_ = 0.0f;
+    std::shared_ptr<const void> mesh_; // released after crowd_
+    std::unique_ptr<dtCrowd, dtCrowdDeleter> crowd_;
+};
+
+} // namespace pluto
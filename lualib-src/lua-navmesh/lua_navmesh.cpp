@@ -1,15 +1,45 @@
+#include "buffer.hpp"
+#include "crowd.hpp"
+#include "lua_buffer.hpp"
 #include "lua_utility.hpp"
 #include "navmesh.hpp"
 
 
 #define METANAME "lnavmesh"
+#define CROWD_METANAME "lnavmesh_crowd"
 
 using navmesh_type = pluto::navmesh;
+using crowd_type = pluto::crowd;
+
+// packed float input: a string or a buffer
+static std::string_view get_packed(lua_State* L, int index) {
+    if (lua_type(L, index) == LUA_TSTRING) {
+        size_t len = 0;
+        const char* data = lua_tolstring(L, index, &len);
+        return std::string_view { data, len };
+    }
+    auto b = pluto::lua_check_buffer(L, index);
+    return std::string_view { b->data(), b->size() };
+}
 
 static int load_static(lua_State* L) {
     auto meshfile = pluto::lua_check<std::string>(L, 1);
     std::string err;
-    if (pluto::navmesh::load_static(meshfile, err)) {
+    bool build_graph = lua_toboolean(L, 2);
+    if (pluto::navmesh::load_static(meshfile, err, build_graph)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushlstring(L, err.data(), err.size());
+    return 2;
+}
+
+static int reload_static(lua_State* L) {
+    auto meshfile = pluto::lua_check<std::string>(L, 1);
+    std::string err;
+    bool build_graph = lua_toboolean(L, 2);
+    if (pluto::navmesh::reload_static(meshfile, err, build_graph)) {
         lua_pushboolean(L, 1);
         return 1;
     }
@@ -18,6 +48,47 @@ static int load_static(lua_State* L) {
     return 2;
 }
 
+static int unload_static(lua_State* L) {
+    auto meshfile = pluto::lua_check<std::string>(L, 1);
+    lua_pushboolean(L, pluto::navmesh::unload_static(meshfile));
+    return 1;
+}
+
+static int static_info(lua_State* L) {
+    auto meshfile = pluto::lua_check<std::string>(L, 1);
+    auto [version, refs] = pluto::navmesh::static_info(meshfile);
+    if (0 == version) {
+        return 0;
+    }
+    lua_pushinteger(L, version);
+    lua_pushinteger(L, refs);
+    return 2;
+}
+
+// navmesh.set_query_nodes(n), returns the previous size
+static int set_query_nodes(lua_State* L) {
+    auto max_nodes = pluto::lua_check<int>(L, 1);
+    luaL_argcheck(L, max_nodes > 0 && max_nodes <= 65535, 1, "node count out of range");
+    lua_pushinteger(L, pluto::navmesh::set_query_nodes(max_nodes));
+    return 1;
+}
+
+static int pooled_queries(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    lua_pushinteger(L, (lua_Integer)p->pooled_queries());
+    return 1;
+}
+
+static int version(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    lua_pushinteger(L, p->version());
+    return 1;
+}
+
 static int load_dynamic(lua_State* L) {
     navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
     if (nullptr == p)
@@ -58,6 +129,128 @@ static int find_straight_path(lua_State* L) {
     return 2;
 }
 
+static int find_long_path(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto sx = pluto::lua_check<float>(L, 2);
+    auto sy = pluto::lua_check<float>(L, 3);
+    auto sz = pluto::lua_check<float>(L, 4);
+    auto ex = pluto::lua_check<float>(L, 5);
+    auto ey = pluto::lua_check<float>(L, 6);
+    auto ez = pluto::lua_check<float>(L, 7);
+    int segments = (int)luaL_optinteger(L, 8, 2);
+    std::vector<float> paths;
+    bool done = true;
+    if (p->find_long_path(sx, sy, sz, ex, ey, ez, segments, paths, done)) {
+        lua_createtable(L, (int)paths.size(), 0);
+        for (size_t i = 0; i < paths.size(); ++i) {
+            lua_pushnumber(L, paths[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushboolean(L, done);
+        return 2;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushlstring(L, p->get_status().data(), p->get_status().size());
+    return 2;
+}
+
+static int find_paths(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto requests = get_packed(L, 2);
+    auto out = pluto::lua_check_buffer(L, 3);
+
+    constexpr size_t request_size = sizeof(float) * 6;
+    if (requests.size() % request_size != 0)
+        return luaL_argerror(L, 2, "requests size must be a multiple of 6 floats");
+
+    size_t count = requests.size() / request_size;
+    // copy out in case requests and out are the same buffer
+    std::vector<float> tmp(count * 6);
+    if (count > 0)
+        memcpy(tmp.data(), requests.data(), requests.size());
+    p->find_paths(tmp.data(), count, *out);
+    lua_pushinteger(L, (lua_Integer)count);
+    return 1;
+}
+
+static int request_path(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto sx = pluto::lua_check<float>(L, 2);
+    auto sy = pluto::lua_check<float>(L, 3);
+    auto sz = pluto::lua_check<float>(L, 4);
+    auto ex = pluto::lua_check<float>(L, 5);
+    auto ey = pluto::lua_check<float>(L, 6);
+    auto ez = pluto::lua_check<float>(L, 7);
+    auto id = p->request_path(sx, sy, sz, ex, ey, ez);
+    if (id > 0) {
+        lua_pushinteger(L, id);
+        return 1;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushlstring(L, p->get_status().data(), p->get_status().size());
+    return 2;
+}
+
+static int cancel_path(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto id = pluto::lua_check<uint32_t>(L, 2);
+    lua_pushboolean(L, p->cancel_path(id));
+    return 1;
+}
+
+static int update_paths(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto max_iters = pluto::lua_check<int>(L, 2);
+    auto out = pluto::lua_check_buffer(L, 3);
+    auto count = p->update_paths(max_iters, *out);
+    lua_pushinteger(L, (lua_Integer)count);
+    lua_pushinteger(L, (lua_Integer)p->pending_paths());
+    return 2;
+}
+
+static int init_path_queue(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto slots = pluto::lua_check<int>(L, 2);
+    auto max_nodes = pluto::lua_check<int>(L, 3);
+    lua_pushboolean(L, p->init_path_queue(slots, max_nodes));
+    return 1;
+}
+
+static int set_path_cache(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto capacity = pluto::lua_check<size_t>(L, 2);
+    p->set_path_cache(capacity);
+    return 0;
+}
+
+static int path_cache_stats(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    const auto& cache = p->get_path_cache();
+    const auto& stats = cache.GetStats();
+    lua_createtable(L, 0, 4);
+    luaL_rawsetfield(L, -3, "hits", lua_pushinteger(L, (lua_Integer)stats.hits));
+    luaL_rawsetfield(L, -3, "misses", lua_pushinteger(L, (lua_Integer)stats.misses));
+    luaL_rawsetfield(L, -3, "invalidations", lua_pushinteger(L, (lua_Integer)stats.invalidations));
+    luaL_rawsetfield(L, -3, "size", lua_pushinteger(L, (lua_Integer)cache.Size()));
+    return 1;
+}
+
 static int valid(lua_State* L) {
     navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
     if (nullptr == p)
@@ -127,6 +320,27 @@ static int recast(lua_State* L) {
     return 4;
 }
 
+static int raycast_batch(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto rays = get_packed(L, 2);
+    auto out = pluto::lua_check_buffer(L, 3);
+
+    constexpr size_t ray_size = sizeof(float) * 6;
+    if (rays.size() % ray_size != 0)
+        return luaL_argerror(L, 2, "rays size must be a multiple of 6 floats");
+
+    size_t count = rays.size() / ray_size;
+    // copy out in case rays and out are the same buffer
+    std::vector<float> tmp(count * 6);
+    if (count > 0)
+        memcpy(tmp.data(), rays.data(), rays.size());
+    p->raycast_batch(tmp.data(), count, *out);
+    lua_pushinteger(L, (lua_Integer)count);
+    return 1;
+}
+
 static int add_capsule_obstacle(lua_State* L) {
     navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
     if (nullptr == p)
@@ -156,6 +370,70 @@ static int remove_obstacle(lua_State* L) {
     return 1;
 }
 
+static int add_obstacles(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto obstacles = get_packed(L, 2);
+
+    constexpr size_t obstacle_size = sizeof(float) * 5;
+    if (obstacles.size() % obstacle_size != 0)
+        return luaL_argerror(L, 2, "obstacles size must be a multiple of 5 floats");
+
+    size_t count = obstacles.size() / obstacle_size;
+    std::vector<float> data(count * 5);
+    if (count > 0)
+        memcpy(data.data(), obstacles.data(), obstacles.size());
+
+    std::vector<unsigned int> ids;
+    p->add_obstacles(data.data(), count, ids);
+    lua_createtable(L, (int)ids.size(), 0);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        lua_pushinteger(L, ids[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int remove_obstacles(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer removed = 0;
+    lua_Integer n = luaL_len(L, 2);
+    for (lua_Integer i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 2, i);
+        auto obstacleId = (unsigned int)luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+        if (p->remove_obstacle(obstacleId))
+            ++removed;
+    }
+    lua_pushinteger(L, removed);
+    return 1;
+}
+
+static int set_async_rebuild(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    if (p->set_async_rebuild(lua_toboolean(L, 2))) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushlstring(L, p->get_status().data(), p->get_status().size());
+    return 2;
+}
+
+static int pending_rebuilds(lua_State* L) {
+    navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    lua_pushinteger(L, (lua_Integer)p->pending_rebuilds());
+    return 1;
+}
+
 static int clear_all_obstacle(lua_State* L) {
     navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
     if (nullptr == p)
@@ -173,6 +451,144 @@ static int update(lua_State* L) {
     return 0;
 }
 
+static crowd_type* check_crowd(lua_State* L) {
+    auto p = (crowd_type*)luaL_checkudata(L, 1, CROWD_METANAME);
+    if (!p->valid())
+        luaL_error(L, "Invalid crowd");
+    return p;
+}
+
+// crowd:add_agent(x, y, z [, speed [, acceleration [, radius [, height]]]]), the
+// radius defaults to the max radius of the crowd and the height to 2 * radius
+static int crowd_add_agent(lua_State* L) {
+    auto p = check_crowd(L);
+    auto x = pluto::lua_check<float>(L, 2);
+    auto y = pluto::lua_check<float>(L, 3);
+    auto z = pluto::lua_check<float>(L, 4);
+    auto speed = (float)luaL_optnumber(L, 5, 3.5);
+    auto acceleration = (float)luaL_optnumber(L, 6, 8.0);
+    auto radius = (float)luaL_optnumber(L, 7, p->max_radius());
+    auto height = (float)luaL_optnumber(L, 8, radius * 2.0f);
+    luaL_argcheck(L, radius > 0.0f && radius <= p->max_radius(), 7, "radius must be in (0, max radius of the crowd]");
+    luaL_argcheck(L, height > 0.0f, 8, "height must be positive");
+    int idx = p->add_agent(x, y, z, speed, acceleration, radius, height);
+    if (idx < 0)
+        return 0;
+    lua_pushinteger(L, idx);
+    return 1;
+}
+
+static int crowd_remove_agent(lua_State* L) {
+    auto p = check_crowd(L);
+    auto idx = pluto::lua_check<int>(L, 2);
+    lua_pushboolean(L, p->remove_agent(idx));
+    return 1;
+}
+
+static int crowd_set_target(lua_State* L) {
+    auto p = check_crowd(L);
+    auto idx = pluto::lua_check<int>(L, 2);
+    auto x = pluto::lua_check<float>(L, 3);
+    auto y = pluto::lua_check<float>(L, 4);
+    auto z = pluto::lua_check<float>(L, 5);
+    lua_pushboolean(L, p->set_target(idx, x, y, z));
+    return 1;
+}
+
+static int crowd_stop(lua_State* L) {
+    auto p = check_crowd(L);
+    auto idx = pluto::lua_check<int>(L, 2);
+    lua_pushboolean(L, p->stop(idx));
+    return 1;
+}
+
+static int crowd_set_speed(lua_State* L) {
+    auto p = check_crowd(L);
+    auto idx = pluto::lua_check<int>(L, 2);
+    auto speed = pluto::lua_check<float>(L, 3);
+    lua_pushboolean(L, p->set_speed(idx, speed));
+    return 1;
+}
+
+static int crowd_update(lua_State* L) {
+    auto p = check_crowd(L);
+    auto dt = pluto::lua_check<float>(L, 2);
+    p->update(dt);
+    if (!lua_isnoneornil(L, 3)) {
+        auto out = pluto::lua_check_buffer(L, 3);
+        lua_pushinteger(L, (lua_Integer)p->get_agents(*out));
+        return 1;
+    }
+    return 0;
+}
+
+static int crowd_get_agents(lua_State* L) {
+    auto p = check_crowd(L);
+    auto out = pluto::lua_check_buffer(L, 2);
+    lua_pushinteger(L, (lua_Integer)p->get_agents(*out));
+    return 1;
+}
+
+static int crowd_get_position(lua_State* L) {
+    auto p = check_crowd(L);
+    auto idx = pluto::lua_check<int>(L, 2);
+    float pos[3];
+    if (!p->get_position(idx, pos))
+        return 0;
+    lua_pushnumber(L, pos[0]);
+    lua_pushnumber(L, pos[1]);
+    lua_pushnumber(L, pos[2]);
+    return 3;
+}
+
+static int crowd_release(lua_State* L) {
+    auto p = (crowd_type*)luaL_checkudata(L, 1, CROWD_METANAME);
+    std::destroy_at(p);
+    return 0;
+}
+
+static int create_crowd(lua_State* L) {
+    navmesh_type* nav = (navmesh_type*)lua_touserdata(L, 1);
+    if (nullptr == nav)
+        return luaL_error(L, "Invalid navmesh pointer");
+    if (lua_type(L, 1) != LUA_TUSERDATA)
+        return luaL_argerror(L, 1, "expected navmesh userdata");
+    auto max_agents = pluto::lua_check<int>(L, 2);
+    auto radius = pluto::lua_check<float>(L, 3);
+
+    crowd_type* p = (crowd_type*)lua_newuserdatauv(L, sizeof(crowd_type), 1);
+    new (p) crowd_type(*nav, max_agents, radius);
+
+    // keep the navmesh alive as long as the crowd
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+
+    if (luaL_newmetatable(L, CROWD_METANAME)) //mt
+    {
+        luaL_Reg l[] = { { "add_agent", crowd_add_agent },
+                         { "remove_agent", crowd_remove_agent },
+                         { "set_target", crowd_set_target },
+                         { "stop", crowd_stop },
+                         { "set_speed", crowd_set_speed },
+                         { "update", crowd_update },
+                         { "get_agents", crowd_get_agents },
+                         { "get_position", crowd_get_position },
+                         { NULL, NULL } };
+        luaL_newlib(L, l); //{}
+        lua_setfield(L, -2, "__index"); //mt[__index] = {}
+        lua_pushcfunction(L, crowd_release);
+        lua_setfield(L, -2, "__gc"); //mt[__gc] = crowd_release
+    }
+    lua_setmetatable(L, -2); // set userdata metatable
+
+    if (!p->valid()) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "create crowd failed");
+        return 2;
+    }
+    return 1;
+}
+
 static int lrelease(lua_State* L) {
     navmesh_type* p = (navmesh_type*)lua_touserdata(L, 1);
     if (nullptr == p)
@@ -192,14 +608,30 @@ static int lcreate(lua_State* L) {
     {
         luaL_Reg l[] = { { "load_dynamic", load_dynamic },
                          { "find_straight_path", find_straight_path },
+                         { "find_long_path", find_long_path },
+                         { "find_paths", find_paths },
+                         { "request_path", request_path },
+                         { "cancel_path", cancel_path },
+                         { "update_paths", update_paths },
+                         { "init_path_queue", init_path_queue },
+                         { "set_path_cache", set_path_cache },
+                         { "path_cache_stats", path_cache_stats },
                          { "valid", valid },
                          { "random_position", random_position },
                          { "random_position_around_circle", random_position_around_circle },
                          { "recast", recast },
+                         { "raycast_batch", raycast_batch },
                          { "add_capsule_obstacle", add_capsule_obstacle },
                          { "remove_obstacle", remove_obstacle },
+                         { "add_obstacles", add_obstacles },
+                         { "remove_obstacles", remove_obstacles },
                          { "clear_all_obstacle", clear_all_obstacle },
+                         { "set_async_rebuild", set_async_rebuild },
+                         { "pending_rebuilds", pending_rebuilds },
                          { "update", update },
+                         { "version", version },
+                         { "pooled_queries", pooled_queries },
+                         { "create_crowd", create_crowd },
                          { NULL, NULL } };
         luaL_newlib(L, l); //{}
         lua_setfield(L, -2, "__index"); //mt[__index] = {}
@@ -216,6 +648,10 @@ int luaopen_navmesh(lua_State* L) {
     luaL_Reg l[] = {
         { "new", lcreate },
         { "load_static", load_static },
+        { "reload_static", reload_static },
+        { "unload_static", unload_static },
+        { "static_info", static_info },
+        { "set_query_nodes", set_query_nodes },
         { NULL, NULL },
     };
     luaL_newlib(L, l);
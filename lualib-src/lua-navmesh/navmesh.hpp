@@ -2,23 +2,37 @@
 // Copyright (c) 2021 Bruce https://github.com/sniper00/moon
 //
 #pragma once
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <DetourCommon.h>
 #include <DetourNavMesh.h>
 #include <DetourNavMeshBuilder.h>
 #include <DetourNavMeshQuery.h>
+#include <DetourNode.h>
 #include <DetourTileCache.h>
 #include <DetourTileCacheBuilder.h>
 
 #include "fastlz.h"
+#include "mapped_file.hpp"
+#include "tile_graph.hpp"
 
 namespace pluto {
 enum PolyAreas {
@@ -78,10 +92,12 @@ struct LinearAllocator: public dtTileCacheAlloc {
     virtual void* alloc(const size_t size) {
         if (!buffer)
             return 0;
-        if (top + size > capacity)
+        // keep every block aligned for the structs dtTileCache places in it
+        const size_t aligned = (size + 7) & ~static_cast<size_t>(7);
+        if (top + aligned > capacity)
             return 0;
         unsigned char* mem = &buffer[top];
-        top += size;
+        top += aligned;
         return mem;
     }
 
@@ -201,13 +217,521 @@ protected:
     std::unique_ptr<dtQueryFilter> mFilter;
 };
 
-class navmesh {
+// LRU of polygon corridors keyed on (startRef, endRef, filter flags).
+// Entries carry the mesh version they were found on. Any tile rebuild calls
+// Invalidate, so an obstacle removed away from a corridor, which may open a
+// shorter one, drops it as well as a change on the corridor itself.
+class PathCache {
+    struct Key {
+        dtPolyRef startRef;
+        dtPolyRef endRef;
+        uint32_t filter;
+
+        bool operator==(const Key& other) const {
+            return startRef == other.startRef && endRef == other.endRef && filter == other.filter;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            size_t h = std::hash<dtPolyRef> {}(k.startRef);
+            h ^= std::hash<dtPolyRef> {}(k.endRef) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            h ^= std::hash<uint32_t> {}(k.filter) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+
+    struct Entry {
+        Key key;
+        uint64_t version;
+        std::vector<dtPolyRef> polys;
+    };
+
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t invalidations = 0;
+    };
+
+    bool Enabled() const {
+        return capacity_ > 0;
+    }
+
+    void SetCapacity(size_t capacity) {
+        capacity_ = capacity;
+        while (lru_.size() > capacity_) {
+            map_.erase(lru_.back().key);
+            lru_.pop_back();
+        }
+    }
+
+    size_t Size() const {
+        return lru_.size();
+    }
+
+    const Stats& GetStats() const {
+        return stats_;
+    }
+
+    // cached corridor or nullptr, corridors of an older mesh version are erased
+    const std::vector<dtPolyRef>* Find(
+        const dtQueryFilter& filter,
+        dtPolyRef startRef,
+        dtPolyRef endRef
+    ) {
+        Key key { startRef, endRef, FilterKey(filter) };
+        auto iter = map_.find(key);
+        if (iter == map_.end()) {
+            ++stats_.misses;
+            return nullptr;
+        }
+
+        if (iter->second->version != version_) {
+            lru_.erase(iter->second);
+            map_.erase(iter);
+            ++stats_.invalidations;
+            ++stats_.misses;
+            return nullptr;
+        }
+
+        ++stats_.hits;
+        lru_.splice(lru_.begin(), lru_, iter->second);
+        return &iter->second->polys;
+    }
+
+    void Insert(
+        const dtQueryFilter& filter,
+        dtPolyRef startRef,
+        dtPolyRef endRef,
+        const dtPolyRef* polys,
+        int nPolys
+    ) {
+        if (!Enabled() || nPolys <= 0) {
+            return;
+        }
+
+        Key key { startRef, endRef, FilterKey(filter) };
+        if (auto iter = map_.find(key); iter != map_.end()) {
+            iter->second->version = version_;
+            iter->second->polys.assign(polys, polys + nPolys);
+            lru_.splice(lru_.begin(), lru_, iter->second);
+            return;
+        }
+
+        if (lru_.size() >= capacity_) {
+            map_.erase(lru_.back().key);
+            lru_.pop_back();
+        }
+        lru_.push_front(Entry { key, version_, std::vector<dtPolyRef>(polys, polys + nPolys) });
+        map_.emplace(key, lru_.begin());
+    }
+
+    // the mesh changed, entries are dropped lazily by Find
+    void Invalidate() {
+        ++version_;
+    }
+
+    void Clear() {
+        lru_.clear();
+        map_.clear();
+    }
+
 private:
+    static uint32_t FilterKey(const dtQueryFilter& filter) {
+        return (uint32_t)filter.getIncludeFlags() << 16 | filter.getExcludeFlags();
+    }
+
+    size_t capacity_ = 0;
+    uint64_t version_ = 0;
+    Stats stats_;
+    std::list<Entry> lru_;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map_;
+};
+
+// Rebuilds tile-cache tiles on a background thread. Obstacles are tracked here
+// instead of in dtTileCache; Update() hands dirty tiles to the worker and swaps
+// finished tiles into the navmesh, so queries keep using the old tiles until then.
+class TileRebuilder {
+    static constexpr size_t MAX_TALLOC_SIZE = 32 * 1024 * 1024;
+
+    struct Cylinder {
+        float pos[3];
+        float radius;
+        float height;
+    };
+
+    struct Obstacle {
+        Cylinder shape;
+        std::vector<dtCompressedTileRef> touched;
+    };
+
+    struct Result {
+        dtCompressedTileRef ref;
+        uint32_t generation;
+        int tx;
+        int ty;
+        int tlayer;
+        unsigned char* data;
+        int size;
+        dtStatus status;
+    };
+
+    // shared with the worker, kept alive by queued jobs
+    struct State {
+        dtTileCacheParams params;
+        std::mutex mutex;
+        std::condition_variable idle;
+        std::vector<Result> results;
+        int inFlight = 0;
+        bool cancelled = false;
+    };
+
+    struct Job {
+        std::shared_ptr<State> state;
+        dtCompressedTileRef ref = 0;
+        uint32_t generation = 0;
+        const dtCompressedTile* tile = nullptr; // compressed tiles are immutable after load
+        std::vector<Cylinder> obstacles;
+    };
+
+    // one process-wide thread serves the rebuilders of all navmesh objects
+    class Worker {
+    public:
+        static Worker& Instance() {
+            static Worker worker;
+            return worker;
+        }
+
+        void Submit(Job&& job) {
+            {
+                std::lock_guard lock { mutex_ };
+                jobs_.push_back(std::move(job));
+            }
+            cv_.notify_one();
+        }
+
+        ~Worker() {
+            {
+                std::lock_guard lock { mutex_ };
+                stop_ = true;
+            }
+            cv_.notify_all();
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+        }
+
+    private:
+        Worker(): thread_([this] { Run(); }) {}
+
+        void Run() {
+            for (;;) {
+                Job job;
+                {
+                    std::unique_lock lock { mutex_ };
+                    cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+                    if (jobs_.empty()) {
+                        return;
+                    }
+                    job = std::move(jobs_.front());
+                    jobs_.pop_front();
+                }
+                Process(job);
+            }
+        }
+
+        static void Process(Job& job) {
+            State& state = *job.state;
+            const dtTileCacheLayerHeader* header = job.tile->header;
+            Result res { job.ref,   job.generation, header->tx, header->ty, header->tlayer,
+                         nullptr,   0,              DT_SUCCESS };
+
+            bool cancelled = false;
+            {
+                std::lock_guard lock { state.mutex };
+                cancelled = state.cancelled;
+            }
+            if (!cancelled) {
+                res.status = BuildTile(state.params, job, res);
+            }
+
+            {
+                std::lock_guard lock { state.mutex };
+                if (state.cancelled) {
+                    dtFree(res.data);
+                } else {
+                    state.results.push_back(res);
+                }
+                --state.inFlight;
+            }
+            state.idle.notify_all();
+        }
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::deque<Job> jobs_;
+        bool stop_ = false;
+        std::thread thread_; // last, started after the members it uses
+    };
+
+public:
+    explicit TileRebuilder(const dtTileCacheParams& params): state_(std::make_shared<State>()) {
+        state_->params = params;
+    }
+
+    TileRebuilder(const TileRebuilder&) = delete;
+    TileRebuilder& operator=(const TileRebuilder&) = delete;
+
+    // jobs reference the tile cache, wait for the ones already running
+    ~TileRebuilder() {
+        std::unique_lock lock { state_->mutex };
+        state_->cancelled = true;
+        state_->idle.wait(lock, [this] { return state_->inFlight == 0; });
+        for (Result& res: state_->results) {
+            dtFree(res.data);
+        }
+        state_->results.clear();
+    }
+
+    // returns obstacle id, 0 when the obstacle touches no tile
+    uint32_t AddObstacle(const dtTileCache& tilecache, const float* pos, float radius, float height) {
+        float bmin[3] = { pos[0] - radius, pos[1], pos[2] - radius };
+        float bmax[3] = { pos[0] + radius, pos[1] + height, pos[2] + radius };
+
+        dtCompressedTileRef touched[DT_MAX_TOUCHED_TILES];
+        int ntouched = 0;
+        dtStatus status = tilecache.queryTiles(bmin, bmax, touched, &ntouched, DT_MAX_TOUCHED_TILES);
+        if (!dtStatusSucceed(status) || ntouched == 0) {
+            return 0;
+        }
+
+        if (++nextId_ == 0) {
+            ++nextId_;
+        }
+        Obstacle& ob = obstacles_[nextId_];
+        dtVcopy(ob.shape.pos, pos);
+        ob.shape.radius = radius;
+        ob.shape.height = height;
+        ob.touched.assign(touched, touched + ntouched);
+        for (dtCompressedTileRef ref: ob.touched) {
+            tileObstacles_[ref].push_back(nextId_);
+            dirty_.insert(ref);
+        }
+        return nextId_;
+    }
+
+    bool RemoveObstacle(uint32_t id) {
+        auto iter = obstacles_.find(id);
+        if (iter == obstacles_.end()) {
+            return false;
+        }
+        for (dtCompressedTileRef ref: iter->second.touched) {
+            auto& ids = tileObstacles_[ref];
+            ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+            dirty_.insert(ref);
+        }
+        obstacles_.erase(iter);
+        return true;
+    }
+
+    void Clear() {
+        for (const auto& [ref, ids]: tileObstacles_) {
+            if (!ids.empty()) {
+                dirty_.insert(ref);
+            }
+        }
+        obstacles_.clear();
+        tileObstacles_.clear();
+    }
+
+    size_t ObstacleCount() const {
+        return obstacles_.size();
+    }
+
+    // tiles waiting for a rebuild, being rebuilt or waiting to be swapped in
+    size_t Pending() const {
+        std::lock_guard lock { state_->mutex };
+        return dirty_.size() + (size_t)state_->inFlight + state_->results.size();
+    }
+
+    // Swaps in finished tiles and submits dirty ones. Returns the number of tiles swapped.
+    int Update(const dtTileCache& tilecache, dtNavMesh& mesh) {
+        std::vector<Result> done;
+        {
+            std::lock_guard lock { state_->mutex };
+            done.swap(state_->results);
+        }
+
+        int swapped = 0;
+        for (Result& res: done) {
+            // a newer rebuild of the same tile supersedes this one
+            auto iter = generations_.find(res.ref);
+            if (iter == generations_.end() || iter->second != res.generation
+                || dtStatusFailed(res.status))
+            {
+                dtFree(res.data);
+                continue;
+            }
+
+            mesh.removeTile(mesh.getTileRefAt(res.tx, res.ty, res.tlayer), nullptr, nullptr);
+            if (nullptr != res.data
+                && dtStatusFailed(mesh.addTile(res.data, res.size, DT_TILE_FREE_DATA, 0, nullptr)))
+            {
+                dtFree(res.data);
+            }
+            ++swapped;
+        }
+
+        for (dtCompressedTileRef ref: dirty_) {
+            const dtCompressedTile* tile = tilecache.getTileByRef(ref);
+            if (nullptr == tile || nullptr == tile->header) {
+                continue;
+            }
+
+            Job job;
+            job.state = state_;
+            job.ref = ref;
+            job.generation = ++generations_[ref];
+            job.tile = tile;
+            if (auto iter = tileObstacles_.find(ref); iter != tileObstacles_.end()) {
+                for (uint32_t id: iter->second) {
+                    job.obstacles.push_back(obstacles_[id].shape);
+                }
+            }
+
+            {
+                std::lock_guard lock { state_->mutex };
+                ++state_->inFlight;
+            }
+            Worker::Instance().Submit(std::move(job));
+        }
+        dirty_.clear();
+        return swapped;
+    }
+
+private:
+    // dtTileCache::buildNavMeshTile without touching the tile cache or the navmesh
+    static dtStatus BuildTile(const dtTileCacheParams& params, const Job& job, Result& res) {
+        static thread_local LinearAllocator talloc(32 * 1024);
+
+        for (;;) {
+            dtStatus status = BuildTileOnce(params, job, talloc, res);
+            if (!dtStatusFailed(status) || !dtStatusDetail(status, DT_OUT_OF_MEMORY)
+                || talloc.capacity >= MAX_TALLOC_SIZE)
+            {
+                return status;
+            }
+            talloc.resize(talloc.capacity * 2);
+        }
+    }
+
+    static dtStatus
+    BuildTileOnce(const dtTileCacheParams& params, const Job& job, LinearAllocator& talloc, Result& res) {
+        FastLZCompressor tcomp;
+        MeshProcess tmproc;
+
+        talloc.reset();
+
+        const dtCompressedTile* tile = job.tile;
+        const int walkableClimbVx = (int)(params.walkableClimb / params.ch);
+
+        dtTileCacheLayer* layer = nullptr;
+        dtStatus status =
+            dtDecompressTileCacheLayer(&talloc, &tcomp, tile->data, tile->dataSize, &layer);
+        if (dtStatusFailed(status)) {
+            return status;
+        }
+
+        for (const Cylinder& ob: job.obstacles) {
+            dtMarkCylinderArea(
+                *layer,
+                tile->header->bmin,
+                params.cs,
+                params.ch,
+                ob.pos,
+                ob.radius,
+                ob.height,
+                0
+            );
+        }
+
+        status = dtBuildTileCacheRegions(&talloc, *layer, walkableClimbVx);
+        if (dtStatusFailed(status)) {
+            return status;
+        }
+
+        dtTileCacheContourSet* lcset = dtAllocTileCacheContourSet(&talloc);
+        if (nullptr == lcset) {
+            return DT_FAILURE | DT_OUT_OF_MEMORY;
+        }
+        status = dtBuildTileCacheContours(
+            &talloc,
+            *layer,
+            walkableClimbVx,
+            params.maxSimplificationError,
+            *lcset
+        );
+        if (dtStatusFailed(status)) {
+            return status;
+        }
+
+        dtTileCachePolyMesh* lmesh = dtAllocTileCachePolyMesh(&talloc);
+        if (nullptr == lmesh) {
+            return DT_FAILURE | DT_OUT_OF_MEMORY;
+        }
+        status = dtBuildTileCachePolyMesh(&talloc, *lcset, *lmesh);
+        if (dtStatusFailed(status)) {
+            return status;
+        }
+
+        // empty tile, the swap only removes the old one
+        if (0 == lmesh->npolys) {
+            return DT_SUCCESS;
+        }
+
+        dtNavMeshCreateParams p;
+        memset(&p, 0, sizeof(p));
+        p.verts = lmesh->verts;
+        p.vertCount = lmesh->nverts;
+        p.polys = lmesh->polys;
+        p.polyAreas = lmesh->areas;
+        p.polyFlags = lmesh->flags;
+        p.polyCount = lmesh->npolys;
+        p.nvp = DT_VERTS_PER_POLYGON;
+        p.walkableHeight = params.walkableHeight;
+        p.walkableRadius = params.walkableRadius;
+        p.walkableClimb = params.walkableClimb;
+        p.tileX = tile->header->tx;
+        p.tileY = tile->header->ty;
+        p.tileLayer = tile->header->tlayer;
+        p.cs = params.cs;
+        p.ch = params.ch;
+        p.buildBvTree = false;
+        dtVcopy(p.bmin, tile->header->bmin);
+        dtVcopy(p.bmax, tile->header->bmax);
+
+        tmproc.process(&p, lmesh->areas, lmesh->flags);
+
+        if (!dtCreateNavMeshData(&p, &res.data, &res.size)) {
+            return DT_FAILURE;
+        }
+        return DT_SUCCESS;
+    }
+
+    std::shared_ptr<State> state_;
+    uint32_t nextId_ = 0;
+    std::unordered_map<uint32_t, Obstacle> obstacles_;
+    std::unordered_map<dtCompressedTileRef, std::vector<uint32_t>> tileObstacles_;
+    std::unordered_map<dtCompressedTileRef, uint32_t> generations_;
+    std::unordered_set<dtCompressedTileRef> dirty_;
+};
+
+class navmesh {
+public:
+    // MSET of load_static and TSET of load_dynamic, also written by tools/navmesh-builder
     static constexpr int NAVMESHSET_MAGIC = 'M' << 24 | 'S' << 16 | 'E' << 8 | 'T'; //'MSET';
     static constexpr int NAVMESHSET_VERSION = 1;
-    static constexpr int MAX_POLYS = 2048;
-    static constexpr int NAV_ERROR_NEARESTPOLY = -2;
-
     static constexpr int TILECACHESET_MAGIC = 'T' << 24 | 'S' << 16 | 'E' << 8 | 'T';
     static constexpr int TILECACHESET_VERSION = 1;
 
@@ -238,6 +762,14 @@ private:
         int32_t dataSize;
     };
 
+private:
+    static constexpr int MAX_POLYS = 2048;
+    static constexpr int NAV_ERROR_NEARESTPOLY = -2;
+
+    static constexpr int DEFAULT_PATH_QUEUE_SLOTS = 4;
+    static constexpr int DEFAULT_PATH_QUEUE_NODES = 4096;
+    static constexpr int DEFAULT_QUERY_NODES = 65535;
+
     template<typename T, void (*F)(T*)>
     struct unique_deleter {
         void operator()(T* p) {
@@ -249,12 +781,74 @@ private:
     using dtTileCacheDeleter = unique_deleter<dtTileCache, dtFreeTileCache>;
     using dtNavMeshQueryDeleter = unique_deleter<dtNavMeshQuery, dtFreeNavMeshQuery>;
 
+    // Detour queries of one mesh, checked out for the duration of a call. A service
+    // runs one call at a time on a worker thread, so the pool grows to the number of
+    // threads querying the mesh at once instead of one query per navmesh object.
+    class QueryPool {
+    public:
+        explicit QueryPool(const dtNavMesh* mesh): mesh_(mesh) {}
+
+        QueryPool(const QueryPool&) = delete;
+        QueryPool& operator=(const QueryPool&) = delete;
+
+        ~QueryPool() {
+            for (dtNavMeshQuery* q: free_)
+                dtFreeNavMeshQuery(q);
+        }
+
+        // nullptr when the query can not be allocated
+        dtNavMeshQuery* Acquire(int maxNodes) {
+            dtNavMeshQuery* q = nullptr;
+            {
+                std::lock_guard lock { mutex_ };
+                if (!free_.empty()) {
+                    q = free_.back();
+                    free_.pop_back();
+                }
+            }
+
+            // init keeps a larger node pool, so a query pooled before the node
+            // count changed is replaced rather than re-inited
+            if (nullptr != q && q->getNodePool()->getMaxNodes() == maxNodes)
+                return q;
+            dtFreeNavMeshQuery(q);
+
+            q = dtAllocNavMeshQuery();
+            if (nullptr == q)
+                return nullptr;
+            if (dtStatusFailed(q->init(mesh_, maxNodes))) {
+                dtFreeNavMeshQuery(q);
+                return nullptr;
+            }
+            return q;
+        }
+
+        void Release(dtNavMeshQuery* q) {
+            std::lock_guard lock { mutex_ };
+            free_.push_back(q);
+        }
+
+        size_t Size() const {
+            std::lock_guard lock { mutex_ };
+            return free_.size();
+        }
+
+    private:
+        const dtNavMesh* mesh_;
+        mutable std::mutex mutex_;
+        std::vector<dtNavMeshQuery*> free_;
+    };
+
     struct navmesh_context {
+        // tiles may point into the mapping, so it is declared first and released last
+        std::unique_ptr<mapped_file> mapping;
         std::unique_ptr<dtNavMesh, dtNavMeshDeleter> mesh = nullptr;
         std::unique_ptr<dtTileCache, dtTileCacheDeleter> tilecache = nullptr;
         std::unique_ptr<LinearAllocator> talloc;
         std::unique_ptr<FastLZCompressor> tcomp;
         std::unique_ptr<MeshProcess> tmproc;
+        std::unique_ptr<tile_graph> graph;
+        std::unique_ptr<QueryPool> queries;
 
         navmesh_context() = default;
 
@@ -263,6 +857,122 @@ private:
         navmesh_context& operator=(navmesh_context&& other) = default;
     };
 
+    using static_handle = std::shared_ptr<const navmesh_context>;
+
+    struct path_request {
+        uint32_t id = 0;
+        float spos[3];
+        float epos[3];
+        dtPolyRef startRef = 0;
+        dtPolyRef endRef = 0;
+    };
+
+    // dtNavMeshQuery keeps one sliced search at a time, so each slot owns a query
+    struct path_slot {
+        std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter> query;
+        path_request req;
+        bool busy = false;
+    };
+
+    struct path_queue {
+        std::deque<path_request> pending;
+        std::vector<path_slot> slots;
+        size_t cursor = 0;
+        uint32_t next_id = 0;
+    };
+
+    // Process-wide immutable static meshes, shared by navmesh objects of all services.
+    // Each navmesh object holds a handle from acquire. An entry is dropped when the
+    // last handle of its version is released, or when it is unloaded. A replaced
+    // version is freed when the last object using it goes away.
+    class static_registry {
+        struct entry {
+            static_handle ctx;
+            uint32_t version = 0;
+            long holders = 0; // handles from acquire alive for this version
+        };
+
+        // deleter of the acquired handles, its ctx keeps the mesh until the last
+        // copy of the handle is gone, so release never frees it under the lock
+        struct holder {
+            static_registry* registry;
+            std::string name;
+            uint32_t version;
+            static_handle ctx;
+
+            void operator()(const navmesh_context*) const {
+                registry->release(name, version);
+            }
+        };
+
+    public:
+        std::pair<static_handle, uint32_t> acquire(const std::string& name) {
+            std::unique_lock lock { mutex_ };
+            auto iter = meshes_.find(name);
+            if (iter == meshes_.end()) {
+                return { nullptr, 0 };
+            }
+            entry& e = iter->second;
+            ++e.holders;
+            return { static_handle(e.ctx.get(), holder { this, name, e.version, e.ctx }), e.version };
+        }
+
+        // version and holders of the current version
+        std::pair<uint32_t, long> info(const std::string& name) const {
+            std::shared_lock lock { mutex_ };
+            if (auto iter = meshes_.find(name); iter != meshes_.end()) {
+                return { iter->second.version, iter->second.holders };
+            }
+            return { 0, 0 };
+        }
+
+        bool contains(const std::string& name) const {
+            std::shared_lock lock { mutex_ };
+            return meshes_.find(name) != meshes_.end();
+        }
+
+        // replace = false keeps a mesh already published by another thread
+        uint32_t publish(const std::string& name, static_handle ctx, bool replace) {
+            std::unique_lock lock { mutex_ };
+            auto res = meshes_.try_emplace(name);
+            if (!res.second && !replace) {
+                return res.first->second.version;
+            }
+            res.first->second.ctx = std::move(ctx);
+            res.first->second.version = ++version_;
+            res.first->second.holders = 0;
+            return version_;
+        }
+
+        void release(const std::string& name, uint32_t version) {
+            std::unique_lock lock { mutex_ };
+            auto iter = meshes_.find(name);
+            if (iter != meshes_.end() && iter->second.version == version && --iter->second.holders == 0) {
+                meshes_.erase(iter);
+            }
+        }
+
+        bool erase(const std::string& name) {
+            static_handle ctx;
+            {
+                std::unique_lock lock { mutex_ };
+                auto iter = meshes_.find(name);
+                if (iter == meshes_.end()) {
+                    return false;
+                }
+                ctx = std::move(iter->second.ctx);
+                meshes_.erase(iter);
+            }
+            // mesh may be freed here, outside the lock
+            return true;
+        }
+
+    private:
+        mutable std::shared_mutex mutex_;
+        uint32_t version_ = 0;
+        std::unordered_map<std::string, entry> meshes_;
+    };
+
     static std::string read_all(const std::string& path, std::ios::openmode Mode) {
         std::fstream is(path, Mode);
         if (is.is_open()) {
@@ -280,6 +990,44 @@ private:
         return std::string();
     }
 
+    // Maps meshfile so tile data can be used in place, falls back to reading it
+    // into buffer when the file can not be mapped.
+    static std::string_view open_meshfile(
+        const std::string& meshfile,
+        bool copy_on_write,
+        mapped_file& mapping,
+        std::string& buffer
+    ) {
+        if (mapping.open(meshfile, copy_on_write)) {
+            return std::string_view { mapping.data(), mapping.size() };
+        }
+        buffer = read_all(meshfile, std::ios::binary | std::ios::in);
+        return buffer;
+    }
+
+    // Tile data inside the mapping is used in place when it is 4-byte aligned
+    // as Detour requires, otherwise it is copied and owned is set.
+    static unsigned char* tile_data(
+        const mapped_file& mapping,
+        std::string_view content,
+        size_t offset,
+        int size,
+        bool& owned
+    ) {
+        const char* src = content.data() + offset;
+        if (nullptr != mapping.data() && reinterpret_cast<uintptr_t>(src) % 4 == 0) {
+            owned = false;
+            return reinterpret_cast<unsigned char*>(const_cast<char*>(src));
+        }
+
+        owned = true;
+        unsigned char* data = (unsigned char*)dtAlloc(size, DT_ALLOC_PERM);
+        if (nullptr != data) {
+            memcpy(data, src, size);
+        }
+        return data;
+    }
+
     inline static thread_local std::mt19937 generator { std::random_device {}() };
     static inline float randf() {
         std::uniform_real_distribution<float> dis(0.0f, 1.0f);
@@ -295,15 +1043,63 @@ private:
             p[2] = -p[2];
     }
 
-public:
-    enum coord_transform_mask {
-        negative_x_axis = 1 << 0,
-        negative_y_axis = 1 << 1,
-        negative_z_axis = 1 << 2,
+    static static_registry& static_mesh() {
+        static static_registry registry;
+        return registry;
+    }
+
+    static std::atomic<int>& query_nodes() {
+        static std::atomic<int> nodes { DEFAULT_QUERY_NODES };
+        return nodes;
+    }
+
+    // pool of the mesh in use, see get_mesh
+    QueryPool* query_pool() const {
+        if (nullptr != dynamic_.mesh)
+            return dynamic_.queries.get();
+        if (nullptr != static_)
+            return static_->queries.get();
+        return nullptr;
+    }
+
+    // Binds meshQuery to a pooled query until the outermost scope of a call ends.
+    // meshQuery stays null when there is no mesh or the query can not be created.
+    class query_scope {
+    public:
+        explicit query_scope(const navmesh& nav): nav_(nav) {
+            if (nullptr != nav_.meshQuery)
+                return;
+            pool_ = nav_.query_pool();
+            if (nullptr != pool_)
+                nav_.meshQuery = pool_->Acquire(query_nodes().load(std::memory_order_relaxed));
+        }
+
+        query_scope(const query_scope&) = delete;
+        query_scope& operator=(const query_scope&) = delete;
+
+        ~query_scope() {
+            if (nullptr != pool_ && nullptr != nav_.meshQuery) {
+                pool_->Release(nav_.meshQuery);
+                nav_.meshQuery = nullptr;
+            }
+        }
+
+    private:
+        const navmesh& nav_;
+        QueryPool* pool_ = nullptr;
     };
 
-    static bool load_static(const std::string& meshfile, std::string& err) {
-        auto content = read_all(meshfile, std::ios::binary | std::ios::in);
+    static bool build_static(
+        const std::string& meshfile,
+        bool build_graph,
+        navmesh_context& ctx,
+        std::string& err
+    ) {
+        // Detour links polygons by writing into tile data, so the mapping is
+        // copy-on-write: only the pages holding polys and links become private.
+        auto mapping = std::make_unique<mapped_file>();
+        std::string buffer;
+        std::string_view content = open_meshfile(meshfile, true, *mapping, buffer);
         if (content.size() < sizeof(NavMeshSetHeader)) {
             err = "meshfile can not find or format error";
             return false;
@@ -345,52 +1141,272 @@ public:
                 break;
             }
 
-            NavMeshTileHeader tileHeader = *(NavMeshTileHeader*)(content.data() + offset);
+            NavMeshTileHeader tileHeader;
+            memcpy(&tileHeader, content.data() + offset, sizeof(tileHeader));
             offset += sizeof(NavMeshTileHeader);
 
-            if (!tileHeader.tileRef || !tileHeader.dataSize) {
+            if (!tileHeader.tileRef || tileHeader.dataSize <= 0
+                || content.size() - offset < (size_t)tileHeader.dataSize)
+            {
                 success = false;
                 status = DT_FAILURE + DT_INVALID_PARAM;
                 break;
             }
 
-            unsigned char* tileData = (unsigned char*)dtAlloc(tileHeader.dataSize, DT_ALLOC_PERM);
+            bool owned = false;
+            unsigned char* tileData =
+                tile_data(*mapping, content, offset, tileHeader.dataSize, owned);
             if (!tileData) {
                 success = false;
                 status = DT_FAILURE + DT_OUT_OF_MEMORY;
                 break;
             }
 
-            memcpy(tileData, content.data() + offset, tileHeader.dataSize);
             offset += tileHeader.dataSize;
 
             status = mesh->addTile(
                 tileData,
                 tileHeader.dataSize,
-                DT_TILE_FREE_DATA,
+                owned ? DT_TILE_FREE_DATA : 0,
                 tileHeader.tileRef,
                 0
             );
 
             if (dtStatusFailed(status)) {
+                if (owned) {
+                    dtFree(tileData);
+                }
                 success = false;
                 break;
             }
         }
 
-        if (!success) {
-            err = "load tiles ailed";
+        if (!success) {
+            err = "load tiles ailed";
+            return false;
+        }
+
+        if (build_graph) {
+            dtQueryFilter filter;
+            ctx.graph = std::make_unique<tile_graph>();
+            ctx.graph->build(*mesh, filter);
+        }
+        ctx.queries = std::make_unique<QueryPool>(mesh.get());
+
+        ctx.mesh = std::move(mesh);
+        if (nullptr != mapping->data()) {
+            ctx.mapping = std::move(mapping);
+        }
+        return true;
+    }
+
+    template<typename Buffer, typename T>
+    static void write_array(Buffer& out, const std::vector<T>& v) {
+        if (!v.empty()) {
+            out.write_back(
+                std::string_view { reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T) }
+            );
+        }
+    }
+
+    // nearest polys of spos/epos, epos falls back to a larger search extent
+    bool find_path_endpoints(const float* spos, const float* epos, dtPolyRef& startRef, dtPolyRef& endRef) {
+        const float extents[3] = { 8.0f, 4.f, 8.0f };
+        const float large_extents[3] = { 64.0f, 4.f, 64.0f };
+
+        dtStatus status =
+            meshQuery->findNearestPoly(spos, extents, &queryFilter, &startRef, nullptr);
+        if (!dtStatusSucceed(status)) {
+            return false;
+        }
+
+        status = meshQuery->findNearestPoly(epos, extents, &queryFilter, &endRef, nullptr);
+        if (!dtStatusSucceed(status)) {
+            return false;
+        }
+
+        if (!endRef) {
+            status =
+                meshQuery->findNearestPoly(epos, large_extents, &queryFilter, &endRef, nullptr);
+            if (!dtStatusSucceed(status)) {
+                return false;
+            }
+        }
+
+        if (!startRef || !endRef) {
+            status_ = "find_straight_path could not find any nearby poly's";
+            return false;
+        }
+        return true;
+    }
+
+    // string-pull a polygon corridor into paths (in caller coordinates)
+    bool straight_path(
+        const dtNavMeshQuery* query,
+        const float* spos,
+        const float* epos,
+        dtPolyRef endRef,
+        const dtPolyRef* polys,
+        int nPolys,
+        std::vector<float>& paths
+    ) const {
+        static thread_local std::array<float, MAX_POLYS * 3> mStraightPath;
+        static thread_local std::array<uint8_t, MAX_POLYS> mStraightPathFlags;
+        static thread_local std::array<dtPolyRef, MAX_POLYS> mStraightPathPolys;
+
+        if (0 == nPolys) {
+            return false;
+        }
+
+        float tmp[3];
+        dtVcopy(tmp, epos);
+
+        if (polys[nPolys - 1] != endRef) {
+            // In case of partial path, make sure the end point is clamped to the last polygon.
+            dtStatus status = query->closestPointOnPoly(polys[nPolys - 1], epos, tmp, 0);
+            if (!dtStatusSucceed(status)) {
+                return false;
+            }
+        }
+
+        int nStraightPath = 0;
+        dtStatus status = query->findStraightPath(
+            spos,
+            tmp,
+            polys,
+            nPolys,
+            mStraightPath.data(),
+            mStraightPathFlags.data(),
+            mStraightPathPolys.data(),
+            &nStraightPath,
+            MAX_POLYS
+        );
+        if (!dtStatusSucceed(status)) {
+            return false;
+        }
+
+        if (status & DT_BUFFER_TOO_SMALL) {
+            return false;
+        }
+
+        for (int i = 0; i < nStraightPath * 3;) {
+            paths.push_back(mStraightPath[i++]);
+            paths.push_back(mStraightPath[i++]);
+            paths.push_back(mStraightPath[i++]);
+            coord_transform(paths.data() + (paths.size() - 3));
+        }
+        return true;
+    }
+
+    // exact start point of a batched ray, rays from one origin share the lookup
+    struct point_key {
+        float p[3];
+
+        bool operator==(const point_key& other) const {
+            return memcmp(p, other.p, sizeof(p)) == 0;
+        }
+    };
+
+    struct point_key_hash {
+        size_t operator()(const point_key& k) const {
+            uint32_t bits[3];
+            memcpy(bits, k.p, sizeof(bits));
+            size_t h = bits[0];
+            h ^= bits[1] + 0x9e3779b9 + (h << 6) + (h >> 2);
+            h ^= bits[2] + 0x9e3779b9 + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+
+    // raycast along the mesh surface, hitPos (caller coordinates) is the first wall
+    // hit or epos; returns true when blocked
+    bool raycast_from(dtPolyRef startRef, const float* spos, const float* epos, float* hitPos) const {
+        thread_local static dtPolyRef polys[MAX_POLYS];
+
+        float t = 0.0f;
+        int npolys = 0;
+        meshQuery
+            ->raycast(startRef, spos, epos, &queryFilter, &t, nullptr, polys, &npolys, MAX_POLYS);
+        bool hit = false;
+        if (t > 1) {
+            //No hit
+            dtVcopy(hitPos, epos);
+        } else {
+            // Hit
+            hit = true;
+            dtVlerp(hitPos, spos, epos, t);
+        }
+
+        // Adjust height.
+        if (npolys > 0) {
+            float h = 0;
+            meshQuery->getPolyHeight(polys[npolys - 1], hitPos, &h);
+            hitPos[1] = h;
+        }
+        coord_transform(hitPos);
+        return hit;
+    }
+
+public:
+    enum coord_transform_mask {
+        negative_x_axis = 1 << 0,
+        negative_y_axis = 1 << 1,
+        negative_z_axis = 1 << 2,
+    };
+
+    // load once, later calls with the same meshfile reuse the loaded mesh until
+    // the last navmesh object using it is released, the mesh is dropped then.
+    // build_graph precomputes the tile graph used by find_long_path
+    static bool load_static(const std::string& meshfile, std::string& err, bool build_graph = false) {
+        if (static_mesh().contains(meshfile)) {
+            return true;
+        }
+
+        auto ctx = std::make_shared<navmesh_context>();
+        if (!build_static(meshfile, build_graph, *ctx, err)) {
             return false;
         }
+        static_mesh().publish(meshfile, std::move(ctx), false);
+        return true;
+    }
 
-        navmesh_context ctx;
-        ctx.mesh = std::move(mesh);
-        static_mesh_.emplace(meshfile, std::move(ctx));
+    // load a new version of meshfile, navmesh objects created after this use it,
+    // existing ones keep the old version until they are released. The new file
+    // is mapped and validated in its own context, the old context and mapping
+    // stay published when it fails. meshfile must be replaced by rename, see
+    // mapped_file.hpp
+    static bool reload_static(const std::string& meshfile, std::string& err, bool build_graph = false) {
+        auto ctx = std::make_shared<navmesh_context>();
+        if (!build_static(meshfile, build_graph, *ctx, err)) {
+            return false;
+        }
+        static_mesh().publish(meshfile, std::move(ctx), true);
         return true;
     }
 
+    static bool unload_static(const std::string& meshfile) {
+        return static_mesh().erase(meshfile);
+    }
+
+    // version and number of navmesh objects using the current version
+    static std::pair<uint32_t, long> static_info(const std::string& meshfile) {
+        return static_mesh().info(meshfile);
+    }
+
+    // builds into a new context, the current mesh and its mapping are kept
+    // when meshfile fails to load. Refused while crowds hold the dynamic mesh
     bool load_dynamic(const std::string& meshfile, std::string& err) {
-        auto content = read_all(meshfile, std::ios::binary | std::ios::in);
+        if (nullptr != dynamic_.mesh && dynamic_ref_.use_count() > 1) {
+            err = "dynamic mesh is used by crowds";
+            return false;
+        }
+
+        navmesh_context ctx;
+
+        // compressed tiles are only read, so every scene shares the pages
+        ctx.mapping = std::make_unique<mapped_file>();
+        std::string buffer;
+        std::string_view content = open_meshfile(meshfile, false, *ctx.mapping, buffer);
         if (content.size() < sizeof(TileCacheSetHeader)) {
             err = "meshfile format error";
             return false;
@@ -411,7 +1427,6 @@ public:
             return false;
         }
 
-        navmesh_context ctx;
         ctx.mesh = std::unique_ptr<dtNavMesh, dtNavMeshDeleter>(dtAllocNavMesh());
         if (nullptr == ctx.mesh) {
             err = "dtAllocNavMesh failed";
@@ -451,30 +1466,40 @@ public:
                 break;
             }
 
-            TileCacheTileHeader tileHeader = *(TileCacheTileHeader*)(content.data() + offset);
+            TileCacheTileHeader tileHeader;
+            memcpy(&tileHeader, content.data() + offset, sizeof(tileHeader));
             offset += sizeof(TileCacheTileHeader);
 
-            if (!tileHeader.tileRef || !tileHeader.dataSize) {
+            if (!tileHeader.tileRef || tileHeader.dataSize <= 0
+                || content.size() - offset < (size_t)tileHeader.dataSize)
+            {
                 success = false;
                 status = DT_FAILURE + DT_INVALID_PARAM;
                 break;
             }
 
-            unsigned char* tileData = (unsigned char*)dtAlloc(tileHeader.dataSize, DT_ALLOC_PERM);
+            bool owned = false;
+            unsigned char* tileData =
+                tile_data(*ctx.mapping, content, offset, tileHeader.dataSize, owned);
             if (!tileData) {
                 success = false;
                 status = DT_FAILURE + DT_OUT_OF_MEMORY;
                 break;
             }
 
-            memcpy(tileData, content.data() + offset, tileHeader.dataSize);
             offset += tileHeader.dataSize;
 
             dtCompressedTileRef tile = 0;
-            status =
-                ctx.tilecache
-                    ->addTile(tileData, tileHeader.dataSize, DT_COMPRESSEDTILE_FREE_DATA, &tile);
+            status = ctx.tilecache->addTile(
+                tileData,
+                tileHeader.dataSize,
+                owned ? DT_COMPRESSEDTILE_FREE_DATA : 0,
+                &tile
+            );
             if (dtStatusFailed(status)) {
+                if (owned) {
+                    dtFree(tileData);
+                }
                 success = false;
                 break;
             }
@@ -496,10 +1521,22 @@ public:
             return false;
         }
 
-        meshQuery = std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter>(dtAllocNavMeshQuery());
-        meshQuery->init(ctx.mesh.get(), 65535);
+        // queued searches, cached corridors and rebuild jobs reference the replaced mesh
+        const bool async = nullptr != rebuilder_;
+        path_queue_.reset();
+        rebuilder_.reset();
+        path_cache_.Clear();
+        obstacles_changed_ = false;
 
+        ctx.queries = std::make_unique<QueryPool>(ctx.mesh.get());
+
+        if (nullptr == ctx.mapping->data()) {
+            ctx.mapping = nullptr;
+        }
         dynamic_ = std::move(ctx);
+        // the new tilecache has no obstacles, it keeps the rebuild mode
+        if (async)
+            rebuilder_ = std::make_unique<TileRebuilder>(*dynamic_.tilecache->getParams());
         return true;
     }
 
@@ -507,18 +1544,54 @@ public:
         if (meshfile.empty())
             return;
 
-        if (auto iter = static_mesh_.find(meshfile); iter != static_mesh_.end()) {
-            meshQuery =
-                std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter>(dtAllocNavMeshQuery());
-            if (nullptr != meshQuery) {
-                dtStatus status = meshQuery->init(iter->second.mesh.get(), 65535);
-                if (dtStatusFailed(status)) {
-                    meshQuery = nullptr;
-                }
-            }
+        auto [ctx, version] = static_mesh().acquire(meshfile);
+        if (nullptr != ctx) {
+            static_ = std::move(ctx);
+            static_version_ = version;
         }
     }
 
+    // Node pool size of queries checked out from now on, for every mesh in the
+    // process; returns the previous size.
+    static int set_query_nodes(int max_nodes) {
+        return query_nodes().exchange(max_nodes);
+    }
+
+    static int get_query_nodes() {
+        return query_nodes().load(std::memory_order_relaxed);
+    }
+
+    // idle queries pooled for the mesh in use
+    size_t pooled_queries() const {
+        QueryPool* pool = query_pool();
+        return nullptr != pool ? pool->Size() : 0;
+    }
+
+    uint32_t version() const {
+        return static_version_;
+    }
+
+    int coord_mask() const {
+        return coord_mask_;
+    }
+
+    // the dynamic mesh if loaded, otherwise the shared static mesh
+    dtNavMesh* get_mesh() const {
+        if (nullptr != dynamic_.mesh)
+            return dynamic_.mesh.get();
+        if (nullptr != static_)
+            return static_->mesh.get();
+        return nullptr;
+    }
+
+    // Keeps the mesh of get_mesh usable by its holder: the static context is
+    // shared, and load_dynamic refuses to replace a dynamic mesh that is held.
+    std::shared_ptr<const void> hold_mesh() const {
+        if (nullptr != dynamic_.mesh)
+            return dynamic_ref_;
+        return static_;
+    }
+
     bool find_straight_path(
         float sx,
         float sy,
@@ -529,10 +1602,8 @@ public:
         std::vector<float>& paths
     ) {
         static thread_local std::array<dtPolyRef, MAX_POLYS> mPolys;
-        static thread_local std::array<float, MAX_POLYS * 3> mStraightPath;
-        static thread_local std::array<uint8_t, MAX_POLYS> mStraightPathFlags;
-        static thread_local std::array<dtPolyRef, MAX_POLYS> mStraightPathPolys;
 
+        query_scope scope { *this };
         if (!meshQuery) {
             return false;
         }
@@ -545,38 +1616,13 @@ public:
         coord_transform(spos);
         coord_transform(epos);
 
-        const float extents[3] = { 8.0f, 4.f, 8.0f };
-        const float large_extents[3] = { 64.0f, 4.f, 64.0f };
-
         dtPolyRef startRef = 0;
         dtPolyRef endRef = 0;
-
-        dtStatus status =
-            meshQuery->findNearestPoly(spos, extents, &queryFilter, &startRef, nullptr);
-        if (!dtStatusSucceed(status)) {
-            return false;
-        }
-
-        status = meshQuery->findNearestPoly(epos, extents, &queryFilter, &endRef, nullptr);
-        if (!dtStatusSucceed(status)) {
-            return false;
-        }
-
-        if (!endRef) {
-            status =
-                meshQuery->findNearestPoly(epos, large_extents, &queryFilter, &endRef, nullptr);
-            if (!dtStatusSucceed(status)) {
-                return false;
-            }
-        }
-
-        if (!startRef || !endRef) {
-            status_ = "find_straight_path could not find any nearby poly's";
+        if (!find_path_endpoints(spos, epos, startRef, endRef)) {
             return false;
         }
 
         int nPolys = 0;
-        int nStraightPath = 0;
 
         if (dtVdist2DSqr(spos, epos) < 10000.0f) {
             float t = 0.0f;
@@ -602,10 +1648,24 @@ public:
                 return true;
             }
             nPolys = 0;
-            nStraightPath = 0;
         }
 
-        status = meshQuery->findPath(
+        if (path_cache_.Enabled()) {
+            auto corridor = path_cache_.Find(queryFilter, startRef, endRef);
+            if (nullptr != corridor) {
+                return straight_path(
+                    meshQuery,
+                    spos,
+                    epos,
+                    endRef,
+                    corridor->data(),
+                    (int)corridor->size(),
+                    paths
+                );
+            }
+        }
+
+        dtStatus status = meshQuery->findPath(
             startRef,
             endRef,
             spos,
@@ -631,49 +1691,353 @@ public:
         //    return false;
         //}
 
-        if (nPolys) {
-            float tmp[3];
-            dtVcopy(tmp, epos);
+        path_cache_.Insert(queryFilter, startRef, endRef, mPolys.data(), nPolys);
 
-            if (mPolys[(size_t)nPolys - 1] != endRef) {
-                // In case of partial path, make sure the end point is clamped to the last polygon.
-                status = meshQuery->closestPointOnPoly(mPolys[(size_t)nPolys - 1], epos, tmp, 0);
-                if (!dtStatusSucceed(status)) {
-                    return false;
-                }
-            }
+        return straight_path(meshQuery, spos, epos, endRef, mPolys.data(), nPolys, paths);
+    }
 
-            status = meshQuery->findStraightPath(
-                spos,
-                epos,
+    // Long-range query over the static mesh's tile graph: abstract A* between tile
+    // portals, then Detour refines only the first `segments` legs. done is false
+    // when legs remain, the caller queries again from the end of paths.
+    // Falls back to find_straight_path without a graph or within a single tile.
+    bool find_long_path(
+        float sx,
+        float sy,
+        float sz,
+        float ex,
+        float ey,
+        float ez,
+        int segments,
+        std::vector<float>& paths,
+        bool& done
+    ) {
+        static thread_local std::array<dtPolyRef, MAX_POLYS> mPolys;
+        static thread_local std::vector<tile_graph::leg> legs;
+        static thread_local std::vector<float> leg_paths;
+
+        done = true;
+        query_scope scope { *this };
+        if (!meshQuery) {
+            return false;
+        }
+
+        if (nullptr != dynamic_.mesh || nullptr == static_ || nullptr == static_->graph) {
+            return find_straight_path(sx, sy, sz, ex, ey, ez, paths);
+        }
+
+        status_.clear();
+
+        float spos[3] = { sx, sy, sz };
+        float epos[3] = { ex, ey, ez };
+
+        coord_transform(spos);
+        coord_transform(epos);
+
+        dtPolyRef startRef = 0;
+        dtPolyRef endRef = 0;
+        if (!find_path_endpoints(spos, epos, startRef, endRef)) {
+            return false;
+        }
+
+        const dtNavMesh& mesh = *static_->mesh;
+        if (mesh.decodePolyIdTile(startRef) == mesh.decodePolyIdTile(endRef)) {
+            return find_straight_path(sx, sy, sz, ex, ey, ez, paths);
+        }
+
+        if (!static_->graph->search(mesh, queryFilter, startRef, spos, endRef, epos, legs)) {
+            status_ = "find_long_path no route in tile graph";
+            return false;
+        }
+
+        size_t n = legs.size();
+        if (segments > 0 && (size_t)segments < n) {
+            n = (size_t)segments;
+            done = false;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            const tile_graph::leg& l = legs[i];
+            int nPolys = 0;
+            dtStatus status = meshQuery->findPath(
+                l.fromRef,
+                l.toRef,
+                l.from,
+                l.to,
+                &queryFilter,
                 mPolys.data(),
-                nPolys,
-                mStraightPath.data(),
-                mStraightPathFlags.data(),
-                mStraightPathPolys.data(),
-                &nStraightPath,
+                &nPolys,
                 MAX_POLYS
             );
-            if (!dtStatusSucceed(status)) {
+            // a partial result ends short of the portal the next leg starts from
+            if (!dtStatusSucceed(status) || dtStatusDetail(status, DT_PARTIAL_RESULT)
+                || nPolys == 0 || mPolys[nPolys - 1] != l.toRef)
+            {
+                status_ = "find_long_path leg not reached";
                 return false;
             }
 
-            if (status & DT_BUFFER_TOO_SMALL) {
+            leg_paths.clear();
+            if (!straight_path(meshQuery, l.from, l.to, l.toRef, mPolys.data(), nPolys, leg_paths)) {
                 return false;
             }
 
-            for (int i = 0; i < nStraightPath * 3;) {
-                paths.push_back(mStraightPath[i++]);
-                paths.push_back(mStraightPath[i++]);
-                paths.push_back(mStraightPath[i++]);
-                coord_transform(paths.data() + (paths.size() - 3));
+            // consecutive legs share the portal point
+            size_t skip = (i > 0 && !leg_paths.empty()) ? 3 : 0;
+            paths.insert(paths.end(), leg_paths.begin() + skip, leg_paths.end());
+        }
+        return true;
+    }
+
+    // queue a time-sliced path request, returns request id, 0 on failure
+    uint32_t request_path(float sx, float sy, float sz, float ex, float ey, float ez) {
+        query_scope scope { *this };
+        if (!meshQuery) {
+            return 0;
+        }
+
+        status_.clear();
+
+        if (nullptr == path_queue_
+            && !init_path_queue(DEFAULT_PATH_QUEUE_SLOTS, DEFAULT_PATH_QUEUE_NODES))
+        {
+            status_ = "request_path: path queue init failed";
+            return 0;
+        }
+
+        path_request req;
+        req.spos[0] = sx;
+        req.spos[1] = sy;
+        req.spos[2] = sz;
+        req.epos[0] = ex;
+        req.epos[1] = ey;
+        req.epos[2] = ez;
+        coord_transform(req.spos);
+        coord_transform(req.epos);
+
+        if (!find_path_endpoints(req.spos, req.epos, req.startRef, req.endRef)) {
+            return 0;
+        }
+
+        req.id = ++path_queue_->next_id;
+        if (0 == req.id) {
+            req.id = ++path_queue_->next_id;
+        }
+        path_queue_->pending.push_back(req);
+        return req.id;
+    }
+
+    bool cancel_path(uint32_t id) {
+        if (nullptr == path_queue_) {
+            return false;
+        }
+
+        auto& pending = path_queue_->pending;
+        for (auto iter = pending.begin(); iter != pending.end(); ++iter) {
+            if (iter->id == id) {
+                pending.erase(iter);
+                return true;
+            }
+        }
+
+        for (auto& slot: path_queue_->slots) {
+            if (slot.busy && slot.req.id == id) {
+                slot.busy = false;
+                return true;
             }
-            return true;
         }
         return false;
     }
 
+    size_t pending_paths() const {
+        if (nullptr == path_queue_) {
+            return 0;
+        }
+        size_t n = path_queue_->pending.size();
+        for (const auto& slot: path_queue_->slots) {
+            n += slot.busy ? 1 : 0;
+        }
+        return n;
+    }
+
+    // slots: requests searched concurrently, each slot owns a query with max_nodes nodes
+    bool init_path_queue(int slots, int max_nodes) {
+        dtNavMesh* mesh = get_mesh();
+        if (nullptr == mesh || slots <= 0 || max_nodes <= 0) {
+            return false;
+        }
+
+        auto queue = std::make_unique<path_queue>();
+        queue->slots.resize(static_cast<size_t>(slots));
+        for (auto& slot: queue->slots) {
+            slot.query =
+                std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter>(dtAllocNavMeshQuery());
+            if (nullptr == slot.query) {
+                return false;
+            }
+            dtStatus status = slot.query->init(mesh, max_nodes);
+            if (dtStatusFailed(status)) {
+                return false;
+            }
+        }
+
+        if (nullptr != path_queue_) {
+            queue->pending = std::move(path_queue_->pending);
+            queue->next_id = path_queue_->next_id;
+            // requests being searched restart in the new slots
+            for (auto& slot: path_queue_->slots) {
+                if (slot.busy) {
+                    queue->pending.push_front(slot.req);
+                }
+            }
+        }
+        path_queue_ = std::move(queue);
+        return true;
+    }
+
+    // Advance queued requests by at most max_iters A* iterations in total, shared
+    // round-robin by the busy slots. Completed requests are appended to out:
+    // uint32 count, uint32 ids[count], uint32 offsets[count + 1] in points,
+    // float points[offsets[count] * 3]. A failed request has an empty range.
+    template<typename Buffer>
+    size_t update_paths(int max_iters, Buffer& out) {
+        static thread_local std::vector<float> points;
+        static thread_local std::vector<uint32_t> ids;
+        static thread_local std::vector<uint32_t> offsets;
+        static thread_local std::array<dtPolyRef, MAX_POLYS> mPolys;
+
+        points.clear();
+        ids.clear();
+        offsets.clear();
+        offsets.push_back(0);
+
+        auto complete = [](uint32_t id) {
+            ids.push_back(id);
+            offsets.push_back(static_cast<uint32_t>(points.size() / 3));
+        };
+
+        if (nullptr != path_queue_) {
+            auto& queue = *path_queue_;
+            size_t nslots = queue.slots.size();
+            int budget = max_iters;
+            while (budget > 0) {
+                size_t busy = 0;
+                for (auto& slot: queue.slots) {
+                    // feed free slots from pending
+                    while (!slot.busy && !queue.pending.empty()) {
+                        slot.req = queue.pending.front();
+                        queue.pending.pop_front();
+                        const auto& r = slot.req;
+                        dtStatus status = slot.query->initSlicedFindPath(
+                            r.startRef,
+                            r.endRef,
+                            r.spos,
+                            r.epos,
+                            &queryFilter
+                        );
+                        if (dtStatusFailed(status)) {
+                            complete(r.id);
+                            continue;
+                        }
+                        slot.busy = true;
+                    }
+                    busy += slot.busy ? 1 : 0;
+                }
+
+                if (0 == busy) {
+                    break;
+                }
+
+                int share = std::max(1, budget / static_cast<int>(busy));
+                for (size_t i = 0; i < nslots && budget > 0; ++i) {
+                    auto& slot = queue.slots[(queue.cursor + i) % nslots];
+                    if (!slot.busy) {
+                        continue;
+                    }
+
+                    int done = 0;
+                    dtStatus status =
+                        slot.query->updateSlicedFindPath(std::min(share, budget), &done);
+                    budget -= std::max(1, done);
+                    if (dtStatusInProgress(status)) {
+                        continue;
+                    }
+
+                    slot.busy = false;
+                    const auto& r = slot.req;
+                    int nPolys = 0;
+                    if (dtStatusSucceed(status)) {
+                        status =
+                            slot.query->finalizeSlicedFindPath(mPolys.data(), &nPolys, MAX_POLYS);
+                    }
+
+                    size_t n = points.size();
+                    if (!dtStatusSucceed(status)
+                        || !straight_path(
+                            slot.query.get(),
+                            r.spos,
+                            r.epos,
+                            r.endRef,
+                            mPolys.data(),
+                            nPolys,
+                            points
+                        ))
+                    {
+                        points.resize(n);
+                    }
+                    complete(r.id);
+                }
+                // next update starts from the following slot
+                queue.cursor = (queue.cursor + 1) % nslots;
+            }
+        }
+
+        size_t count = ids.size();
+        out.write_back(static_cast<uint32_t>(count));
+        write_array(out, ids);
+        write_array(out, offsets);
+        write_array(out, points);
+        return count;
+    }
+
+    // requests: count * 6 floats (start xyz, end xyz)
+    // out: uint32 count, uint32 offsets[count + 1] in points, float points[offsets[count] * 3]
+    // path i is points [offsets[i], offsets[i + 1]), empty when the request failed
+    template<typename Buffer>
+    void find_paths(const float* requests, size_t count, Buffer& out) {
+        static thread_local std::vector<float> points;
+        static thread_local std::vector<uint32_t> offsets;
+
+        points.clear();
+        offsets.clear();
+        offsets.push_back(0);
+
+        // one checkout for the whole batch
+        query_scope scope { *this };
+        for (size_t i = 0; i < count; ++i) {
+            const float* r = requests + i * 6;
+            size_t n = points.size();
+            if (!find_straight_path(r[0], r[1], r[2], r[3], r[4], r[5], points)) {
+                points.resize(n);
+            }
+            offsets.push_back(static_cast<uint32_t>(points.size() / 3));
+        }
+
+        out.write_back(static_cast<uint32_t>(count));
+        write_array(out, offsets);
+        write_array(out, points);
+    }
+
+    // capacity 0 disables the path cache
+    void set_path_cache(size_t capacity) {
+        path_cache_.SetCapacity(capacity);
+    }
+
+    const PathCache& get_path_cache() const {
+        return path_cache_;
+    }
+
     bool valid(float x, float y, float z) const {
+        query_scope scope { *this };
         if (!meshQuery)
             return false;
 
@@ -699,6 +2063,7 @@ public:
     }
 
     bool random_position(float* out) {
+        query_scope scope { *this };
         if (!meshQuery)
             return false;
 
@@ -718,6 +2083,7 @@ public:
     }
 
     bool random_position_around_circle(float x, float y, float z, float r, float* out) {
+        query_scope scope { *this };
         if (!meshQuery)
             return false;
 
@@ -763,8 +2129,7 @@ public:
     }
 
     bool recast(float sx, float sy, float sz, float ex, float ey, float ez, float* hitPos) const {
-        thread_local static dtPolyRef polys[MAX_POLYS];
-
+        query_scope scope { *this };
         if (!meshQuery) {
             return false;
         }
@@ -790,28 +2155,93 @@ public:
             return false;
         }
 
-        float t = 0.0f;
-        int npolys;
-        meshQuery
-            ->raycast(startRef, spos, epos, &queryFilter, &t, nullptr, polys, &npolys, MAX_POLYS);
-        bool hit = false;
-        if (t > 1) {
-            //No hit
-            dtVcopy(hitPos, epos);
-        } else {
-            // Hit
-            hit = true;
-            dtVlerp(hitPos, spos, epos, t);
+        return raycast_from(startRef, spos, epos, hitPos);
+    }
+
+    // Packed rays (sx, sy, sz, ex, ey, ez). Appends uint32 count, the hit bitset as
+    // uint32 words (bit i set when ray i is blocked), then float hit positions[count * 3].
+    // The start poly is looked up once per distinct start point; rays starting
+    // off the mesh are reported blocked at their start.
+    template<typename Buffer>
+    size_t raycast_batch(const float* rays, size_t count, Buffer& out) const {
+        static thread_local std::vector<uint32_t> hits;
+        static thread_local std::vector<float> positions;
+        static thread_local std::unordered_map<point_key, dtPolyRef, point_key_hash> starts;
+
+        hits.assign((count + 31) / 32, 0);
+        positions.resize(count * 3);
+        starts.clear();
+
+        const float extents[3] = { 8.0f, 4.f, 8.0f };
+
+        query_scope scope { *this };
+        for (size_t i = 0; i < count; ++i) {
+            const float* r = rays + i * 6;
+            float* hitPos = &positions[i * 3];
+
+            float spos[3] = { r[0], r[1], r[2] };
+            float epos[3] = { r[3], r[4], r[5] };
+            coord_transform(spos);
+            coord_transform(epos);
+
+            point_key key { { r[0], r[1], r[2] } };
+            auto iter = starts.find(key);
+            if (iter == starts.end()) {
+                dtPolyRef ref = 0;
+                if (meshQuery) {
+                    meshQuery->findNearestPoly(spos, extents, &queryFilter, &ref, nullptr);
+                }
+                iter = starts.emplace(key, ref).first;
+            }
+
+            bool hit = true;
+            if (iter->second) {
+                hit = raycast_from(iter->second, spos, epos, hitPos);
+            } else {
+                dtVcopy(hitPos, r);
+            }
+            if (hit) {
+                hits[i / 32] |= 1u << (i % 32);
+            }
         }
 
-        // Adjust height.
-        if (npolys > 0) {
-            float h = 0;
-            meshQuery->getPolyHeight(polys[npolys - 1], hitPos, &h);
-            hitPos[1] = h;
+        out.write_back(static_cast<uint32_t>(count));
+        write_array(out, hits);
+        write_array(out, positions);
+        return count;
+    }
+
+    // Moves tile rebuilds after obstacle changes to a background thread.
+    // Only switchable while the dynamic mesh has no obstacles, load_dynamic
+    // keeps the mode.
+    bool set_async_rebuild(bool enable) {
+        if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
+            return false;
+
+        if (enable == (nullptr != rebuilder_))
+            return true;
+
+        if (enable) {
+            for (int i = 0; i < dynamic_.tilecache->getObstacleCount(); ++i) {
+                if (dynamic_.tilecache->getObstacle(i)->state != DT_OBSTACLE_EMPTY) {
+                    status_ = "set_async_rebuild: remove obstacles first";
+                    return false;
+                }
+            }
+            rebuilder_ = std::make_unique<TileRebuilder>(*dynamic_.tilecache->getParams());
+        } else {
+            if (rebuilder_->ObstacleCount() > 0 || rebuilder_->Pending() > 0) {
+                status_ = "set_async_rebuild: remove obstacles first";
+                return false;
+            }
+            rebuilder_ = nullptr;
         }
-        coord_transform(hitPos);
-        return hit;
+        return true;
+    }
+
+    // tiles waiting for an asynchronous rebuild
+    size_t pending_rebuilds() const {
+        return rebuilder_ ? rebuilder_->Pending() : 0;
     }
 
     unsigned int add_capsule_obstacle(float x, float y, float z, float radius, float height) {
@@ -821,37 +2251,76 @@ public:
         float pos[3] = { x, y, z };
         coord_transform(pos);
 
+        if (rebuilder_) {
+            return rebuilder_->AddObstacle(*dynamic_.tilecache, pos, radius, height);
+        }
+
         dtObstacleRef obstacleId;
         dtStatus status = dynamic_.tilecache->addObstacle(pos, radius, height, &obstacleId);
         if (!dtStatusSucceed(status)) {
             return 0;
         }
+        obstacles_changed_ = true;
         return (unsigned int)obstacleId;
     }
 
+    // obstacles are packed (x, y, z, radius, height), ids receives 0 for failures.
+    // dtTileCache queues at most 64 requests per update, use set_async_rebuild
+    // for larger batches.
+    void add_obstacles(const float* obstacles, size_t count, std::vector<unsigned int>& ids) {
+        for (size_t i = 0; i < count; ++i) {
+            const float* ob = obstacles + i * 5;
+            ids.push_back(add_capsule_obstacle(ob[0], ob[1], ob[2], ob[3], ob[4]));
+        }
+    }
+
     bool remove_obstacle(unsigned int obstacleId) {
         if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
             return false;
+        if (rebuilder_)
+            return rebuilder_->RemoveObstacle(obstacleId);
         dtStatus status = dynamic_.tilecache->removeObstacle((dtObstacleRef)obstacleId);
-        return dtStatusSucceed(status);
+        if (!dtStatusSucceed(status))
+            return false;
+        obstacles_changed_ = true;
+        return true;
     }
 
     void clear_all_obstacle() {
         if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
             return;
 
+        if (rebuilder_) {
+            rebuilder_->Clear();
+            return;
+        }
+
         for (int i = 0; i < dynamic_.tilecache->getObstacleCount(); ++i) {
             const dtTileCacheObstacle* ob = dynamic_.tilecache->getObstacle(i);
             if (ob->state == DT_OBSTACLE_EMPTY)
                 continue;
             dynamic_.tilecache->removeObstacle(dynamic_.tilecache->getObstacleRef(ob));
+            obstacles_changed_ = true;
         }
     }
 
     void update(float dt) {
         if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
             return;
-        dynamic_.tilecache->update(dt, dynamic_.mesh.get());
+        if (rebuilder_) {
+            if (rebuilder_->Update(*dynamic_.tilecache, *dynamic_.mesh) > 0)
+                path_cache_.Invalidate();
+            return;
+        }
+        if (!obstacles_changed_) {
+            dynamic_.tilecache->update(dt, dynamic_.mesh.get());
+            return;
+        }
+        // the tiles of an obstacle change are rebuilt over one or more updates
+        bool upToDate = false;
+        dynamic_.tilecache->update(dt, dynamic_.mesh.get(), &upToDate);
+        path_cache_.Invalidate();
+        obstacles_changed_ = !upToDate;
     }
 
     const std::string& get_status() const {
@@ -859,10 +2328,17 @@ public:
     }
 
 private:
-    inline static std::unordered_map<std::string, navmesh_context> static_mesh_;
     int coord_mask_ = 0;
-    std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter> meshQuery;
+    uint32_t static_version_ = 0;
+    static_handle static_;
+    // checked out by query_scope for the duration of a call
+    mutable dtNavMeshQuery* meshQuery = nullptr;
     navmesh_context dynamic_;
+    std::shared_ptr<const void> dynamic_ref_ = std::make_shared<char>(0); // see hold_mesh
+    std::unique_ptr<TileRebuilder> rebuilder_; // jobs read dynamic_, released before it
+    bool obstacles_changed_ = false; // tile cache requests not yet rebuilt, see update
+    std::unique_ptr<path_queue> path_queue_;
+    PathCache path_cache_;
     Filter filter_;
     dtQueryFilter queryFilter;
     std::string status_;
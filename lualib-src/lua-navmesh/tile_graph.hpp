@@ -0,0 +1,374 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <DetourCommon.h>
+#include <DetourNavMesh.h>
+#include <DetourNavMeshQuery.h>
+
+namespace pluto {
+
+// Abstract graph for long-range planning. Each navmesh tile is a cluster, each
+// contiguous run of polygon edges shared by two tiles is a portal node, and the
+// portals of one tile are connected by their path cost over the polygons of
+// that tile, one Dijkstra per portal instead of a findPath per portal pair.
+class tile_graph {
+    static constexpr float PORTAL_JOIN_DIST_SQR = 0.01f;
+
+    struct portal {
+        float pos[3];
+        int tiles[2]; // tile index on each side
+        dtPolyRef refs[2]; // polygon on each side touching the portal
+    };
+
+    struct edge {
+        int to;
+        int tile; // tile the edge crosses
+        float cost;
+    };
+
+    struct segment {
+        float a[3];
+        float b[3];
+        dtPolyRef refs[2];
+    };
+
+public:
+    // one portal-to-portal leg of an abstract path, inside a single tile
+    struct leg {
+        float from[3];
+        float to[3];
+        dtPolyRef fromRef;
+        dtPolyRef toRef;
+    };
+
+    bool build(const dtNavMesh& mesh, const dtQueryFilter& filter) {
+        portals_.clear();
+        edges_.clear();
+        tile_portals_.assign(static_cast<size_t>(mesh.getMaxTiles()), {});
+
+        collect_portals(mesh);
+
+        edges_.resize(portals_.size());
+        std::vector<float> costs;
+        for (size_t t = 0; t < tile_portals_.size(); ++t) {
+            const auto& ps = tile_portals_[t];
+            for (size_t i = 0; i < ps.size(); ++i) {
+                const portal& a = portals_[ps[i]];
+                tile_costs(mesh, filter, (int)t, portal_ref(a, (int)t), a.pos, ps, costs);
+                for (size_t j = 0; j < ps.size(); ++j) {
+                    if (j != i && costs[j] >= 0.0f)
+                        edges_[ps[i]].push_back(edge { ps[j], (int)t, costs[j] });
+                }
+            }
+        }
+        return true;
+    }
+
+    size_t portal_count() const {
+        return portals_.size();
+    }
+
+    // A* over the portal graph. legs receives start -> portal -> ... -> end.
+    // Returns false when start and end are in the same tile or no route exists.
+    bool search(
+        const dtNavMesh& mesh,
+        const dtQueryFilter& filter,
+        dtPolyRef startRef,
+        const float* spos,
+        dtPolyRef endRef,
+        const float* epos,
+        std::vector<leg>& legs
+    ) const {
+        const int st = (int)mesh.decodePolyIdTile(startRef);
+        const int et = (int)mesh.decodePolyIdTile(endRef);
+        if (st == et || st >= (int)tile_portals_.size() || et >= (int)tile_portals_.size())
+            return false;
+
+        const int n = (int)portals_.size();
+        const int goal = n;
+        constexpr float inf = std::numeric_limits<float>::max();
+
+        // reachable exits into the goal
+        std::vector<float> costs;
+        std::vector<float> goal_cost(n, -1.0f);
+        tile_costs(mesh, filter, et, endRef, epos, tile_portals_[et], costs);
+        for (size_t i = 0; i < costs.size(); ++i)
+            goal_cost[tile_portals_[et][i]] = costs[i];
+
+        std::vector<float> g(n + 1, inf);
+        std::vector<int> parent(n + 1, -1);
+        std::vector<int> parent_tile(n + 1, -1);
+        std::vector<bool> closed(n + 1, false);
+
+        using open_item = std::pair<float, int>;
+        std::priority_queue<open_item, std::vector<open_item>, std::greater<open_item>> open;
+
+        auto relax = [&](int from, int to, int tile, float cost) {
+            float ng = (from < 0 ? 0.0f : g[from]) + cost;
+            if (ng >= g[to])
+                return;
+            g[to] = ng;
+            parent[to] = from;
+            parent_tile[to] = tile;
+            float h = to == goal ? 0.0f : dtVdist(portals_[to].pos, epos);
+            open.emplace(ng + h, to);
+        };
+
+        tile_costs(mesh, filter, st, startRef, spos, tile_portals_[st], costs);
+        for (size_t i = 0; i < costs.size(); ++i) {
+            if (costs[i] >= 0.0f)
+                relax(-1, tile_portals_[st][i], st, costs[i]);
+        }
+
+        while (!open.empty()) {
+            int cur = open.top().second;
+            open.pop();
+            if (closed[cur])
+                continue;
+            closed[cur] = true;
+            if (cur == goal)
+                break;
+            for (const edge& e: edges_[cur]) {
+                if (!closed[e.to])
+                    relax(cur, e.to, e.tile, e.cost);
+            }
+            if (goal_cost[cur] >= 0.0f)
+                relax(cur, goal, et, goal_cost[cur]);
+        }
+
+        if (!closed[goal])
+            return false;
+
+        std::vector<int> nodes;
+        for (int cur = goal; cur >= 0; cur = parent[cur])
+            nodes.push_back(cur);
+        std::reverse(nodes.begin(), nodes.end());
+
+        legs.clear();
+        const float* from = spos;
+        dtPolyRef fromRef = startRef;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const int node = nodes[i];
+            leg& l = legs.emplace_back();
+            dtVcopy(l.from, from);
+            l.fromRef = fromRef;
+            if (node == goal) {
+                dtVcopy(l.to, epos);
+                l.toRef = endRef;
+                break;
+            }
+            const portal& p = portals_[node];
+            dtVcopy(l.to, p.pos);
+            l.toRef = portal_ref(p, parent_tile[node]);
+            // the next leg runs in the tile of the next edge, the same tile
+            // when the route follows two portals of one tile without crossing
+            from = p.pos;
+            fromRef = portal_ref(p, parent_tile[nodes[i + 1]]);
+        }
+        return true;
+    }
+
+private:
+    static dtPolyRef portal_ref(const portal& p, int tile) {
+        return p.tiles[0] == tile ? p.refs[0] : p.refs[1];
+    }
+
+    // point where a search steps from poly into next through link: the middle of
+    // the shared edge, or the centre of next for off-mesh connections
+    static void entry_point(
+        const dtMeshTile* tile,
+        const dtPoly* poly,
+        const dtLink& link,
+        const dtPoly* next,
+        float* out
+    ) {
+        if (poly->getType() == DT_POLYTYPE_GROUND && link.edge < poly->vertCount) {
+            const float* va = &tile->verts[poly->verts[link.edge] * 3];
+            const float* vb = &tile->verts[poly->verts[(link.edge + 1) % poly->vertCount] * 3];
+            dtVlerp(out, va, vb, 0.5f);
+            return;
+        }
+        dtVset(out, 0.0f, 0.0f, 0.0f);
+        for (int i = 0; i < next->vertCount; ++i)
+            dtVadd(out, out, &tile->verts[next->verts[i] * 3]);
+        dtVscale(out, out, 1.0f / (float)next->vertCount);
+    }
+
+    // Dijkstra over the polygons of tile t from pos on ref. costs receives the
+    // cost to each portal of targets, -1 when it can not be reached without
+    // leaving the tile. Bounded by the tile size, unlike a findPath.
+    void tile_costs(
+        const dtNavMesh& mesh,
+        const dtQueryFilter& filter,
+        int t,
+        dtPolyRef ref,
+        const float* pos,
+        const std::vector<int>& targets,
+        std::vector<float>& costs
+    ) const {
+        static thread_local std::vector<float> dist;
+        static thread_local std::vector<float> at; // where each polygon is entered
+        constexpr float inf = std::numeric_limits<float>::max();
+
+        costs.assign(targets.size(), -1.0f);
+        const dtMeshTile* tile = mesh.getTile(t);
+        if (nullptr == tile || nullptr == tile->header || (int)mesh.decodePolyIdTile(ref) != t)
+            return;
+
+        const int count = tile->header->polyCount;
+        dist.assign(static_cast<size_t>(count), inf);
+        at.resize(static_cast<size_t>(count) * 3);
+
+        using open_item = std::pair<float, int>;
+        std::priority_queue<open_item, std::vector<open_item>, std::greater<open_item>> open;
+        const int s = (int)mesh.decodePolyIdPoly(ref);
+        dist[s] = 0.0f;
+        dtVcopy(&at[s * 3], pos);
+        open.emplace(0.0f, s);
+        while (!open.empty()) {
+            auto [d, i] = open.top();
+            open.pop();
+            if (d > dist[i])
+                continue;
+            const dtPoly* poly = &tile->polys[i];
+            for (unsigned int k = poly->firstLink; k != DT_NULL_LINK; k = tile->links[k].next) {
+                const dtLink& link = tile->links[k];
+                if ((int)mesh.decodePolyIdTile(link.ref) != t)
+                    continue;
+                const int j = (int)mesh.decodePolyIdPoly(link.ref);
+                const dtPoly* next = &tile->polys[j];
+                // the default dtQueryFilter rules, Detour keeps passFilter and
+                // getCost inline in its own translation unit
+                if (!(next->flags & filter.getIncludeFlags()) || (next->flags & filter.getExcludeFlags()))
+                    continue;
+                float entry[3];
+                entry_point(tile, poly, link, next, entry);
+                float nd = d + dtVdist(&at[i * 3], entry) * filter.getAreaCost(poly->getArea());
+                if (nd >= dist[j])
+                    continue;
+                dist[j] = nd;
+                dtVcopy(&at[j * 3], entry);
+                open.emplace(nd, j);
+            }
+        }
+
+        for (size_t k = 0; k < targets.size(); ++k) {
+            const portal& p = portals_[targets[k]];
+            const int j = (int)mesh.decodePolyIdPoly(portal_ref(p, t));
+            if (dist[j] < inf)
+                costs[k] = dist[j] + dtVdist(&at[j * 3], p.pos);
+        }
+    }
+
+    void collect_portals(const dtNavMesh& mesh) {
+        // boundary segments per tile pair (lower tile index first)
+        std::map<std::pair<int, int>, std::vector<segment>> pairs;
+
+        for (int t = 0; t < mesh.getMaxTiles(); ++t) {
+            const dtMeshTile* tile = mesh.getTile(t);
+            if (nullptr == tile || nullptr == tile->header)
+                continue;
+
+            dtPolyRef base = mesh.getPolyRefBase(tile);
+            for (int i = 0; i < tile->header->polyCount; ++i) {
+                const dtPoly* poly = &tile->polys[i];
+                if (poly->getType() == DT_POLYTYPE_OFFMESH_CONNECTION)
+                    continue;
+
+                for (unsigned int k = poly->firstLink; k != DT_NULL_LINK; k = tile->links[k].next) {
+                    const dtLink& link = tile->links[k];
+                    if (link.side == 0xff)
+                        continue;
+
+                    int nt = (int)mesh.decodePolyIdTile(link.ref);
+                    if (nt <= t)
+                        continue;
+
+                    const float* va = &tile->verts[poly->verts[link.edge] * 3];
+                    const float* vb = &tile->verts[poly->verts[(link.edge + 1) % poly->vertCount] * 3];
+
+                    segment seg;
+                    const float s = 1.0f / 255.0f;
+                    dtVlerp(seg.a, va, vb, link.bmin * s);
+                    dtVlerp(seg.b, va, vb, link.bmax * s);
+                    seg.refs[0] = base | (dtPolyRef)i;
+                    seg.refs[1] = link.ref;
+                    pairs[{ t, nt }].push_back(seg);
+                }
+            }
+        }
+
+        for (const auto& [key, segs]: pairs) {
+            // join segments sharing an end point into runs
+            std::vector<int> root(segs.size());
+            std::iota(root.begin(), root.end(), 0);
+            std::function<int(int)> find = [&](int x) {
+                return root[x] == x ? x : (root[x] = find(root[x]));
+            };
+            for (size_t i = 0; i < segs.size(); ++i) {
+                for (size_t j = i + 1; j < segs.size(); ++j) {
+                    const segment& a = segs[i];
+                    const segment& b = segs[j];
+                    if (dtVdistSqr(a.a, b.a) < PORTAL_JOIN_DIST_SQR
+                        || dtVdistSqr(a.a, b.b) < PORTAL_JOIN_DIST_SQR
+                        || dtVdistSqr(a.b, b.a) < PORTAL_JOIN_DIST_SQR
+                        || dtVdistSqr(a.b, b.b) < PORTAL_JOIN_DIST_SQR)
+                        root[find((int)i)] = find((int)j);
+                }
+            }
+
+            std::map<int, std::vector<int>> runs;
+            for (size_t i = 0; i < segs.size(); ++i)
+                runs[find((int)i)].push_back((int)i);
+
+            for (const auto& [_, run]: runs) {
+                // portal at the segment nearest the centre of the run
+                float center[3] = { 0, 0, 0 };
+                for (int i: run) {
+                    dtVadd(center, center, segs[i].a);
+                    dtVadd(center, center, segs[i].b);
+                }
+                dtVscale(center, center, 0.5f / (float)run.size());
+
+                int best = run[0];
+                float best_dist = std::numeric_limits<float>::max();
+                for (int i: run) {
+                    float mid[3];
+                    dtVlerp(mid, segs[i].a, segs[i].b, 0.5f);
+                    float d = dtVdistSqr(mid, center);
+                    if (d < best_dist) {
+                        best_dist = d;
+                        best = i;
+                    }
+                }
+
+                portal p;
+                dtVlerp(p.pos, segs[best].a, segs[best].b, 0.5f);
+                p.tiles[0] = key.first;
+                p.tiles[1] = key.second;
+                p.refs[0] = segs[best].refs[0];
+                p.refs[1] = segs[best].refs[1];
+
+                int index = (int)portals_.size();
+                portals_.push_back(p);
+                tile_portals_[key.first].push_back(index);
+                tile_portals_[key.second].push_back(index);
+            }
+        }
+    }
+
+private:
+    std::vector<portal> portals_;
+    std::vector<std::vector<edge>> edges_;
+    std::vector<std::vector<int>> tile_portals_;
+};
+
+} // namespace pluto
@@ -0,0 +1,845 @@
+/*
+** Sampling profilers of a lua state, see the comments of each part.
+**
+** The running thread is tracked by replacing coroutine.resume while a
+** profiler of the state runs, and the stacks are taken in a one-shot count
+** hook of that thread, so nothing reads the lua stack out of a safe point.
+** skynet.profile keeps the coroutine.resume it sees when it's loaded, the
+** resume in its upvalues is replaced too, or the start fails.
+*/
+#include <lua.h>
+#include <lauxlib.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "profiler_stack.h"
+
+#define PROFILER_METANAME "profiler.state"
+#define PROFILER_SLOT 64
+#define DEFAULT_RATE (512 * 1024)
+#define DEFAULT_MAX_STACK 4096
+#define PENDING_MAX 64
+#define DEFAULT_HZ 1000
+#define MAX_HZ 10000
+
+// counters of a stack
+#define ALLOC_COUNT 0
+#define ALLOC_BYTES 1
+#define LIVE_COUNT 2
+#define LIVE_BYTES 3
+
+struct live_sample {
+	const void *ptr;
+	int64_t bytes;
+	uint32_t count;
+	uint32_t stack;	// STACK_NONE before the hook takes the stack
+};
+
+struct pending_sample {
+	int64_t bytes;
+	uint32_t count;
+};
+
+struct profiler {
+	lua_State *current;	// the running thread, set by profiler_resume
+	lua_State *hook_thread;	// the thread to take the stack of the pending samples
+	int slot;	// -1 when stopped
+	lua_Alloc alloc;	// the wrapped allocator
+	void *ud;
+	struct stack_map *stacks;
+	int64_t rate;
+	int64_t countdown;
+	uint64_t seed;
+	uint64_t samples;
+	struct live_sample *live;
+	size_t live_n;
+	size_t live_cap;
+	int pending_n;
+	struct pending_sample pending[PENDING_MAX];
+	const void *pending_ptr[PENDING_MAX];
+	// cpu profiler
+	bool cpu_running;
+	int cpu_slot;
+	int cpu_session;	// changes at each cpu_start
+	int cpu_depth;	// nested resumes counted by profiler_resume
+	volatile sig_atomic_t cpu_hold;	// the state runs on cpu_thread
+	pthread_t cpu_thread;
+	lua_State *volatile cpu_hook_thread;	// the thread to take the stack of the pending ticks
+	atomic_int cpu_pending;
+	atomic_int cpu_lost;
+	struct stack_map *cpu_stacks;
+	uint64_t cpu_samples;
+};
+
+static int profiler_key;
+static _Atomic(struct profiler *) slot[PROFILER_SLOT];
+static _Atomic(struct profiler *) cpu_slot[PROFILER_SLOT];
+static atomic_int active;	// running profilers of the process
+static _Atomic(lua_CFunction) co_resume;
+
+// the timer of the process, runs when cpu_n > 0
+static pthread_mutex_t cpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cpu_n;
+static int cpu_hz;
+static struct sigaction cpu_oldaction;
+
+static void profiler_hook(lua_State *L, lua_Debug *ar);
+
+/* Allocation profiler
+**
+** The allocator of the state is wrapped to sample 1 in rate bytes: the
+** distance between two samples is exponential, so a sample of n bytes stands
+** for n / (1 - exp(-n / rate)) bytes. Each sample is aggregated by its stack
+** into the allocated bytes, and into the live bytes until it's freed.
+**
+** skynet keeps its own data in the ud of the allocator, so ud is kept and the
+** profiler is found by the allocator function, one of PROFILER_SLOT ones.
+*/
+
+static inline size_t
+live_slot(const void *ptr, size_t cap) {
+	uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ULL;
+	return (size_t)(h >> 32) & (cap - 1);
+}
+
+static struct live_sample *
+live_find(struct profiler *P, const void *ptr) {
+	size_t mask = P->live_cap - 1;
+	size_t i = live_slot(ptr, P->live_cap);
+	for (;;) {
+		struct live_sample *s = &P->live[i];
+		if (s->ptr == ptr)
+			return s;
+		if (s->ptr == NULL)
+			return NULL;
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+live_remove(struct profiler *P, const void *ptr) {
+	struct live_sample *s = live_find(P, ptr);
+	if (s == NULL)
+		return;
+	if (s->stack != STACK_NONE) {
+		int64_t *v = stack_map_value(P->stacks, s->stack);
+		v[LIVE_COUNT] -= s->count;
+		v[LIVE_BYTES] -= s->bytes;
+	}
+	// backward shift deletion, moves up the samples probed past the hole
+	size_t mask = P->live_cap - 1;
+	size_t i = s - P->live;
+	size_t j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		const void *p = P->live[j].ptr;
+		if (p == NULL)
+			break;
+		size_t k = live_slot(p, P->live_cap);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		P->live[i] = P->live[j];
+		i = j;
+	}
+	P->live[i].ptr = NULL;
+	--P->live_n;
+}
+
+static bool
+live_insert(struct profiler *P, const void *ptr, int64_t bytes, uint32_t count) {
+	if ((P->live_n + 1) * 2 > P->live_cap) {
+		size_t cap = P->live_cap ? P->live_cap * 2 : 256;
+		struct live_sample *live = (struct live_sample *)calloc(cap, sizeof(struct live_sample));
+		if (live == NULL)
+			return false;
+		size_t i;
+		for (i=0;i<P->live_cap;i++) {
+			const struct live_sample *s = &P->live[i];
+			if (s->ptr == NULL)
+				continue;
+			size_t k = live_slot(s->ptr, cap);
+			while (live[k].ptr != NULL)
+				k = (k + 1) & (cap - 1);
+			live[k] = *s;
+		}
+		free(P->live);
+		P->live = live;
+		P->live_cap = cap;
+	}
+	size_t mask = P->live_cap - 1;
+	size_t i = live_slot(ptr, P->live_cap);
+	while (P->live[i].ptr != NULL && P->live[i].ptr != ptr)
+		i = (i + 1) & mask;
+	struct live_sample *s = &P->live[i];
+	if (s->ptr == NULL)
+		++P->live_n;
+	s->ptr = ptr;
+	s->bytes = bytes;
+	s->count = count;
+	s->stack = STACK_NONE;
+	return true;
+}
+
+// gives the pending samples the stack
+static void
+resolve_pending(struct profiler *P, uint32_t stack) {
+	int64_t *v = stack_map_value(P->stacks, stack);
+	int i;
+	for (i=0;i<P->pending_n;i++) {
+		const struct pending_sample *p = &P->pending[i];
+		v[ALLOC_COUNT] += p->count;
+		v[ALLOC_BYTES] += p->bytes;
+		if (P->pending_ptr[i] == NULL || P->live_n == 0)
+			continue;
+		struct live_sample *s = live_find(P, P->pending_ptr[i]);
+		if (s && s->stack == STACK_NONE) {
+			s->stack = stack;
+			v[LIVE_COUNT] += s->count;
+			v[LIVE_BYTES] += s->bytes;
+		}
+	}
+	P->pending_n = 0;
+	P->hook_thread = NULL;
+}
+
+// exponential distance to the next sample, xorshift64*
+static int64_t
+next_countdown(struct profiler *P) {
+	uint64_t x = P->seed;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	P->seed = x;
+	double u = (double)((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+	return (int64_t)(-log(1.0 - u) * (double)P->rate) + 1;
+}
+
+// In the allocator the lua stack may be in the middle of a change, so the
+// stack is taken by the hook of the running thread at its next instruction.
+static void
+sample(struct profiler *P, const void *ptr, size_t size) {
+	P->countdown = next_countdown(P);
+	++P->samples;
+	double n = (double)size;
+	double weight = n / (1.0 - exp(-n / (double)P->rate));
+	int64_t bytes = (int64_t)(weight + 0.5);
+	uint32_t count = (uint32_t)(weight / n + 0.5);
+	lua_State *L = P->current;
+	if (P->pending_n > 0 && (P->hook_thread != L || P->pending_n == PENDING_MAX)) {
+		// the hooked thread is dead or blocked in C
+		resolve_pending(P, STACK_UNKNOWN);
+	}
+	if (!live_insert(P, ptr, bytes, count))
+		ptr = NULL;
+	int i = P->pending_n++;
+	P->pending[i].bytes = bytes;
+	P->pending[i].count = count;
+	P->pending_ptr[i] = ptr;
+	if (i == 0) {
+		lua_Hook hook = lua_gethook(L);
+		if (hook == NULL || hook == profiler_hook) {
+			lua_sethook(L, profiler_hook, LUA_MASKCOUNT, 1);
+			P->hook_thread = L;
+		} else {
+			// don't replace the hook of others
+			resolve_pending(P, STACK_UNKNOWN);
+		}
+	}
+}
+
+static inline void *
+profiler_alloc(int s, void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct profiler *P = atomic_load_explicit(&slot[s], memory_order_relaxed);
+	void *r = P->alloc(ud, ptr, osize, nsize);
+	if (ptr && P->live_n > 0 && (r || nsize == 0))
+		live_remove(P, ptr);
+	// osize is the type of the object when ptr is NULL
+	if (r && (ptr == NULL || nsize > osize)) {
+		P->countdown -= (int64_t)nsize;
+		if (P->countdown < 0)
+			sample(P, r, nsize);
+	}
+	return r;
+}
+
+#define ALLOC_SLOT(n, k) \
+	static void * \
+	alloc_##n##_##k(void *ud, void *ptr, size_t osize, size_t nsize) { \
+		return profiler_alloc(n * 8 + k, ud, ptr, osize, nsize); \
+	}
+
+#define ALLOC_SLOT8(n) \
+	ALLOC_SLOT(n, 0) ALLOC_SLOT(n, 1) ALLOC_SLOT(n, 2) ALLOC_SLOT(n, 3) \
+	ALLOC_SLOT(n, 4) ALLOC_SLOT(n, 5) ALLOC_SLOT(n, 6) ALLOC_SLOT(n, 7)
+
+#define ALLOC_NAME8(n) \
+	alloc_##n##_0, alloc_##n##_1, alloc_##n##_2, alloc_##n##_3, \
+	alloc_##n##_4, alloc_##n##_5, alloc_##n##_6, alloc_##n##_7,
+
+ALLOC_SLOT8(0) ALLOC_SLOT8(1) ALLOC_SLOT8(2) ALLOC_SLOT8(3)
+ALLOC_SLOT8(4) ALLOC_SLOT8(5) ALLOC_SLOT8(6) ALLOC_SLOT8(7)
+
+static const lua_Alloc alloc_slot[PROFILER_SLOT] = {
+	ALLOC_NAME8(0) ALLOC_NAME8(1) ALLOC_NAME8(2) ALLOC_NAME8(3)
+	ALLOC_NAME8(4) ALLOC_NAME8(5) ALLOC_NAME8(6) ALLOC_NAME8(7)
+};
+
+static struct profiler *
+get_profiler(lua_State *L) {
+	struct profiler *P = NULL;
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &profiler_key) == LUA_TUSERDATA)
+		P = (struct profiler *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return P;
+}
+
+static inline struct profiler *
+find_profiler(lua_State *L) {
+	if (atomic_load_explicit(&active, memory_order_relaxed) == 0)
+		return NULL;
+	return get_profiler(L);
+}
+
+/* CPU profiler
+**
+** SIGPROF of ITIMER_PROF comes hz times in a second of process cpu time, to
+** the thread using the cpu. When the state runs on that thread, the signal
+** sets a one-shot hook on the running lua thread, like lua.c does for
+** SIGINT, and the hook takes the stack. So a state gets samples for its own
+** share of the cpu.
+**
+** A skynet worker thread runs other services between two messages, so the
+** state holds its thread only in a resume of profiler_resume started after
+** cpu_start. On macOS the signal may come
+** to another thread, so there are fewer samples. The ticks when the thread
+** has a hook of others are counted in lost.
+*/
+
+static void
+cpu_signal(int sig) {
+	(void)sig;
+	int err = errno;
+	pthread_t self = pthread_self();
+	int i;
+	for (i=0;i<PROFILER_SLOT;i++) {
+		struct profiler *P = atomic_load_explicit(&cpu_slot[i], memory_order_acquire);
+		if (P == NULL || !P->cpu_hold || !pthread_equal(P->cpu_thread, self))
+			continue;
+		lua_State *L = P->current;
+		lua_Hook hook = lua_gethook(L);
+		if (hook == NULL || hook == profiler_hook) {
+			atomic_fetch_add_explicit(&P->cpu_pending, 1, memory_order_relaxed);
+			P->cpu_hook_thread = L;
+			lua_sethook(L, profiler_hook, LUA_MASKCOUNT, 1);
+		} else {
+			atomic_fetch_add_explicit(&P->cpu_lost, 1, memory_order_relaxed);
+		}
+		break;
+	}
+	errno = err;
+}
+
+static bool
+cpu_timer_start(int hz) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cpu_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, &cpu_oldaction) != 0)
+		return false;
+	long usec = 1000000 / hz;
+	struct itimerval it;
+	it.it_interval.tv_sec = usec / 1000000;
+	it.it_interval.tv_usec = usec % 1000000;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) != 0) {
+		sigaction(SIGPROF, &cpu_oldaction, NULL);
+		return false;
+	}
+	return true;
+}
+
+static void
+cpu_timer_stop(void) {
+	struct itimerval it;
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_PROF, &it, NULL);
+	sigaction(SIGPROF, &cpu_oldaction, NULL);
+}
+
+static inline void
+cpu_hold(struct profiler *P) {
+	P->cpu_thread = pthread_self();
+	atomic_signal_fence(memory_order_seq_cst);
+	P->cpu_hold = 1;
+}
+
+static void
+cpu_resolve(struct profiler *P, lua_State *L) {
+	P->cpu_hook_thread = NULL;
+	int n = atomic_exchange_explicit(&P->cpu_pending, 0, memory_order_relaxed);
+	if (n > 0 && P->cpu_stacks) {
+		stack_map_value(P->cpu_stacks, stack_map_capture(P->cpu_stacks, L))[0] += n;
+		P->cpu_samples += n;
+	}
+}
+
+// the outermost resume returns, the os thread goes to others
+static void
+cpu_release(struct profiler *P, lua_State *L, lua_State *co) {
+	P->cpu_hold = 0;
+	atomic_signal_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&P->cpu_pending, memory_order_relaxed) == 0)
+		return;
+	// co yielded before its hook, take the yield point
+	lua_Debug ar;
+	if (co && P->cpu_hook_thread == co && lua_getstack(co, 0, &ar))
+		cpu_resolve(P, co);
+	else if (P->cpu_hook_thread != L)
+		cpu_resolve(P, L);
+}
+
+static void
+profiler_hook(lua_State *L, lua_Debug *ar) {
+	(void)ar;
+	// a signal in the hook sets it again
+	lua_sethook(L, NULL, 0, 0);
+	struct profiler *P = find_profiler(L);
+	if (P == NULL)
+		return;
+	if (P->hook_thread == L)
+		resolve_pending(P, stack_map_capture(P->stacks, L));
+	if (P->cpu_hook_thread == L)
+		cpu_resolve(P, L);
+}
+
+/* Running thread */
+
+// A light C function, skynet.profile calls it by lua_tocfunction.
+// The running thread before the resume is restored after it, co may be
+// collected later. It's L when the profiler is started in the resume.
+static int
+profiler_resume(lua_State *L) {
+	lua_CFunction resume = atomic_load_explicit(&co_resume, memory_order_relaxed);
+	struct profiler *P = find_profiler(L);
+	lua_State *co = lua_tothread(L, 1);
+	lua_State *prev = L;
+	int session = -1;
+	if (P && co) {
+		prev = P->current;
+		P->current = co;
+		if (P->cpu_running) {
+			session = P->cpu_session;
+			if (P->cpu_depth++ == 0)
+				cpu_hold(P);
+		}
+	}
+	int r = resume(L);
+	P = find_profiler(L);
+	if (P) {
+		P->current = prev;
+		if (P->cpu_running && session == P->cpu_session) {
+			if (--P->cpu_depth == 0)
+				cpu_release(P, L, co);
+		}
+	}
+	return r;
+}
+
+// a closure can't be called by the function pointer
+static bool
+is_resume(lua_State *L, int idx, lua_CFunction f) {
+	if (lua_tocfunction(L, idx) != f)
+		return false;
+	if (lua_getupvalue(L, idx, 1) != NULL) {
+		lua_pop(L, 1);
+		return false;
+	}
+	return true;
+}
+
+// Replaces the resume from by to in coroutine.resume and in the upvalues of
+// the C functions of skynet.profile. Returns false if coroutine.resume is not
+// to at last, n is the number of the upvalues of skynet.profile being to, or
+// -1 when skynet.profile is not loaded.
+static bool
+replace_resume(lua_State *L, lua_CFunction from, lua_CFunction to, int *n) {
+	bool ok = false;
+	if (lua_getglobal(L, "coroutine") == LUA_TTABLE) {
+		lua_getfield(L, -1, "resume");
+		if (is_resume(L, -1, from)) {
+			lua_pushcfunction(L, to);
+			lua_setfield(L, -3, "resume");
+			ok = true;
+		} else {
+			ok = is_resume(L, -1, to);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	*n = -1;
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	if (lua_getfield(L, -1, "skynet.profile") == LUA_TTABLE) {
+		*n = 0;
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			int i;
+			for (i=1; lua_iscfunction(L, -1) && lua_getupvalue(L, -1, i) != NULL; i++) {
+				if (is_resume(L, -1, from)) {
+					lua_pushcfunction(L, to);
+					lua_setupvalue(L, -3, i);
+					++*n;
+				} else if (is_resume(L, -1, to)) {
+					++*n;
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 2);
+	return ok;
+}
+
+// Restores coroutine.resume when no profiler of the state runs
+static void
+unhook_coroutine(lua_State *L, struct profiler *P) {
+	lua_CFunction resume = atomic_load(&co_resume);
+	int n;
+	if (P->slot < 0 && !P->cpu_running && resume)
+		replace_resume(L, profiler_resume, resume, &n);
+}
+
+// Hooks coroutine.resume for the first running profiler of the state
+static void
+hook_coroutine(lua_State *L, struct profiler *P) {
+	if (P->slot >= 0 || P->cpu_running)
+		return;
+	lua_CFunction f = NULL;
+	if (lua_getglobal(L, "coroutine") == LUA_TTABLE) {
+		lua_getfield(L, -1, "resume");
+		f = lua_tocfunction(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_CFunction expect = NULL;
+	// the same resume for all the states of the process
+	if (f == NULL || (f != profiler_resume
+		&& !atomic_compare_exchange_strong(&co_resume, &expect, f) && expect != f))
+		luaL_error(L, "can't hook coroutine.resume");
+	int n;
+	if (!replace_resume(L, atomic_load(&co_resume), profiler_resume, &n)) {
+		luaL_error(L, "can't hook coroutine.resume");
+	} else if (n == 0) {
+		replace_resume(L, profiler_resume, atomic_load(&co_resume), &n);
+		luaL_error(L, "can't hook coroutine.resume of skynet.profile");
+	}
+}
+
+/* Lua API */
+
+static void
+alloc_stop(lua_State *L, struct profiler *P) {
+	if (P->slot < 0)
+		return;
+	lua_setallocf(L, P->alloc, P->ud);
+	atomic_store(&slot[P->slot], NULL);
+	atomic_fetch_sub(&active, 1);
+	P->slot = -1;
+	if (P->pending_n > 0)
+		resolve_pending(P, STACK_UNKNOWN);
+	// the frees are not seen any more
+	free(P->live);
+	P->live = NULL;
+	P->live_n = 0;
+	P->live_cap = 0;
+}
+
+static void
+cpu_stop(lua_State *L, struct profiler *P) {
+	if (!P->cpu_running)
+		return;
+	P->cpu_running = false;
+	P->cpu_hold = 0;
+	atomic_store(&cpu_slot[P->cpu_slot], NULL);
+	pthread_mutex_lock(&cpu_lock);
+	if (--cpu_n == 0)
+		cpu_timer_stop();
+	pthread_mutex_unlock(&cpu_lock);
+	atomic_fetch_sub(&active, 1);
+	if (P->cpu_hook_thread == L)
+		cpu_resolve(P, L);
+}
+
+static int
+profiler_gc(lua_State *L) {
+	struct profiler *P = (struct profiler *)lua_touserdata(L, 1);
+	alloc_stop(L, P);
+	cpu_stop(L, P);
+	stack_map_delete(P->stacks);
+	P->stacks = NULL;
+	stack_map_delete(P->cpu_stacks);
+	P->cpu_stacks = NULL;
+	return 0;
+}
+
+static struct profiler *
+new_profiler(lua_State *L) {
+	struct profiler *P = get_profiler(L);
+	if (P)
+		return P;
+	P = (struct profiler *)lua_newuserdatauv(L, sizeof(struct profiler), 0);
+	memset(P, 0, sizeof(*P));
+	P->slot = -1;
+	if (luaL_newmetatable(L, PROFILER_METANAME)) {
+		lua_pushcfunction(L, profiler_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &profiler_key);
+	return P;
+}
+
+// profiler.alloc_start([rate [, max_stack]]), samples 1 in rate bytes (512K)
+static int
+lalloc_start(lua_State *L) {
+	lua_Integer rate = luaL_optinteger(L, 1, DEFAULT_RATE);
+	lua_Integer max_stack = luaL_optinteger(L, 2, DEFAULT_MAX_STACK);
+	luaL_argcheck(L, rate > 0, 1, "rate should be positive");
+	luaL_argcheck(L, max_stack > 0 && max_stack < INT32_MAX, 2, "invalid max_stack");
+	struct profiler *P = new_profiler(L);
+	if (P->slot >= 0)
+		return luaL_error(L, "alloc profiler is running");
+	// the running thread is tracked by coroutine.resume only
+	hook_coroutine(L, P);
+	struct stack_map *stacks = stack_map_new((int)max_stack);
+	if (stacks == NULL) {
+		unhook_coroutine(L, P);
+		return luaL_error(L, "not enough memory");
+	}
+	stack_map_delete(P->stacks);
+	P->stacks = stacks;
+	int i;
+	for (i=0;i<PROFILER_SLOT;i++) {
+		struct profiler *expect = NULL;
+		if (atomic_compare_exchange_strong(&slot[i], &expect, P))
+			break;
+	}
+	if (i == PROFILER_SLOT) {
+		unhook_coroutine(L, P);
+		return luaL_error(L, "too many profilers (%d)", PROFILER_SLOT);
+	}
+	P->slot = i;
+	P->rate = rate;
+	P->seed = ((uint64_t)(uintptr_t)P ^ ((uint64_t)time(NULL) << 32)) | 1;
+	P->countdown = next_countdown(P);
+	P->samples = 0;
+	P->pending_n = 0;
+	P->hook_thread = NULL;
+	P->current = L;
+	P->alloc = lua_getallocf(L, &P->ud);
+	lua_setallocf(L, alloc_slot[i], P->ud);
+	atomic_fetch_add(&active, 1);
+	return 0;
+}
+
+static int
+lalloc_stop(lua_State *L) {
+	struct profiler *P = get_profiler(L);
+	if (P == NULL || P->slot < 0)
+		return 0;
+	if (lua_getallocf(L, NULL) != alloc_slot[P->slot])
+		return luaL_error(L, "the allocator is replaced, can't stop");
+	alloc_stop(L, P);
+	unhook_coroutine(L, P);
+	return 0;
+}
+
+static void
+write_buffer(void *ud, const char *s, size_t sz) {
+	luaL_addlstring((luaL_Buffer *)ud, s, sz);
+}
+
+static void
+write_file(void *ud, const char *s, size_t sz) {
+	fwrite(s, 1, sz, (FILE *)ud);
+}
+
+static int
+dump_stacks(lua_State *L, struct stack_map *S, int v, const char *filename) {
+	if (filename) {
+		FILE *f = fopen(filename, "wb");
+		if (f == NULL)
+			return luaL_error(L, "can't open %s", filename);
+		int n = stack_map_folded(S, v, write_file, f);
+		bool err = ferror(f) != 0;
+		if (fclose(f) != 0 || err)
+			return luaL_error(L, "can't write %s", filename);
+		lua_pushinteger(L, n);
+		return 1;
+	}
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	stack_map_folded(S, v, write_buffer, &b);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+// profiler.alloc_dump(["live" | "alloc" | "count" [, filename]])
+// returns the folded stacks, or the number of stacks written to the file
+static int
+lalloc_dump(lua_State *L) {
+	static const char *const opts[] = { "live", "alloc", "count", NULL };
+	static const int value[] = { LIVE_BYTES, ALLOC_BYTES, ALLOC_COUNT };
+	int v = value[luaL_checkoption(L, 1, "live", opts)];
+	const char *filename = luaL_optstring(L, 2, NULL);
+	struct profiler *P = get_profiler(L);
+	if (P == NULL || P->stacks == NULL)
+		return luaL_error(L, "alloc profiler is not started");
+	return dump_stacks(L, P->stacks, v, filename);
+}
+
+static void
+set_integer(lua_State *L, const char *key, lua_Integer v) {
+	lua_pushinteger(L, v);
+	lua_setfield(L, -2, key);
+}
+
+static int
+lalloc_info(lua_State *L) {
+	struct profiler *P = get_profiler(L);
+	lua_createtable(L, 0, 6);
+	lua_pushboolean(L, P && P->slot >= 0);
+	lua_setfield(L, -2, "running");
+	if (P == NULL || P->stacks == NULL)
+		return 1;
+	set_integer(L, "rate", P->rate);
+	set_integer(L, "samples", (lua_Integer)P->samples);
+	set_integer(L, "live", (lua_Integer)P->live_n);
+	set_integer(L, "stacks", stack_map_count(P->stacks));
+	set_integer(L, "memory", (lua_Integer)(sizeof(*P) + stack_map_memsize(P->stacks)
+		+ P->live_cap * sizeof(struct live_sample)));
+	return 1;
+}
+
+// profiler.cpu_start([hz [, max_stack]]), samples hz times in a second of cpu time.
+// hz is of the process, the one of the first running profiler is used.
+static int
+lcpu_start(lua_State *L) {
+	lua_Integer hz = luaL_optinteger(L, 1, DEFAULT_HZ);
+	lua_Integer max_stack = luaL_optinteger(L, 2, DEFAULT_MAX_STACK);
+	luaL_argcheck(L, hz > 0 && hz <= MAX_HZ, 1, "invalid hz");
+	luaL_argcheck(L, max_stack > 0 && max_stack < INT32_MAX, 2, "invalid max_stack");
+	struct profiler *P = new_profiler(L);
+	if (P->cpu_running)
+		return luaL_error(L, "cpu profiler is running");
+	hook_coroutine(L, P);
+	struct stack_map *stacks = stack_map_new((int)max_stack);
+	if (stacks == NULL) {
+		unhook_coroutine(L, P);
+		return luaL_error(L, "not enough memory");
+	}
+	int i;
+	for (i=0;i<PROFILER_SLOT;i++) {
+		struct profiler *expect = NULL;
+		if (atomic_compare_exchange_strong(&cpu_slot[i], &expect, P))
+			break;
+	}
+	if (i == PROFILER_SLOT) {
+		stack_map_delete(stacks);
+		unhook_coroutine(L, P);
+		return luaL_error(L, "too many profilers (%d)", PROFILER_SLOT);
+	}
+	pthread_mutex_lock(&cpu_lock);
+	if (cpu_n == 0) {
+		if (!cpu_timer_start((int)hz)) {
+			pthread_mutex_unlock(&cpu_lock);
+			int err = errno;
+			atomic_store(&cpu_slot[i], NULL);
+			stack_map_delete(stacks);
+			unhook_coroutine(L, P);
+			return luaL_error(L, "can't start the timer: %s", strerror(err));
+		}
+		cpu_hz = (int)hz;
+	}
+	++cpu_n;
+	pthread_mutex_unlock(&cpu_lock);
+	stack_map_delete(P->cpu_stacks);
+	P->cpu_stacks = stacks;
+	P->cpu_slot = i;
+	P->cpu_depth = 0;
+	++P->cpu_session;
+	P->cpu_hook_thread = NULL;
+	atomic_store(&P->cpu_pending, 0);
+	atomic_store(&P->cpu_lost, 0);
+	P->cpu_samples = 0;
+	P->current = L;
+	P->cpu_running = true;
+	atomic_fetch_add(&active, 1);
+	return 0;
+}
+
+static int
+lcpu_stop(lua_State *L) {
+	struct profiler *P = get_profiler(L);
+	if (P) {
+		cpu_stop(L, P);
+		unhook_coroutine(L, P);
+	}
+	return 0;
+}
+
+// profiler.cpu_dump([filename]), returns the folded stacks, or the number of stacks written to the file
+static int
+lcpu_dump(lua_State *L) {
+	const char *filename = luaL_optstring(L, 1, NULL);
+	struct profiler *P = get_profiler(L);
+	if (P == NULL || P->cpu_stacks == NULL)
+		return luaL_error(L, "cpu profiler is not started");
+	return dump_stacks(L, P->cpu_stacks, 0, filename);
+}
+
+static int
+lcpu_info(lua_State *L) {
+	struct profiler *P = get_profiler(L);
+	lua_createtable(L, 0, 7);
+	lua_pushboolean(L, P && P->cpu_running);
+	lua_setfield(L, -2, "running");
+	if (P == NULL || P->cpu_stacks == NULL)
+		return 1;
+	set_integer(L, "hz", cpu_hz);
+	set_integer(L, "samples", (lua_Integer)P->cpu_samples);
+	set_integer(L, "lost", atomic_load(&P->cpu_lost));
+	set_integer(L, "stacks", stack_map_count(P->cpu_stacks));
+	set_integer(L, "memory", (lua_Integer)stack_map_memsize(P->cpu_stacks));
+	return 1;
+}
+
+LUAMOD_API int
+luaopen_profiler(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "alloc_start", lalloc_start },
+		{ "alloc_stop", lalloc_stop },
+		{ "alloc_dump", lalloc_dump },
+		{ "alloc_info", lalloc_info },
+		{ "cpu_start", lcpu_start },
+		{ "cpu_stop", lcpu_stop },
+		{ "cpu_dump", lcpu_dump },
+		{ "cpu_info", lcpu_info },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
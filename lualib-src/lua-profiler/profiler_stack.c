@@ -0,0 +1,415 @@
+#if defined(__linux__)
+#define _GNU_SOURCE	// dladdr
+#endif
+
+#include <lua.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <dlfcn.h>
+#define HAVE_DLADDR
+#endif
+
+#include "profiler_stack.h"
+
+#define FRAME_NAME_SIZE 256
+
+struct frame {
+	uint64_t hash;
+	const void *key;	// the C function, NULL for a lua function
+	uint32_t source;	// the interned source of a lua function, else STACK_NONE
+	int line;
+	uint32_t name;	// offset in names
+};
+
+// the source strings of lua functions are copied, a chunk may be collected
+struct source {
+	uint64_t hash;
+	uint32_t offset;	// in names
+	uint32_t len;
+};
+
+struct stack {
+	uint64_t hash;
+	uint32_t frame;	// offset in pool, leaf first
+	uint32_t depth;
+	int64_t value[STACK_VALUE_N];
+};
+
+// open addressing, slot is id + 1, 0 is empty
+struct hash_index {
+	uint32_t *slot;
+	size_t cap;
+};
+
+struct stack_map {
+	int max_stack;
+	struct frame *frame;
+	size_t frame_n;
+	size_t frame_cap;
+	struct hash_index frame_index;
+	struct source *source;
+	size_t source_n;
+	size_t source_cap;
+	struct hash_index source_index;
+	char *name;
+	size_t name_n;
+	size_t name_cap;
+	struct stack *stack;
+	size_t stack_n;
+	size_t stack_cap;
+	struct hash_index stack_index;
+	uint32_t *pool;
+	size_t pool_n;
+	size_t pool_cap;
+	uint32_t truncated;	// the frame "..." at the root of a stack deeper than STACK_MAX_DEPTH
+};
+
+static inline uint64_t
+hash_mix(uint64_t h, uint64_t v) {
+	h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	return h;
+}
+
+static inline size_t
+hash_slot(uint64_t h, size_t cap) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t)h & (cap - 1);
+}
+
+static bool
+reserve(void **ptr, size_t *cap, size_t n, size_t elem) {
+	if (n <= *cap)
+		return true;
+	size_t newcap = *cap ? *cap * 2 : 64;
+	while (newcap < n)
+		newcap *= 2;
+	void *p = realloc(*ptr, newcap * elem);
+	if (p == NULL)
+		return false;
+	*ptr = p;
+	*cap = newcap;
+	return true;
+}
+
+// keeps the load factor under 1/2, hash(S, id) is the hash of an id to rehash
+static bool
+index_reserve(struct stack_map *S, struct hash_index *h, size_t n, uint64_t (*hash)(struct stack_map *, uint32_t)) {
+	if (n * 2 <= h->cap)
+		return true;
+	size_t cap = h->cap ? h->cap * 2 : 256;
+	while (n * 2 > cap)
+		cap *= 2;
+	uint32_t *slot = (uint32_t *)calloc(cap, sizeof(uint32_t));
+	if (slot == NULL)
+		return false;
+	size_t i;
+	for (i=0;i<h->cap;i++) {
+		uint32_t id = h->slot[i];
+		if (id == 0)
+			continue;
+		size_t s = hash_slot(hash(S, id - 1), cap);
+		while (slot[s] != 0)
+			s = (s + 1) & (cap - 1);
+		slot[s] = id;
+	}
+	free(h->slot);
+	h->slot = slot;
+	h->cap = cap;
+	return true;
+}
+
+static uint64_t
+frame_hash(struct stack_map *S, uint32_t id) {
+	return S->frame[id].hash;
+}
+
+static uint64_t
+stack_hash(struct stack_map *S, uint32_t id) {
+	return S->stack[id].hash;
+}
+
+static uint64_t
+source_hash(struct stack_map *S, uint32_t id) {
+	return S->source[id].hash;
+}
+
+static uint32_t
+intern_source(struct stack_map *S, const char *src, size_t len) {
+	uint64_t h = len;
+	size_t i;
+	for (i=0;i<len;i++)
+		h = h * 31 + (unsigned char)src[i];
+	uint32_t id;
+	if (S->source_index.cap > 0) {
+		size_t s = hash_slot(h, S->source_index.cap);
+		while ((id = S->source_index.slot[s]) != 0) {
+			const struct source *o = &S->source[id - 1];
+			if (o->hash == h && o->len == len && memcmp(S->name + o->offset, src, len) == 0)
+				return id - 1;
+			s = (s + 1) & (S->source_index.cap - 1);
+		}
+	}
+	if (len >= UINT32_MAX
+		|| !index_reserve(S, &S->source_index, S->source_n + 1, source_hash)
+		|| !reserve((void **)&S->source, &S->source_cap, S->source_n + 1, sizeof(struct source))
+		|| !reserve((void **)&S->name, &S->name_cap, S->name_n + len, 1))
+		return STACK_NONE;
+	id = (uint32_t)S->source_n++;
+	struct source *o = &S->source[id];
+	o->hash = h;
+	o->offset = (uint32_t)S->name_n;
+	o->len = (uint32_t)len;
+	memcpy(S->name + S->name_n, src, len);
+	S->name_n += len;
+	size_t s = hash_slot(h, S->source_index.cap);
+	while (S->source_index.slot[s] != 0)
+		s = (s + 1) & (S->source_index.cap - 1);
+	S->source_index.slot[s] = id + 1;
+	return id;
+}
+
+static uint32_t
+add_frame(struct stack_map *S, uint64_t h, const void *key, uint32_t source, int line, const char *name) {
+	size_t sz = strlen(name) + 1;
+	if (!index_reserve(S, &S->frame_index, S->frame_n + 1, frame_hash)
+		|| !reserve((void **)&S->frame, &S->frame_cap, S->frame_n + 1, sizeof(struct frame))
+		|| !reserve((void **)&S->name, &S->name_cap, S->name_n + sz, 1))
+		return STACK_NONE;
+	uint32_t id = (uint32_t)S->frame_n++;
+	struct frame *f = &S->frame[id];
+	f->hash = h;
+	f->key = key;
+	f->source = source;
+	f->line = line;
+	f->name = (uint32_t)S->name_n;
+	memcpy(S->name + S->name_n, name, sz);
+	S->name_n += sz;
+	size_t s = hash_slot(h, S->frame_index.cap);
+	while (S->frame_index.slot[s] != 0)
+		s = (s + 1) & (S->frame_index.cap - 1);
+	S->frame_index.slot[s] = id + 1;
+	return id;
+}
+
+static uint32_t
+find_frame(struct stack_map *S, uint64_t h, const void *key, uint32_t source, int line) {
+	if (S->frame_index.cap == 0)
+		return STACK_NONE;
+	size_t s = hash_slot(h, S->frame_index.cap);
+	uint32_t id;
+	while ((id = S->frame_index.slot[s]) != 0) {
+		const struct frame *f = &S->frame[id - 1];
+		if (f->key == key && f->source == source && f->line == line)
+			return id - 1;
+		s = (s + 1) & (S->frame_index.cap - 1);
+	}
+	return STACK_NONE;
+}
+
+static uint32_t
+add_stack(struct stack_map *S, uint64_t h, const uint32_t *frame, int depth) {
+	if (!index_reserve(S, &S->stack_index, S->stack_n + 1, stack_hash)
+		|| !reserve((void **)&S->stack, &S->stack_cap, S->stack_n + 1, sizeof(struct stack))
+		|| !reserve((void **)&S->pool, &S->pool_cap, S->pool_n + depth, sizeof(uint32_t)))
+		return STACK_OVERFLOW;
+	uint32_t id = (uint32_t)S->stack_n++;
+	struct stack *st = &S->stack[id];
+	memset(st, 0, sizeof(*st));
+	st->hash = h;
+	st->frame = (uint32_t)S->pool_n;
+	st->depth = depth;
+	memcpy(S->pool + S->pool_n, frame, depth * sizeof(uint32_t));
+	S->pool_n += depth;
+	size_t s = hash_slot(h, S->stack_index.cap);
+	while (S->stack_index.slot[s] != 0)
+		s = (s + 1) & (S->stack_index.cap - 1);
+	S->stack_index.slot[s] = id + 1;
+	return id;
+}
+
+static uint32_t
+intern_stack(struct stack_map *S, const uint32_t *frame, int depth) {
+	uint64_t h = depth;
+	int i;
+	for (i=0;i<depth;i++)
+		h = hash_mix(h, frame[i]);
+	if (S->stack_index.cap > 0) {
+		size_t s = hash_slot(h, S->stack_index.cap);
+		uint32_t id;
+		while ((id = S->stack_index.slot[s]) != 0) {
+			const struct stack *st = &S->stack[id - 1];
+			if (st->hash == h && st->depth == (uint32_t)depth
+				&& memcmp(S->pool + st->frame, frame, depth * sizeof(uint32_t)) == 0)
+				return id - 1;
+			s = (s + 1) & (S->stack_index.cap - 1);
+		}
+	}
+	if (S->stack_n >= (size_t)S->max_stack)
+		return STACK_OVERFLOW;
+	return add_stack(S, h, frame, depth);
+}
+
+static uint32_t
+pseudo_frame(struct stack_map *S, int line, const char *name) {
+	uint64_t h = hash_mix(0, line);
+	return add_frame(S, h, NULL, STACK_NONE, line, name);
+}
+
+struct stack_map *
+stack_map_new(int max_stack) {
+	struct stack_map *S = (struct stack_map *)malloc(sizeof(*S));
+	if (S == NULL)
+		return NULL;
+	memset(S, 0, sizeof(*S));
+	S->max_stack = max_stack + 2;
+	uint32_t overflow = pseudo_frame(S, -1, "[overflow]");
+	uint32_t unknown = pseudo_frame(S, -2, "[unknown]");
+	S->truncated = pseudo_frame(S, -3, "...");
+	if (S->truncated == STACK_NONE
+		|| intern_stack(S, &overflow, 1) != STACK_OVERFLOW
+		|| intern_stack(S, &unknown, 1) != STACK_UNKNOWN) {
+		stack_map_delete(S);
+		return NULL;
+	}
+	return S;
+}
+
+void
+stack_map_delete(struct stack_map *S) {
+	if (S == NULL)
+		return;
+	free(S->frame);
+	free(S->frame_index.slot);
+	free(S->source);
+	free(S->source_index.slot);
+	free(S->name);
+	free(S->stack);
+	free(S->stack_index.slot);
+	free(S->pool);
+	free(S);
+}
+
+size_t
+stack_map_memsize(struct stack_map *S) {
+	return sizeof(*S)
+		+ S->frame_cap * sizeof(struct frame)
+		+ S->frame_index.cap * sizeof(uint32_t)
+		+ S->source_cap * sizeof(struct source)
+		+ S->source_index.cap * sizeof(uint32_t)
+		+ S->name_cap
+		+ S->stack_cap * sizeof(struct stack)
+		+ S->stack_index.cap * sizeof(uint32_t)
+		+ S->pool_cap * sizeof(uint32_t);
+}
+
+int
+stack_map_count(struct stack_map *S) {
+	return (int)S->stack_n - 2;
+}
+
+int64_t *
+stack_map_value(struct stack_map *S, uint32_t id) {
+	return S->stack[id].value;
+}
+
+static void
+cfunction_name(char *buf, size_t sz, lua_CFunction f) {
+#ifdef HAVE_DLADDR
+	Dl_info info;
+	// dladdr gives the nearest exported symbol, the static functions have none
+	if (dladdr((void *)(uintptr_t)f, &info) && info.dli_sname && info.dli_saddr == (void *)(uintptr_t)f) {
+		snprintf(buf, sz, "c_function:%s", info.dli_sname);
+		return;
+	}
+#endif
+	snprintf(buf, sz, "c_function:%p", (void *)(uintptr_t)f);
+}
+
+// The key of a lua frame is the interned source string and the line, the
+// source pointer of a collected chunk may be reused by another one. The name
+// is made when the frame is seen first.
+static uint32_t
+intern_frame(struct stack_map *S, lua_State *L, lua_Debug *ar) {
+	const void *key = NULL;
+	uint32_t source = STACK_NONE;
+	int line;
+	lua_CFunction f = NULL;
+	lua_getinfo(L, "Sl", ar);
+	if (ar->what[0] == 'C') {
+		// L may be a suspended coroutine
+		if (!lua_checkstack(L, 1))
+			return STACK_NONE;
+		lua_getinfo(L, "f", ar);
+		f = lua_tocfunction(L, -1);
+		key = f ? (const void *)(uintptr_t)f : lua_topointer(L, -1);
+		lua_pop(L, 1);
+		line = -1;
+	} else {
+		source = intern_source(S, ar->source, ar->srclen);
+		if (source == STACK_NONE)
+			return STACK_NONE;
+		line = ar->currentline;
+	}
+	uint64_t h = hash_mix(hash_mix((uint64_t)(uintptr_t)key, source), (uint64_t)line);
+	uint32_t id = find_frame(S, h, key, source, line);
+	if (id != STACK_NONE)
+		return id;
+	char name[FRAME_NAME_SIZE];
+	if (ar->what[0] == 'C') {
+		cfunction_name(name, sizeof(name), f);
+	} else if (line < 0) {
+		snprintf(name, sizeof(name), "%s:%d", ar->short_src, ar->linedefined);
+	} else {
+		snprintf(name, sizeof(name), "%s:%d", ar->short_src, line);
+	}
+	return add_frame(S, h, key, source, line, name);
+}
+
+uint32_t
+stack_map_capture(struct stack_map *S, lua_State *L) {
+	uint32_t frame[STACK_MAX_DEPTH];
+	int depth = 0;
+	lua_Debug ar;
+	while (depth < STACK_MAX_DEPTH && lua_getstack(L, depth, &ar)) {
+		uint32_t id = intern_frame(S, L, &ar);
+		if (id == STACK_NONE)
+			return STACK_OVERFLOW;
+		frame[depth++] = id;
+	}
+	if (depth == 0)
+		return STACK_UNKNOWN;
+	if (depth == STACK_MAX_DEPTH && lua_getstack(L, depth, &ar))
+		frame[depth - 1] = S->truncated;
+	return intern_stack(S, frame, depth);
+}
+
+int
+stack_map_folded(struct stack_map *S, int v, stack_writer w, void *ud) {
+	int n = 0;
+	size_t i;
+	for (i=0;i<S->stack_n;i++) {
+		const struct stack *st = &S->stack[i];
+		if (st->value[v] <= 0)
+			continue;
+		const uint32_t *frame = S->pool + st->frame;
+		int j;
+		for (j=st->depth-1;j>=0;j--) {
+			const char *name = S->name + S->frame[frame[j]].name;
+			w(ud, name, strlen(name));
+			if (j > 0)
+				w(ud, ";", 1);
+		}
+		char tmp[32];
+		int sz = snprintf(tmp, sizeof(tmp), " %lld\n", (long long)st->value[v]);
+		w(ud, tmp, sz);
+		++n;
+	}
+	return n;
+}
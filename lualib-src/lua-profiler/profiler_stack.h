@@ -0,0 +1,35 @@
+#ifndef profiler_stack_h
+#define profiler_stack_h
+
+#include <lua.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lua call stacks interned as lists of frames, a frame is a line of a lua
+// function (source:line) or a C function. Each stack has STACK_VALUE_N
+// counters. The map is bounded, the stacks beyond max_stack are counted in
+// STACK_OVERFLOW.
+
+#define STACK_OVERFLOW 0	// "[overflow]"
+#define STACK_UNKNOWN 1	// "[unknown]", the samples without a stack
+#define STACK_NONE UINT32_MAX
+#define STACK_MAX_DEPTH 64
+#define STACK_VALUE_N 4
+
+struct stack_map;
+
+typedef void (*stack_writer)(void *ud, const char *s, size_t sz);
+
+struct stack_map * stack_map_new(int max_stack);
+void stack_map_delete(struct stack_map *S);
+size_t stack_map_memsize(struct stack_map *S);
+int stack_map_count(struct stack_map *S);
+
+// interns the current stack of L, call it in a hook or a C function only
+uint32_t stack_map_capture(struct stack_map *S, lua_State *L);
+int64_t * stack_map_value(struct stack_map *S, uint32_t id);
+
+// writes "root;...;leaf value\n" of the stacks with value[v] > 0, the input format of flamegraph.pl
+int stack_map_folded(struct stack_map *S, int v, stack_writer w, void *ud);
+
+#endif
@@ -7,6 +7,9 @@
 
 #include "lgc.h"
 
+#include "snapshot_stream.h"
+#include "snapshot_analyzer.h"
+
 #ifdef isshared
 	static int
 	check_shared(lua_State* L, int idx, int t) {
@@ -25,12 +28,17 @@
 	}
 #endif
 
+struct snapshot_stream;
+
 struct snapshot_params {
 	int max_count;
 	int current_mark_count;
+	struct snapshot_stream *stream;	// write records to the stream instead of building tables in dL
 };
 
 static void mark_object(lua_State *L, lua_State *dL, const void * parent, const char * desc, struct snapshot_params* args);
+static int stream_object(lua_State *L, struct snapshot_stream *s, const void *p, int tidx, const void *parent, const char *desc);
+static void stream_source(struct snapshot_stream *s, const void *p, const char *text, size_t sz);
 
 #define check_limit(L, args) do { \
 	if((args)->max_count > 0) { \
@@ -198,7 +206,7 @@ ismarked(lua_State *dL, const void *p) {
 }
 
 static const void *
-readobject(lua_State *L, lua_State *dL, const void *parent, const char *desc) {
+readobject(lua_State *L, lua_State *dL, const void *parent, const char *desc, struct snapshot_params* args) {
 	int t = lua_type(L, -1);
 #ifdef isshared
 	if(check_shared(L, -1, t)) {
@@ -250,6 +258,12 @@ readobject(lua_State *L, lua_State *dL, const void *parent, const char *desc) {
 	else {
 		p = (const void*)lua_topointer(L, -1);
 	}
+	if (args->stream) {
+		if (stream_object(L, args->stream, p, tidx, parent, desc))
+			return p;
+		lua_pop(L,1);
+		return NULL;
+	}
 	if (ismarked(dL, p)) {
 		lua_rawgetp(dL, tidx, p);
 		if (!lua_isnil(dL,-1)) {
@@ -269,6 +283,19 @@ readobject(lua_State *L, lua_State *dL, const void *parent, const char *desc) {
 	return p;
 }
 
+// the source of t is at the top of dL
+static void
+set_source(lua_State *dL, const void *t, struct snapshot_params* args) {
+	if (args->stream) {
+		size_t sz = 0;
+		const char * s = lua_tolstring(dL, -1, &sz);
+		stream_source(args->stream, t, s, sz);
+		lua_pop(dL,1);
+	} else {
+		lua_rawsetp(dL, SOURCE, t);
+	}
+}
+
 static const char *
 keystring(lua_State *L, int index, char * buffer) {
 	int t = lua_type(L,index);
@@ -293,7 +320,7 @@ keystring(lua_State *L, int index, char * buffer) {
 
 static void
 mark_table(lua_State *L, lua_State *dL, const void * parent, const char * desc, struct snapshot_params* args) {
-	const void * t = readobject(L, dL, parent, desc);
+	const void * t = readobject(L, dL, parent, desc, args);
 	if (t == NULL)
 		return;
 
@@ -338,8 +365,8 @@ mark_table(lua_State *L, lua_State *dL, const void * parent, const char * desc,
 }
 
 static void
-mark_string(lua_State *L, lua_State *dL, const void * parent, const char *desc) {
-	const void* t = readobject(L, dL, parent, desc);
+mark_string(lua_State *L, lua_State *dL, const void * parent, const char *desc, struct snapshot_params* args) {
+	const void* t = readobject(L, dL, parent, desc, args);
 	if(t == NULL)
 		return;
 	lua_pop(L,1);
@@ -347,7 +374,7 @@ mark_string(lua_State *L, lua_State *dL, const void * parent, const char *desc)
 
 static void
 mark_userdata(lua_State *L, lua_State *dL, const void * parent, const char *desc, struct snapshot_params* args) {
-	const void * t = readobject(L, dL, parent, desc);
+	const void * t = readobject(L, dL, parent, desc, args);
 	if (t == NULL)
 		return;
 
@@ -385,7 +412,7 @@ mark_userdata(lua_State *L, lua_State *dL, const void * parent, const char *desc
 
 static void
 mark_function(lua_State *L, lua_State *dL, const void * parent, const char *desc, struct snapshot_params* args) {
-	const void * t = readobject(L, dL, parent, desc);
+	const void * t = readobject(L, dL, parent, desc, args);
 	if (t == NULL)
 		return;
 
@@ -411,13 +438,13 @@ mark_function(lua_State *L, lua_State *dL, const void * parent, const char *desc
 		sprintf(tmp,":%d",ar.linedefined);
 		luaL_addstring(&b, tmp);
 		luaL_pushresult(&b);
-		lua_rawsetp(dL, SOURCE, t);
+		set_source(dL, t, args);
 	}
 }
 
 static void
 mark_thread(lua_State *L, lua_State *dL, const void * parent, const char *desc, struct snapshot_params* args) {
-	const void * t = readobject(L, dL, parent, desc);
+	const void * t = readobject(L, dL, parent, desc, args);
 	if (t == NULL)
 		return;
 
@@ -466,7 +493,7 @@ mark_thread(lua_State *L, lua_State *dL, const void * parent, const char *desc,
 		++level;
 	}
 	luaL_pushresult(&b);
-	lua_rawsetp(dL, SOURCE, t);
+	set_source(dL, t, args);
 	lua_pop(L,1);
 }
 
@@ -494,7 +521,7 @@ mark_object(lua_State *L, lua_State *dL, const void * parent, const char *desc,
 		mark_thread(L, dL, parent, desc, args);
 		break;
 	case LUA_TSTRING:
-		mark_string(L, dL, parent, desc);
+		mark_string(L, dL, parent, desc, args);
 		break;
 	default:
 		lua_pop(L,1);
@@ -666,6 +693,188 @@ _lstring_size(const void* s) {
 
 #endif
 
+/* Streaming snapshot, see snapshot_stream.h. Records are written while the heap
+   is walked; only the set of visited addresses is kept in memory. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define STREAM_METANAME "snapshot.stream"
+
+struct snapshot_stream {
+	FILE *f;
+	uint64_t objects;
+	uint64_t edges;
+	size_t visited_n;
+	size_t visited_cap;
+	const void **visited;
+	lua_State *dL;	// closed by __gc too, when marking raises an error
+};
+
+static inline size_t
+visited_slot(const void *p, size_t cap) {
+	uint64_t h = (uint64_t)(uintptr_t)p * UINT64_C(0x9E3779B97F4A7C15);
+	return (size_t)(h >> 32) & (cap - 1);
+}
+
+static void
+visited_grow(lua_State *L, struct snapshot_stream *s) {
+	size_t cap = s->visited_cap ? s->visited_cap * 2 : 4096;
+	const void **set = (const void **)calloc(cap, sizeof(*set));
+	if (set == NULL) {
+		luaL_error(L, "snapshot: out of memory");
+	}
+	size_t i;
+	for (i=0;i<s->visited_cap;i++) {
+		const void *p = s->visited[i];
+		if (p) {
+			size_t slot = visited_slot(p, cap);
+			while (set[slot])
+				slot = (slot + 1) & (cap - 1);
+			set[slot] = p;
+		}
+	}
+	free(s->visited);
+	s->visited = set;
+	s->visited_cap = cap;
+}
+
+// true when p is visited before, or mark it
+static bool
+stream_visited(lua_State *L, struct snapshot_stream *s, const void *p) {
+	if ((s->visited_n + 1) * 2 > s->visited_cap) {
+		visited_grow(L, s);
+	}
+	size_t cap = s->visited_cap;
+	size_t slot = visited_slot(p, cap);
+	while (s->visited[slot]) {
+		if (s->visited[slot] == p)
+			return true;
+		slot = (slot + 1) & (cap - 1);
+	}
+	s->visited[slot] = p;
+	++s->visited_n;
+	return false;
+}
+
+static inline uint8_t *
+put_u64(uint8_t *ptr, uint64_t v) {
+	memcpy(ptr, &v, sizeof(v));
+	return ptr + sizeof(v);
+}
+
+/* write errors are checked by ferror when the stream is closed */
+static inline void
+stream_write(struct snapshot_stream *s, const void *data, size_t sz) {
+	if (sz > 0)
+		fwrite(data, sz, 1, s->f);
+}
+
+static void
+stream_edge(struct snapshot_stream *s, const void *parent, const void *child, const char *desc) {
+	size_t len = strlen(desc);
+	if (len > SNAPSHOT_DESC_MAX)
+		len = SNAPSHOT_DESC_MAX;
+	uint16_t l = (uint16_t)len;
+	uint8_t head[1 + 8 + 8 + 2];
+	uint8_t *ptr = head;
+	*ptr++ = SNAPSHOT_RECORD_EDGE;
+	ptr = put_u64(ptr, (uint64_t)(uintptr_t)parent);
+	ptr = put_u64(ptr, (uint64_t)(uintptr_t)child);
+	memcpy(ptr, &l, sizeof(l));
+	stream_write(s, head, sizeof(head));
+	stream_write(s, desc, len);
+	++s->edges;
+}
+
+static void
+stream_source(struct snapshot_stream *s, const void *p, const char *text, size_t sz) {
+	uint32_t l = (uint32_t)sz;
+	uint8_t head[1 + 8 + 4];
+	uint8_t *ptr = head;
+	*ptr++ = SNAPSHOT_RECORD_SOURCE;
+	ptr = put_u64(ptr, (uint64_t)(uintptr_t)p);
+	memcpy(ptr, &l, sizeof(l));
+	stream_write(s, head, sizeof(head));
+	stream_write(s, text, sz);
+}
+
+/* the object p is at the top of L, returns 1 when it's the first time */
+static int
+stream_object(lua_State *L, struct snapshot_stream *s, const void *p, int tidx, const void *parent, const char *desc) {
+	if (stream_visited(L, s, p)) {
+		stream_edge(s, parent, p, desc);
+		return 0;
+	}
+	int type = 0;
+	size_t size = 0;
+	switch (tidx) {
+	case TABLE:
+		type = SNAPSHOT_TYPE_TABLE;
+		size = _table_size((Table*)p);
+		break;
+	case FUNCTION:
+		if (lua_iscfunction(L, -1)) {
+			type = SNAPSHOT_TYPE_CFUNCTION;
+			size = _cfunc_size((CClosure*)p);
+		} else {
+			type = SNAPSHOT_TYPE_FUNCTION;
+			size = _lfunc_size((LClosure*)p);
+		}
+		break;
+	case THREAD:
+		type = SNAPSHOT_TYPE_THREAD;
+		size = _thread_size((struct lua_State*)p);
+		break;
+	case USERDATA:
+		type = SNAPSHOT_TYPE_USERDATA;
+		size = _userdata_size((Udata*)p);
+		break;
+	case STRING:
+		type = SNAPSHOT_TYPE_STRING;
+		size = _lstring_size(p);
+		break;
+	}
+	uint8_t rec[1 + 1 + 8 + 8];
+	uint8_t *ptr = rec;
+	*ptr++ = SNAPSHOT_RECORD_OBJECT;
+	*ptr++ = (uint8_t)type;
+	ptr = put_u64(ptr, (uint64_t)(uintptr_t)p);
+	put_u64(ptr, (uint64_t)size);
+	stream_write(s, rec, sizeof(rec));
+	++s->objects;
+	stream_edge(s, parent, p, desc);
+	return 1;
+}
+
+/* returns non zero when any write failed */
+static int
+stream_close(struct snapshot_stream *s) {
+	int err = 0;
+	if (s->f) {
+		err = ferror(s->f);
+		if (fclose(s->f) != 0)
+			err = 1;
+		s->f = NULL;
+	}
+	free(s->visited);
+	s->visited = NULL;
+	s->visited_cap = 0;
+	s->visited_n = 0;
+	if (s->dL) {
+		lua_close(s->dL);
+		s->dL = NULL;
+	}
+	return err;
+}
+
+static int
+stream_gc(lua_State *L) {
+	stream_close((struct snapshot_stream *)lua_touserdata(L, 1));
+	return 0;
+}
+
 static void
 pdesc(lua_State *L, lua_State *dL, int idx, const char * typename) {
 	lua_pushnil(dL);
@@ -800,6 +1009,66 @@ snapshot(lua_State *L) {
 	return 1;
 }
 
+/*
+** snapshot.dump(filename [, max_count]), writes the records of the heap to
+** filename instead of returning a table. Returns the number of objects and
+** edges written, or nil and the error.
+*/
+static int
+dump(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	struct snapshot_params args = {0};
+	args.max_count = luaL_optinteger(L, 2, 0);
+
+	struct snapshot_stream *s = (struct snapshot_stream *)lua_newuserdata(L, sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	if (luaL_newmetatable(L, STREAM_METANAME)) {
+		lua_pushcfunction(L, stream_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	s->f = fopen(filename, "wb");
+	if (s->f == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+		return 2;
+	}
+	setvbuf(s->f, NULL, _IOFBF, 64 * 1024);
+	uint32_t version = SNAPSHOT_STREAM_VERSION;
+	stream_write(s, SNAPSHOT_STREAM_MAGIC, 4);
+	stream_write(s, &version, sizeof(version));
+
+	// dL only holds the source strings of functions and threads
+	s->dL = luaL_newstate();
+	if (s->dL == NULL) {
+		return luaL_error(L, "snapshot: failed to create auxiliary state (out of memory)");
+	}
+	args.stream = s;
+	lua_pushvalue(L, LUA_REGISTRYINDEX);
+	mark_table(L, s->dL, NULL, "[registry]", &args);
+	lua_close(s->dL);
+	s->dL = NULL;
+
+	uint8_t end[1 + 8 + 8];
+	uint8_t *ptr = end;
+	*ptr++ = SNAPSHOT_RECORD_END;
+	ptr = put_u64(ptr, s->objects);
+	put_u64(ptr, s->edges);
+	stream_write(s, end, sizeof(end));
+
+	uint64_t objects = s->objects;
+	uint64_t edges = s->edges;
+	if (stream_close(s)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: write failed", filename);
+		return 2;
+	}
+	lua_pushinteger(L, (lua_Integer)objects);
+	lua_pushinteger(L, (lua_Integer)edges);
+	return 2;
+}
+
 static int
 l_str2lightuserdata(lua_State* L) {
 	const char* s = luaL_checklstring(L, 1, NULL);
@@ -936,6 +1205,8 @@ luaopen_snapshot(lua_State *L) {
 	luaL_checkversion(L);
 	luaL_Reg l[] = {
 		{"snapshot", snapshot},
+		{"dump", dump},
+		{"diff", snapshot_diff},
 		{"str2ud", l_str2lightuserdata},
 		{"ud2str", l_lightuserdata2str},
 		{"obj2addr", l_obj2addr},
@@ -0,0 +1,1063 @@
+/*
+** Native analysis of heap snapshots, for the tables of snapshot.snapshot and
+** the files of snapshot.dump.
+**
+** The end snapshot is loaded as a graph: node 0 is the root (the registry's
+** parent), an edge whose parent is not in the snapshot hangs on the root too.
+** Objects of the end snapshot missing in the begin snapshot are new. Each
+** object is named by its shortest path from the root, and the retained size
+** of an object is the size of its subtree in the dominator tree
+** (Lengauer-Tarjan), i.e. the memory freed if it was released.
+*/
+#include <lua.h>
+#include <lauxlib.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot_stream.h"
+#include "snapshot_analyzer.h"
+
+#define ANALYZER_METANAME "snapshot.analyzer"
+#define NONE UINT32_MAX
+#define PATH_DEPTH 64
+#define DEFAULT_TOP 32
+
+struct object {
+	uint64_t addr;
+	uint64_t size;
+	uint32_t source;	// string of the function source or thread traceback, NONE for others
+	uint8_t type;	// SNAPSHOT_TYPE_*
+};
+
+struct edge {
+	uint64_t parent;	// address, 0 for the root
+	uint32_t from;	// object of the parent, 0 when it's the root or unknown
+	uint32_t child;
+	uint32_t desc;
+};
+
+// uint64 (not 0) -> uint32, open addressing
+struct addr_map {
+	size_t n;
+	size_t cap;
+	uint64_t *key;
+	uint32_t *value;
+};
+
+// strings are interned, and refered by their offset in buf
+struct string_pool {
+	char *buf;
+	size_t n;
+	size_t cap;
+	struct addr_map index;	// hash -> the first string of the chain
+	uint32_t *offset;	// of each string
+	uint32_t *next;	// string of the same hash
+	size_t count;
+	size_t count_cap;
+};
+
+struct group {
+	uint32_t path;
+	uint32_t count;
+	uint64_t size;
+	uint64_t retained;
+};
+
+struct top_item {
+	uint64_t retained;
+	uint32_t object;
+};
+
+struct analyzer {
+	struct object *obj;
+	size_t obj_n;
+	size_t obj_cap;
+	struct edge *edge;
+	size_t edge_n;
+	size_t edge_cap;
+	struct addr_map index;	// address -> object of the end snapshot
+	struct addr_map begin;	// addresses of the begin snapshot
+	struct string_pool str;
+	uint32_t *work[14];	// arrays of the analysis (W_*), freed with the analyzer
+	uint64_t *retained;
+	struct group *group;
+	size_t group_n;
+	size_t group_cap;
+	struct addr_map group_index;	// path -> group
+	char *path;
+	size_t path_cap;
+	FILE *f;
+};
+
+static void *
+grow_array(lua_State *L, void *ptr, size_t *cap, size_t n, size_t elem) {
+	if (n < *cap)
+		return ptr;
+	size_t newcap = *cap ? *cap * 2 : 1024;
+	while (newcap <= n)
+		newcap *= 2;
+	void *p = realloc(ptr, newcap * elem);
+	if (p == NULL)
+		luaL_error(L, "snapshot: out of memory");
+	*cap = newcap;
+	return p;
+}
+
+static uint32_t *
+new_work(lua_State *L, struct analyzer *A, int slot, size_t n) {
+	free(A->work[slot]);
+	A->work[slot] = (uint32_t *)malloc((n ? n : 1) * sizeof(uint32_t));
+	if (A->work[slot] == NULL)
+		luaL_error(L, "snapshot: out of memory");
+	return A->work[slot];
+}
+
+static inline size_t
+map_slot(uint64_t key, size_t cap) {
+	return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (cap - 1);
+}
+
+static void
+map_free(struct addr_map *m) {
+	free(m->key);
+	free(m->value);
+	memset(m, 0, sizeof(*m));
+}
+
+static void map_insert(lua_State *L, struct addr_map *m, uint64_t key, uint32_t value);
+
+static void
+map_rehash(lua_State *L, struct addr_map *m) {
+	struct addr_map tmp;
+	tmp.n = 0;
+	tmp.cap = m->cap ? m->cap * 2 : 4096;
+	tmp.key = (uint64_t *)calloc(tmp.cap, sizeof(uint64_t));
+	tmp.value = (uint32_t *)malloc(tmp.cap * sizeof(uint32_t));
+	if (tmp.key == NULL || tmp.value == NULL) {
+		free(tmp.key);
+		free(tmp.value);
+		luaL_error(L, "snapshot: out of memory");
+	}
+	size_t i;
+	for (i=0;i<m->cap;i++) {
+		if (m->key[i])
+			map_insert(L, &tmp, m->key[i], m->value[i]);
+	}
+	map_free(m);
+	*m = tmp;
+}
+
+// replaces the value of an existing key
+static void
+map_insert(lua_State *L, struct addr_map *m, uint64_t key, uint32_t value) {
+	if ((m->n + 1) * 2 > m->cap)
+		map_rehash(L, m);
+	size_t slot = map_slot(key, m->cap);
+	while (m->key[slot]) {
+		if (m->key[slot] == key) {
+			m->value[slot] = value;
+			return;
+		}
+		slot = (slot + 1) & (m->cap - 1);
+	}
+	m->key[slot] = key;
+	m->value[slot] = value;
+	++m->n;
+}
+
+static uint32_t
+map_find(const struct addr_map *m, uint64_t key) {
+	if (m->cap == 0)
+		return NONE;
+	size_t slot = map_slot(key, m->cap);
+	while (m->key[slot]) {
+		if (m->key[slot] == key)
+			return m->value[slot];
+		slot = (slot + 1) & (m->cap - 1);
+	}
+	return NONE;
+}
+
+static uint64_t
+string_hash(const char *s, size_t sz) {
+	uint64_t h = UINT64_C(14695981039346656037);
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h = (h ^ (uint8_t)s[i]) * UINT64_C(1099511628211);
+	}
+	return h ? h : 1;
+}
+
+// same strings share one copy, field names repeat a lot in a heap
+static uint32_t
+pool_intern(lua_State *L, struct string_pool *p, const char *s, size_t sz) {
+	uint64_t h = string_hash(s, sz);
+	uint32_t head = map_find(&p->index, h);
+	uint32_t iter;
+	for (iter = head; iter != NONE; iter = p->next[iter]) {
+		const char *str = p->buf + p->offset[iter];
+		if (memcmp(str, s, sz) == 0 && str[sz] == '\0')
+			return p->offset[iter];
+	}
+	if (p->n + sz + 1 > UINT32_MAX || p->count >= NONE)
+		luaL_error(L, "snapshot: too many strings");
+	p->buf = (char *)grow_array(L, p->buf, &p->cap, p->n + sz + 1, 1);
+	size_t cap = p->count_cap;
+	p->offset = (uint32_t *)grow_array(L, p->offset, &cap, p->count, sizeof(uint32_t));
+	cap = p->count_cap;
+	p->next = (uint32_t *)grow_array(L, p->next, &cap, p->count, sizeof(uint32_t));
+	p->count_cap = cap;
+	uint32_t offset = (uint32_t)p->n;
+	memcpy(p->buf + p->n, s, sz);
+	p->buf[p->n + sz] = '\0';
+	p->n += sz + 1;
+	uint32_t id = (uint32_t)p->count++;
+	p->offset[id] = offset;
+	p->next[id] = head;
+	map_insert(L, &p->index, h, id);
+	return offset;
+}
+
+static inline const char *
+pool_string(struct string_pool *p, uint32_t offset) {
+	return p->buf + offset;
+}
+
+static uint32_t
+add_object(lua_State *L, struct analyzer *A, uint64_t addr, int type, uint64_t size, uint32_t source) {
+	if (A->obj_n >= NONE)
+		luaL_error(L, "snapshot: too many objects");
+	A->obj = (struct object *)grow_array(L, A->obj, &A->obj_cap, A->obj_n, sizeof(struct object));
+	uint32_t id = (uint32_t)A->obj_n++;
+	struct object *o = &A->obj[id];
+	o->addr = addr;
+	o->size = size;
+	o->source = source;
+	o->type = (uint8_t)type;
+	if (addr)
+		map_insert(L, &A->index, addr, id);
+	return id;
+}
+
+static void
+add_edge(lua_State *L, struct analyzer *A, uint64_t parent, uint32_t child, const char *desc, size_t sz) {
+	A->edge = (struct edge *)grow_array(L, A->edge, &A->edge_cap, A->edge_n, sizeof(struct edge));
+	struct edge *e = &A->edge[A->edge_n++];
+	e->parent = parent;
+	e->from = 0;
+	e->child = child;
+	e->desc = pool_intern(L, &A->str, desc, sz);
+}
+
+/* The tables of snapshot.snapshot, addr -> "type {size}\nparent : desc\n..." */
+
+static int
+record_type(const char *t, size_t sz, const char **source, size_t *source_sz) {
+	*source = NULL;
+	*source_sz = 0;
+#define IS(name) (sz == sizeof(name) - 1 && memcmp(t, name, sz) == 0)
+	if (IS("table"))
+		return SNAPSHOT_TYPE_TABLE;
+	if (IS("userdata"))
+		return SNAPSHOT_TYPE_USERDATA;
+	if (IS("cfunction"))
+		return SNAPSHOT_TYPE_CFUNCTION;
+	if (IS("string"))
+		return SNAPSHOT_TYPE_STRING;
+#undef IS
+	if (sz >= 7 && memcmp(t, "thread ", 7) == 0) {
+		*source = t + 7;
+		*source_sz = sz - 7;
+		return SNAPSHOT_TYPE_THREAD;
+	}
+	*source = t;
+	*source_sz = sz;
+	return SNAPSHOT_TYPE_FUNCTION;
+}
+
+static uint64_t
+parse_pointer(const char *s) {
+	void *p = NULL;
+	sscanf(s, "%p", &p);
+	return (uint64_t)(uintptr_t)p;
+}
+
+static void
+load_record(lua_State *L, struct analyzer *A, uint64_t addr, const char *s, size_t sz) {
+	const char *end = s + sz;
+	const char *eol = memchr(s, '\n', sz);
+	if (eol == NULL)
+		eol = end;
+	// the size is the last {n} of the first line
+	const char *brace = NULL;
+	const char *p;
+	for (p = s; p + 1 < eol; p++) {
+		if (p[0] == ' ' && p[1] == '{')
+			brace = p;
+	}
+	if (brace == NULL)
+		luaL_error(L, "snapshot: bad record %s", s);
+	const char *source;
+	size_t source_sz;
+	int type = record_type(s, brace - s, &source, &source_sz);
+	uint64_t size = strtoull(brace + 2, NULL, 10);
+	uint32_t src = source ? pool_intern(L, &A->str, source, source_sz) : NONE;
+	uint32_t id = add_object(L, A, addr, type, size, src);
+
+	for (p = eol; p < end;) {
+		++p;	// skip '\n'
+		const char *line_end = memchr(p, '\n', end - p);
+		if (line_end == NULL)
+			line_end = end;
+		const char *sep = NULL;
+		const char *q;
+		for (q = p; q + 3 <= line_end; q++) {
+			if (q[0] == ' ' && q[1] == ':' && q[2] == ' ') {
+				sep = q;
+				break;
+			}
+		}
+		if (sep) {
+			char tmp[64];
+			size_t n = sep - p < (ptrdiff_t)sizeof(tmp) ? (size_t)(sep - p) : sizeof(tmp) - 1;
+			memcpy(tmp, p, n);
+			tmp[n] = '\0';
+			add_edge(L, A, parse_pointer(tmp), id, sep + 3, line_end - sep - 3);
+		}
+		p = line_end;
+	}
+}
+
+static void
+load_table(lua_State *L, struct analyzer *A, int idx, bool objects) {
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		uint64_t addr = (uint64_t)(uintptr_t)lua_touserdata(L, -2);
+		if (objects) {
+			size_t sz = 0;
+			const char *s = lua_tolstring(L, -1, &sz);
+			if (s == NULL)
+				luaL_error(L, "snapshot: bad record at %p", lua_touserdata(L, -2));
+			load_record(L, A, addr, s, sz);
+		} else {
+			map_insert(L, &A->begin, addr, 0);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/* The files of snapshot.dump, see snapshot_stream.h */
+
+struct reader {
+	FILE *f;
+	size_t pos;
+	size_t len;
+	uint8_t buf[64 * 1024];
+};
+
+static bool
+read_bytes(struct reader *r, void *data, size_t sz) {
+	uint8_t *ptr = (uint8_t *)data;
+	while (sz > 0) {
+		if (r->pos == r->len) {
+			r->len = fread(r->buf, 1, sizeof(r->buf), r->f);
+			r->pos = 0;
+			if (r->len == 0)
+				return false;
+		}
+		size_t n = r->len - r->pos;
+		if (n > sz)
+			n = sz;
+		if (ptr) {
+			memcpy(ptr, r->buf + r->pos, n);
+			ptr += n;
+		}
+		r->pos += n;
+		sz -= n;
+	}
+	return true;
+}
+
+static void
+load_file(lua_State *L, struct analyzer *A, const char *filename, bool objects) {
+	A->f = fopen(filename, "rb");
+	if (A->f == NULL)
+		luaL_error(L, "snapshot: can not open %s", filename);
+	struct reader *r = (struct reader *)lua_newuserdata(L, sizeof(struct reader));
+	r->f = A->f;
+	r->pos = r->len = 0;
+
+	char magic[4];
+	uint32_t version;
+	if (!read_bytes(r, magic, 4) || memcmp(magic, SNAPSHOT_STREAM_MAGIC, 4) != 0
+		|| !read_bytes(r, &version, sizeof(version)) || version != SNAPSHOT_STREAM_VERSION)
+		luaL_error(L, "snapshot: %s is not a snapshot file", filename);
+
+	char *text = NULL;
+	size_t text_cap = 0;
+	bool ok = false;
+	for (;;) {
+		uint8_t tag;
+		if (!read_bytes(r, &tag, 1))
+			break;
+		if (tag == SNAPSHOT_RECORD_END) {
+			ok = read_bytes(r, NULL, 16);
+			break;
+		} else if (tag == SNAPSHOT_RECORD_OBJECT) {
+			uint8_t type;
+			uint64_t addr, size;
+			if (!read_bytes(r, &type, 1) || !read_bytes(r, &addr, 8) || !read_bytes(r, &size, 8))
+				break;
+			if (objects)
+				add_object(L, A, addr, type, size, NONE);
+			else
+				map_insert(L, &A->begin, addr, 0);
+		} else if (tag == SNAPSHOT_RECORD_EDGE || tag == SNAPSHOT_RECORD_SOURCE) {
+			uint64_t parent, child;
+			uint16_t len16;
+			uint32_t len;
+			if (tag == SNAPSHOT_RECORD_EDGE) {
+				if (!read_bytes(r, &parent, 8) || !read_bytes(r, &child, 8) || !read_bytes(r, &len16, 2))
+					break;
+				len = len16;
+			} else {
+				if (!read_bytes(r, &child, 8) || !read_bytes(r, &len, 4))
+					break;
+			}
+			if (!objects) {
+				if (!read_bytes(r, NULL, len))
+					break;
+				continue;
+			}
+			if (len + 1 > text_cap) {
+				char *t = (char *)realloc(text, len + 1);
+				if (t == NULL)
+					break;
+				text = t;
+				text_cap = len + 1;
+			}
+			if (!read_bytes(r, text, len))
+				break;
+			uint32_t id = map_find(&A->index, child);
+			if (id == NONE)
+				break;
+			if (tag == SNAPSHOT_RECORD_EDGE) {
+				add_edge(L, A, parent, id, text, len);
+			} else {
+				A->obj[id].source = pool_intern(L, &A->str, text, len);
+			}
+		} else {
+			break;
+		}
+	}
+	free(text);
+	fclose(A->f);
+	A->f = NULL;
+	lua_pop(L, 1);
+	if (!ok)
+		luaL_error(L, "snapshot: %s is truncated or corrupt", filename);
+}
+
+static void
+load(lua_State *L, struct analyzer *A, int idx, bool objects) {
+	switch (lua_type(L, idx)) {
+	case LUA_TTABLE:
+		load_table(L, A, idx, objects);
+		break;
+	case LUA_TSTRING:
+		load_file(L, A, lua_tostring(L, idx), objects);
+		break;
+	default:
+		luaL_argerror(L, idx, "snapshot table or file name expected");
+	}
+}
+
+/* Graph */
+
+enum {
+	W_SUCC_START,
+	W_SUCC,
+	W_PRED_START,
+	W_PRED,
+	W_DFN,
+	W_VERTEX,
+	W_PARENT,
+	W_SEMI,
+	W_IDOM,
+	W_ANCESTOR,
+	W_LABEL,
+	W_BUCKET,
+	W_CHAIN,
+	W_STACK,
+	W_COUNT,
+};
+
+// edges by parent (succ) and by child (pred), as offsets to edge indices
+static void
+build_csr(lua_State *L, struct analyzer *A, int start_slot, int slot, bool by_parent) {
+	size_t n = A->obj_n;
+	uint32_t *start = new_work(L, A, start_slot, n + 1);
+	uint32_t *list = new_work(L, A, slot, A->edge_n);
+	memset(start, 0, (n + 1) * sizeof(uint32_t));
+	size_t i;
+	for (i=0;i<A->edge_n;i++) {
+		uint32_t v = by_parent ? A->edge[i].from : A->edge[i].child;
+		++start[v + 1];
+	}
+	for (i=0;i<n;i++) {
+		start[i + 1] += start[i];
+	}
+	// fill with start[v] as the cursor, then shift back
+	for (i=0;i<A->edge_n;i++) {
+		uint32_t v = by_parent ? A->edge[i].from : A->edge[i].child;
+		list[start[v]++] = (uint32_t)i;
+	}
+	for (i=n;i>0;i--) {
+		start[i] = start[i - 1];
+	}
+	start[0] = 0;
+}
+
+static void
+resolve_edges(struct analyzer *A) {
+	size_t i;
+	for (i=0;i<A->edge_n;i++) {
+		struct edge *e = &A->edge[i];
+		uint32_t from = e->parent ? map_find(&A->index, e->parent) : NONE;
+		e->from = (from == NONE) ? 0 : from;
+	}
+}
+
+static inline uint32_t
+eval(uint32_t *ancestor, uint32_t *label, const uint32_t *semi, uint32_t *stack, uint32_t v) {
+	if (ancestor[v] == NONE)
+		return v;
+	// compress the path to the root of v's tree in the forest, without recursion
+	int sp = 0;
+	uint32_t u = v;
+	while (ancestor[ancestor[u]] != NONE) {
+		stack[sp++] = u;
+		u = ancestor[u];
+	}
+	while (sp > 0) {
+		uint32_t x = stack[--sp];
+		uint32_t a = ancestor[x];
+		if (semi[label[a]] < semi[label[x]])
+			label[x] = label[a];
+		ancestor[x] = ancestor[a];
+	}
+	return label[v];
+}
+
+// Lengauer-Tarjan. Objects not reachable from the root (cycles without a known
+// parent) start another dfs tree under the root. Leaves the objects in dfs order
+// in W_VERTEX and the dominator of each object in W_IDOM.
+static void
+dominators(lua_State *L, struct analyzer *A) {
+	uint32_t n = (uint32_t)A->obj_n;
+	const uint32_t *succ_start = A->work[W_SUCC_START];
+	const uint32_t *succ = A->work[W_SUCC];
+	const uint32_t *pred_start = A->work[W_PRED_START];
+	const uint32_t *pred = A->work[W_PRED];
+	uint32_t *dfn = new_work(L, A, W_DFN, n);
+	uint32_t *vertex = new_work(L, A, W_VERTEX, n);
+	uint32_t *parent = new_work(L, A, W_PARENT, n);
+	uint32_t *semi = new_work(L, A, W_SEMI, n);
+	uint32_t *idom = new_work(L, A, W_IDOM, n);
+	uint32_t *ancestor = new_work(L, A, W_ANCESTOR, n);
+	uint32_t *label = new_work(L, A, W_LABEL, n);
+	uint32_t *bucket = new_work(L, A, W_BUCKET, n);
+	uint32_t *chain = new_work(L, A, W_CHAIN, n);
+	uint32_t *stack = new_work(L, A, W_STACK, n);
+	// the dfs keeps (object, next succ) pairs, in label and ancestor before they are used
+	uint32_t *stack_iter = label;
+	uint32_t *stack_node = ancestor;
+
+	uint32_t i;
+	for (i=0;i<n;i++) {
+		dfn[i] = NONE;
+	}
+	uint32_t r = 0;
+	uint32_t start;
+	for (start=0;start<n;start++) {
+		if (dfn[start] != NONE)
+			continue;
+		dfn[start] = r;
+		vertex[r] = start;
+		parent[r] = 0;
+		++r;
+		int sp = 0;
+		stack_node[sp] = start;
+		stack_iter[sp] = succ_start[start];
+		++sp;
+		while (sp > 0) {
+			uint32_t v = stack_node[sp - 1];
+			uint32_t it = stack_iter[sp - 1];
+			if (it == succ_start[v + 1]) {
+				--sp;
+				continue;
+			}
+			stack_iter[sp - 1] = it + 1;
+			uint32_t w = A->edge[succ[it]].child;
+			if (dfn[w] == NONE) {
+				dfn[w] = r;
+				vertex[r] = w;
+				parent[r] = dfn[v];
+				++r;
+				stack_node[sp] = w;
+				stack_iter[sp] = succ_start[w];
+				++sp;
+			}
+		}
+	}
+
+	// nodes are dfs numbers from here
+	for (i=0;i<n;i++) {
+		semi[i] = i;
+		label[i] = i;
+		ancestor[i] = NONE;
+		bucket[i] = NONE;
+		idom[i] = 0;
+	}
+	uint32_t w;
+	for (w=n-1;w>0;w--) {
+		uint32_t node = vertex[w];
+		uint32_t pw = parent[w];
+		uint32_t p;
+		if (pw == 0) {
+			// an edge of the root, or the start of a dfs tree
+			semi[w] = 0;
+		} else {
+			for (p = pred_start[node]; p < pred_start[node + 1]; p++) {
+				uint32_t u = eval(ancestor, label, semi, stack, dfn[A->edge[pred[p]].from]);
+				if (semi[u] < semi[w])
+					semi[w] = semi[u];
+			}
+		}
+		chain[w] = bucket[semi[w]];
+		bucket[semi[w]] = w;
+		ancestor[w] = pw;
+		uint32_t v;
+		for (v = bucket[pw]; v != NONE; v = chain[v]) {
+			uint32_t u = eval(ancestor, label, semi, stack, v);
+			idom[v] = semi[u] < semi[v] ? u : pw;
+		}
+		bucket[pw] = NONE;
+	}
+	for (w=1;w<n;w++) {
+		if (idom[w] != semi[w])
+			idom[w] = idom[idom[w]];
+	}
+
+	// back to objects
+	for (w=0;w<n;w++) {
+		parent[vertex[w]] = vertex[idom[w]];
+	}
+	memcpy(idom, parent, n * sizeof(uint32_t));
+}
+
+static void
+retained_size(lua_State *L, struct analyzer *A) {
+	size_t n = A->obj_n;
+	const uint32_t *vertex = A->work[W_VERTEX];
+	const uint32_t *idom = A->work[W_IDOM];
+	A->retained = (uint64_t *)malloc(n * sizeof(uint64_t));
+	if (A->retained == NULL)
+		luaL_error(L, "snapshot: out of memory");
+	size_t i;
+	for (i=0;i<n;i++) {
+		A->retained[i] = A->obj[i].size;
+	}
+	// a dominator comes before the objects it dominates in dfs order
+	for (i=n-1;i>0;i--) {
+		uint32_t v = vertex[i];
+		A->retained[idom[v]] += A->retained[v];
+	}
+}
+
+// The edge to each object on a shortest path from the root, in W_PARENT. NONE
+// for the root and the objects not reachable from it that start a path.
+static void
+shortest_path(lua_State *L, struct analyzer *A) {
+	uint32_t n = (uint32_t)A->obj_n;
+	const uint32_t *succ_start = A->work[W_SUCC_START];
+	const uint32_t *succ = A->work[W_SUCC];
+	const uint32_t *vertex = A->work[W_VERTEX];
+	uint32_t *by = new_work(L, A, W_PARENT, n);
+	uint32_t *queue = new_work(L, A, W_SEMI, n);
+	uint32_t *seen = new_work(L, A, W_ANCESTOR, n);
+	uint32_t i;
+	for (i=0;i<n;i++) {
+		by[i] = NONE;
+		seen[i] = 0;
+	}
+	uint32_t head = 0, tail = 0;
+	// in dfs order, the first object of each dfs tree is not seen by the trees before
+	for (i=0;i<n;i++) {
+		uint32_t s = vertex[i];
+		if (seen[s])
+			continue;
+		seen[s] = 1;
+		queue[tail++] = s;
+		while (head < tail) {
+			uint32_t v = queue[head++];
+			uint32_t p;
+			for (p = succ_start[v]; p < succ_start[v + 1]; p++) {
+				uint32_t e = succ[p];
+				uint32_t w = A->edge[e].child;
+				if (!seen[w]) {
+					seen[w] = 1;
+					by[w] = e;
+					queue[tail++] = w;
+				}
+			}
+		}
+	}
+}
+
+/* Report */
+
+static void
+path_add(lua_State *L, struct analyzer *A, size_t *n, const char *s, size_t sz) {
+	A->path = (char *)grow_array(L, A->path, &A->path_cap, *n + sz + 1, 1);
+	memcpy(A->path + *n, s, sz);
+	*n += sz;
+	A->path[*n] = '\0';
+}
+
+static inline void
+path_addstring(lua_State *L, struct analyzer *A, size_t *n, const char *s) {
+	path_add(L, A, n, s, strlen(s));
+}
+
+// short type names of lsnapshot
+static void
+path_type(lua_State *L, struct analyzer *A, size_t *n, uint32_t v) {
+	const struct object *o = &A->obj[v];
+	switch (o->type) {
+	case SNAPSHOT_TYPE_TABLE:
+		path_addstring(L, A, n, "(T)");
+		break;
+	case SNAPSHOT_TYPE_USERDATA:
+		path_addstring(L, A, n, "(U)");
+		break;
+	case SNAPSHOT_TYPE_CFUNCTION:
+		path_addstring(L, A, n, "(C)");
+		break;
+	case SNAPSHOT_TYPE_THREAD:
+		path_addstring(L, A, n, "(S)");
+		break;
+	case SNAPSHOT_TYPE_STRING:
+		path_addstring(L, A, n, "(A)");
+		break;
+	default:
+		path_addstring(L, A, n, "(L@");
+		if (o->source != NONE)
+			path_addstring(L, A, n, pool_string(&A->str, o->source));
+		path_addstring(L, A, n, ")");
+		break;
+	}
+}
+
+// when normalized, array indices become [#] and object keys lose their address,
+// so the elements of a container fall in one group
+static void
+path_field(lua_State *L, struct analyzer *A, size_t *n, const char *desc, bool normalize) {
+	if (normalize && desc[0] == '[') {
+		const char *c = desc + 1;
+		if (isdigit((unsigned char)*c) || *c == '-' || *c == '.'
+			|| strncmp(c, "inf", 3) == 0 || strncmp(c, "nan", 3) == 0) {
+			path_addstring(L, A, n, "[#]");
+			return;
+		}
+		const char *addr = strstr(c, ":0x");
+		size_t sz = strlen(desc);
+		if (addr && desc[sz - 1] == ']') {
+			path_add(L, A, n, desc, addr - desc);
+			path_addstring(L, A, n, "]");
+			return;
+		}
+	}
+	path_addstring(L, A, n, desc);
+}
+
+static void
+path_address(lua_State *L, struct analyzer *A, size_t *n, uint64_t addr) {
+	char tmp[32];
+	snprintf(tmp, sizeof(tmp), "{%p}", (void *)(uintptr_t)addr);
+	path_addstring(L, A, n, tmp);
+}
+
+// Root->(T)field->... of the shortest path to v, in A->path
+static size_t
+build_path(lua_State *L, struct analyzer *A, uint32_t v, bool normalize) {
+	const uint32_t *by = A->work[W_PARENT];
+	uint32_t chain[PATH_DEPTH];
+	int depth = 0;
+	size_t n = 0;
+	uint32_t x = v;
+	for (;;) {
+		uint32_t e = by[x];
+		if (e == NONE) {
+			// not reachable from the root
+			path_address(L, A, &n, A->obj[x].addr);
+			break;
+		}
+		if (depth == PATH_DEPTH) {
+			path_addstring(L, A, &n, "!PathTooDeep...!");
+			break;
+		}
+		chain[depth++] = e;
+		const struct edge *ed = &A->edge[e];
+		if (ed->from == 0) {
+			if (ed->parent == 0) {
+				path_addstring(L, A, &n, "Root");
+			} else {
+				path_address(L, A, &n, ed->parent);
+			}
+			break;
+		}
+		x = ed->from;
+	}
+	while (depth > 0) {
+		const struct edge *ed = &A->edge[chain[--depth]];
+		path_addstring(L, A, &n, "->");
+		path_type(L, A, &n, ed->child);
+		path_field(L, A, &n, pool_string(&A->str, ed->desc), normalize);
+	}
+	return n;
+}
+
+static int
+group_compare(const void *a, const void *b) {
+	const struct group *ga = (const struct group *)a;
+	const struct group *gb = (const struct group *)b;
+	if (ga->retained != gb->retained)
+		return ga->retained < gb->retained ? 1 : -1;
+	if (ga->size != gb->size)
+		return ga->size < gb->size ? 1 : -1;
+	return 0;
+}
+
+static int
+top_compare(const void *a, const void *b) {
+	const struct top_item *ta = (const struct top_item *)a;
+	const struct top_item *tb = (const struct top_item *)b;
+	if (ta->retained != tb->retained)
+		return ta->retained < tb->retained ? 1 : -1;
+	return ta->object < tb->object ? -1 : (ta->object > tb->object);
+}
+
+// keeps the k largest in a min heap
+static void
+top_push(struct top_item *heap, int *n, int k, uint64_t retained, uint32_t object) {
+	int i;
+	if (*n < k) {
+		i = (*n)++;
+		while (i > 0) {
+			int p = (i - 1) / 2;
+			if (heap[p].retained <= retained)
+				break;
+			heap[i] = heap[p];
+			i = p;
+		}
+	} else if (k > 0 && retained > heap[0].retained) {
+		i = 0;
+		for (;;) {
+			int c = i * 2 + 1;
+			if (c >= k)
+				break;
+			if (c + 1 < k && heap[c + 1].retained < heap[c].retained)
+				++c;
+			if (heap[c].retained >= retained)
+				break;
+			heap[i] = heap[c];
+			i = c;
+		}
+	} else {
+		return;
+	}
+	heap[i].retained = retained;
+	heap[i].object = object;
+}
+
+static void
+set_integer(lua_State *L, const char *key, uint64_t v) {
+	lua_pushinteger(L, (lua_Integer)v);
+	lua_setfield(L, -2, key);
+}
+
+static void
+report(lua_State *L, struct analyzer *A, bool has_begin, int top) {
+	uint32_t n = (uint32_t)A->obj_n;
+	const uint32_t *vertex = A->work[W_VERTEX];
+	const uint32_t *idom = A->work[W_IDOM];
+	uint32_t *isnew = new_work(L, A, W_LABEL, n);
+	uint32_t *newabove = new_work(L, A, W_BUCKET, n);
+	struct top_item *heap = (struct top_item *)lua_newuserdata(L, sizeof(struct top_item) * (top > 0 ? top : 1));
+	int heap_n = 0;
+	uint64_t total = 0, new_size = 0, new_retained = 0, new_n = 0;
+	uint32_t i;
+	isnew[0] = 0;
+	for (i=1;i<n;i++) {
+		isnew[i] = !has_begin || map_find(&A->begin, A->obj[i].addr) == NONE;
+		total += A->obj[i].size;
+	}
+	// whether any dominator of an object is new, dominators come first in dfs order
+	newabove[0] = 0;
+	for (i=1;i<n;i++) {
+		uint32_t v = vertex[i];
+		uint32_t d = idom[v];
+		newabove[v] = isnew[d] || newabove[d];
+	}
+	for (i=1;i<n;i++) {
+		if (!isnew[i])
+			continue;
+		const struct object *o = &A->obj[i];
+		// only the new objects not dominated by another new one count as retained,
+		// or a new container would be counted again by each new element, also
+		// through old objects between them
+		uint64_t retained = newabove[i] ? 0 : A->retained[i];
+		++new_n;
+		new_size += o->size;
+		new_retained += retained;
+
+		size_t sz = build_path(L, A, i, true);
+		uint64_t path = pool_intern(L, &A->str, A->path, sz);
+		uint32_t g = map_find(&A->group_index, path + 1);
+		if (g == NONE) {
+			A->group = (struct group *)grow_array(L, A->group, &A->group_cap, A->group_n, sizeof(struct group));
+			g = (uint32_t)A->group_n++;
+			memset(&A->group[g], 0, sizeof(struct group));
+			A->group[g].path = (uint32_t)path;
+			map_insert(L, &A->group_index, path + 1, g);
+		}
+		struct group *gp = &A->group[g];
+		++gp->count;
+		gp->size += o->size;
+		gp->retained += retained;
+
+		top_push(heap, &heap_n, top, A->retained[i], i);
+	}
+	if (A->group_n > 0)
+		qsort(A->group, A->group_n, sizeof(struct group), group_compare);
+	if (heap_n > 0)
+		qsort(heap, heap_n, sizeof(struct top_item), top_compare);
+
+	lua_createtable(L, 0, 8);
+	set_integer(L, "objects", n - 1);
+	set_integer(L, "size", total);
+	set_integer(L, "new_objects", new_n);
+	set_integer(L, "new_size", new_size);
+	set_integer(L, "new_retained", new_retained);
+	set_integer(L, "group_count", A->group_n);
+
+	int group_n = A->group_n < (size_t)top ? (int)A->group_n : top;
+	lua_createtable(L, group_n, 0);
+	int k;
+	for (k=0;k<group_n;k++) {
+		const struct group *gp = &A->group[k];
+		lua_createtable(L, 0, 4);
+		lua_pushstring(L, pool_string(&A->str, gp->path));
+		lua_setfield(L, -2, "path");
+		set_integer(L, "count", gp->count);
+		set_integer(L, "size", gp->size);
+		set_integer(L, "retained", gp->retained);
+		lua_rawseti(L, -2, k + 1);
+	}
+	lua_setfield(L, -2, "groups");
+
+	lua_createtable(L, heap_n, 0);
+	for (k=0;k<heap_n;k++) {
+		uint32_t v = heap[k].object;
+		const struct object *o = &A->obj[v];
+		lua_createtable(L, 0, 5);
+		lua_pushlightuserdata(L, (void *)(uintptr_t)o->addr);
+		lua_setfield(L, -2, "addr");
+		size_t sz = 0;
+		path_type(L, A, &sz, v);
+		lua_pushlstring(L, A->path, sz);
+		lua_setfield(L, -2, "type");
+		set_integer(L, "size", o->size);
+		set_integer(L, "retained", A->retained[v]);
+		sz = build_path(L, A, v, false);
+		lua_pushlstring(L, A->path, sz);
+		lua_setfield(L, -2, "path");
+		lua_rawseti(L, -2, k + 1);
+	}
+	lua_setfield(L, -2, "top");
+	lua_remove(L, -2);	// heap
+}
+
+static void
+analyzer_free(struct analyzer *A) {
+	free(A->obj);
+	free(A->edge);
+	map_free(&A->index);
+	map_free(&A->begin);
+	free(A->str.buf);
+	map_free(&A->str.index);
+	free(A->str.offset);
+	free(A->str.next);
+	int i;
+	for (i=0;i<W_COUNT;i++) {
+		free(A->work[i]);
+	}
+	free(A->retained);
+	free(A->group);
+	map_free(&A->group_index);
+	free(A->path);
+	if (A->f)
+		fclose(A->f);
+	memset(A, 0, sizeof(*A));
+}
+
+static int
+analyzer_gc(lua_State *L) {
+	analyzer_free((struct analyzer *)lua_touserdata(L, 1));
+	return 0;
+}
+
+/*
+** snapshot.diff(begin, end [, top]), begin and end are tables of
+** snapshot.snapshot or files of snapshot.dump, begin can be nil to take every
+** object of end as new. Returns
+**   { objects, size, new_objects, new_size, new_retained, group_count,
+**     groups = { { path, count, size, retained } ... },
+**     top = { { addr, type, size, retained, path } ... } }
+** groups are the new objects by their path from the root, top are the new
+** objects of the largest retained size; both sorted and limited to top (32).
+*/
+int
+snapshot_diff(lua_State *L) {
+	int top = (int)luaL_optinteger(L, 3, DEFAULT_TOP);
+	if (top < 0)
+		top = 0;
+	bool has_begin = !lua_isnoneornil(L, 1);
+	lua_settop(L, 2);
+	struct analyzer *A = (struct analyzer *)lua_newuserdata(L, sizeof(struct analyzer));
+	memset(A, 0, sizeof(*A));
+	if (luaL_newmetatable(L, ANALYZER_METANAME)) {
+		lua_pushcfunction(L, analyzer_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	add_object(L, A, 0, 0, 0, NONE);	// the root
+	if (has_begin)
+		load(L, A, 1, false);
+	load(L, A, 2, true);
+	resolve_edges(A);
+	build_csr(L, A, W_SUCC_START, W_SUCC, true);
+	build_csr(L, A, W_PRED_START, W_PRED, false);
+	dominators(L, A);
+	retained_size(L, A);
+	shortest_path(L, A);
+	report(L, A, has_begin, top);
+	analyzer_free(A);
+	return 1;
+}
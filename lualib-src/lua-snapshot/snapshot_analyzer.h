@@ -0,0 +1,9 @@
+#ifndef snapshot_analyzer_h
+#define snapshot_analyzer_h
+
+#include <lua.h>
+
+// snapshot.diff(begin, end [, top]), see snapshot_analyzer.c
+int snapshot_diff(lua_State *L);
+
+#endif
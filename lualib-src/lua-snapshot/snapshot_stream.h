@@ -0,0 +1,34 @@
+#ifndef snapshot_stream_h
+#define snapshot_stream_h
+
+// Record stream of snapshot.dump, in native byte order.
+//
+//   header  char magic[4] = "LSNP", uint32 version
+//   object  uint8 'o', uint8 type, uint64 addr, uint64 size
+//   edge    uint8 'e', uint64 parent, uint64 child, uint16 len, char desc[len]
+//   source  uint8 's', uint64 addr, uint32 len, char text[len]
+//   end     uint8 'z', uint64 objects, uint64 edges
+//
+// An object comes before the edges to it. The first edge of an object is the
+// path it is found by, parent 0 is the root (the registry). Source is the
+// definition of a lua function or the traceback of a thread. A file without
+// the end record is truncated.
+
+#define SNAPSHOT_STREAM_MAGIC "LSNP"
+#define SNAPSHOT_STREAM_VERSION 1
+
+#define SNAPSHOT_RECORD_OBJECT 'o'
+#define SNAPSHOT_RECORD_EDGE 'e'
+#define SNAPSHOT_RECORD_SOURCE 's'
+#define SNAPSHOT_RECORD_END 'z'
+
+#define SNAPSHOT_TYPE_TABLE 1
+#define SNAPSHOT_TYPE_FUNCTION 2
+#define SNAPSHOT_TYPE_CFUNCTION 3
+#define SNAPSHOT_TYPE_THREAD 4
+#define SNAPSHOT_TYPE_USERDATA 5
+#define SNAPSHOT_TYPE_STRING 6
+
+#define SNAPSHOT_DESC_MAX 0xffff
+
+#endif
@@ -0,0 +1,595 @@
+// Counted B+tree: inner nodes keep the number of entries under each child, so
+// rank lookups descend one root-to-leaf path, and range scans walk contiguous
+// leaf arrays instead of chasing one pointer per entry.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+
+#define BTREE_LEAF_MIN (BTREE_LEAF_MAX / 4)
+#define BTREE_INNER_MIN (BTREE_INNER_MAX / 4)
+
+/* inner nodes from the root down to the leaf, and the child taken in each */
+typedef struct btPath {
+    btInner *nodes[BTREE_MAXHEIGHT];
+    int idx[BTREE_MAXHEIGHT];
+} btPath;
+
+static int btCompareObj(const slobj *a, const slobj *b) {
+    int cmp = memcmp(a->ptr, b->ptr, a->length <= b->length ? a->length : b->length);
+    if (cmp != 0) return cmp;
+    return a->length < b->length ? -1 : (a->length > b->length ? 1 : 0);
+}
+
+/* order by score, then timestamp, then member */
+static int btCompare(const btEntry *e, double score, const slobj *obj, double timestamp) {
+    if (e->score != score) return e->score < score ? -1 : 1;
+    if (e->timestamp != timestamp) return e->timestamp < timestamp ? -1 : 1;
+    return btCompareObj(e->obj, obj);
+}
+
+static btLeaf *btLeafCreate(void) {
+    btLeaf *leaf = malloc(sizeof(*leaf));
+    leaf->n = 0;
+    leaf->prev = leaf->next = NULL;
+    return leaf;
+}
+
+static btInner *btInnerCreate(void) {
+    btInner *in = malloc(sizeof(*in));
+    in->n = 0;
+    in->keys[0].obj = NULL;
+    return in;
+}
+
+btree *btCreate(void) {
+    btree *bt = malloc(sizeof(*bt));
+    bt->root = btLeafCreate();
+    bt->height = 0;
+    bt->length = 0;
+    bt->head = bt->tail = bt->root;
+    return bt;
+}
+
+static void btFreeNode(void *node, int height) {
+    int i;
+    if (height == 0) {
+        btLeaf *leaf = node;
+        for (i = 0; i < leaf->n; i++)
+            slFreeObj(leaf->entries[i].obj);
+    } else {
+        btInner *in = node;
+        for (i = 0; i < in->n; i++) {
+            if (i > 0) slFreeObj(in->keys[i].obj);
+            btFreeNode(in->children[i], height - 1);
+        }
+    }
+    free(node);
+}
+
+void btFree(btree *bt) {
+    btFreeNode(bt->root, bt->height);
+    free(bt);
+}
+
+/* child holding key: the last one whose lower bound is <= key */
+static int btInnerFind(const btInner *in, double score, const slobj *obj, double timestamp) {
+    int lo = 1, hi = in->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (btCompare(&in->keys[mid], score, obj, timestamp) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/* first entry of leaf >= key */
+static int btLeafFind(const btLeaf *leaf, double score, const slobj *obj, double timestamp) {
+    int lo = 0, hi = leaf->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (btCompare(&leaf->entries[mid], score, obj, timestamp) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* descend to the leaf that holds key, rank receives the entries left of it */
+static btLeaf *btDescend(btree *bt, double score, const slobj *obj, double timestamp, btPath *path, unsigned long *rank) {
+    void *node = bt->root;
+    unsigned long r = 0;
+    int h, i, j;
+    for (h = 0; h < bt->height; h++) {
+        btInner *in = node;
+        i = btInnerFind(in, score, obj, timestamp);
+        for (j = 0; j < i; j++)
+            r += in->counts[j];
+        path->nodes[h] = in;
+        path->idx[h] = i;
+        node = in->children[i];
+    }
+    if (rank) *rank = r;
+    return node;
+}
+
+/* descend to the entry of 1-based rank, which must exist */
+static btLeaf *btDescendRank(btree *bt, unsigned long rank, btPath *path, int *pos) {
+    void *node = bt->root;
+    unsigned long r = rank - 1;
+    int h, i;
+    for (h = 0; h < bt->height; h++) {
+        btInner *in = node;
+        for (i = 0; r >= in->counts[i]; i++)
+            r -= in->counts[i];
+        path->nodes[h] = in;
+        path->idx[h] = i;
+        node = in->children[i];
+    }
+    *pos = (int)r;
+    return node;
+}
+
+static void btInnerInsert(btInner *in, int at, btEntry key, void *child, unsigned long count) {
+    int move = in->n - at;
+    memmove(&in->keys[at+1], &in->keys[at], move * sizeof(btEntry));
+    memmove(&in->children[at+1], &in->children[at], move * sizeof(void*));
+    memmove(&in->counts[at+1], &in->counts[at], move * sizeof(unsigned long));
+    in->keys[at] = key;
+    in->children[at] = child;
+    in->counts[at] = count;
+    in->n++;
+}
+
+static unsigned long btInnerCount(const btInner *in) {
+    unsigned long n = 0;
+    int i;
+    for (i = 0; i < in->n; i++)
+        n += in->counts[i];
+    return n;
+}
+
+static btLeaf *btLeafSplit(btree *bt, btLeaf *leaf, int mid) {
+    btLeaf *right = btLeafCreate();
+    right->n = leaf->n - mid;
+    memcpy(right->entries, &leaf->entries[mid], right->n * sizeof(btEntry));
+    leaf->n = mid;
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next)
+        leaf->next->prev = right;
+    else
+        bt->tail = right;
+    leaf->next = right;
+    return right;
+}
+
+void btInsert(btree *bt, double score, slobj *obj, double timestamp) {
+    btPath path;
+    btLeaf *leaf, *right, *target;
+    btEntry sep;
+    void *child;
+    unsigned long lcount, rcount;
+    int h, pos, append;
+
+    /* we assume the key is not already inside, see slInsert */
+    leaf = btDescend(bt, score, obj, timestamp, &path, NULL);
+    for (h = 0; h < bt->height; h++)
+        path.nodes[h]->counts[path.idx[h]]++;
+
+    pos = btLeafFind(leaf, score, obj, timestamp);
+    /* ascending inserts leave full nodes behind instead of half full ones */
+    append = leaf == bt->tail && pos == leaf->n;
+    target = leaf;
+    right = NULL;
+    if (leaf->n == BTREE_LEAF_MAX) {
+        right = btLeafSplit(bt, leaf, append ? leaf->n : leaf->n / 2);
+        if (pos >= leaf->n) {
+            pos -= leaf->n;
+            target = right;
+        }
+    }
+    memmove(&target->entries[pos+1], &target->entries[pos], (target->n - pos) * sizeof(btEntry));
+    target->entries[pos].score = score;
+    target->entries[pos].timestamp = timestamp;
+    target->entries[pos].obj = obj;
+    target->n++;
+    bt->length++;
+
+    if (right == NULL)
+        return;
+
+    /* hand the split up, the separator owns a copy of the member */
+    sep = right->entries[0];
+    sep.obj = slCreateObj(sep.obj->ptr, sep.obj->length);
+    child = right;
+    lcount = leaf->n;
+    rcount = right->n;
+    for (h = bt->height - 1; h >= 0; h--) {
+        btInner *in = path.nodes[h], *rin;
+        int i = path.idx[h], mid;
+        in->counts[i] = lcount;
+        if (in->n < BTREE_INNER_MAX) {
+            btInnerInsert(in, i + 1, sep, child, rcount);
+            return;
+        }
+
+        /* split a full inner node, keys[mid] moves up */
+        rin = btInnerCreate();
+        mid = append ? in->n - 1 : in->n / 2;
+        rin->n = in->n - mid;
+        memcpy(rin->keys, &in->keys[mid], rin->n * sizeof(btEntry));
+        memcpy(rin->children, &in->children[mid], rin->n * sizeof(void*));
+        memcpy(rin->counts, &in->counts[mid], rin->n * sizeof(unsigned long));
+        in->n = mid;
+        if (i < mid)
+            btInnerInsert(in, i + 1, sep, child, rcount);
+        else
+            btInnerInsert(rin, i + 1 - mid, sep, child, rcount);
+
+        sep = rin->keys[0];
+        rin->keys[0].obj = NULL;
+        child = rin;
+        lcount = btInnerCount(in);
+        rcount = btInnerCount(rin);
+    }
+
+    /* the root was split */
+    btInner *root = btInnerCreate();
+    root->n = 2;
+    root->children[0] = bt->root;
+    root->counts[0] = lcount;
+    root->children[1] = child;
+    root->counts[1] = rcount;
+    root->keys[1] = sep;
+    bt->root = root;
+    bt->height++;
+}
+
+/* Bulk append: entries go to the tail leaf, and a full node is closed and a
+ * new one started to its right, so every node but the right spine is full.
+ * The count of the last child of each spine node is fixed when that child is
+ * closed or in btBulkEnd, O(1) amortized per entry. Nothing else may change
+ * the tree between btBulkBegin and btBulkEnd. */
+void btBulkBegin(btBulk *b, btree *bt) {
+    void *node = bt->root;
+    int h;
+
+    b->bt = bt;
+    for (h = 0; h < bt->height; h++) {
+        btInner *in = node;
+        b->spine[h] = in;
+        node = in->children[in->n - 1];
+    }
+}
+
+/* Returns 0 without taking obj when it does not sort after the tail. */
+int btBulkAppend(btBulk *b, double score, slobj *obj, double timestamp) {
+    btree *bt = b->bt;
+    btLeaf *tail = bt->tail, *leaf;
+    btEntry sep;
+    void *child;
+    unsigned long count;
+    int h;
+
+    if (bt->length > 0 &&
+        (tail->n == 0 || btCompare(&tail->entries[tail->n-1], score, obj, timestamp) >= 0))
+        return 0;
+
+    bt->length++;
+    if (tail->n < BTREE_LEAF_MAX) {
+        btEntry *e = &tail->entries[tail->n++];
+        e->score = score;
+        e->timestamp = timestamp;
+        e->obj = obj;
+        return 1;
+    }
+
+    /* the tail is closed, a new leaf starts with the entry */
+    leaf = btLeafCreate();
+    leaf->entries[0].score = score;
+    leaf->entries[0].timestamp = timestamp;
+    leaf->entries[0].obj = obj;
+    leaf->n = 1;
+    leaf->prev = tail;
+    tail->next = leaf;
+    bt->tail = leaf;
+
+    /* hand the new node up the spine, the separator owns a copy of the member */
+    sep = leaf->entries[0];
+    sep.obj = slCreateObj(obj->ptr, obj->length);
+    child = leaf;
+    count = tail->n;
+    for (h = bt->height - 1; h >= 0; h--) {
+        btInner *in = b->spine[h], *rin;
+        in->counts[in->n - 1] = count;
+        if (in->n < BTREE_INNER_MAX) {
+            in->keys[in->n] = sep;
+            in->children[in->n] = child;
+            in->counts[in->n] = 0;
+            in->n++;
+            return 1;
+        }
+
+        /* in is closed too, child starts a new node whose lower bound is sep */
+        count = btInnerCount(in);
+        rin = btInnerCreate();
+        rin->n = 1;
+        rin->children[0] = child;
+        rin->counts[0] = 0;
+        b->spine[h] = rin;
+        child = rin;
+    }
+
+    /* the root was closed */
+    btInner *root = btInnerCreate();
+    root->n = 2;
+    root->children[0] = bt->root;
+    root->counts[0] = count;
+    root->children[1] = child;
+    root->counts[1] = 0;
+    root->keys[1] = sep;
+    memmove(&b->spine[1], &b->spine[0], bt->height * sizeof(btInner*));
+    b->spine[0] = root;
+    bt->root = root;
+    bt->height++;
+    return 1;
+}
+
+void btBulkEnd(btBulk *b) {
+    btree *bt = b->bt;
+    unsigned long count = bt->tail->n;
+    int h;
+    for (h = bt->height - 1; h >= 0; h--) {
+        btInner *in = b->spine[h];
+        in->counts[in->n - 1] = count;
+        count = btInnerCount(in);
+    }
+}
+
+/* merge child l + 1 of parent into child l, 0 when they do not fit in one node */
+static int btMerge(btree *bt, btInner *parent, int l, int leaves) {
+    int move;
+    if (leaves) {
+        btLeaf *a = parent->children[l], *b = parent->children[l+1];
+        if (a->n + b->n > BTREE_LEAF_MAX)
+            return 0;
+        memcpy(&a->entries[a->n], b->entries, b->n * sizeof(btEntry));
+        a->n += b->n;
+        a->next = b->next;
+        if (b->next)
+            b->next->prev = a;
+        else
+            bt->tail = a;
+        free(b);
+        slFreeObj(parent->keys[l+1].obj);
+    } else {
+        btInner *a = parent->children[l], *b = parent->children[l+1];
+        if (a->n + b->n > BTREE_INNER_MAX)
+            return 0;
+        /* the parent separator becomes the lower bound of b's first child */
+        b->keys[0] = parent->keys[l+1];
+        memcpy(&a->keys[a->n], b->keys, b->n * sizeof(btEntry));
+        memcpy(&a->children[a->n], b->children, b->n * sizeof(void*));
+        memcpy(&a->counts[a->n], b->counts, b->n * sizeof(unsigned long));
+        a->n += b->n;
+        free(b);
+    }
+
+    parent->counts[l] += parent->counts[l+1];
+    move = parent->n - l - 2;
+    memmove(&parent->keys[l+1], &parent->keys[l+2], move * sizeof(btEntry));
+    memmove(&parent->children[l+1], &parent->children[l+2], move * sizeof(void*));
+    memmove(&parent->counts[l+1], &parent->counts[l+2], move * sizeof(unsigned long));
+    parent->n--;
+    return 1;
+}
+
+/* drop an empty child from parent */
+static void btUnlink(btree *bt, btInner *parent, int i, int leaves) {
+    int k = i > 0 ? i : 1; /* separator that goes with the child */
+    if (leaves) {
+        btLeaf *leaf = parent->children[i];
+        if (leaf->prev)
+            leaf->prev->next = leaf->next;
+        else
+            bt->head = leaf->next;
+        if (leaf->next)
+            leaf->next->prev = leaf->prev;
+        else
+            bt->tail = leaf->prev;
+    }
+    free(parent->children[i]);
+
+    if (k < parent->n) {
+        slFreeObj(parent->keys[k].obj);
+        memmove(&parent->keys[k], &parent->keys[k+1], (parent->n - k - 1) * sizeof(btEntry));
+    }
+    memmove(&parent->children[i], &parent->children[i+1], (parent->n - i - 1) * sizeof(void*));
+    memmove(&parent->counts[i], &parent->counts[i+1], (parent->n - i - 1) * sizeof(unsigned long));
+    parent->n--;
+}
+
+/* remove the entry at pos of the leaf reached through path, obj is not freed */
+static void btRemoveAt(btree *bt, btPath *path, btLeaf *leaf, int pos) {
+    void *node = leaf;
+    int h;
+
+    memmove(&leaf->entries[pos], &leaf->entries[pos+1], (leaf->n - pos - 1) * sizeof(btEntry));
+    leaf->n--;
+    for (h = 0; h < bt->height; h++)
+        path->nodes[h]->counts[path->idx[h]]--;
+    bt->length--;
+
+    /* Going up, drop empty nodes and merge underfull ones into a sibling.
+     * A node whose siblings are too full to merge stays underfull. */
+    for (h = bt->height; h > 0; h--) {
+        btInner *parent = path->nodes[h-1];
+        int i = path->idx[h-1];
+        int leaves = h == bt->height;
+        int n = leaves ? ((btLeaf*)node)->n : ((btInner*)node)->n;
+        if (n == 0)
+            btUnlink(bt, parent, i, leaves);
+        else if (n >= (leaves ? BTREE_LEAF_MIN : BTREE_INNER_MIN))
+            break;
+        else if (!(i > 0 && btMerge(bt, parent, i - 1, leaves)) &&
+            !(i + 1 < parent->n && btMerge(bt, parent, i, leaves)))
+            break;
+        node = parent;
+    }
+
+    while (bt->height > 0 && ((btInner*)bt->root)->n <= 1) {
+        btInner *root = bt->root;
+        bt->root = root->n == 1 ? root->children[0] : btLeafCreate();
+        bt->height = root->n == 1 ? bt->height - 1 : 0;
+        free(root);
+    }
+    if (bt->height == 0)
+        bt->head = bt->tail = bt->root;
+}
+
+int btDelete(btree *bt, double score, slobj *obj, double timestamp) {
+    btPath path;
+    btLeaf *leaf = btDescend(bt, score, obj, timestamp, &path, NULL);
+    int pos = btLeafFind(leaf, score, obj, timestamp);
+    if (pos >= leaf->n || btCompare(&leaf->entries[pos], score, obj, timestamp) != 0)
+        return 0; /* not found */
+
+    slobj *found = leaf->entries[pos].obj;
+    btRemoveAt(bt, &path, leaf, pos);
+    slFreeObj(found);
+    return 1;
+}
+
+/* remove the entry of 1-based rank, which must exist, and pass it to cb */
+static void btDeleteRank(btree *bt, unsigned long rank, btDeleteCb cb, void* ud) {
+    btPath path;
+    int pos;
+    btLeaf *leaf = btDescendRank(bt, rank, &path, &pos);
+    slobj *obj = leaf->entries[pos].obj;
+    btRemoveAt(bt, &path, leaf, pos);
+    cb(ud, obj);
+    slFreeObj(obj);
+}
+
+/* number of entries with score < min, or <= max when inclusive */
+static unsigned long btCountBelow(btree *bt, double bound, int inclusive) {
+    void *node = bt->root;
+    unsigned long r = 0;
+    int h, i;
+    for (h = 0; h < bt->height; h++) {
+        btInner *in = node;
+        /* last child whose lower bound is below the bound */
+        for (i = 0; i + 1 < in->n; i++) {
+            double s = in->keys[i+1].score;
+            if (inclusive ? s > bound : s >= bound)
+                break;
+            r += in->counts[i];
+        }
+        node = in->children[i];
+    }
+
+    btLeaf *leaf = node;
+    for (i = 0; i < leaf->n; i++) {
+        double s = leaf->entries[i].score;
+        if (inclusive ? s > bound : s >= bound)
+            break;
+    }
+    return r + i;
+}
+
+/* Delete all the elements with score between min and max.
+ * Both min and max are inclusive. */
+unsigned long btDeleteByScore(btree *bt, double min, double max, btDeleteCb cb, void* ud) {
+    unsigned long first = btCountBelow(bt, min, 0) + 1;
+    unsigned long last = btCountBelow(bt, max, 1);
+    unsigned long removed = 0;
+    while (first + removed <= last) {
+        btDeleteRank(bt, first, cb, ud);
+        removed++;
+    }
+    return removed;
+}
+
+/* Delete all the elements with rank between start and end.
+ * Start and end are inclusive. Note that start and end need to be 1-based */
+unsigned long btDeleteByRank(btree *bt, unsigned int start, unsigned int end, btDeleteCb cb, void* ud) {
+    unsigned long removed = 0;
+    if (start == 0)
+        start = 1;
+    if (end > bt->length)
+        end = bt->length;
+    while (start + removed <= end) {
+        btDeleteRank(bt, start, cb, ud);
+        removed++;
+    }
+    return removed;
+}
+
+/* Find the rank for an element by both score and key.
+ * Returns 0 when the element cannot be found, 1-based rank otherwise. */
+unsigned long btGetRank(btree *bt, double score, slobj *o, double timestamp) {
+    btPath path;
+    unsigned long rank;
+    btLeaf *leaf = btDescend(bt, score, o, timestamp, &path, &rank);
+    int pos = btLeafFind(leaf, score, o, timestamp);
+    if (pos >= leaf->n || btCompare(&leaf->entries[pos], score, o, timestamp) != 0)
+        return 0;
+    return rank + pos + 1;
+}
+
+/* Finds an element by its rank. The rank argument needs to be 1-based. */
+btIter btGetByRank(btree *bt, unsigned long rank) {
+    btIter it = { NULL, 0 };
+    btPath path;
+    if (rank == 0 || rank > bt->length)
+        return it;
+    it.leaf = btDescendRank(bt, rank, &path, &it.i);
+    return it;
+}
+
+/* Find the first entry with score in [min, max]. */
+btIter btFirstInRange(btree *bt, double min, double max) {
+    btIter it = { NULL, 0 };
+    unsigned long below;
+    if (min > max)
+        return it;
+    below = btCountBelow(bt, min, 0);
+    if (below == bt->length)
+        return it;
+    it = btGetByRank(bt, below + 1);
+    if (btIterEntry(it)->score > max)
+        it.leaf = NULL;
+    return it;
+}
+
+/* Find the last entry with score in [min, max]. */
+btIter btLastInRange(btree *bt, double min, double max) {
+    btIter it = { NULL, 0 };
+    unsigned long upto;
+    if (min > max)
+        return it;
+    upto = btCountBelow(bt, max, 1);
+    if (upto == 0)
+        return it;
+    it = btGetByRank(bt, upto);
+    if (btIterEntry(it)->score < min)
+        it.leaf = NULL;
+    return it;
+}
+
+void btDump(btree *bt) {
+    btLeaf *leaf;
+    int i, n = 0;
+    for (leaf = bt->head; leaf; leaf = leaf->next) {
+        for (i = 0; i < leaf->n; i++) {
+            btEntry *e = &leaf->entries[i];
+            printf("node %d: score:%f, member:%s ts:%f\n", ++n, e->score, e->obj->ptr, e->timestamp);
+        }
+    }
+}
@@ -0,0 +1,90 @@
+//
+// order statistics B+tree with the ordering and interface of skiplist.h
+#pragma once
+#include <stdlib.h>
+
+#include "skiplist.h"
+
+#define BTREE_LEAF_MAX 64
+#define BTREE_INNER_MAX 64
+#define BTREE_MAXHEIGHT 16
+
+typedef struct btEntry {
+    double score;
+    double timestamp;
+    slobj *obj;
+} btEntry;
+
+/* entries of a leaf are contiguous and sorted, leaves are chained in order */
+typedef struct btLeaf {
+    int n;
+    struct btLeaf *prev, *next;
+    btEntry entries[BTREE_LEAF_MAX];
+} btLeaf;
+
+/* keys[i] (i > 0) is a lower bound of child i and owns its obj, keys[0] is unused */
+typedef struct btInner {
+    int n;
+    unsigned long counts[BTREE_INNER_MAX]; /* entries under each child */
+    btEntry keys[BTREE_INNER_MAX];
+    void *children[BTREE_INNER_MAX];
+} btInner;
+
+typedef struct btree {
+    void *root;
+    int height; /* inner levels above the leaves */
+    unsigned long length;
+    btLeaf *head, *tail;
+} btree;
+
+/* appends presorted entries at the right edge without searching, see btBulkAppend */
+typedef struct btBulk {
+    btree *bt;
+    btInner *spine[BTREE_MAXHEIGHT]; /* rightmost inner node of each level, root first */
+} btBulk;
+
+/* position of an entry, leaf is NULL past either end */
+typedef struct btIter {
+    btLeaf *leaf;
+    int i;
+} btIter;
+
+typedef void (*btDeleteCb) (void *ud, slobj *obj);
+
+btree *btCreate(void);
+void btFree(btree *bt);
+void btDump(btree *bt);
+
+void btInsert(btree *bt, double score, slobj *obj, double timestamp);
+void btBulkBegin(btBulk *b, btree *bt);
+int btBulkAppend(btBulk *b, double score, slobj *obj, double timestamp);
+void btBulkEnd(btBulk *b);
+int btDelete(btree *bt, double score, slobj *obj, double timestamp);
+unsigned long btDeleteByScore(btree *bt, double min, double max, btDeleteCb cb, void* ud);
+unsigned long btDeleteByRank(btree *bt, unsigned int start, unsigned int end, btDeleteCb cb, void* ud);
+
+unsigned long btGetRank(btree *bt, double score, slobj *o, double timestamp);
+btIter btGetByRank(btree *bt, unsigned long rank);
+
+btIter btFirstInRange(btree *bt, double min, double max);
+btIter btLastInRange(btree *bt, double min, double max);
+
+static inline btEntry *btIterEntry(btIter it) {
+    return &it.leaf->entries[it.i];
+}
+
+static inline btIter btIterNext(btIter it) {
+    if (++it.i >= it.leaf->n) {
+        it.leaf = it.leaf->next;
+        it.i = 0;
+    }
+    return it;
+}
+
+static inline btIter btIterPrev(btIter it) {
+    if (--it.i < 0) {
+        it.leaf = it.leaf->prev;
+        it.i = it.leaf ? it.leaf->n - 1 : 0;
+    }
+    return it;
+}
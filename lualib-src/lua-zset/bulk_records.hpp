@@ -0,0 +1,120 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include "buffer.hpp"
+#include "lua_buffer.hpp"
+#include "lua_utility.hpp"
+#include "mapped_file.hpp"
+
+// Packed records of bulk_load and bulk_dump, shared by snapshots and views.
+enum class record_kind : uint32_t {
+    string = 1, // skiplist.c, skiplist.btree: double score, double ts, uint32 len, bytes
+    int64 = 2, // skiplist.int: double score, double ts, int64 member
+};
+
+constexpr size_t STRING_RECORD_HEAD = sizeof(double) * 2 + sizeof(uint32_t);
+constexpr size_t INT64_RECORD_SIZE = sizeof(double) * 2 + sizeof(int64_t);
+
+struct bulk_record {
+    double score;
+    double timestamp;
+    int64_t member; // int64 kind
+    std::string_view name; // string kind, points into the packed data
+};
+
+// Calls fn(const bulk_record&) per record, returns the number of records or -1
+// when data does not end on a record boundary.
+template<typename Fn>
+inline int64_t for_each_record(std::string_view data, record_kind kind, Fn&& fn) {
+    bulk_record r {};
+    int64_t count = 0;
+    size_t pos = 0;
+    if (kind == record_kind::int64) {
+        if (data.size() % INT64_RECORD_SIZE != 0)
+            return -1;
+        for (; pos < data.size(); pos += INT64_RECORD_SIZE, ++count) {
+            memcpy(&r.score, data.data() + pos, sizeof(double));
+            memcpy(&r.timestamp, data.data() + pos + sizeof(double), sizeof(double));
+            memcpy(&r.member, data.data() + pos + sizeof(double) * 2, sizeof(int64_t));
+            fn(r);
+        }
+        return count;
+    }
+
+    while (data.size() - pos >= STRING_RECORD_HEAD) {
+        uint32_t len;
+        memcpy(&len, data.data() + pos + sizeof(double) * 2, sizeof(len));
+        if (data.size() - pos - STRING_RECORD_HEAD < len)
+            return -1;
+        memcpy(&r.score, data.data() + pos, sizeof(double));
+        memcpy(&r.timestamp, data.data() + pos + sizeof(double), sizeof(double));
+        r.name = data.substr(pos + STRING_RECORD_HEAD, len);
+        fn(r);
+        pos += STRING_RECORD_HEAD + len;
+        ++count;
+    }
+    return pos == data.size() ? count : -1;
+}
+
+inline int64_t count_records(std::string_view data, record_kind kind) {
+    if (kind == record_kind::int64)
+        return data.size() % INT64_RECORD_SIZE == 0 ? static_cast<int64_t>(data.size() / INT64_RECORD_SIZE) : -1;
+    return for_each_record(data, kind, [](const bulk_record&) {});
+}
+
+inline record_kind check_record_kind(lua_State* L, int index) {
+    auto name = pluto::lua_check<std::string_view>(L, index);
+    if (name == "string")
+        return record_kind::string;
+    if (name == "int64")
+        return record_kind::int64;
+    luaL_argerror(L, index, "kind must be 'string' or 'int64'");
+    return record_kind::string;
+}
+
+struct dump_range {
+    unsigned long start; // rank, from 1
+    unsigned long count;
+};
+
+// optional start rank and count of bulk_dump at index 3 and 4, count is
+// clamped to the entries left from start and is 0 past the end
+inline dump_range check_dump_range(lua_State* L, unsigned long length) {
+    lua_Integer start = luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, start >= 1, 3, "start must be >= 1");
+    lua_Integer count = luaL_optinteger(L, 4, LUA_MAXINTEGER);
+    luaL_argcheck(L, count >= 0, 4, "count must be >= 0");
+    if (static_cast<lua_Unsigned>(start) > length)
+        return dump_range { length + 1, 0 };
+    unsigned long left = length - static_cast<unsigned long>(start) + 1;
+    return dump_range { static_cast<unsigned long>(start), static_cast<lua_Unsigned>(count) < left ? static_cast<unsigned long>(count) : left };
+}
+
+// Records read in place from a mapped file, see snapshot.load. The mapping
+// is released by view:close() or when the view is collected.
+constexpr const char* PACKED_VIEW_METANAME = "skiplist.packed_view";
+
+struct packed_view {
+    std::unique_ptr<pluto::mapped_file> file;
+    std::string_view data;
+};
+
+// packed records from a string, a packed view, a buffer lightuserdata or a
+// buffer.to_shared userdata
+inline std::string_view check_packed(lua_State* L, int index) {
+    if (lua_type(L, index) == LUA_TSTRING) {
+        size_t len = 0;
+        const char* data = lua_tolstring(L, index, &len);
+        return std::string_view { data, len };
+    }
+    if (auto view = static_cast<packed_view*>(luaL_testudata(L, index, PACKED_VIEW_METANAME))) {
+        if (nullptr == view->file)
+            luaL_argerror(L, index, "closed view");
+        return view->data;
+    }
+    pluto::buffer* b = pluto::lua_check_buffer(L, index);
+    return std::string_view { b->data(), b->size() };
+}
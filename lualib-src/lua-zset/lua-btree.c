@@ -0,0 +1,293 @@
+// skiplist.c compatible binding of the B+tree, see btree.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "btree.h"
+#include "lua_skiplist_bulk.h"
+
+static inline btree*
+_to_btree(lua_State *L) {
+    btree **bt = lua_touserdata(L, 1);
+    if(bt==NULL) {
+        luaL_error(L, "must be btree object");
+    }
+    return *bt;
+}
+
+static int
+_insert(lua_State *L) {
+    btree *bt = _to_btree(L);
+    double score = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TSTRING);
+    size_t len;
+    const char* ptr = lua_tolstring(L, 3, &len);
+    slobj *obj = slCreateObj(ptr, len);
+    double timestamp = luaL_optnumber(L, 4, 0);
+    btInsert(bt, score, obj, timestamp);
+    return 0;
+}
+
+static int
+_delete(lua_State *L) {
+    btree *bt = _to_btree(L);
+    double score = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TSTRING);
+    slobj obj;
+    obj.ptr = (char *)lua_tolstring(L, 3, &obj.length);
+    double timestamp = luaL_optnumber(L, 4, 0);
+    lua_pushboolean(L, btDelete(bt, score, &obj, timestamp));
+    return 1;
+}
+
+static void
+_delete_cb(void* ud, slobj *obj) {
+    lua_State *L = (lua_State*)ud;
+    lua_pushvalue(L, 4);
+    lua_pushlstring(L, obj->ptr, obj->length);
+    lua_call(L, 1, 0);
+}
+
+static int
+_delete_by_score(lua_State *L) {
+    btree *bt = _to_btree(L);
+    double min = luaL_checknumber(L, 2);
+    double max = luaL_checknumber(L, 3);
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+    if (min > max) {
+        double tmp = min;
+        min = max;
+        max = tmp;
+    }
+
+    lua_pushinteger(L, btDeleteByScore(bt, min, max, _delete_cb, L));
+    return 1;
+}
+
+static int
+_delete_by_rank(lua_State *L) {
+    btree *bt = _to_btree(L);
+    unsigned int start = luaL_checkinteger(L, 2);
+    unsigned int end = luaL_checkinteger(L, 3);
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+    if (start > end) {
+        unsigned int tmp = start;
+        start = end;
+        end = tmp;
+    }
+
+    lua_pushinteger(L, btDeleteByRank(bt, start, end, _delete_cb, L));
+    return 1;
+}
+
+static int
+_get_count(lua_State *L) {
+    btree *bt = _to_btree(L);
+    lua_pushinteger(L, bt->length);
+    return 1;
+}
+
+static int
+_get_rank(lua_State *L) {
+    btree *bt = _to_btree(L);
+    double score = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TSTRING);
+    slobj obj;
+    obj.ptr = (char *)lua_tolstring(L, 3, &obj.length);
+    double timestamp = luaL_optnumber(L, 4, 0);
+
+    unsigned long rank = btGetRank(bt, score, &obj, timestamp);
+    if(rank == 0) {
+        return 0;
+    }
+
+    lua_pushinteger(L, rank);
+
+    return 1;
+}
+
+static int
+_get_rank_range(lua_State *L) {
+    btree *bt = _to_btree(L);
+    unsigned long r1 = luaL_checkinteger(L, 2);
+    unsigned long r2 = luaL_checkinteger(L, 3);
+    int reverse, rangelen;
+    if(r1 <= r2) {
+        reverse = 0;
+        rangelen = r2 - r1 + 1;
+    } else {
+        reverse = 1;
+        rangelen = r1 - r2 + 1;
+    }
+
+    btIter it = btGetByRank(bt, r1);
+    lua_createtable(L, rangelen, 0);
+    int n = 0;
+    while(it.leaf && n < rangelen) {
+        n++;
+
+        slobj *obj = btIterEntry(it)->obj;
+        lua_pushlstring(L, obj->ptr, obj->length);
+        lua_rawseti(L, -2, n);
+        it = reverse? btIterPrev(it) : btIterNext(it);
+    }
+    return 1;
+}
+
+static int
+_get_score_range(lua_State *L) {
+    btree *bt = _to_btree(L);
+    double s1 = luaL_checknumber(L, 2);
+    double s2 = luaL_checknumber(L, 3);
+    int reverse;
+    btIter it;
+
+    if(s1 <= s2) {
+        reverse = 0;
+        it = btFirstInRange(bt, s1, s2);
+    } else {
+        reverse = 1;
+        it = btLastInRange(bt, s2, s1);
+    }
+
+    lua_newtable(L);
+    int n = 0;
+    while(it.leaf) {
+        btEntry *e = btIterEntry(it);
+        if(reverse) {
+            if(e->score < s2) break;
+        } else {
+            if(e->score > s2) break;
+        }
+        n++;
+
+        lua_pushlstring(L, e->obj->ptr, e->obj->length);
+        lua_rawseti(L, -2, n);
+
+        it = reverse? btIterPrev(it) : btIterNext(it);
+    }
+    return 1;
+}
+
+static int
+_get_member_by_rank(lua_State *L){
+    btree *bt = _to_btree(L);
+    unsigned long r = luaL_checkinteger(L, 2);
+    btIter it = btGetByRank(bt, r);
+    if (it.leaf) {
+        slobj *obj = btIterEntry(it)->obj;
+        lua_pushlstring(L, obj->ptr, obj->length);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+_dump(lua_State *L) {
+    btree *bt = _to_btree(L);
+    btDump(bt);
+    return 0;
+}
+
+/* sl:bulk_load(packed [, scores [, timestamps]]), records in rank order.
+ * They are appended to the right edge with full nodes, O(n) overall. The
+ * tables are filled like skiplist.c bulk_load. */
+static int
+_bulk_load(lua_State *L) {
+    btree *bt = _to_btree(L);
+    size_t len;
+    const char *p = bulk_check_packed(L, 2, &len);
+    const char *end = p + len;
+    unsigned long n = 0;
+    bulk_string_record r;
+    btBulk b;
+    int more;
+
+    bulk_check_tables(L, bt->length);
+    btBulkBegin(&b, bt);
+    while ((more = bulk_next_record(&p, end, &r)) > 0) {
+        double old, old_timestamp = 0;
+        slobj *obj = slCreateObj(r.member, r.length);
+        if (bulk_set_member(L, &r, &old, &old_timestamp)) {
+            /* loaded before, replaced like zset:add */
+            btBulkEnd(&b);
+            btDelete(bt, old, obj, old_timestamp);
+            btInsert(bt, r.score, obj, r.timestamp);
+            btBulkBegin(&b, bt);
+        } else if (!btBulkAppend(&b, r.score, obj, r.timestamp)) {
+            /* out of order, fall back to a regular insert */
+            btBulkEnd(&b);
+            btInsert(bt, r.score, obj, r.timestamp);
+            btBulkBegin(&b, bt);
+        }
+        n++;
+    }
+    btBulkEnd(&b);
+    if (more < 0) {
+        return luaL_error(L, "bulk_load: truncated record %lu", n + 1);
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int
+_bulk_dump(lua_State *L) {
+    return btree_bulk_dump(L, _to_btree(L));
+}
+
+static int
+_new(lua_State *L) {
+    btree *pbt = btCreate();
+
+    btree **bt = (btree**) lua_newuserdata(L, sizeof(btree*));
+    *bt = pbt;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int
+_release(lua_State *L) {
+    btree *bt = _to_btree(L);
+    btFree(bt);
+    return 0;
+}
+
+int luaopen_skiplist_btree(lua_State *L) {
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM > 501
+    luaL_checkversion(L);
+#endif
+
+    luaL_Reg l[] = {
+        {"insert", _insert},
+        {"delete", _delete},
+        {"delete_by_score", _delete_by_score},
+        {"delete_by_rank", _delete_by_rank},
+
+        {"get_count", _get_count},
+        {"get_rank", _get_rank},
+        {"get_rank_range", _get_rank_range},
+        {"get_score_range", _get_score_range},
+        {"get_member_by_rank", _get_member_by_rank},
+
+        {"bulk_load", _bulk_load},
+        {"bulk_dump", _bulk_dump},
+
+        {"dump", _dump},
+        {NULL, NULL}
+    };
+
+    lua_createtable(L, 0, 2);
+
+    luaL_newlib(L, l);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, _release);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcclosure(L, _new, 1);
+    return 1;
+}
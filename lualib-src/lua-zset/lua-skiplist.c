@@ -5,10 +5,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "lua.h"
 #include "lauxlib.h"
 #include "skiplist.h"
+#include "lua_skiplist_bulk.h"
 
 static inline skiplist*
 _to_skiplist(lua_State *L) {
@@ -199,6 +202,53 @@ _dump(lua_State *L) {
     return 0;
 }
 
+/* sl:bulk_load(packed [, scores [, timestamps]]), records in rank order.
+ * scores[member] and timestamps[member] are filled, the tables are needed
+ * when the list isn't empty. A member given again replaces the old one. */
+static int
+_bulk_load(lua_State *L) {
+    skiplist *sl = _to_skiplist(L);
+    size_t len;
+    const char *p = bulk_check_packed(L, 2, &len);
+    const char *end = p + len;
+    unsigned long n = 0;
+    bulk_string_record r;
+    slBulk b;
+    int more;
+
+    bulk_check_tables(L, sl->length);
+    slBulkBegin(&b, sl);
+    while ((more = bulk_next_record(&p, end, &r)) > 0) {
+        double old, old_timestamp = 0;
+        slobj *obj = slCreateObj(r.member, r.length);
+        if (bulk_set_member(L, &r, &old, &old_timestamp)) {
+            /* loaded before, replaced like zset:add */
+            slBulkEnd(&b);
+            slDelete(sl, old, obj, old_timestamp);
+            slInsert(sl, r.score, obj, r.timestamp);
+            slBulkBegin(&b, sl);
+        } else if (!slBulkAppend(&b, r.score, obj, r.timestamp)) {
+            /* out of order, fall back to a regular insert */
+            slBulkEnd(&b);
+            slInsert(sl, r.score, obj, r.timestamp);
+            slBulkBegin(&b, sl);
+        }
+        n++;
+    }
+    slBulkEnd(&b);
+    if (more < 0) {
+        return luaL_error(L, "bulk_load: truncated record %lu", n + 1);
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/* sl:bulk_dump([buffer [, start [, count]]]), see lua_skiplist_bulk.h */
+static int
+_bulk_dump(lua_State *L) {
+    return skiplist_bulk_dump(L, _to_skiplist(L));
+}
+
 static int
 _new(lua_State *L) {
     skiplist *psl = slCreate();
@@ -235,6 +285,9 @@ int luaopen_skiplist_c(lua_State *L) {
         {"get_score_range", _get_score_range},
         {"get_member_by_rank", _get_member_by_rank},
 
+        {"bulk_load", _bulk_load},
+        {"bulk_dump", _bulk_dump},
+
         {"dump", _dump},
         {NULL, NULL}
     };
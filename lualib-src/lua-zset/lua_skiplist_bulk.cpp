@@ -0,0 +1,114 @@
+// bulk_load input and bulk_dump output of the string member engines, the
+// records of bulk_records.hpp
+#include <cstdint>
+#include <cstring>
+
+#include "lua_skiplist_bulk.h"
+#include "bulk_records.hpp"
+
+static void write_record(pluto::buffer& out, double score, double timestamp, const slobj* obj) {
+    out.write_back(score);
+    out.write_back(timestamp);
+    out.write_back(static_cast<uint32_t>(obj->length));
+    out.write_back(std::string_view { obj->ptr, obj->length });
+}
+
+// fn(pluto::buffer&, const dump_range&) writes the records in range to the
+// buffer at index 2 and returns their count, or to a string returned when
+// there is none
+template<typename Fn>
+static int dump_records(lua_State* L, unsigned long length, Fn&& fn) {
+    bool to_string = lua_isnoneornil(L, 2);
+    pluto::buffer tmp;
+    pluto::buffer* out = to_string ? &tmp : pluto::lua_check_buffer(L, 2);
+    dump_range range = check_dump_range(L, length);
+    if (range.count > 0)
+        fn(*out, range);
+    if (!to_string) {
+        lua_pushinteger(L, static_cast<lua_Integer>(range.count));
+        return 1;
+    }
+    lua_pushlstring(L, tmp.data(), tmp.size());
+    return 1;
+}
+
+extern "C" {
+const char* bulk_check_packed(lua_State* L, int index, size_t* len) {
+    std::string_view packed = check_packed(L, index);
+    *len = packed.size();
+    return packed.data();
+}
+
+int bulk_next_record(const char** p, const char* end, bulk_string_record* r) {
+    size_t left = static_cast<size_t>(end - *p);
+    if (left == 0)
+        return 0;
+    if (left < STRING_RECORD_HEAD)
+        return -1;
+    memcpy(&r->score, *p, sizeof(double));
+    memcpy(&r->timestamp, *p + sizeof(double), sizeof(double));
+    memcpy(&r->length, *p + sizeof(double) * 2, sizeof(uint32_t));
+    if (left - STRING_RECORD_HEAD < r->length)
+        return -1;
+    r->member = *p + STRING_RECORD_HEAD;
+    *p = r->member + r->length;
+    return 1;
+}
+
+void bulk_check_tables(lua_State* L, unsigned long length) {
+    lua_settop(L, 4);
+    for (int index = 3; index <= 4; ++index) {
+        if (lua_istable(L, index))
+            continue;
+        if (length > 0)
+            luaL_argerror(L, index, "the table of a list with members is needed");
+        lua_newtable(L);
+        lua_replace(L, index);
+    }
+}
+
+int bulk_set_member(lua_State* L, const bulk_string_record* r, double* score, double* timestamp) {
+    lua_pushlstring(L, r->member, r->length);
+    lua_pushvalue(L, -1);
+    int found = lua_rawget(L, 3) == LUA_TNUMBER;
+    if (found) {
+        *score = lua_tonumber(L, -1);
+        lua_pushvalue(L, -2);
+        lua_rawget(L, 4);
+        *timestamp = lua_tonumber(L, -1); // 0 for nil
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_pushnumber(L, r->score);
+    lua_rawset(L, 3);
+    if (r->timestamp != 0) {
+        lua_pushnumber(L, r->timestamp);
+        lua_rawset(L, 4);
+    } else if (found) {
+        lua_pushnil(L);
+        lua_rawset(L, 4);
+    } else {
+        lua_pop(L, 1);
+    }
+    return found;
+}
+
+int skiplist_bulk_dump(lua_State* L, skiplist* sl) {
+    return dump_records(L, sl->length, [sl](pluto::buffer& out, const dump_range& range) {
+        skiplistNode* x = slGetNodeByRank(sl, range.start);
+        for (unsigned long n = 0; n < range.count; ++n, x = x->level[0].forward)
+            write_record(out, x->score, x->timestamp, x->obj);
+    });
+}
+
+int btree_bulk_dump(lua_State* L, btree* bt) {
+    return dump_records(L, bt->length, [bt](pluto::buffer& out, const dump_range& range) {
+        btIter it = btGetByRank(bt, range.start);
+        for (unsigned long n = 0; n < range.count; ++n, it = btIterNext(it)) {
+            const btEntry* e = btIterEntry(it);
+            write_record(out, e->score, e->timestamp, e->obj);
+        }
+    });
+}
+}
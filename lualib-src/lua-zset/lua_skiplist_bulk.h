@@ -0,0 +1,46 @@
+// bulk_load input and bulk_dump output of skiplist.c and skiplist.btree, in
+// lua_skiplist_bulk.cpp to share pluto::buffer and the packed view with
+// skiplist.int
+#pragma once
+#include "lua.h"
+#include "btree.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* packed records at index: a string, a buffer or a view of snapshot.load,
+ * raises an argument error otherwise */
+const char *bulk_check_packed(lua_State *L, int index, size_t *len);
+
+/* a record of bulk_load, member points into the packed records */
+typedef struct bulk_string_record {
+    double score;
+    double timestamp;
+    const char *member;
+    uint32_t length;
+} bulk_string_record;
+
+/* reads the record at *p and moves *p past it, returns 1, 0 at end or -1
+ * when the record is truncated */
+int bulk_next_record(const char **p, const char *end, bulk_string_record *r);
+
+/* the scores and timestamps tables at 3 and 4 of bulk_load, they're needed
+ * to find the members of a list of length > 0, temporary ones are used for
+ * an empty list */
+void bulk_check_tables(lua_State *L, unsigned long length);
+
+/* sets the score and timestamp of the member of r in the tables, returns 1
+ * with the old ones when the member is there already */
+int bulk_set_member(lua_State *L, const bulk_string_record *r, double *score, double *timestamp);
+
+/* sl:bulk_dump([buffer [, start [, count]]]), appends count entries (default
+ * all) from rank start (default 1) in rank order to buffer and returns how
+ * many were written, returns them as a string when no buffer is given */
+int skiplist_bulk_dump(lua_State *L, skiplist *sl);
+int btree_bulk_dump(lua_State *L, btree *bt);
+
+#ifdef __cplusplus
+}
+#endif
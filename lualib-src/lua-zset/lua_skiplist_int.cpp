@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "bulk_records.hpp"
+#include "skiplist_int.h"
+
+#define METANAME "skiplist.int"
+#define BULK_PREFETCH 16 // records ahead
+
+static iskiplist* to_skiplist(lua_State* L) {
+    iskiplist** sl = (iskiplist**)lua_touserdata(L, 1);
+    if (nullptr == sl || nullptr == *sl)
+        luaL_error(L, "must be skiplist.int object");
+    return *sl;
+}
+
+// sl:add(score, member [, timestamp]), true when member was not inside
+static int add(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto score = pluto::lua_check<double>(L, 2);
+    auto member = pluto::lua_check<int64_t>(L, 3);
+    double timestamp = luaL_optnumber(L, 4, 0);
+    lua_pushboolean(L, islUpdate(sl, member, score, timestamp));
+    return 1;
+}
+
+static int rem(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto member = pluto::lua_check<int64_t>(L, 2);
+    lua_pushboolean(L, islDelete(sl, member));
+    return 1;
+}
+
+// score, timestamp of member, nothing when it is not inside
+static int score(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto member = pluto::lua_check<int64_t>(L, 2);
+    iskiplistNode* node = islFind(sl, member);
+    if (nullptr == node)
+        return 0;
+    lua_pushnumber(L, node->score);
+    lua_pushnumber(L, node->timestamp);
+    return 2;
+}
+
+static int rank(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto member = pluto::lua_check<int64_t>(L, 2);
+    unsigned long r = islGetRank(sl, member);
+    if (0 == r)
+        return 0;
+    lua_pushinteger(L, (lua_Integer)r);
+    return 1;
+}
+
+static void delete_cb(void* ud, int64_t member) {
+    lua_State* L = (lua_State*)ud;
+    lua_pushvalue(L, 4);
+    lua_pushinteger(L, member);
+    lua_call(L, 1, 0);
+}
+
+// sl:delete_by_score(min, max [, cb]), cb(member) per removed member
+static int delete_by_score(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto min = pluto::lua_check<double>(L, 2);
+    auto max = pluto::lua_check<double>(L, 3);
+    bool has_cb = !lua_isnoneornil(L, 4);
+    if (has_cb)
+        luaL_checktype(L, 4, LUA_TFUNCTION);
+    if (min > max)
+        std::swap(min, max);
+    lua_pushinteger(L, (lua_Integer)islDeleteByScore(sl, min, max, has_cb ? delete_cb : nullptr, L));
+    return 1;
+}
+
+static int delete_by_rank(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto start = pluto::lua_check<unsigned int>(L, 2);
+    auto end = pluto::lua_check<unsigned int>(L, 3);
+    bool has_cb = !lua_isnoneornil(L, 4);
+    if (has_cb)
+        luaL_checktype(L, 4, LUA_TFUNCTION);
+    if (start > end)
+        std::swap(start, end);
+    lua_pushinteger(L, (lua_Integer)islDeleteByRank(sl, start, end, has_cb ? delete_cb : nullptr, L));
+    return 1;
+}
+
+static int get_count(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    lua_pushinteger(L, (lua_Integer)sl->length);
+    return 1;
+}
+
+static int get_rank_range(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto r1 = pluto::lua_check<unsigned long>(L, 2);
+    auto r2 = pluto::lua_check<unsigned long>(L, 3);
+    bool reverse = r1 > r2;
+    unsigned long rangelen = reverse ? r1 - r2 + 1 : r2 - r1 + 1;
+
+    iskiplistNode* node = islGetNodeByRank(sl, r1);
+    lua_createtable(L, (int)std::min(rangelen, sl->length), 0);
+    lua_Integer n = 0;
+    while (nullptr != node && (unsigned long)n < rangelen) {
+        lua_pushinteger(L, node->member);
+        lua_rawseti(L, -2, ++n);
+        node = reverse ? node->backward : node->level[0].forward;
+    }
+    return 1;
+}
+
+static int get_score_range(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto s1 = pluto::lua_check<double>(L, 2);
+    auto s2 = pluto::lua_check<double>(L, 3);
+    bool reverse = s1 > s2;
+    iskiplistNode* node = reverse ? islLastInRange(sl, s2, s1) : islFirstInRange(sl, s1, s2);
+
+    lua_newtable(L);
+    lua_Integer n = 0;
+    while (nullptr != node) {
+        if (reverse ? node->score < s2 : node->score > s2)
+            break;
+        lua_pushinteger(L, node->member);
+        lua_rawseti(L, -2, ++n);
+        node = reverse ? node->backward : node->level[0].forward;
+    }
+    return 1;
+}
+
+static int get_member_by_rank(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    auto r = pluto::lua_check<unsigned long>(L, 2);
+    iskiplistNode* node = islGetNodeByRank(sl, r);
+    if (nullptr == node)
+        return 0;
+    lua_pushinteger(L, node->member);
+    return 1;
+}
+
+// sl:bulk_load(packed), packed is a string or a buffer of int64 records in rank
+// order, see bulk_records.hpp. Returns the number of new members.
+static int bulk_load(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    std::string_view packed = check_packed(L, 2);
+    int64_t count = count_records(packed, record_kind::int64);
+    if (count < 0)
+        return luaL_argerror(L, 2, "truncated record");
+
+    islBulk bulk;
+    islBulkBegin(&bulk, sl, static_cast<unsigned long>(count));
+    lua_Integer n = 0;
+    int64_t next = BULK_PREFETCH;
+    for_each_record(packed, record_kind::int64, [&](const bulk_record& r) {
+        // the index bucket of a random member is a cache miss
+        if (next < count) {
+            int64_t member;
+            memcpy(&member, packed.data() + next * INT64_RECORD_SIZE + sizeof(double) * 2, sizeof(member));
+            islBulkPrefetch(&bulk, member);
+        }
+        ++next;
+        n += islBulkAppend(&bulk, r.member, r.score, r.timestamp);
+    });
+    islBulkEnd(&bulk);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+// sl:bulk_dump([buffer [, start [, count]]]), appends count entries (default
+// all) from rank start (default 1) in rank order to buffer and returns how
+// many were written, returns them as a string when no buffer is given
+static int bulk_dump(lua_State* L) {
+    iskiplist* sl = to_skiplist(L);
+    bool to_string = lua_isnoneornil(L, 2);
+    pluto::buffer tmp;
+    pluto::buffer* out = to_string ? &tmp : pluto::lua_check_buffer(L, 2);
+    dump_range range = check_dump_range(L, sl->length);
+    out->prepare(range.count * INT64_RECORD_SIZE);
+    iskiplistNode* x = range.count > 0 ? islGetNodeByRank(sl, range.start) : nullptr;
+    for (unsigned long n = 0; n < range.count; ++n, x = x->level[0].forward) {
+        out->write_back(x->score);
+        out->write_back(x->timestamp);
+        out->write_back(x->member);
+    }
+    if (!to_string) {
+        lua_pushinteger(L, static_cast<lua_Integer>(range.count));
+        return 1;
+    }
+    lua_pushlstring(L, tmp.data(), tmp.size());
+    return 1;
+}
+
+static int dump(lua_State* L) {
+    islDump(to_skiplist(L));
+    return 0;
+}
+
+static int release(lua_State* L) {
+    iskiplist** sl = (iskiplist**)lua_touserdata(L, 1);
+    if (nullptr != sl && nullptr != *sl) {
+        islFree(*sl);
+        *sl = nullptr;
+    }
+    return 0;
+}
+
+static int create(lua_State* L) {
+    iskiplist** sl = (iskiplist**)lua_newuserdatauv(L, sizeof(iskiplist*), 0);
+    *sl = islCreate();
+
+    if (luaL_newmetatable(L, METANAME)) //mt
+    {
+        luaL_Reg l[] = { { "add", add },
+                         { "rem", rem },
+                         { "score", score },
+                         { "rank", rank },
+                         { "delete_by_score", delete_by_score },
+                         { "delete_by_rank", delete_by_rank },
+                         { "get_count", get_count },
+                         { "get_rank_range", get_rank_range },
+                         { "get_score_range", get_score_range },
+                         { "get_member_by_rank", get_member_by_rank },
+                         { "bulk_load", bulk_load },
+                         { "bulk_dump", bulk_dump },
+                         { "dump", dump },
+                         { NULL, NULL } };
+        luaL_newlib(L, l); //{}
+        lua_setfield(L, -2, "__index"); //mt[__index] = {}
+        lua_pushcfunction(L, release);
+        lua_setfield(L, -2, "__gc"); //mt[__gc] = release
+    }
+    lua_setmetatable(L, -2); // set userdata metatable
+    return 1;
+}
+
+extern "C" {
+int luaopen_skiplist_int(lua_State* L) {
+    luaL_Reg l[] = {
+        { "new", create },
+        { NULL, NULL },
+    };
+    luaL_newlib(L, l);
+    return 1;
+}
+}
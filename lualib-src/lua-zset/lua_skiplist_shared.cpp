@@ -0,0 +1,337 @@
+// Read-only leaderboard views shared by every service of the process.
+// The owning service publishes bulk_dump output under a name, at an interval
+// of its choosing; each publish builds an immutable view and bumps the epoch
+// of the board. Readers hold a handle with the view they last saw: a query
+// loads the epoch without locking, and takes the board lock only to pick up
+// a newer view.
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bulk_records.hpp"
+
+#define VIEW_METANAME "skiplist.shared.view"
+
+class leaderboard_view {
+public:
+    leaderboard_view() = default;
+
+    // names_ point into data_
+    leaderboard_view(const leaderboard_view&) = delete;
+    leaderboard_view& operator=(const leaderboard_view&) = delete;
+
+    // data is bulk_dump output, count the number of records in it
+    leaderboard_view(record_kind kind, std::string data, size_t count):
+        kind_(kind),
+        data_(std::move(data)) {
+        scores_.reserve(count);
+        if (kind_ == record_kind::int64) {
+            ints_.reserve(count);
+            int_ranks_.reserve(count);
+        } else {
+            names_.reserve(count);
+            name_ranks_.reserve(count);
+        }
+        for_each_record(data_, kind_, [this](const bulk_record& r) {
+            auto rank = static_cast<uint32_t>(scores_.size() + 1);
+            scores_.push_back(r.score);
+            if (kind_ == record_kind::int64) {
+                ints_.push_back(r.member);
+                int_ranks_.emplace(r.member, rank);
+            } else {
+                names_.push_back(r.name);
+                name_ranks_.emplace(r.name, rank);
+            }
+        });
+    }
+
+    record_kind kind() const {
+        return kind_;
+    }
+
+    size_t count() const {
+        return scores_.size();
+    }
+
+    // rank is 1-based and in range
+    double score_at(size_t rank) const {
+        return scores_[rank - 1];
+    }
+
+    void push_member(lua_State* L, size_t rank) const {
+        if (kind_ == record_kind::int64) {
+            lua_pushinteger(L, ints_[rank - 1]);
+        } else {
+            std::string_view name = names_[rank - 1];
+            lua_pushlstring(L, name.data(), name.size());
+        }
+    }
+
+    // rank of the member at index, 0 when it is not on the board
+    size_t check_rank(lua_State* L, int index) const {
+        if (kind_ == record_kind::int64) {
+            auto iter = int_ranks_.find(pluto::lua_check<int64_t>(L, index));
+            return iter == int_ranks_.end() ? 0 : iter->second;
+        }
+        auto iter = name_ranks_.find(pluto::lua_check<std::string_view>(L, index));
+        return iter == name_ranks_.end() ? 0 : iter->second;
+    }
+
+    // number of entries with score < s, or <= s when inclusive
+    size_t count_below(double s, bool inclusive) const {
+        auto iter = inclusive ? std::upper_bound(scores_.begin(), scores_.end(), s)
+                              : std::lower_bound(scores_.begin(), scores_.end(), s);
+        return static_cast<size_t>(iter - scores_.begin());
+    }
+
+private:
+    record_kind kind_ = record_kind::string;
+    std::string data_; // owns the bytes of names_
+    std::vector<double> scores_;
+    std::vector<int64_t> ints_;
+    std::vector<std::string_view> names_;
+    std::unordered_map<int64_t, uint32_t> int_ranks_;
+    std::unordered_map<std::string_view, uint32_t> name_ranks_;
+};
+
+using view_ptr = std::shared_ptr<const leaderboard_view>;
+
+struct board {
+    std::atomic<uint64_t> epoch { 0 };
+    std::mutex mutex; // guards view
+    view_ptr view = std::make_shared<const leaderboard_view>();
+};
+
+// boards live as long as the process, so handles opened before a publish or
+// kept across an unpublish see the later publishes of the same name
+static std::shared_ptr<board> find_board(const std::string& name) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::shared_ptr<board>> boards;
+    std::lock_guard lock { mutex };
+    auto& b = boards[name];
+    if (!b)
+        b = std::make_shared<board>();
+    return b;
+}
+
+// the replaced view is left in the parameter, it may be the last reference and
+// is destroyed by the caller after the board is unlocked
+static uint64_t publish_view(board& b, view_ptr view) {
+    std::lock_guard lock { b.mutex };
+    b.view.swap(view);
+    return b.epoch.fetch_add(1, std::memory_order_release) + 1;
+}
+
+struct view_handle {
+    std::shared_ptr<board> owner;
+    view_ptr view;
+    uint64_t epoch = 0;
+};
+
+static view_handle& to_handle(lua_State* L) {
+    return *(view_handle*)luaL_checkudata(L, 1, VIEW_METANAME);
+}
+
+// the latest published view, the handle keeps it alive until the next change
+static const leaderboard_view& current(lua_State* L) {
+    view_handle& h = to_handle(L);
+    if (h.owner->epoch.load(std::memory_order_acquire) != h.epoch) {
+        view_ptr old; // released after unlocking, it may free the whole old view
+        {
+            std::lock_guard lock { h.owner->mutex };
+            old = std::exchange(h.view, h.owner->view);
+            h.epoch = h.owner->epoch.load(std::memory_order_relaxed);
+        }
+    }
+    return *h.view;
+}
+
+// members from rank r1 to r2, reversed when r1 > r2, like skiplist get_rank_range
+static void push_rank_range(lua_State* L, const leaderboard_view& v, lua_Integer r1, lua_Integer r2) {
+    lua_Integer n = static_cast<lua_Integer>(v.count());
+    r1 = std::max<lua_Integer>(r1, 1);
+    r2 = std::max<lua_Integer>(r2, 1);
+    lua_Integer step = r1 <= r2 ? 1 : -1;
+    if (r1 > n) {
+        lua_createtable(L, 0, 0);
+        return;
+    }
+    r2 = std::min(r2, n);
+    lua_createtable(L, static_cast<int>((r2 - r1) * step + 1), 0);
+    lua_Integer i = 0;
+    for (lua_Integer r = r1;; r += step) {
+        v.push_member(L, static_cast<size_t>(r));
+        lua_rawseti(L, -2, ++i);
+        if (r == r2)
+            break;
+    }
+}
+
+static int view_epoch(lua_State* L) {
+    current(L);
+    lua_pushinteger(L, static_cast<lua_Integer>(to_handle(L).epoch));
+    return 1;
+}
+
+static int view_count(lua_State* L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(current(L).count()));
+    return 1;
+}
+
+static int view_range(lua_State* L) {
+    const leaderboard_view& v = current(L);
+    push_rank_range(L, v, pluto::lua_check<lua_Integer>(L, 2), pluto::lua_check<lua_Integer>(L, 3));
+    return 1;
+}
+
+static int view_rev_range(lua_State* L) {
+    const leaderboard_view& v = current(L);
+    lua_Integer n = static_cast<lua_Integer>(v.count());
+    lua_Integer r1 = n - pluto::lua_check<lua_Integer>(L, 2) + 1;
+    lua_Integer r2 = n - pluto::lua_check<lua_Integer>(L, 3) + 1;
+    push_rank_range(L, v, r1, r2);
+    return 1;
+}
+
+static int view_rank(lua_State* L) {
+    size_t r = current(L).check_rank(L, 2);
+    if (0 == r)
+        return 0;
+    lua_pushinteger(L, static_cast<lua_Integer>(r));
+    return 1;
+}
+
+static int view_rev_rank(lua_State* L) {
+    const leaderboard_view& v = current(L);
+    size_t r = v.check_rank(L, 2);
+    if (0 == r)
+        return 0;
+    lua_pushinteger(L, static_cast<lua_Integer>(v.count() - r + 1));
+    return 1;
+}
+
+static int view_score(lua_State* L) {
+    const leaderboard_view& v = current(L);
+    size_t r = v.check_rank(L, 2);
+    if (0 == r)
+        return 0;
+    lua_pushnumber(L, v.score_at(r));
+    return 1;
+}
+
+// members with score between s1 and s2, reversed when s1 > s2
+static int view_range_by_score(lua_State* L) {
+    const leaderboard_view& v = current(L);
+    auto s1 = pluto::lua_check<double>(L, 2);
+    auto s2 = pluto::lua_check<double>(L, 3);
+    size_t first = v.count_below(std::min(s1, s2), false) + 1;
+    size_t last = v.count_below(std::max(s1, s2), true);
+    if (first > last) {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+    if (s1 <= s2)
+        push_rank_range(L, v, first, last);
+    else
+        push_rank_range(L, v, last, first);
+    return 1;
+}
+
+static int view_member_by_rank(lua_State* L) {
+    const leaderboard_view& v = current(L);
+    auto r = pluto::lua_check<lua_Integer>(L, 2);
+    if (r < 1 || r > static_cast<lua_Integer>(v.count()))
+        return 0;
+    v.push_member(L, static_cast<size_t>(r));
+    return 1;
+}
+
+static int view_member_by_rev_rank(lua_State* L) {
+    const leaderboard_view& v = current(L);
+    auto r = static_cast<lua_Integer>(v.count()) - pluto::lua_check<lua_Integer>(L, 2) + 1;
+    if (r < 1 || r > static_cast<lua_Integer>(v.count()))
+        return 0;
+    v.push_member(L, static_cast<size_t>(r));
+    return 1;
+}
+
+static int view_gc(lua_State* L) {
+    to_handle(L).~view_handle();
+    return 0;
+}
+
+// shared.publish(name, packed, kind), packed is bulk_dump output in rank order.
+// The view is built on the calling service. Returns the new epoch.
+static int publish(lua_State* L) {
+    auto name = pluto::lua_check<std::string>(L, 1);
+    std::string_view packed = check_packed(L, 2);
+    record_kind kind = check_record_kind(L, 3);
+    int64_t count = count_records(packed, kind);
+    if (count < 0)
+        return luaL_argerror(L, 2, "truncated record");
+
+    auto view = std::make_shared<const leaderboard_view>(kind, std::string { packed }, static_cast<size_t>(count));
+    lua_pushinteger(L, static_cast<lua_Integer>(publish_view(*find_board(name), std::move(view))));
+    return 1;
+}
+
+// shared.unpublish(name), open handles see an empty board
+static int unpublish(lua_State* L) {
+    auto name = pluto::lua_check<std::string>(L, 1);
+    lua_pushinteger(L, static_cast<lua_Integer>(publish_view(*find_board(name), std::make_shared<const leaderboard_view>())));
+    return 1;
+}
+
+// shared.open(name), a handle that follows the publishes of name. The board may
+// be published after it is opened.
+static int open_view(lua_State* L) {
+    auto name = pluto::lua_check<std::string>(L, 1);
+    void* space = lua_newuserdatauv(L, sizeof(view_handle), 0);
+    view_handle* h = new (space) view_handle {};
+    h->owner = find_board(name);
+    {
+        std::lock_guard lock { h->owner->mutex };
+        h->view = h->owner->view;
+        h->epoch = h->owner->epoch.load(std::memory_order_relaxed);
+    }
+    if (luaL_newmetatable(L, VIEW_METANAME)) //mt
+    {
+        luaL_Reg l[] = { { "epoch", view_epoch },
+                         { "count", view_count },
+                         { "range", view_range },
+                         { "rev_range", view_rev_range },
+                         { "rank", view_rank },
+                         { "rev_rank", view_rev_rank },
+                         { "score", view_score },
+                         { "range_by_score", view_range_by_score },
+                         { "member_by_rank", view_member_by_rank },
+                         { "member_by_rev_rank", view_member_by_rev_rank },
+                         { NULL, NULL } };
+        luaL_newlib(L, l); //{}
+        lua_setfield(L, -2, "__index"); //mt[__index] = {}
+        lua_pushcfunction(L, view_gc);
+        lua_setfield(L, -2, "__gc"); //mt[__gc] = view_gc
+    }
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+extern "C" {
+int luaopen_skiplist_shared(lua_State* L) {
+    luaL_Reg l[] = {
+        { "publish", publish },
+        { "unpublish", unpublish },
+        { "open", open_view },
+        { NULL, NULL },
+    };
+    luaL_newlib(L, l);
+    return 1;
+}
+}
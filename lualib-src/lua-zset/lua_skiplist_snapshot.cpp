@@ -0,0 +1,422 @@
+// On-disk snapshots of a leaderboard, in the packed record layout of bulk_dump.
+// A file is a snapshot_header followed by the records in rank order; the header
+// carries the payload checksum. Files are written to a tmp file of their own
+// next to <path> on a background thread while save dumps the records, synced,
+// and renamed over <path> when complete, so a crash mid-write keeps the
+// previous snapshot and concurrent saves to one path never mix. At most
+// SAVE_QUEUE dumped chunks wait for the disk, save blocks on a slow one.
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "bulk_records.hpp"
+#include "mapped_file.hpp"
+
+#define WRITER_METANAME "skiplist.snapshot.writer"
+
+static constexpr char SNAPSHOT_MAGIC[4] = { 'Z', 'S', 'N', 'P' };
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+static constexpr lua_Integer SAVE_CHUNK = 65536; // records per bulk_dump of save
+static constexpr size_t SAVE_QUEUE = 4; // chunks waiting for the writer thread
+
+struct snapshot_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t size; // payload bytes
+    uint64_t checksum; // of the payload
+};
+
+// checksum of a payload fed in pieces: 64-bit words through a murmur2 style
+// mix, the tail bytes and the total size are folded in last
+class payload_checksum {
+public:
+    void update(std::string_view data) {
+        size_ += data.size();
+        if (pending_ > 0) {
+            size_t n = std::min(sizeof(word_) - pending_, data.size());
+            memcpy(word_ + pending_, data.data(), n);
+            pending_ += n;
+            data.remove_prefix(n);
+            if (pending_ < sizeof(word_))
+                return;
+            mix(word_);
+            pending_ = 0;
+        }
+        for (; data.size() >= sizeof(word_); data.remove_prefix(sizeof(word_)))
+            mix(data.data());
+        memcpy(word_, data.data(), data.size());
+        pending_ = data.size();
+    }
+
+    uint64_t digest() const {
+        uint64_t h = h_;
+        if (pending_ > 0) {
+            uint64_t tail = 0;
+            memcpy(&tail, word_, pending_);
+            h ^= tail;
+            h *= M;
+        }
+        h ^= size_ * M;
+        h *= M;
+        h ^= h >> 47;
+        h *= M;
+        h ^= h >> 47;
+        return h;
+    }
+
+private:
+    static constexpr uint64_t M = UINT64_C(0xc6a4a7935bd1e995);
+
+    void mix(const char* p) {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+        k *= M;
+        k ^= k >> 47;
+        k *= M;
+        h_ ^= k;
+        h_ *= M;
+    }
+
+    uint64_t h_ = UINT64_C(0x5a534e50);
+    uint64_t size_ = 0;
+    char word_[sizeof(uint64_t)];
+    size_t pending_ = 0;
+};
+
+// flushes fp through to the disk
+static bool sync_file(FILE* fp) {
+    if (fflush(fp) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+// makes a rename into the directory of path durable, Windows has no
+// directory handle to sync
+static bool sync_parent_dir(const std::string& path) {
+#ifdef _WIN32
+    (void)path;
+    return true;
+#else
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+// <path>.tmp.<pid>.<n>, unique per save across threads and processes
+static std::string unique_tmp(const std::string& path) {
+    static std::atomic<uint64_t> next { 0 };
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = static_cast<int>(getpid());
+#endif
+    return path + ".tmp." + std::to_string(pid) + "." + std::to_string(++next);
+}
+
+// Writes chunks of packed records as save fills them. The file starts with a
+// placeholder header that is rewritten once the size and checksum are known.
+class snapshot_writer {
+public:
+    snapshot_writer(std::string path, snapshot_header header):
+        path_(std::move(path)),
+        header_(header) {}
+
+    bool done() {
+        std::lock_guard lock { mutex_ };
+        return done_;
+    }
+
+    // empty error on success
+    std::string wait() {
+        std::unique_lock lock { mutex_ };
+        cv_.wait(lock, [this] { return done_; });
+        return error_;
+    }
+
+    // the writer owns the chunk from here, waits while SAVE_QUEUE chunks are
+    // not written yet
+    void push(std::unique_ptr<pluto::buffer> chunk) {
+        {
+            std::unique_lock lock { mutex_ };
+            cv_.wait(lock, [this] { return chunks_.size() < SAVE_QUEUE; });
+            chunks_.push_back(std::move(chunk));
+        }
+        cv_.notify_all();
+    }
+
+    // no more chunks; count records were pushed, or the file is discarded
+    // when aborted
+    void finish(uint64_t count, bool aborted) {
+        {
+            std::lock_guard lock { mutex_ };
+            header_.count = count;
+            aborted_ = aborted;
+            finished_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    void run() {
+        std::string tmp = unique_tmp(path_);
+        std::string error;
+        FILE* fp = fopen(tmp.c_str(), "wb");
+        bool ok = nullptr != fp && fwrite(&header_, sizeof(header_), 1, fp) == 1;
+        payload_checksum sum;
+        uint64_t size = 0;
+        bool aborted = false;
+        for (;;) {
+            std::unique_ptr<pluto::buffer> chunk;
+            {
+                std::unique_lock lock { mutex_ };
+                cv_.wait(lock, [this] { return !chunks_.empty() || finished_; });
+                if (chunks_.empty()) {
+                    aborted = aborted_;
+                    break;
+                }
+                chunk = std::move(chunks_.front());
+                chunks_.pop_front();
+            }
+            cv_.notify_all();
+            // after a failure the queue is still drained to free the chunks
+            if (ok && chunk->size() > 0) {
+                std::string_view data { chunk->data(), chunk->size() };
+                sum.update(data);
+                size += data.size();
+                ok = fwrite(data.data(), data.size(), 1, fp) == 1;
+            }
+        }
+
+        if (nullptr == fp) {
+            error = "can not open " + tmp;
+        } else {
+            header_.size = size;
+            header_.checksum = sum.digest();
+            ok = ok && !aborted && fseek(fp, 0, SEEK_SET) == 0
+                && fwrite(&header_, sizeof(header_), 1, fp) == 1 && sync_file(fp);
+            ok = (fclose(fp) == 0) && ok;
+            std::error_code ec;
+            if (!ok) {
+                error = (aborted ? "save aborted " : "write failed ") + tmp;
+                std::filesystem::remove(tmp, ec);
+            } else {
+                std::filesystem::rename(tmp, path_, ec);
+                if (ec) {
+                    error = "rename failed " + path_ + ": " + ec.message();
+                    std::filesystem::remove(tmp, ec);
+                } else if (!sync_parent_dir(path_)) {
+                    error = "sync failed " + path_;
+                }
+            }
+        }
+
+        {
+            std::lock_guard lock { mutex_ };
+            error_ = std::move(error);
+            done_ = true;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    std::string path_;
+    snapshot_header header_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<pluto::buffer>> chunks_;
+    bool finished_ = false;
+    bool aborted_ = false;
+    bool done_ = false;
+    std::string error_;
+};
+
+using writer_ptr = std::shared_ptr<snapshot_writer>;
+
+static writer_ptr& to_writer(lua_State* L) {
+    return *(writer_ptr*)luaL_checkudata(L, 1, WRITER_METANAME);
+}
+
+// writer:done(), true once the file is complete or failed
+static int writer_done(lua_State* L) {
+    lua_pushboolean(L, to_writer(L)->done());
+    return 1;
+}
+
+// writer:wait(), blocks until done, returns true or false, err
+static int writer_wait(lua_State* L) {
+    std::string err = to_writer(L)->wait();
+    if (err.empty()) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushlstring(L, err.data(), err.size());
+    return 2;
+}
+
+static int writer_gc(lua_State* L) {
+    to_writer(L).~writer_ptr();
+    return 0;
+}
+
+// snapshot.save(path, sl, kind), sl is a skiplist engine of the kind. Its
+// records are dumped here through sl:bulk_dump(buffer, start, count), each
+// chunk of SAVE_CHUNK records going to the writer thread as soon as it is
+// filled, so the file is written while the rest is dumped and no record is
+// copied twice. The dump is the point in time of the snapshot, it runs on the
+// calling thread as sl may change after save returns. Returns a writer.
+static int save(lua_State* L) {
+    auto path = pluto::lua_check<std::string>(L, 1);
+    luaL_checktype(L, 2, LUA_TUSERDATA);
+    record_kind kind = check_record_kind(L, 3);
+    if (lua_getfield(L, 2, "bulk_dump") != LUA_TFUNCTION)
+        return luaL_argerror(L, 2, "no bulk_dump");
+    lua_pop(L, 1);
+
+    snapshot_header header {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.kind = static_cast<uint32_t>(kind);
+
+    auto writer = std::make_shared<snapshot_writer>(std::move(path), header);
+    void* space = lua_newuserdatauv(L, sizeof(writer_ptr), 0);
+    new (space) writer_ptr { writer };
+    if (luaL_newmetatable(L, WRITER_METANAME)) //mt
+    {
+        luaL_Reg l[] = { { "done", writer_done }, { "wait", writer_wait }, { NULL, NULL } };
+        luaL_newlib(L, l); //{}
+        lua_setfield(L, -2, "__index"); //mt[__index] = {}
+        lua_pushcfunction(L, writer_gc);
+        lua_setfield(L, -2, "__gc"); //mt[__gc] = writer_gc
+    }
+    lua_setmetatable(L, -2);
+    // the thread keeps the writer alive when the Lua handle is collected first
+    std::thread { [writer] { writer->run(); } }.detach();
+
+    uint64_t count = 0;
+    for (;;) {
+        auto chunk = std::make_unique<pluto::buffer>();
+        lua_getfield(L, 2, "bulk_dump");
+        lua_pushvalue(L, 2);
+        lua_pushlightuserdata(L, chunk.get());
+        lua_pushinteger(L, static_cast<lua_Integer>(count + 1));
+        lua_pushinteger(L, SAVE_CHUNK);
+        if (lua_pcall(L, 4, 1, 0) != LUA_OK) {
+            chunk.reset();
+            writer->finish(count, true);
+            return lua_error(L);
+        }
+        lua_Integer n = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        count += static_cast<uint64_t>(n);
+        writer->push(std::move(chunk));
+        if (n < SAVE_CHUNK)
+            break;
+    }
+    writer->finish(count, false);
+    return 1;
+}
+
+static int view_close(lua_State* L) {
+    auto view = static_cast<packed_view*>(luaL_checkudata(L, 1, PACKED_VIEW_METANAME));
+    view->file.reset();
+    view->data = {};
+    return 0;
+}
+
+static int view_gc(lua_State* L) {
+    std::destroy_at(static_cast<packed_view*>(luaL_checkudata(L, 1, PACKED_VIEW_METANAME)));
+    return 0;
+}
+
+// snapshot.load(path, kind), returns a view of the packed records for
+// bulk_load, read in place from the mapped file, and their count. Returns
+// false, err when the file is missing, of another kind or corrupt.
+static int load(lua_State* L) {
+    auto path = pluto::lua_check<std::string>(L, 1);
+    record_kind kind = check_record_kind(L, 2);
+
+    auto fail = [L](const std::string& err) {
+        lua_pushboolean(L, 0);
+        lua_pushlstring(L, err.data(), err.size());
+        return 2;
+    };
+
+    auto file = std::make_unique<pluto::mapped_file>();
+    if (!file->open(path, false))
+        return fail("can not open " + path);
+
+    snapshot_header header;
+    if (file->size() < sizeof(header))
+        return fail("truncated snapshot " + path);
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SNAPSHOT_VERSION)
+        return fail("not a snapshot " + path);
+    if (header.kind != static_cast<uint32_t>(kind))
+        return fail("snapshot kind mismatch " + path);
+    if (file->size() - sizeof(header) != header.size)
+        return fail("truncated snapshot " + path);
+
+    std::string_view payload { file->data() + sizeof(header), static_cast<size_t>(header.size) };
+    payload_checksum sum;
+    sum.update(payload);
+    if (sum.digest() != header.checksum)
+        return fail("checksum mismatch " + path);
+
+    void* space = lua_newuserdatauv(L, sizeof(packed_view), 0);
+    new (space) packed_view { std::move(file), payload };
+    if (luaL_newmetatable(L, PACKED_VIEW_METANAME)) //mt
+    {
+        luaL_Reg l[] = { { "close", view_close }, { NULL, NULL } };
+        luaL_newlib(L, l); //{}
+        lua_setfield(L, -2, "__index"); //mt[__index] = {}
+        lua_pushcfunction(L, view_gc);
+        lua_setfield(L, -2, "__gc"); //mt[__gc] = view_gc
+    }
+    lua_setmetatable(L, -2);
+    lua_pushinteger(L, static_cast<lua_Integer>(header.count));
+    return 2;
+}
+
+extern "C" {
+int luaopen_skiplist_snapshot(lua_State* L) {
+    luaL_Reg l[] = {
+        { "save", save },
+        { "load", load },
+        { NULL, NULL },
+    };
+    luaL_newlib(L, l);
+    return 1;
+}
+}
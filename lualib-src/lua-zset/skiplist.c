@@ -147,6 +147,66 @@ void slInsert(skiplist *sl, double score, slobj *obj, double timestamp) {
     sl->length++;
 }
 
+/* Bulk build: nodes are appended after the tail in rank order, so the
+ * predecessor at each level is the last node appended there. Spans of the
+ * last nodes are fixed once in slBulkEnd, O(1) per node overall. */
+void slBulkBegin(slBulk *b, skiplist *sl) {
+    skiplistNode *x = sl->header;
+    unsigned long rank = 0;
+    int i;
+
+    b->sl = sl;
+    for (i = SKIPLIST_MAXLEVEL-1; i >= sl->level; i--) {
+        b->last[i] = sl->header;
+        b->rank[i] = 0;
+    }
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        b->last[i] = x;
+        b->rank[i] = rank;
+    }
+}
+
+/* Returns 0 without taking obj when it does not sort after the tail. */
+int slBulkAppend(slBulk *b, double score, slobj *obj, double timestamp) {
+    skiplist *sl = b->sl;
+    skiplistNode *x;
+    unsigned long rank;
+    int i, level;
+
+    if (sl->tail && compare(sl->tail, score, obj, timestamp) >= 0)
+        return 0;
+
+    level = slRandomLevel();
+    if (level > sl->level)
+        sl->level = level;
+    x = slCreateNode(level,score,obj,timestamp);
+    rank = sl->length + 1;
+    for (i = 0; i < level; i++) {
+        x->level[i].forward = NULL;
+        x->level[i].span = 0;
+        b->last[i]->level[i].forward = x;
+        b->last[i]->level[i].span = rank - b->rank[i];
+        b->last[i] = x;
+        b->rank[i] = rank;
+    }
+    x->backward = sl->tail;
+    sl->tail = x;
+    sl->length++;
+    return 1;
+}
+
+void slBulkEnd(slBulk *b) {
+    skiplist *sl = b->sl;
+    int i;
+    for (i = 0; i < sl->level; i++) {
+        b->last[i]->level[i].span = sl->length - b->rank[i];
+    }
+}
+
 /* Internal function used by slDelete, slDeleteByScore */
 void slDeleteNode(skiplist *sl, skiplistNode *x, skiplistNode **update) {
     int i;
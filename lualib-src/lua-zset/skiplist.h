@@ -1,4 +1,5 @@
 //
+#pragma once
 #include <stdlib.h>
 
 #define SKIPLIST_MAXLEVEL 32
@@ -26,6 +27,13 @@ typedef struct skiplist {
     int level;
 } skiplist;
 
+/* appends presorted nodes at the tail without searching, see slBulkAppend */
+typedef struct slBulk {
+    skiplist *sl;
+    skiplistNode *last[SKIPLIST_MAXLEVEL];
+    unsigned long rank[SKIPLIST_MAXLEVEL];
+} slBulk;
+
 typedef void (*slDeleteCb) (void *ud, slobj *obj);
 slobj* slCreateObj(const char* ptr, size_t length);
 void slFreeObj(slobj *obj);
@@ -35,6 +43,9 @@ void slFree(skiplist *sl);
 void slDump(skiplist *sl);
 
 void slInsert(skiplist *sl, double score, slobj *obj, double timestamp);
+void slBulkBegin(slBulk *b, skiplist *sl);
+int slBulkAppend(slBulk *b, double score, slobj *obj, double timestamp);
+void slBulkEnd(slBulk *b);
 int slDelete(skiplist *sl, double score, slobj *obj, double timestamp);
 unsigned long slDeleteByScore(skiplist *sl, double min, double max, slDeleteCb cb, void* ud);
 unsigned long slDeleteByRank(skiplist *sl, unsigned int start, unsigned int end, slDeleteCb cb, void* ud);
@@ -0,0 +1,500 @@
+// skiplist with int64 members, derived from skiplist.c
+// Members live inline in the nodes, and an intrusive hash index finds the
+// node of a member, so callers need no member -> score table of their own.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "skiplist_int.h"
+
+#define ISKIPLIST_MIN_BUCKETS 16
+
+static iskiplistNode *islCreateNode(int level, double score, int64_t member, double timestamp) {
+    iskiplistNode *n = malloc(sizeof(*n) + level * sizeof(struct iskiplistLevel));
+    n->score = score;
+    n->member = member;
+    n->timestamp = timestamp;
+    n->hnext = NULL;
+    return n;
+}
+
+static unsigned long islHash(int64_t member, unsigned long nbuckets) {
+    uint64_t h = (uint64_t)member * 0x9E3779B97F4A7C15ULL;
+    return (unsigned long)(h >> 32) & (nbuckets - 1);
+}
+
+static void islIndexResize(iskiplist *sl, unsigned long nbuckets) {
+    iskiplistNode **buckets = calloc(nbuckets, sizeof(iskiplistNode*));
+    unsigned long i;
+    for (i = 0; i < sl->nbuckets; i++) {
+        iskiplistNode *x = sl->buckets[i], *next;
+        while (x) {
+            unsigned long h = islHash(x->member, nbuckets);
+            next = x->hnext;
+            x->hnext = buckets[h];
+            buckets[h] = x;
+            x = next;
+        }
+    }
+    free(sl->buckets);
+    sl->buckets = buckets;
+    sl->nbuckets = nbuckets;
+}
+
+static void islIndexAdd(iskiplist *sl, iskiplistNode *x) {
+    unsigned long h;
+    if (sl->length >= sl->nbuckets)
+        islIndexResize(sl, sl->nbuckets * 2);
+    h = islHash(x->member, sl->nbuckets);
+    x->hnext = sl->buckets[h];
+    sl->buckets[h] = x;
+}
+
+static void islIndexRemove(iskiplist *sl, iskiplistNode *x) {
+    iskiplistNode **p = &sl->buckets[islHash(x->member, sl->nbuckets)];
+    while (*p != x)
+        p = &(*p)->hnext;
+    *p = x->hnext;
+}
+
+iskiplistNode* islFind(iskiplist *sl, int64_t member) {
+    iskiplistNode *x = sl->buckets[islHash(member, sl->nbuckets)];
+    while (x && x->member != member)
+        x = x->hnext;
+    return x;
+}
+
+iskiplist *islCreate(void) {
+    int j;
+    iskiplist *sl;
+
+    sl = malloc(sizeof(*sl));
+    sl->level = 1;
+    sl->length = 0;
+    sl->header = islCreateNode(ISKIPLIST_MAXLEVEL, 0, 0, 0);
+    for (j=0; j < ISKIPLIST_MAXLEVEL; j++) {
+        sl->header->level[j].forward = NULL;
+        sl->header->level[j].span = 0;
+    }
+    sl->header->backward = NULL;
+    sl->tail = NULL;
+    sl->nbuckets = ISKIPLIST_MIN_BUCKETS;
+    sl->buckets = calloc(sl->nbuckets, sizeof(iskiplistNode*));
+    return sl;
+}
+
+void islFree(iskiplist *sl) {
+    iskiplistNode *node = sl->header->level[0].forward, *next;
+
+    free(sl->header);
+    while(node) {
+        next = node->level[0].forward;
+        free(node);
+        node = next;
+    }
+    free(sl->buckets);
+    free(sl);
+}
+
+static int islRandomLevel(void) {
+    int level = 1;
+    while((random() & 0xffff) < (ISKIPLIST_P * 0xffff))
+        level += 1;
+    return (level < ISKIPLIST_MAXLEVEL) ? level : ISKIPLIST_MAXLEVEL;
+}
+
+/* order by score, then timestamp, then member */
+static int compare(iskiplistNode *node, double score, double timestamp, int64_t member) {
+    if (node->score != score) return node->score < score ? -1 : 1;
+    if (node->timestamp != timestamp) return node->timestamp < timestamp ? -1 : 1;
+    if (node->member != member) return node->member < member ? -1 : 1;
+    return 0;
+}
+
+static iskiplistNode *islInsert(iskiplist *sl, double score, int64_t member, double timestamp) {
+    iskiplistNode *update[ISKIPLIST_MAXLEVEL], *x;
+    unsigned int rank[ISKIPLIST_MAXLEVEL];
+    int i, level;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        /* store rank that is crossed to reach the insert position */
+        rank[i] = i == (sl->level-1) ? 0 : rank[i+1];
+        while (x->level[i].forward && compare(x->level[i].forward, score, timestamp, member) < 0) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+    level = islRandomLevel();
+    if (level > sl->level) {
+        for (i = sl->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = sl->header;
+            update[i]->level[i].span = sl->length;
+        }
+        sl->level = level;
+    }
+    x = islCreateNode(level,score,member,timestamp);
+    for (i = 0; i < level; i++) {
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
+
+        /* update span covered by update[i] as x is inserted here */
+        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    }
+
+    /* increment span for untouched levels */
+    for (i = level; i < sl->level; i++) {
+        update[i]->level[i].span++;
+    }
+
+    x->backward = (update[0] == sl->header) ? NULL : update[0];
+    if (x->level[0].forward)
+        x->level[0].forward->backward = x;
+    else
+        sl->tail = x;
+    sl->length++;
+    return x;
+}
+
+/* Internal function used by islDelete, islDeleteByScore and islDeleteByRank */
+static void islDeleteNode(iskiplist *sl, iskiplistNode *x, iskiplistNode **update) {
+    int i;
+    for (i = 0; i < sl->level; i++) {
+        if (update[i]->level[i].forward == x) {
+            update[i]->level[i].span += x->level[i].span - 1;
+            update[i]->level[i].forward = x->level[i].forward;
+        } else {
+            update[i]->level[i].span -= 1;
+        }
+    }
+    if (x->level[0].forward) {
+        x->level[0].forward->backward = x->backward;
+    } else {
+        sl->tail = x->backward;
+    }
+    while(sl->level > 1 && sl->header->level[sl->level-1].forward == NULL)
+        sl->level--;
+    sl->length--;
+    islIndexRemove(sl, x);
+}
+
+static void islUnlink(iskiplist *sl, iskiplistNode *node) {
+    iskiplistNode *update[ISKIPLIST_MAXLEVEL], *x;
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && x->level[i].forward != node &&
+            compare(x->level[i].forward, node->score, node->timestamp, node->member) < 0)
+            x = x->level[i].forward;
+        update[i] = x;
+    }
+    islDeleteNode(sl, node, update);
+}
+
+int islUpdate(iskiplist *sl, int64_t member, double score, double timestamp) {
+    iskiplistNode *x = islFind(sl, member);
+    if (x) {
+        if (x->score == score && x->timestamp == timestamp)
+            return 0;
+
+        /* still between its neighbours, update in place */
+        iskiplistNode *next = x->level[0].forward;
+        if ((x->backward == NULL || compare(x->backward, score, timestamp, member) < 0) &&
+            (next == NULL || compare(next, score, timestamp, member) > 0)) {
+            x->score = score;
+            x->timestamp = timestamp;
+            return 0;
+        }
+
+        islUnlink(sl, x);
+        free(x);
+        islIndexAdd(sl, islInsert(sl, score, member, timestamp));
+        return 0;
+    }
+
+    islIndexAdd(sl, islInsert(sl, score, member, timestamp));
+    return 1;
+}
+
+/* Bulk build as in skiplist.c: the predecessor at each level is the last
+ * node appended there, its span is fixed in islBulkEnd. */
+void islBulkBegin(islBulk *b, iskiplist *sl, unsigned long hint) {
+    iskiplistNode *x = sl->header;
+    unsigned long rank = 0, nbuckets = sl->nbuckets;
+    int i;
+
+    /* size the index once instead of doubling it along the way */
+    while (nbuckets <= sl->length + hint)
+        nbuckets *= 2;
+    if (nbuckets != sl->nbuckets)
+        islIndexResize(sl, nbuckets);
+
+    b->sl = sl;
+    for (i = ISKIPLIST_MAXLEVEL-1; i >= sl->level; i--) {
+        b->last[i] = sl->header;
+        b->rank[i] = 0;
+    }
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        b->last[i] = x;
+        b->rank[i] = rank;
+    }
+}
+
+int islBulkAppend(islBulk *b, int64_t member, double score, double timestamp) {
+    iskiplist *sl = b->sl;
+    iskiplistNode *x, **bucket;
+    unsigned long rank;
+    int i, level, inserted;
+
+    bucket = &sl->buckets[islHash(member, sl->nbuckets)];
+    for (x = *bucket; x && x->member != member; x = x->hnext)
+        ;
+    if (x || (sl->tail && compare(sl->tail, score, timestamp, member) >= 0)) {
+        islBulkEnd(b);
+        inserted = islUpdate(sl, member, score, timestamp);
+        islBulkBegin(b, sl, 0);
+        return inserted;
+    }
+
+    level = islRandomLevel();
+    if (level > sl->level)
+        sl->level = level;
+    x = islCreateNode(level,score,member,timestamp);
+    rank = sl->length + 1;
+    for (i = 0; i < level; i++) {
+        x->level[i].forward = NULL;
+        x->level[i].span = 0;
+        b->last[i]->level[i].forward = x;
+        b->last[i]->level[i].span = rank - b->rank[i];
+        b->last[i] = x;
+        b->rank[i] = rank;
+    }
+    x->backward = sl->tail;
+    sl->tail = x;
+    sl->length++;
+    if (sl->length >= sl->nbuckets) {
+        islIndexAdd(sl, x);
+    } else {
+        x->hnext = *bucket;
+        *bucket = x;
+    }
+    return 1;
+}
+
+void islBulkPrefetch(islBulk *b, int64_t member) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(&b->sl->buckets[islHash(member, b->sl->nbuckets)]);
+#else
+    (void)b;
+    (void)member;
+#endif
+}
+
+void islBulkEnd(islBulk *b) {
+    iskiplist *sl = b->sl;
+    int i;
+    for (i = 0; i < sl->level; i++) {
+        b->last[i]->level[i].span = sl->length - b->rank[i];
+    }
+}
+
+/* Delete member from the skiplist. */
+int islDelete(iskiplist *sl, int64_t member) {
+    iskiplistNode *x = islFind(sl, member);
+    if (x == NULL)
+        return 0; /* not found */
+
+    islUnlink(sl, x);
+    free(x);
+    return 1;
+}
+
+/* Delete all the elements with score between min and max from the skiplist.
+ * Both min and max are inclusive. */
+unsigned long islDeleteByScore(iskiplist *sl, double min, double max, islDeleteCb cb, void* ud) {
+    iskiplistNode *update[ISKIPLIST_MAXLEVEL], *x;
+    unsigned long removed = 0;
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && x->level[i].forward->score < min)
+            x = x->level[i].forward;
+        update[i] = x;
+    }
+
+    /* Current node is the last with score < min. */
+    x = x->level[0].forward;
+
+    /* Delete nodes while in range. */
+    while (x && x->score <= max) {
+        iskiplistNode *next = x->level[0].forward;
+        islDeleteNode(sl,x,update);
+        if (cb) cb(ud, x->member);
+        free(x);
+        removed++;
+        x = next;
+    }
+    return removed;
+}
+
+/* Delete all the elements with rank between start and end from the skiplist.
+ * Start and end are inclusive. Note that start and end need to be 1-based */
+unsigned long islDeleteByRank(iskiplist *sl, unsigned int start, unsigned int end, islDeleteCb cb, void* ud) {
+    iskiplistNode *update[ISKIPLIST_MAXLEVEL], *x;
+    unsigned long traversed = 0, removed = 0;
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+
+    traversed++;
+    x = x->level[0].forward;
+    while (x && traversed <= end) {
+        iskiplistNode *next = x->level[0].forward;
+        islDeleteNode(sl,x,update);
+        if (cb) cb(ud, x->member);
+        free(x);
+        removed++;
+        traversed++;
+        x = next;
+    }
+    return removed;
+}
+
+/* Rank of member, 0 when it is not inside. The rank is 1-based. */
+unsigned long islGetRank(iskiplist *sl, int64_t member) {
+    iskiplistNode *x, *node;
+    unsigned long rank = 0;
+    int i;
+
+    node = islFind(sl, member);
+    if (node == NULL)
+        return 0;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+            compare(x->level[i].forward, node->score, node->timestamp, member) <= 0) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (x == node) {
+            return rank;
+        }
+    }
+    return 0;
+}
+
+/* Finds an element by its rank. The rank argument needs to be 1-based. */
+iskiplistNode* islGetNodeByRank(iskiplist *sl, unsigned long rank) {
+    if(rank == 0 || rank > sl->length) {
+        return NULL;
+    }
+
+    iskiplistNode *x;
+    unsigned long traversed = 0;
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
+        {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (traversed == rank) {
+            return x;
+        }
+    }
+
+    return NULL;
+}
+
+/* range [min, max], left & right both include */
+/* Returns if there is a part of the zset is in range. */
+static int islIsInRange(iskiplist *sl, double min, double max) {
+    iskiplistNode *x;
+
+    /* Test for ranges that will always be empty. */
+    if(min > max) {
+        return 0;
+    }
+    x = sl->tail;
+    if (x == NULL || x->score < min)
+        return 0;
+
+    x = sl->header->level[0].forward;
+    if (x == NULL || x->score > max)
+        return 0;
+    return 1;
+}
+
+/* Find the first node that is contained in the specified range.
+ * Returns NULL when no element is contained in the range. */
+iskiplistNode *islFirstInRange(iskiplist *sl, double min, double max) {
+    iskiplistNode *x;
+    int i;
+
+    /* If everything is out of range, return early. */
+    if (!islIsInRange(sl,min, max)) return NULL;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        /* Go forward while *OUT* of range. */
+        while (x->level[i].forward && x->level[i].forward->score < min)
+                x = x->level[i].forward;
+    }
+
+    /* This is an inner range, so the next node cannot be NULL. */
+    x = x->level[0].forward;
+    return x;
+}
+
+/* Find the last node that is contained in the specified range.
+ * Returns NULL when no element is contained in the range. */
+iskiplistNode *islLastInRange(iskiplist *sl, double min, double max) {
+    iskiplistNode *x;
+    int i;
+
+    /* If everything is out of range, return early. */
+    if (!islIsInRange(sl, min, max)) return NULL;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        /* Go forward while *IN* range. */
+        while (x->level[i].forward &&
+            x->level[i].forward->score <= max)
+                x = x->level[i].forward;
+    }
+
+    /* This is an inner range, so this node cannot be NULL. */
+    return x;
+}
+
+void islDump(iskiplist *sl) {
+    iskiplistNode *x;
+    int i;
+
+    x = sl->header;
+    i = 0;
+    while(x->level[0].forward) {
+        x = x->level[0].forward;
+        i++;
+        printf("node %d: score:%f, member:%lld ts:%f\n", i, x->score, (long long)x->member, x->timestamp);
+    }
+}
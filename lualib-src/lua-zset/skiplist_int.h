@@ -0,0 +1,70 @@
+//
+// skiplist with int64 members stored inline, plus a member -> node index
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ISKIPLIST_MAXLEVEL 32
+#define ISKIPLIST_P 0.25
+
+typedef struct iskiplistNode {
+    int64_t member;
+    double score;
+    double timestamp;
+    struct iskiplistNode *backward;
+    struct iskiplistNode *hnext; /* next node in the same index bucket */
+    struct iskiplistLevel {
+        struct iskiplistNode *forward;
+        unsigned int span;
+    }level[];
+} iskiplistNode;
+
+typedef struct iskiplist {
+    struct iskiplistNode *header, *tail;
+    unsigned long length;
+    int level;
+    struct iskiplistNode **buckets;
+    unsigned long nbuckets; /* power of two */
+} iskiplist;
+
+/* appends presorted members at the tail without searching, see islBulkAppend */
+typedef struct islBulk {
+    iskiplist *sl;
+    iskiplistNode *last[ISKIPLIST_MAXLEVEL];
+    unsigned long rank[ISKIPLIST_MAXLEVEL];
+} islBulk;
+
+typedef void (*islDeleteCb) (void *ud, int64_t member);
+
+iskiplist *islCreate(void);
+void islFree(iskiplist *sl);
+void islDump(iskiplist *sl);
+
+/* Insert member, or move it when it is already inside. Returns 1 when inserted. */
+int islUpdate(iskiplist *sl, int64_t member, double score, double timestamp);
+int islDelete(iskiplist *sl, int64_t member);
+
+/* hint is the expected number of appends, it presizes the member index */
+void islBulkBegin(islBulk *b, iskiplist *sl, unsigned long hint);
+/* Same result as islUpdate, O(1) when member is new and sorts after the tail. */
+int islBulkAppend(islBulk *b, int64_t member, double score, double timestamp);
+/* member of a later append, its index bucket is loaded ahead */
+void islBulkPrefetch(islBulk *b, int64_t member);
+void islBulkEnd(islBulk *b);
+unsigned long islDeleteByScore(iskiplist *sl, double min, double max, islDeleteCb cb, void* ud);
+unsigned long islDeleteByRank(iskiplist *sl, unsigned int start, unsigned int end, islDeleteCb cb, void* ud);
+
+iskiplistNode* islFind(iskiplist *sl, int64_t member);
+unsigned long islGetRank(iskiplist *sl, int64_t member);
+iskiplistNode* islGetNodeByRank(iskiplist *sl, unsigned long rank);
+
+iskiplistNode *islFirstInRange(iskiplist *sl, double min, double max);
+iskiplistNode *islLastInRange(iskiplist *sl, double min, double max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,8 +3,10 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <float.h>
+#include <limits.h>
 #include <assert.h>
 
 #ifndef M_PI
@@ -14,6 +16,7 @@
 #include "mathid.h"	
 #include "math3d.h"
 #include "math3dfunc.h"
+#include "math3dbatch.h"
 
 #define MAT_PERSPECTIVE 0
 #define MAT_ORTHO 1
@@ -807,6 +810,20 @@ box_points_from_index(lua_State *L, struct math_context *M, int index){
 	return points;
 }
 
+static math_t
+output_from_index(lua_State *L, struct math_context *M, int index, int type) {
+	if (lua_isnoneornil(L, index))
+		return MATH_NULL;
+	math_t output = get_id(L, M, index);
+	if (!math_isref(M, output)) {
+		luaL_error(L, "Output is not ref");
+	}
+	int t = math_type(M, output);
+	if (t != type)
+		luaL_error(L, "Output is not %s, it's %s", math_typename(type), math_typename(t));
+	return output;
+}
+
 typedef math_t (*from_index)(lua_State *, struct math_context *, int);
 
 static math_t
@@ -975,7 +992,7 @@ typedef math_t (*math_lfunc)(lua_State *L);
 static inline int
 marked_ctor(lua_State *L, math_lfunc f) {
 	struct math_context *M = GETMC(L);
-	int cp = math_checkpoint(M);
+	int64_t cp = math_checkpoint(M);
 	math_t id = lua_math_mark(L, M, f(L));
 	lua_pushmath(L, id);
 	math_recover(M, cp);
@@ -1992,6 +2009,21 @@ laabb_transform(lua_State *L) {
 	return 2;
 }
 
+// 1 : worldmat
+// 2 : aabb array, vec4[2n] of min, max pairs
+// 3 : output ref (optional)
+static int
+laabb_transform_array(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	math_t worldmat = matrix_from_index(L, M, 1);
+	math_t array_aabb = array_from_index(L, M, 2, MATH_TYPE_VEC4);
+	if (math_size(M, array_aabb) % 2 != 0)
+		return luaL_error(L, "Invalid AABB array size %d", math_size(M, array_aabb));
+	math_t output = output_from_index(L, M, 3, MATH_TYPE_VEC4);
+	lua_pushmath(L, math3d_aabb_transform_array(M, worldmat, array_aabb, output));
+	return 1;
+}
+
 static int
 laabb_center_extents(lua_State *L) {
 	struct math_context *M = GETMC(L);
@@ -2076,31 +2108,62 @@ lfrustum_intersect_aabb(lua_State *L) {
 	return 1;
 }
 
+#define CULL_BATCH 256
+
+// 1 : planes
+// 2 : aabb list, a table of aabb, or a vec4[2n] array of min, max pairs
+// 3 : return the not visible ones instead
+// return : indices of the visible aabbs
 static int
 lfrustum_intersect_aabb_list(lua_State *L) {
 	struct math_context *M = GETMC(L);
 	math_t planes = box_planes_from_index(L, M, 1);
-
-	luaL_checktype(L, 2, LUA_TTABLE);
-	const int numelem = (int)lua_rawlen(L, 2);
-
 	const int return_notvisible = lua_toboolean(L, 3);
 
+	float aabbs[CULL_BATCH * 8];
+	signed char where[CULL_BATCH];
+	const float *v = NULL;
+	int numelem;
+	if (lua_istable(L, 2)) {
+		numelem = (int)lua_rawlen(L, 2);
+	} else {
+		math_t array_aabb = array_from_index(L, M, 2, MATH_TYPE_VEC4);
+		if (math_size(M, array_aabb) % 2 != 0)
+			return luaL_error(L, "Invalid AABB array size %d", math_size(M, array_aabb));
+		numelem = math_size(M, array_aabb) / 2;
+		v = math_value(M, array_aabb);
+	}
+
 	lua_createtable(L, numelem, 0);
+	const float *planes_v = math_value(M, planes);
 	int returnidx = 0;
-	int ii;
-	for (ii=0; ii<numelem; ++ii){
-		lua_geti(L, 2, ii+1);
-		math_t aabb = aabb_from_index(L, M, -1);
-		lua_pop(L, 1);
+	int ii, jj;
+	for (ii=0; ii<numelem; ii+=CULL_BATCH) {
+		int n = numelem - ii < CULL_BATCH ? numelem - ii : CULL_BATCH;
+		const float *batch;
+		if (v) {
+			batch = v + ii * 8;
+		} else {
+			// gather the aabbs of the table, so the planes are tested CULL_BATCH at a time
+			for (jj=0; jj<n; ++jj) {
+				lua_geti(L, 2, ii+jj+1);
+				math_t aabb = aabb_from_index(L, M, -1);
+				lua_pop(L, 1);
+				memcpy(aabbs + jj * 8, math_value(M, aabb), 8 * sizeof(float));
+			}
+			batch = aabbs;
+		}
+		math3d_batch_frustum_intersect_aabb(where, planes_v, batch, n);
 
-		int r = math3d_frustum_intersect_aabb(M, planes, aabb) >= 0;
-		if (return_notvisible)
-			r = !r;
+		for (jj=0; jj<n; ++jj) {
+			int r = where[jj] >= 0;
+			if (return_notvisible)
+				r = !r;
 
-		if (r){
-			lua_pushinteger(L, ii+1);
-			lua_seti(L, -2, ++returnidx);
+			if (r){
+				lua_pushinteger(L, ii+jj+1);
+				lua_seti(L, -2, ++returnidx);
+			}
 		}
 	}
 	return 1;
@@ -2245,6 +2308,465 @@ lbox_ray(lua_State *L){
 	return 1;
 }
 
+// SoA lists of aabbs and triangles for the broad phase, math3d.aabb_list(n) and
+// math3d.triangle_list(n). They live out of the math pages and elements are updated
+// in place. A query keeps its hits in the list as a bitset, read them back with
+// list:result([table]) as indices or list:result_bits() as a string.
+
+#define SOA_AABB 6		// minx, miny, minz, maxx, maxy, maxz
+#define SOA_TRIANGLE 9	// v0.xyz, v1.xyz, v2.xyz
+
+struct soa_list {
+	int n;
+	int cap;
+	int stride;		// SOA_AABB or SOA_TRIANGLE float arrays of cap elements
+	int result_n;	// n at the last query
+	float *v;
+	uint32_t *bits;	// hits of the last query
+};
+
+// The metatables of the lists keep their stride at this key
+static const int soa_tag = 0;
+
+// stride 0 accepts both kinds of lists
+static struct soa_list *
+check_soa(lua_State *L, int stride) {
+	struct soa_list *s = (struct soa_list *)lua_touserdata(L, 1);
+	int tag = 0;
+	if (s != NULL && lua_getmetatable(L, 1)) {
+		lua_rawgetp(L, -1, &soa_tag);
+		tag = (int)lua_tointeger(L, -1);
+		lua_pop(L, 2);
+	}
+	if (tag == 0 || (stride != 0 && tag != stride)) {
+		luaL_error(L, "Need %s list", stride == SOA_TRIANGLE ? "triangle" : "aabb");
+	}
+	return s;
+}
+
+static inline float *
+soa_array(struct soa_list *s, int k) {
+	return s->v + (size_t)k * s->cap;
+}
+
+static void
+soa_reset_result(struct soa_list *s) {
+	s->result_n = 0;
+}
+
+static void
+soa_reserve(lua_State *L, struct soa_list *s, int n) {
+	if (n <= s->cap)
+		return;
+	int cap = s->cap < 64 ? 64 : s->cap;
+	while (cap < n) {
+		if (cap > INT_MAX / 2)
+			luaL_error(L, "Too many elements %d", n);
+		cap *= 2;
+	}
+	float *v = (float *)malloc(sizeof(float) * cap * s->stride);
+	uint32_t *bits = (uint32_t *)malloc(sizeof(uint32_t) * MATH3D_BITS_WORDS(cap));
+	if (v == NULL || bits == NULL) {
+		free(v);
+		free(bits);
+		luaL_error(L, "Out of memory");
+	}
+	int k;
+	for (k=0;k<s->stride;k++) {
+		memcpy(v + (size_t)k * cap, soa_array(s, k), sizeof(float) * s->n);
+	}
+	free(s->v);
+	free(s->bits);
+	s->v = v;
+	s->bits = bits;
+	s->cap = cap;
+	soa_reset_result(s);
+}
+
+static void
+soa_resize(lua_State *L, struct soa_list *s, int n) {
+	if (n < 0)
+		luaL_error(L, "Invalid size %d", n);
+	soa_reserve(L, s, n);
+	if (n > s->n) {
+		int k;
+		for (k=0;k<s->stride;k++) {
+			memset(soa_array(s, k) + s->n, 0, sizeof(float) * (n - s->n));
+		}
+	}
+	s->n = n;
+	soa_reset_result(s);
+}
+
+// 1-based index at arg, n + 1 appends. Returns the 0-based one
+static int
+soa_index(lua_State *L, struct soa_list *s, int arg) {
+	lua_Integer i = luaL_checkinteger(L, arg);
+	if (i == (lua_Integer)s->n + 1) {
+		soa_resize(L, s, s->n + 1);
+	} else if (i < 1 || i > s->n) {
+		luaL_error(L, "Invalid index %d (%d)", (int)i, s->n);
+	}
+	return (int)(i - 1);
+}
+
+static void
+soa_set(struct soa_list *s, int i, const float *v, int k, int n) {
+	int j;
+	for (j=0;j<n;j++) {
+		soa_array(s, k + j)[i] = v[j];
+	}
+}
+
+static int
+soa_hits(struct soa_list *s) {
+	int i, hits = 0;
+	for (i=0;i<MATH3D_BITS_WORDS(s->n);i++) {
+		uint32_t b = s->bits[i];
+		for (; b; b &= b - 1)
+			++hits;
+	}
+	s->result_n = s->n;
+	return hits;
+}
+
+static struct soa_list *
+new_soa(lua_State *L, int stride) {
+	int n = (int)luaL_optinteger(L, 1, 0);
+	struct soa_list *s = (struct soa_list *)lua_newuserdatauv(L, sizeof(struct soa_list), 0);
+	memset(s, 0, sizeof(*s));
+	s->stride = stride;
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setmetatable(L, -2);
+	soa_reserve(L, s, n > 0 ? n : 1);
+	soa_resize(L, s, n);
+	return s;
+}
+
+static int
+lsoa_gc(lua_State *L) {
+	struct soa_list *s = check_soa(L, 0);
+	free(s->v);
+	free(s->bits);
+	s->v = NULL;
+	s->bits = NULL;
+	s->n = s->cap = 0;
+	return 0;
+}
+
+static int
+lsoa_count(lua_State *L) {
+	struct soa_list *s = check_soa(L, 0);
+	lua_pushinteger(L, s->n);
+	return 1;
+}
+
+static int
+lsoa_resize(lua_State *L) {
+	struct soa_list *s = check_soa(L, 0);
+	soa_resize(L, s, (int)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+// 1 : list
+// 2 : table to fill (optional), the entries after the result are cleared
+// return : indices of the last query, count
+static int
+lsoa_result(lua_State *L) {
+	struct soa_list *s = check_soa(L, 0);
+	if (lua_istable(L, 2)) {
+		lua_settop(L, 2);
+	} else {
+		lua_settop(L, 1);
+		lua_newtable(L);
+	}
+	int n = 0;
+	int i, w;
+	for (w=0;w<MATH3D_BITS_WORDS(s->result_n);w++) {
+		uint32_t b = s->bits[w];
+		for (i=w*32; b; b>>=1, i++) {
+			if (b & 1) {
+				lua_pushinteger(L, i + 1);
+				lua_rawseti(L, 2, ++n);
+			}
+		}
+	}
+	for (i=n+1; lua_rawgeti(L, 2, i) != LUA_TNIL; i++) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, 2, i);
+	}
+	lua_pop(L, 1);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+// return : hits of the last query as a string of (n + 7) / 8 bytes, element i is
+//          (byte[i // 8 + 1] >> (i % 8)) & 1, i is 0-based
+static int
+lsoa_result_bits(lua_State *L) {
+	struct soa_list *s = check_soa(L, 0);
+	int bytes = (s->result_n + 7) / 8;
+	luaL_Buffer b;
+	char *p = luaL_buffinitsize(L, &b, bytes);
+	int i;
+	for (i=0;i<bytes;i++) {
+		p[i] = (char)(s->bits[i / 4] >> (i % 4 * 8));
+	}
+	luaL_pushresultsize(&b, bytes);
+	return 1;
+}
+
+static int
+laabb_list(lua_State *L) {
+	new_soa(L, SOA_AABB);
+	return 1;
+}
+
+static void
+aabb_list_set(struct soa_list *s, int i, const float *aabb) {
+	soa_set(s, i, aabb, 0, 3);
+	soa_set(s, i, aabb + 4, 3, 3);
+}
+
+static int
+laabb_list_set(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_AABB);
+	math_t aabb = aabb_from_index(L, M, 3);
+	aabb_list_set(s, soa_index(L, s, 2), math_value(M, aabb));
+	return 0;
+}
+
+// 1 : list
+// 2 : index
+// 3 : worldmat
+// 4 : local aabb
+// set the element to the aabb transformed by worldmat, see aabb_transform
+static int
+laabb_list_transform(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_AABB);
+	math_t mat = matrix_from_index(L, M, 3);
+	math_t aabb = aabb_from_index(L, M, 4);
+	float v[8];
+	math3d_batch_aabb_transform(v, math_value(M, mat), math_value(M, aabb), 1);
+	aabb_list_set(s, soa_index(L, s, 2), v);
+	return 0;
+}
+
+static int
+laabb_list_get(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_AABB);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	if (i < 1 || i > s->n)
+		return luaL_error(L, "Invalid index %d (%d)", (int)i, s->n);
+	math_t r = math_import(M, NULL, MATH_TYPE_VEC4, 2);
+	float *v = math_init(M, r);
+	int k;
+	for (k=0;k<3;k++) {
+		v[k] = soa_array(s, k)[i-1];
+		v[4+k] = soa_array(s, 3+k)[i-1];
+	}
+	v[3] = 0;
+	v[7] = 0;
+	lua_pushmath(L, r);
+	return 1;
+}
+
+static void
+soa_arrays(struct soa_list *s, const float *a[]) {
+	int k;
+	for (k=0;k<s->stride;k++) {
+		a[k] = soa_array(s, k);
+	}
+}
+
+// 1 : list
+// 2 : planes
+// return : number of aabbs inside or intersecting the frustum
+static int
+laabb_list_frustum(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_AABB);
+	math_t planes = box_planes_from_index(L, M, 2);
+	const float *a[SOA_AABB];
+	soa_arrays(s, a);
+	math3d_batch_soa_frustum_aabb(s->bits, math_value(M, planes), a, s->n);
+	lua_pushinteger(L, soa_hits(s));
+	return 1;
+}
+
+// 1 : list
+// 2 : ray origin
+// 3 : ray direction
+// 4 : max t (optional), hits are o + d * t, 0 <= t <= max t
+// return : number of aabbs hit
+static int
+laabb_list_ray(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_AABB);
+	const float *o = math_value(M, vector_from_index(L, M, 2));
+	const float *d = math_value(M, vector_from_index(L, M, 3));
+	const float tmax = (float)luaL_optnumber(L, 4, HUGE_VAL);
+	const float *a[SOA_AABB];
+	soa_arrays(s, a);
+	math3d_batch_soa_ray_aabb(s->bits, o, d, tmax, a, s->n);
+	lua_pushinteger(L, soa_hits(s));
+	return 1;
+}
+
+static int
+ltriangle_list(lua_State *L) {
+	new_soa(L, SOA_TRIANGLE);
+	return 1;
+}
+
+static int
+ltriangle_list_set(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_TRIANGLE);
+	const float *v0 = math_value(M, vector_from_index(L, M, 3));
+	const float *v1 = math_value(M, vector_from_index(L, M, 4));
+	const float *v2 = math_value(M, vector_from_index(L, M, 5));
+	int i = soa_index(L, s, 2);
+	soa_set(s, i, v0, 0, 3);
+	soa_set(s, i, v1, 3, 3);
+	soa_set(s, i, v2, 6, 3);
+	return 0;
+}
+
+static int
+ltriangle_list_get(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_TRIANGLE);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	if (i < 1 || i > s->n)
+		return luaL_error(L, "Invalid index %d (%d)", (int)i, s->n);
+	int j, k;
+	for (j=0;j<3;j++) {
+		float v[4];
+		for (k=0;k<3;k++) {
+			v[k] = soa_array(s, j * 3 + k)[i-1];
+		}
+		v[3] = 1.0f;
+		lua_pushmath(L, math_vec4(M, v));
+	}
+	return 3;
+}
+
+// 1 : list
+// 2 : triangles buffer, see triangles_ray
+// 3 : number of triangles
+// 4 : first index (optional, default 1)
+static int
+ltriangle_list_load(lua_State *L) {
+	struct soa_list *s = check_soa(L, SOA_TRIANGLE);
+	const struct triangle *tri;
+	const int n = (int)luaL_checkinteger(L, 3);
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		size_t len = 0;
+		tri = (const struct triangle *)lua_tolstring(L, 2, &len);
+		if (len < sizeof(struct triangle) * n)
+			return luaL_error(L, "Triangles buffer too small (%d < %d)", (int)len, (int)(sizeof(struct triangle) * n));
+	} else {
+		luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+		tri = (const struct triangle *)lua_touserdata(L, 2);
+	}
+	const lua_Integer first = luaL_optinteger(L, 4, 1);
+	if (n < 0 || first < 1 || first > (lua_Integer)s->n + 1)
+		return luaL_error(L, "Invalid range %d, %d (%d)", (int)first, n, s->n);
+	if (first - 1 + n > s->n)
+		soa_resize(L, s, (int)(first - 1 + n));
+	int i, j;
+	for (i=0;i<n;i++) {
+		for (j=0;j<3;j++) {
+			soa_set(s, (int)first - 1 + i, tri[i].p[j].v, j * 3, 3);
+		}
+	}
+	return 0;
+}
+
+// 1 : list
+// 2 : ray origin
+// 3 : ray direction
+// 4 : max t (optional), hits are o + d * t, 0 <= t <= max t
+// return : t, index of the nearest triangle hit, or nothing
+static int
+ltriangle_list_ray(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct soa_list *s = check_soa(L, SOA_TRIANGLE);
+	const float *o = math_value(M, vector_from_index(L, M, 2));
+	const float *d = math_value(M, vector_from_index(L, M, 3));
+	const float tmax = (float)luaL_optnumber(L, 4, HUGE_VAL);
+	const float *a[SOA_TRIANGLE];
+	float t;
+	soa_arrays(s, a);
+	int nearest = math3d_batch_soa_ray_triangles(s->bits, &t, o, d, tmax, a, s->n);
+	soa_hits(s);
+	if (nearest < 0)
+		return 0;
+	lua_pushnumber(L, t);
+	lua_pushinteger(L, nearest + 1);
+	return 2;
+}
+
+static void
+init_soa_list(lua_State *L, struct math3d_api *M) {
+	luaL_Reg common[] = {
+		{ "count", lsoa_count },
+		{ "resize", lsoa_resize },
+		{ "result", lsoa_result },
+		{ "result_bits", lsoa_result_bits },
+		{ NULL, NULL },
+	};
+	luaL_Reg aabb[] = {
+		{ "set", laabb_list_set },
+		{ "get", laabb_list_get },
+		{ "transform", laabb_list_transform },
+		{ "frustum", laabb_list_frustum },
+		{ "ray", laabb_list_ray },
+		{ NULL, NULL },
+	};
+	luaL_Reg triangle[] = {
+		{ "set", ltriangle_list_set },
+		{ "get", ltriangle_list_get },
+		{ "load", ltriangle_list_load },
+		{ "ray", ltriangle_list_ray },
+		{ NULL, NULL },
+	};
+	struct {
+		const char *name;
+		const luaL_Reg *methods;
+		lua_CFunction create;
+		int stride;
+	} lists[] = {
+		{ "aabb_list", aabb, laabb_list, SOA_AABB },
+		{ "triangle_list", triangle, ltriangle_list, SOA_TRIANGLE },
+	};
+	int i;
+	for (i=0;i<2;i++) {
+		lua_createtable(L, 0, 3);	// metatable
+		lua_pushinteger(L, lists[i].stride);
+		lua_rawsetp(L, -2, &soa_tag);
+		lua_newtable(L);	// methods
+		lua_pushlightuserdata(L, M);
+		luaL_setfuncs(L, common, 1);
+		lua_pushlightuserdata(L, M);
+		luaL_setfuncs(L, lists[i].methods, 1);
+		lua_setfield(L, -2, "__index");
+		lua_pushlightuserdata(L, M);
+		lua_pushcclosure(L, lsoa_gc, 1);
+		lua_setfield(L, -2, "__gc");
+
+		lua_pushlightuserdata(L, M);
+		lua_insert(L, -2);
+		lua_pushcclosure(L, lists[i].create, 2);
+		lua_setfield(L, -2, lists[i].name);
+	}
+}
+
 static math_t
 get_vec_or_number(lua_State *L, struct math_context *M, int index) {
 	if (lua_type(L, index) == LUA_TNUMBER) {
@@ -2355,21 +2877,32 @@ lmul_array(lua_State *L) {
 		return luaL_error(L, "Need matrix");
 	}
 
-	math_t output = MATH_NULL;
-	if (!lua_isnoneornil(L, 3)) {
-		output = get_id(L, M, 3);
-		if (!math_isref(M, output)) {
-			return luaL_error(L, "Output is not ref");
-		}
-		int t = math_type(M, output);
-		if (t != MATH_TYPE_MAT)
-			return luaL_error(L, "Output is not matrix, it's %s", math_typename(t));
-	}
+	math_t output = output_from_index(L, M, 3, MATH_TYPE_MAT);
 	math_t r = math3d_mul_matrix_array(M, lv, rv, output);
 	lua_pushmath(L, r);
 	return 1;
 }
 
+// 1 : mat
+// 2 : vec4 array
+// 3 : w, 0 for vector, 1 for point, nil uses the w of each vec4
+// 4 : output ref (optional)
+static int
+ltransform_array(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	math_t mat = matrix_from_index(L, M, 1);
+	math_t array_vec = array_from_index(L, M, 2, MATH_TYPE_VEC4);
+	float w;
+	const float *pw = NULL;
+	if (!lua_isnoneornil(L, 3)) {
+		w = (float)luaL_checknumber(L, 3);
+		pw = &w;
+	}
+	math_t output = output_from_index(L, M, 4, MATH_TYPE_VEC4);
+	lua_pushmath(L, math3d_transform_array(M, mat, array_vec, pw, output));
+	return 1;
+}
+
 static int
 lpoints_center(lua_State *L) {
 	struct math_context *M = GETMC(L);
@@ -2512,6 +3045,8 @@ lconstant(lua_State *L) {
 		break;
 	}
 	id = math_constant(M, id);
+	if (math_isnull(id))
+		return luaL_error(L, "Too many shared constants");
 	lua_pushmath(L, id);
 	return 1;
 }
@@ -2531,8 +3066,10 @@ lconstant_array(lua_State *L) {
 	}
 
 	struct math_context * M = GETMC(L);
-	math_t id = array_from_index(L, M, 2, type);
-	lua_pushmath(L, math_constant(M, id));
+	math_t id = math_constant(M, array_from_index(L, M, 2, type));
+	if (math_isnull(id))
+		return luaL_error(L, "Too many shared constants");
+	lua_pushmath(L, id);
 	return 1;
 }
 
@@ -2561,6 +3098,14 @@ linfo(lua_State *L) {
 		w = MATH_INFO_MAXPAGE;
 	} else if (strcmp(what, "frame") == 0) {
 		w = MATH_INFO_FRAME;
+	} else if (strcmp(what, "page") == 0) {
+		w = MATH_INFO_PAGE;
+	} else if (strcmp(what, "peak") == 0) {
+		w = MATH_INFO_PEAK;
+	} else if (strcmp(what, "grow") == 0) {
+		w = MATH_INFO_GROW;
+	} else if (strcmp(what, "pool") == 0) {
+		w = MATH_INFO_POOL;
 	} else {
 		return luaL_error(L, "Invalid info name : %s", what);
 	}
@@ -2578,8 +3123,9 @@ lcheckpoint(lua_State *L) {
 static int
 lrecover(lua_State *L) {
 	struct math_context * M = GETMC(L);
-	int cp = (int)luaL_checkinteger(L, 1);
-	math_recover(M, cp);
+	int64_t cp = (int64_t)luaL_checkinteger(L, 1);
+	if (!math_recover(M, cp))
+		return luaL_error(L, "Checkpoint of another frame");
 	return 0;
 }
 
@@ -2647,6 +3193,7 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "reset", lreset },
 		{ "mul", lmul },
 		{ "mul_array", lmul_array },
+		{ "transform_array", ltransform_array },
 		{ "add", ladd },
 		{ "sub", lsub },
 		{ "muladd", lmuladd},
@@ -2705,6 +3252,7 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "aabb_append", 		 laabb_append},
 		{ "aabb_merge", 		 laabb_merge},
 		{ "aabb_transform", 	 laabb_transform},
+		{ "aabb_transform_array", laabb_transform_array},
 		{ "aabb_center_extents", laabb_center_extents},
 		{ "aabb_intersect_plane",laabb_intersect_plane},
 		{ "aabb_intersection",	 laabb_intersection},
@@ -2752,6 +3300,7 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 	luaL_newlibtable(L,l);
 	lua_pushlightuserdata(L, M);
 	luaL_setfuncs(L,l,1);
+	init_soa_list(L, M);
 	lua_pushlightuserdata(L, M);
 	lua_setfield(L, -2, "CINTERFACE");
 }
@@ -2787,7 +3336,7 @@ math3d_from_lua_id_(lua_State *L, struct math_context *M, int index) {
 static int lnew_math3d(lua_State *L);
 
 static void
-math3d_object(lua_State *L, int maxpage) {
+math3d_object(lua_State *L, int maxpage, int shared) {
 	luaL_Reg ref_mt[] = {
 		{ "__newindex", lref_setter },
 		{ "__index", lref_getter },
@@ -2800,6 +3349,8 @@ math3d_object(lua_State *L, int maxpage) {
 
 	struct math3d_api * M = lua_newuserdatauv(L, sizeof(struct math3d_api), 0);
 	M->M = math_new(maxpage);
+	if (shared)
+		math_share_constant(M->M);
 	M->refmeta = lua_topointer(L, refmeta);
 	M->from_lua = math3d_from_lua_;
 	M->from_lua_id = math3d_from_lua_id_;
@@ -2825,10 +3376,12 @@ math3d_object(lua_State *L, int maxpage) {
 	lua_setfield(L, -2, "new");
 }
 
+// 1 : maxpage, the initial page table size
+// 2 : boolean, share constants with the other contexts of the process
 static int
 lnew_math3d(lua_State *L) {
 	int maxpage = (int)luaL_optinteger(L, 1, 0);
-	math3d_object(L, maxpage);
+	math3d_object(L, maxpage, lua_toboolean(L, 2));
 	return 1;
 }
 
@@ -2842,7 +3395,13 @@ luaopen_math3d(lua_State *L) {
 	}
 	lua_pop(L, 1);
 
-	math3d_object(L, maxpage);
+	int shared = 0;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, "MATH3D_SHARED_CONSTANT") != LUA_TNIL) {
+		shared = lua_toboolean(L, -1);
+	}
+	lua_pop(L, 1);
+
+	math3d_object(L, maxpage, shared);
 
 	return 1;
 }
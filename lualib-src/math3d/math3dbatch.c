@@ -0,0 +1,561 @@
+#include "math3dbatch.h"
+
+#include <string.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define BATCH_SSE
+#define BATCH_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BATCH_SSE
+#endif
+
+// nearest and farthest corner on axis i, see plane_aabb_intersect in math3dfunc.cpp
+#define NEAR_D(i) (plane[i] * (plane[i] > 0.0f ? min[i] : max[i]))
+#define FAR_D(i) (plane[i] * (plane[i] > 0.0f ? max[i] : min[i]))
+
+static int
+plane_aabb_intersect(const float *plane, const float *aabb) {
+	const float *min = aabb;
+	const float *max = aabb + 4;
+	float minD = NEAR_D(0);
+	float maxD = FAR_D(0);
+	minD += NEAR_D(1);
+	maxD += FAR_D(1);
+	minD += NEAR_D(2);
+	maxD += FAR_D(2);
+	if (minD > -plane[3])
+		return 1;
+	if (maxD < -plane[3])
+		return -1;
+	return 0;
+}
+
+static void
+frustum_intersect_aabb(signed char *result, const float *planes, const float *aabb, int n) {
+	int i, j;
+	for (i=0;i<n;i++) {
+		int where = 1;
+		for (j=0;j<6;j++) {
+			const int w = plane_aabb_intersect(planes + j * 4, aabb);
+			if (w < 0) {
+				where = -1;
+				break;
+			}
+			if (w == 0)
+				where = 0;
+		}
+		result[i] = (signed char)where;
+		aabb += 8;
+	}
+}
+
+#ifdef BATCH_SSE
+
+// glm::min(x, y) is (y < x) ? y : x, the operand order matters for -0.0
+#define MIN_PS(x, y) _mm_min_ps(y, x)
+#define MAX_PS(x, y) _mm_max_ps(y, x)
+
+void
+math3d_batch_mul_matrix(float *out, const float *lhs, int lstride, const float *rhs, int rstride, int n) {
+	int i, j;
+	for (i=0;i<n;i++) {
+		const __m128 a0 = _mm_loadu_ps(lhs);
+		const __m128 a1 = _mm_loadu_ps(lhs + 4);
+		const __m128 a2 = _mm_loadu_ps(lhs + 8);
+		const __m128 a3 = _mm_loadu_ps(lhs + 12);
+		__m128 c[4];
+		for (j=0;j<4;j++) {
+			const float *b = rhs + j * 4;
+			__m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[0]));
+			r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[1])));
+			r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[2])));
+			c[j] = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[3])));
+		}
+		// out may be the same as lhs or rhs
+		_mm_storeu_ps(out, c[0]);
+		_mm_storeu_ps(out + 4, c[1]);
+		_mm_storeu_ps(out + 8, c[2]);
+		_mm_storeu_ps(out + 12, c[3]);
+		out += 16;
+		lhs += lstride;
+		rhs += rstride;
+	}
+}
+
+void
+math3d_batch_transform(float *out, const float *mat, const float *v, const float *w, int n) {
+	const __m128 m0 = _mm_loadu_ps(mat);
+	const __m128 m1 = _mm_loadu_ps(mat + 4);
+	const __m128 m2 = _mm_loadu_ps(mat + 8);
+	const __m128 m3 = _mm_loadu_ps(mat + 12);
+	int i;
+	for (i=0;i<n;i++) {
+		const __m128 add0 = _mm_add_ps(_mm_mul_ps(m0, _mm_set1_ps(v[0])), _mm_mul_ps(m1, _mm_set1_ps(v[1])));
+		const __m128 add1 = _mm_add_ps(_mm_mul_ps(m2, _mm_set1_ps(v[2])), _mm_mul_ps(m3, _mm_set1_ps(w ? *w : v[3])));
+		_mm_storeu_ps(out, _mm_add_ps(add0, add1));
+		out += 4;
+		v += 4;
+	}
+}
+
+void
+math3d_batch_aabb_transform(float *out, const float *mat, const float *aabb, int n) {
+	const __m128 right = _mm_loadu_ps(mat);
+	const __m128 up = _mm_loadu_ps(mat + 4);
+	const __m128 forward = _mm_loadu_ps(mat + 8);
+	const __m128 pos = _mm_loadu_ps(mat + 12);
+	int i;
+	for (i=0;i<n;i++) {
+		const __m128 xa = _mm_mul_ps(right, _mm_set1_ps(aabb[0]));
+		const __m128 xb = _mm_mul_ps(right, _mm_set1_ps(aabb[4]));
+		const __m128 ya = _mm_mul_ps(up, _mm_set1_ps(aabb[1]));
+		const __m128 yb = _mm_mul_ps(up, _mm_set1_ps(aabb[5]));
+		const __m128 za = _mm_mul_ps(forward, _mm_set1_ps(aabb[2]));
+		const __m128 zb = _mm_mul_ps(forward, _mm_set1_ps(aabb[6]));
+		__m128 minv = _mm_add_ps(MIN_PS(xa, xb), MIN_PS(ya, yb));
+		__m128 maxv = _mm_add_ps(MAX_PS(xa, xb), MAX_PS(ya, yb));
+		minv = _mm_add_ps(_mm_add_ps(minv, MIN_PS(za, zb)), pos);
+		maxv = _mm_add_ps(_mm_add_ps(maxv, MAX_PS(za, zb)), pos);
+		_mm_storeu_ps(out, minv);
+		_mm_storeu_ps(out + 4, maxv);
+		out += 8;
+		aabb += 8;
+	}
+}
+
+#ifdef BATCH_AVX
+#define LANES 8
+typedef __m256 lanes_v;
+#define V_LOAD _mm256_loadu_ps
+#define V_STORE _mm256_storeu_ps
+#define V_SET1 _mm256_set1_ps
+#define V_ADD _mm256_add_ps
+#define V_SUB _mm256_sub_ps
+#define V_MUL _mm256_mul_ps
+#define V_DIV _mm256_div_ps
+#define V_MIN _mm256_min_ps
+#define V_MAX _mm256_max_ps
+#define V_AND _mm256_and_ps
+#define V_OR _mm256_or_ps
+#define V_ANDNOT _mm256_andnot_ps
+#define V_GT(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define V_LT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define V_GE(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define V_LE(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define V_MASK _mm256_movemask_ps
+#else
+#define LANES 4
+typedef __m128 lanes_v;
+#define V_LOAD _mm_loadu_ps
+#define V_STORE _mm_storeu_ps
+#define V_SET1 _mm_set1_ps
+#define V_ADD _mm_add_ps
+#define V_SUB _mm_sub_ps
+#define V_MUL _mm_mul_ps
+#define V_DIV _mm_div_ps
+#define V_MIN _mm_min_ps
+#define V_MAX _mm_max_ps
+#define V_AND _mm_and_ps
+#define V_OR _mm_or_ps
+#define V_ANDNOT _mm_andnot_ps
+#define V_GT _mm_cmpgt_ps
+#define V_LT _mm_cmplt_ps
+#define V_GE _mm_cmpge_ps
+#define V_LE _mm_cmple_ps
+#define V_MASK _mm_movemask_ps
+#endif
+
+// 4 aabbs to minv[axis] = { aabb0.min[axis], aabb1.min[axis], ... }, the same for maxv
+static inline void
+transpose_aabb4(const float *aabb, __m128 minv[3], __m128 maxv[3]) {
+	__m128 r0 = _mm_loadu_ps(aabb);
+	__m128 r1 = _mm_loadu_ps(aabb + 8);
+	__m128 r2 = _mm_loadu_ps(aabb + 16);
+	__m128 r3 = _mm_loadu_ps(aabb + 24);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	minv[0] = r0; minv[1] = r1; minv[2] = r2;
+	r0 = _mm_loadu_ps(aabb + 4);
+	r1 = _mm_loadu_ps(aabb + 12);
+	r2 = _mm_loadu_ps(aabb + 20);
+	r3 = _mm_loadu_ps(aabb + 28);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	maxv[0] = r0; maxv[1] = r1; maxv[2] = r2;
+}
+
+static inline void
+transpose_aabb(const float *aabb, lanes_v minv[3], lanes_v maxv[3]) {
+#ifdef BATCH_AVX
+	__m128 lmin[3], lmax[3], hmin[3], hmax[3];
+	int k;
+	transpose_aabb4(aabb, lmin, lmax);
+	transpose_aabb4(aabb + 32, hmin, hmax);
+	for (k=0;k<3;k++) {
+		minv[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(lmin[k]), hmin[k], 1);
+		maxv[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(lmax[k]), hmax[k], 1);
+	}
+#else
+	transpose_aabb4(aabb, minv, maxv);
+#endif
+}
+
+// The 6 planes as broadcasts, pos tells if the normal is positive on an axis,
+// where the nearest corner is the min one.
+struct cull_planes {
+	lanes_v p[6][3];
+	lanes_v nw[6];
+	int pos[6][3];
+};
+
+static void
+cull_planes_init(struct cull_planes *c, const float *planes) {
+	int j, k;
+	for (j=0;j<6;j++) {
+		for (k=0;k<3;k++) {
+			c->p[j][k] = V_SET1(planes[j * 4 + k]);
+			c->pos[j][k] = planes[j * 4 + k] > 0.0f;
+		}
+		c->nw[j] = V_SET1(-planes[j * 4 + 3]);
+	}
+}
+
+// LANES aabbs at once, each lane is an aabb and each plane a broadcast. The corner
+// of an axis is picked once per plane, and minD, maxD are summed in the order of
+// plane_aabb_intersect. *front is the mask of the lanes in front of all planes,
+// *back of the lanes behind one of them.
+static inline void
+cull_lanes(const struct cull_planes *c, const lanes_v minv[3], const lanes_v maxv[3], int *front, int *back) {
+	lanes_v f = V_SET1(0), b = V_SET1(0);
+	int j, k;
+	for (j=0;j<6;j++) {
+		lanes_v minD = V_MUL(c->p[j][0], c->pos[j][0] ? minv[0] : maxv[0]);
+		lanes_v maxD = V_MUL(c->p[j][0], c->pos[j][0] ? maxv[0] : minv[0]);
+		for (k=1;k<3;k++) {
+			minD = V_ADD(minD, V_MUL(c->p[j][k], c->pos[j][k] ? minv[k] : maxv[k]));
+			maxD = V_ADD(maxD, V_MUL(c->p[j][k], c->pos[j][k] ? maxv[k] : minv[k]));
+		}
+		const lanes_v in = V_GT(minD, c->nw[j]);
+		const lanes_v out = V_ANDNOT(in, V_LT(maxD, c->nw[j]));
+		f = j ? V_AND(f, in) : in;
+		b = V_OR(b, out);
+	}
+	*front = V_MASK(f);
+	*back = V_MASK(b);
+}
+
+void
+math3d_batch_frustum_intersect_aabb(signed char *result, const float *planes, const float *aabb, int n) {
+	struct cull_planes c;
+	int i, k;
+	cull_planes_init(&c, planes);
+	for (i=0;i+LANES<=n;i+=LANES) {
+		lanes_v minv[3], maxv[3];
+		int front, back;
+		transpose_aabb(aabb + i * 8, minv, maxv);
+		cull_lanes(&c, minv, maxv, &front, &back);
+		for (k=0;k<LANES;k++) {
+			result[i + k] = (back >> k & 1) ? -1 : (front >> k & 1);
+		}
+	}
+	frustum_intersect_aabb(result + i, planes, aabb + i * 8, n - i);
+}
+
+#else
+
+// glm::min and glm::max
+static inline float
+min_f(float x, float y) {
+	return (y < x) ? y : x;
+}
+
+static inline float
+max_f(float x, float y) {
+	return (x < y) ? y : x;
+}
+
+void
+math3d_batch_mul_matrix(float *out, const float *lhs, int lstride, const float *rhs, int rstride, int n) {
+	float c[16];
+	int i, j, k;
+	for (i=0;i<n;i++) {
+		for (j=0;j<4;j++) {
+			const float *b = rhs + j * 4;
+			for (k=0;k<4;k++) {
+				float r = lhs[k] * b[0];
+				r += lhs[4 + k] * b[1];
+				r += lhs[8 + k] * b[2];
+				c[j * 4 + k] = r + lhs[12 + k] * b[3];
+			}
+		}
+		// out may be the same as lhs or rhs
+		memcpy(out, c, sizeof(c));
+		out += 16;
+		lhs += lstride;
+		rhs += rstride;
+	}
+}
+
+void
+math3d_batch_transform(float *out, const float *mat, const float *v, const float *w, int n) {
+	int i, k;
+	for (i=0;i<n;i++) {
+		const float vw = w ? *w : v[3];
+		float r[4];
+		for (k=0;k<4;k++) {
+			r[k] = (mat[k] * v[0] + mat[4 + k] * v[1]) + (mat[8 + k] * v[2] + mat[12 + k] * vw);
+		}
+		memcpy(out, r, sizeof(r));
+		out += 4;
+		v += 4;
+	}
+}
+
+void
+math3d_batch_aabb_transform(float *out, const float *mat, const float *aabb, int n) {
+	float r[8];
+	int i, k;
+	for (i=0;i<n;i++) {
+		for (k=0;k<4;k++) {
+			const float xa = mat[k] * aabb[0], xb = mat[k] * aabb[4];
+			const float ya = mat[4 + k] * aabb[1], yb = mat[4 + k] * aabb[5];
+			const float za = mat[8 + k] * aabb[2], zb = mat[8 + k] * aabb[6];
+			r[k] = min_f(xa, xb) + min_f(ya, yb) + min_f(za, zb) + mat[12 + k];
+			r[4 + k] = max_f(xa, xb) + max_f(ya, yb) + max_f(za, zb) + mat[12 + k];
+		}
+		memcpy(out, r, sizeof(r));
+		out += 8;
+		aabb += 8;
+	}
+}
+
+void
+math3d_batch_frustum_intersect_aabb(signed char *result, const float *planes, const float *aabb, int n) {
+	frustum_intersect_aabb(result, planes, aabb, n);
+}
+
+#endif // BATCH_SSE
+
+// SoA queries, the SIMD paths take LANES elements a step and the rest goes
+// through the scalar ones below.
+
+// lane_min and lane_max are _mm_min_ps and _mm_max_ps, b when either is NaN
+static inline float
+lane_min(float a, float b) {
+	return a < b ? a : b;
+}
+
+static inline float
+lane_max(float a, float b) {
+	return a > b ? a : b;
+}
+
+static int
+soa_frustum_aabb(const float *planes, const float *const aabb[6], int i) {
+	float v[8];
+	signed char where;
+	v[0] = aabb[0][i]; v[1] = aabb[1][i]; v[2] = aabb[2][i]; v[3] = 0;
+	v[4] = aabb[3][i]; v[5] = aabb[4][i]; v[6] = aabb[5][i]; v[7] = 0;
+	frustum_intersect_aabb(&where, planes, v, 1);
+	return where >= 0;
+}
+
+// slab test, a hit enters the box before it exits, within [0, tmax]
+static int
+soa_ray_aabb(const float *o, const float *inv, float tmax, const float *const aabb[6], int i) {
+	float enter = 0.0f, exit = tmax;
+	int k;
+	for (k=0;k<3;k++) {
+		const float t1 = (aabb[k][i] - o[k]) * inv[k];
+		const float t2 = (aabb[k + 3][i] - o[k]) * inv[k];
+		enter = lane_max(enter, lane_min(t1, t2));
+		exit = lane_min(exit, lane_max(t1, t2));
+	}
+	return enter <= exit;
+}
+
+#define TRIANGLE_EPSILON 1e-6f
+
+// glm::cross and glm::dot
+static inline void
+cross3(float r[3], const float x[3], const float y[3]) {
+	r[0] = x[1] * y[2] - y[1] * x[2];
+	r[1] = x[2] * y[0] - y[2] * x[0];
+	r[2] = x[0] * y[1] - y[0] * x[1];
+}
+
+static inline float
+dot3(const float a[3], const float b[3]) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// intersect_triangle3 of math3dfunc.cpp
+static int
+soa_ray_triangle(const float *o, const float *d, const float *const tri[9], int i, float *t) {
+	const float v0[3] = { tri[0][i], tri[1][i], tri[2][i] };
+	const float e1[3] = { tri[3][i] - v0[0], tri[4][i] - v0[1], tri[5][i] - v0[2] };
+	const float e2[3] = { tri[6][i] - v0[0], tri[7][i] - v0[1], tri[8][i] - v0[2] };
+	float pvec[3], tvec[3], qvec[3];
+	cross3(pvec, d, e2);
+	const float det = dot3(e1, pvec);
+	const float inv_det = 1.f / det;
+	tvec[0] = o[0] - v0[0];
+	tvec[1] = o[1] - v0[1];
+	tvec[2] = o[2] - v0[2];
+	cross3(qvec, tvec, e1);
+	if (det > TRIANGLE_EPSILON) {
+		const float u = dot3(tvec, pvec);
+		if (u < 0.f || u > det)
+			return 0;
+		const float v = dot3(d, qvec);
+		if (v < 0.f || (u + v) > det)
+			return 0;
+	} else if (det < -TRIANGLE_EPSILON) {
+		const float u = dot3(tvec, pvec);
+		if (u > 0.f || u < det)
+			return 0;
+		const float v = dot3(d, qvec);
+		if (v > 0.f || (u + v) < det)
+			return 0;
+	} else {
+		return 0;
+	}
+	*t = dot3(e2, qvec) * inv_det;
+	return 1;
+}
+
+#define BIT_SET(bits, i) ((bits)[(i) >> 5] |= 1u << ((i) & 31))
+
+void
+math3d_batch_soa_frustum_aabb(uint32_t *bits, const float *planes, const float *const aabb[6], int n) {
+	int i = 0;
+	memset(bits, 0, MATH3D_BITS_WORDS(n) * sizeof(uint32_t));
+#ifdef BATCH_SSE
+	struct cull_planes c;
+	int k;
+	cull_planes_init(&c, planes);
+	for (;i+LANES<=n;i+=LANES) {
+		lanes_v minv[3], maxv[3];
+		int front, back;
+		for (k=0;k<3;k++) {
+			minv[k] = V_LOAD(aabb[k] + i);
+			maxv[k] = V_LOAD(aabb[k + 3] + i);
+		}
+		cull_lanes(&c, minv, maxv, &front, &back);
+		bits[i >> 5] |= (uint32_t)(~back & ((1 << LANES) - 1)) << (i & 31);
+	}
+#endif
+	for (;i<n;i++) {
+		if (soa_frustum_aabb(planes, aabb, i))
+			BIT_SET(bits, i);
+	}
+}
+
+void
+math3d_batch_soa_ray_aabb(uint32_t *bits, const float *o, const float *d, float tmax, const float *const aabb[6], int n) {
+	const float inv[3] = { 1.0f / d[0], 1.0f / d[1], 1.0f / d[2] };
+	int i = 0;
+	memset(bits, 0, MATH3D_BITS_WORDS(n) * sizeof(uint32_t));
+#ifdef BATCH_SSE
+	lanes_v ov[3], iv[3];
+	int k;
+	for (k=0;k<3;k++) {
+		ov[k] = V_SET1(o[k]);
+		iv[k] = V_SET1(inv[k]);
+	}
+	for (;i+LANES<=n;i+=LANES) {
+		lanes_v enter = V_SET1(0.0f), exit = V_SET1(tmax);
+		for (k=0;k<3;k++) {
+			const lanes_v t1 = V_MUL(V_SUB(V_LOAD(aabb[k] + i), ov[k]), iv[k]);
+			const lanes_v t2 = V_MUL(V_SUB(V_LOAD(aabb[k + 3] + i), ov[k]), iv[k]);
+			enter = V_MAX(enter, V_MIN(t1, t2));
+			exit = V_MIN(exit, V_MAX(t1, t2));
+		}
+		bits[i >> 5] |= (uint32_t)V_MASK(V_LE(enter, exit)) << (i & 31);
+	}
+#endif
+	for (;i<n;i++) {
+		if (soa_ray_aabb(o, inv, tmax, aabb, i))
+			BIT_SET(bits, i);
+	}
+}
+
+#ifdef BATCH_SSE
+static inline lanes_v
+lanes_dot(lanes_v ax, lanes_v ay, lanes_v az, lanes_v bx, lanes_v by, lanes_v bz) {
+	return V_ADD(V_ADD(V_MUL(ax, bx), V_MUL(ay, by)), V_MUL(az, bz));
+}
+#endif
+
+int
+math3d_batch_soa_ray_triangles(uint32_t *bits, float *t, const float *o, const float *d, float tmax, const float *const tri[9], int n) {
+	int nearest = -1;
+	float nearest_t = tmax;
+	int i = 0;
+	if (bits)
+		memset(bits, 0, MATH3D_BITS_WORDS(n) * sizeof(uint32_t));
+#ifdef BATCH_SSE
+	const lanes_v zero = V_SET1(0.0f), one = V_SET1(1.f);
+	const lanes_v eps = V_SET1(TRIANGLE_EPSILON), neps = V_SET1(-TRIANGLE_EPSILON);
+	const lanes_v limit = V_SET1(tmax);
+	const lanes_v dx = V_SET1(d[0]), dy = V_SET1(d[1]), dz = V_SET1(d[2]);
+	const lanes_v ox = V_SET1(o[0]), oy = V_SET1(o[1]), oz = V_SET1(o[2]);
+	float lt[LANES];
+	int k;
+	for (;i+LANES<=n;i+=LANES) {
+		const lanes_v v0x = V_LOAD(tri[0] + i), v0y = V_LOAD(tri[1] + i), v0z = V_LOAD(tri[2] + i);
+		const lanes_v e1x = V_SUB(V_LOAD(tri[3] + i), v0x);
+		const lanes_v e1y = V_SUB(V_LOAD(tri[4] + i), v0y);
+		const lanes_v e1z = V_SUB(V_LOAD(tri[5] + i), v0z);
+		const lanes_v e2x = V_SUB(V_LOAD(tri[6] + i), v0x);
+		const lanes_v e2y = V_SUB(V_LOAD(tri[7] + i), v0y);
+		const lanes_v e2z = V_SUB(V_LOAD(tri[8] + i), v0z);
+		// pvec = cross(d, e2), qvec = cross(tvec, e1)
+		const lanes_v px = V_SUB(V_MUL(dy, e2z), V_MUL(e2y, dz));
+		const lanes_v py = V_SUB(V_MUL(dz, e2x), V_MUL(e2z, dx));
+		const lanes_v pz = V_SUB(V_MUL(dx, e2y), V_MUL(e2x, dy));
+		const lanes_v det = lanes_dot(e1x, e1y, e1z, px, py, pz);
+		const lanes_v inv_det = V_DIV(one, det);
+		const lanes_v tx = V_SUB(ox, v0x);
+		const lanes_v ty = V_SUB(oy, v0y);
+		const lanes_v tz = V_SUB(oz, v0z);
+		const lanes_v qx = V_SUB(V_MUL(ty, e1z), V_MUL(e1y, tz));
+		const lanes_v qy = V_SUB(V_MUL(tz, e1x), V_MUL(e1z, tx));
+		const lanes_v qz = V_SUB(V_MUL(tx, e1y), V_MUL(e1x, ty));
+		const lanes_v u = lanes_dot(tx, ty, tz, px, py, pz);
+		const lanes_v v = lanes_dot(dx, dy, dz, qx, qy, qz);
+		const lanes_v uv = V_ADD(u, v);
+		const lanes_v reject_pos = V_OR(V_OR(V_LT(u, zero), V_GT(u, det)), V_OR(V_LT(v, zero), V_GT(uv, det)));
+		const lanes_v reject_neg = V_OR(V_OR(V_GT(u, zero), V_LT(u, det)), V_OR(V_GT(v, zero), V_LT(uv, det)));
+		lanes_v hit = V_OR(V_ANDNOT(reject_pos, V_GT(det, eps)), V_ANDNOT(reject_neg, V_LT(det, neps)));
+		const lanes_v tv = V_MUL(lanes_dot(e2x, e2y, e2z, qx, qy, qz), inv_det);
+		hit = V_AND(hit, V_AND(V_GE(tv, zero), V_LE(tv, limit)));
+		const int mask = V_MASK(hit);
+		if (mask) {
+			if (bits)
+				bits[i >> 5] |= (uint32_t)mask << (i & 31);
+			V_STORE(lt, tv);
+			for (k=0;k<LANES;k++) {
+				if ((mask >> k & 1) && (nearest < 0 || lt[k] < nearest_t)) {
+					nearest = i + k;
+					nearest_t = lt[k];
+				}
+			}
+		}
+	}
+#endif
+	for (;i<n;i++) {
+		float ti;
+		if (soa_ray_triangle(o, d, tri, i, &ti) && ti >= 0.f && ti <= tmax) {
+			if (bits)
+				BIT_SET(bits, i);
+			if (nearest < 0 || ti < nearest_t) {
+				nearest = i;
+				nearest_t = ti;
+			}
+		}
+	}
+	if (nearest >= 0 && t)
+		*t = nearest_t;
+	return nearest;
+}
@@ -0,0 +1,38 @@
+#ifndef math3d_batch_h
+#define math3d_batch_h
+
+#include <stdint.h>
+
+// Batch kernels over contiguous arrays of the math page storage.
+// A matrix is 16 floats in column major, an aabb is 2 vec4 (min, max).
+// The SSE2/AVX paths follow the operation order of the glm code they replace,
+// so results are the same as the scalar path bit for bit.
+
+// out[i] = lhs[i] * rhs[i], stride is 16 to walk an array or 0 to repeat one matrix
+void math3d_batch_mul_matrix(float *out, const float *lhs, int lstride, const float *rhs, int rstride, int n);
+
+// out[i] = mat * v[i], w replaces the w of each v[i] when it's not NULL
+void math3d_batch_transform(float *out, const float *mat, const float *v, const float *w, int n);
+
+// out[i] = aabb[i] transformed by mat, see math3d_aabb_transform
+void math3d_batch_aabb_transform(float *out, const float *mat, const float *aabb, int n);
+
+// result[i] = 1 inside, 0 intersect, -1 outside of the 6 planes, see math3d_frustum_intersect_aabb
+void math3d_batch_frustum_intersect_aabb(signed char *result, const float *planes, const float *aabb, int n);
+
+// SoA queries over arrays of floats, an aabb list is minx, miny, minz, maxx, maxy, maxz
+// and a triangle list v0.xyz, v1.xyz, v2.xyz, 9 arrays of n floats.
+// Results are bitsets, element i is bits[i / 32] >> (i % 32) & 1.
+#define MATH3D_BITS_WORDS(n) (((n) + 31) / 32)
+
+// aabbs inside or intersecting the 6 planes
+void math3d_batch_soa_frustum_aabb(uint32_t *bits, const float *planes, const float *const aabb[6], int n);
+
+// aabbs hit by the ray o + d * t, 0 <= t <= tmax
+void math3d_batch_soa_ray_aabb(uint32_t *bits, const float *o, const float *d, float tmax, const float *const aabb[6], int n);
+
+// triangles hit by the ray o + d * t, 0 <= t <= tmax, see math3d_ray_triangles.
+// Returns the nearest one and its t, or -1. bits can be NULL.
+int math3d_batch_soa_ray_triangles(uint32_t *bits, float *t, const float *o, const float *d, float tmax, const float *const tri[9], int n);
+
+#endif
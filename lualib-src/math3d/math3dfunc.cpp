@@ -8,6 +8,7 @@
 extern "C" {
 	#include "mathid.h"
 	#include "math3dfunc.h"
+	#include "math3dbatch.h"
 }
 
 #ifndef M_PI
@@ -390,14 +391,6 @@ math3d_mul_matrix(struct math_context *M, math_t v1, math_t v2) {
 	return id;
 }
 
-static inline void
-matrix_mul(float * output, const float *m1, const float *m2) {
-	glm::mat4x4 & omat = *(glm::mat4x4 *)(output);
-	const glm::mat4x4 & mat1 = *(const glm::mat4x4 *)(m1);
-	const glm::mat4x4 & mat2 = *(const glm::mat4x4 *)(m2);
-	omat = mat1 * mat2;
-}
-
 math_t
 math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, math_t output_ref) {
 	int reverse = 0;
@@ -421,13 +414,10 @@ math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, ma
 				if (output_sz < sz)
 					sz = output_sz;
 			}
-			int i;
 			const float * lm = math_value(M, mat);
 			const float * rm = math_value(M, array_mat);
 			float * out_buf = math_init(M, output_ref);
-			for (i=0;i<sz;i++) {
-				matrix_mul(out_buf + i * 16, lm + i * 16, rm + i * 16);
-			}
+			math3d_batch_mul_matrix(out_buf, lm, 16, rm, 16, sz);
 			return output_ref;
 		}
 	}
@@ -456,19 +446,33 @@ math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, ma
 		if (output_sz < sz)
 			sz = output_sz;
 	}
-	int i;
 	const float * m = math_value(M, mat);
 	float * out_buf = math_init(M, output_ref);
 	const float * in_buf = math_value(M, array_mat);
 	if (reverse) {
-		for (i=0;i<sz;i++) {
-			matrix_mul(out_buf + i * 16, in_buf + i * 16, m);
-		}
+		math3d_batch_mul_matrix(out_buf, in_buf, 16, m, 0, sz);
 	} else {
-		for (i=0;i<sz;i++) {
-			matrix_mul(out_buf + i * 16, m, in_buf + i * 16);
-		}
+		math3d_batch_mul_matrix(out_buf, m, 0, in_buf, 16, sz);
+	}
+	return output_ref;
+}
+
+math_t
+math3d_transform_array(struct math_context *M, math_t mat, math_t array_vec, const float *w, math_t output_ref) {
+	check_type(M, mat, MATH_TYPE_MAT);
+	check_type(M, array_vec, MATH_TYPE_VEC4);
+	int sz = math_size(M, array_vec);
+	if (math_isnull(output_ref)) {
+		output_ref = math_import(M, NULL, MATH_TYPE_VEC4, sz);
+	} else {
+		int output_sz = math_size(M, output_ref);
+		if (output_sz < sz)
+			sz = output_sz;
 	}
+	const float * m = math_value(M, mat);
+	const float * in_buf = math_value(M, array_vec);
+	float * out_buf = math_init(M, output_ref);
+	math3d_batch_transform(out_buf, m, in_buf, w, sz);
 	return output_ref;
 }
 
@@ -1121,34 +1125,35 @@ math3d_aabb_isvalid(struct math_context *M, math_t aabb) {
 
 math_t
 math3d_aabb_transform(struct math_context *M, math_t trans, math_t aabb) {
-	const auto& t = MAT(M, trans);
-
-	auto a = AABB(M, aabb);
-
-	const glm::vec4 &right	= t[0];
-	const glm::vec4 &up 	= t[1];
-	const glm::vec4 &forward= t[2];
-	const glm::vec4 &pos 	= t[3];
-
-	const glm::vec4 xa = right * a.minv.x;
-	const glm::vec4 xb = right * a.maxv.x;
-
-	const glm::vec4 ya = up * a.minv.y;
-	const glm::vec4 yb = up * a.maxv.y;
-
-	const glm::vec4 za = forward * a.minv.z;
-	const glm::vec4 zb = forward * a.maxv.z;
+	check_type(M, trans, MATH_TYPE_MAT);
+	check_type(M, aabb, MATH_TYPE_VEC4);
 
 	math_t r = math_import(M, NULL, MATH_TYPE_VEC4, 2);
-
-	auto o = initaabb(M, r);
-
-	o.minv = glm::min(xa, xb) + glm::min(ya, yb) + glm::min(za, zb) + pos;
-	o.maxv = glm::max(xa, xb) + glm::max(ya, yb) + glm::max(za, zb) + pos;
+	// min = min(right * min.x, right * max.x) + ... + pos, the same for max
+	math3d_batch_aabb_transform(math_init(M, r), math_value(M, trans), math_value(M, aabb), 1);
 
 	return r;
 }
 
+math_t
+math3d_aabb_transform_array(struct math_context *M, math_t trans, math_t array_aabb, math_t output_ref) {
+	check_type(M, trans, MATH_TYPE_MAT);
+	check_type(M, array_aabb, MATH_TYPE_VEC4);
+	int sz = math_size(M, array_aabb) / 2;
+	if (math_isnull(output_ref)) {
+		output_ref = math_import(M, NULL, MATH_TYPE_VEC4, sz * 2);
+	} else {
+		int output_sz = math_size(M, output_ref) / 2;
+		if (output_sz < sz)
+			sz = output_sz;
+	}
+	const float * m = math_value(M, trans);
+	const float * in_buf = math_value(M, array_aabb);
+	float * out_buf = math_init(M, output_ref);
+	math3d_batch_aabb_transform(out_buf, m, in_buf, sz);
+	return output_ref;
+}
+
 math_t
 math3d_aabb_center_extents(struct math_context *M, math_t aabb) {
 	math_t result = math_import(M, NULL, MATH_TYPE_VEC4, 2);
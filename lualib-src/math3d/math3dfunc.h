@@ -21,6 +21,7 @@ math_t math3d_mul_vec(struct math_context *, math_t v1, math_t v2);
 math_t math3d_mul_quat(struct math_context *, math_t v1, math_t v2);
 math_t math3d_mul_matrix(struct math_context *, math_t v1, math_t v2);
 math_t math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, math_t output_ref);
+math_t math3d_transform_array(struct math_context *M, math_t mat, math_t array_vec, const float *w, math_t output_ref);	// w replaces vec.w if not NULL
 float  math3d_length(struct math_context *, math_t v);
 math_t math3d_floor(struct math_context *, math_t v);
 math_t math3d_ceil(struct math_context *, math_t v);
@@ -64,6 +65,7 @@ math_t math3d_minmax(struct math_context *, math_t transform, math_t v);   // re
 int    math3d_aabb_isvalid(struct math_context *, math_t aabb);
 math_t math3d_aabb_merge(struct math_context *, math_t aabblhs, math_t aabbrhs);
 math_t math3d_aabb_transform(struct math_context *, math_t mat, math_t aabb);
+math_t math3d_aabb_transform_array(struct math_context *, math_t mat, math_t array_aabb, math_t output_ref);	// vec4[2n] aabbs
 math_t math3d_aabb_center_extents(struct math_context *, math_t aabb);	// return { center , extents }
 int    math3d_aabb_intersect_plane(struct math_context *, math_t aabb, math_t plane);
 math_t math3d_aabb_intersection(struct math_context *, math_t aabb1, math_t aabb2);
@@ -4,11 +4,16 @@
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 
-#define DEFAULT_MAX_PAGE 256
+#define DEFAULT_MAX_PAGE 32
 #define PAGE_SIZE 2048
+#define MAX_PAGE (0x10000000 / PAGE_SIZE)	// index is 28 bits
 #define UNMARK_SIZE 1024
 #define INVALID_MARK_COUNT 255
+#define TRANSIENT_IDLE_FRAME 8
+#define POOL_MAX_PAGE 64
+#define SHARED_CONSTANT_PAGE 4096
 
 struct page {
 	float v[PAGE_SIZE][4];
@@ -46,6 +51,7 @@ struct pages {
 	struct page * transient;
 	struct page * marked;
 	struct marked_count *count;
+	int transient_frame;	// the last frame allocates in this transient page
 };
 
 struct math_context {
@@ -56,19 +62,95 @@ struct math_context {
 	int frame;
 	int last_frame;
 	int n;
-	int base;
-	int top;
+	int transient_n;
+	int last_n;
+	int transient_top;
+	int transient_page;
+	int transient_peak;
+	int grow_n;
 	int marked_page;
 	int marked_n;
 	int marked_slot;
 	int constant_n;
+	int shared_constant;
 	int ref_n;
 	uint32_t flags;
 };
 
+// Free pages of all the contexts in the process. Pages released by one context
+// (idle transient pages, or every page of a deleted context) are reused by the others.
+static struct {
+	atomic_flag lock;
+	int n;
+	struct page *page[POOL_MAX_PAGE];
+} page_pool = { .lock = ATOMIC_FLAG_INIT };
+
+struct constant_slot {
+	uint32_t hash;
+	int index;
+	int n;
+};
+
+// Constants of the contexts created with math_share_constant. They are never freed,
+// so the same constant id is valid in all of these contexts.
+static struct {
+	atomic_flag lock;
+	atomic_int n;
+	int slot_n;
+	int slot_cap;
+	struct constant_slot *slot;
+	struct page *page[SHARED_CONSTANT_PAGE];
+} shared_constant = { .lock = ATOMIC_FLAG_INIT };
+
+static inline void
+spin_lock(atomic_flag *lock) {
+	while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {}
+}
+
+static inline void
+spin_unlock(atomic_flag *lock) {
+	atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+static struct page *
+new_page(void) {
+	struct page *p = NULL;
+	spin_lock(&page_pool.lock);
+	if (page_pool.n > 0) {
+		p = page_pool.page[--page_pool.n];
+	}
+	spin_unlock(&page_pool.lock);
+	if (p == NULL)
+		p = (struct page *)malloc(sizeof(struct page));
+	return p;
+}
+
+static void
+release_page(struct page *p) {
+	if (p == NULL)
+		return;
+	spin_lock(&page_pool.lock);
+	if (page_pool.n < POOL_MAX_PAGE) {
+		page_pool.page[page_pool.n++] = p;
+		p = NULL;
+	}
+	spin_unlock(&page_pool.lock);
+	free(p);
+}
+
+static int
+pool_pages(void) {
+	spin_lock(&page_pool.lock);
+	int n = page_pool.n;
+	spin_unlock(&page_pool.lock);
+	return n;
+}
+
 static inline int
-transient_used(struct math_context *M, int n) {
-	return (n >= M->base) ? n - M->base : n + M->maxpage * PAGE_SIZE - M->base;
+constant_count(struct math_context *M) {
+	if (M->shared_constant)
+		return atomic_load_explicit(&shared_constant.n, memory_order_acquire);
+	return M->constant_n;
 }
 
 int
@@ -79,17 +161,25 @@ math_info(struct math_context *M, int what) {
 		case MATH_INFO_FRAME:
 			return M->frame;
 		case MATH_INFO_TRANSIENT:
-			return transient_used(M, M->n);
+			return M->transient_n;
 		case MATH_INFO_LAST :
-			return (M->base >= M->top) ? M->base - M->top : M->maxpage * PAGE_SIZE - M->top + M->base;
+			return M->last_n;
 		case MATH_INFO_MARKED:
 			return M->marked_n;
 		case MATH_INFO_CONSTANT:
-			return M->constant_n;
+			return constant_count(M);
 		case MATH_INFO_REF:
 			return M->ref_n;
 		case MATH_INFO_SLOT:
 			return M->marked_slot;
+		case MATH_INFO_PAGE:
+			return M->transient_page;
+		case MATH_INFO_PEAK:
+			return M->transient_peak;
+		case MATH_INFO_GROW:
+			return M->grow_n;
+		case MATH_INFO_POOL:
+			return pool_pages();
 		default:
 			return -1;
 	}
@@ -134,10 +224,18 @@ math_new(int maxpage) {
 	struct math_context * m = (struct math_context *)malloc(sizeof(*m));
 	if (maxpage <= 0)
 		maxpage = DEFAULT_MAX_PAGE;
+	if (maxpage > MAX_PAGE)
+		maxpage = MAX_PAGE;
 	m->maxpage = maxpage;
 	m->frame = 0;
 	m->last_frame = 0;
 	m->n = 0;
+	m->transient_n = 0;
+	m->last_n = 0;
+	m->transient_top = 0;
+	m->transient_page = 0;
+	m->transient_peak = 0;
+	m->grow_n = 0;
 	m->marked_page = 0;
 	m->freelist = NULL;
 	m->p = (struct pages *)malloc(sizeof(struct pages) * maxpage);
@@ -145,14 +243,39 @@ math_new(int maxpage) {
 	m->marked_n = 0;
 	m->marked_slot = 0;
 	m->constant_n = 0;
+	m->shared_constant = 0;
 	m->ref_n = 0;
 	m->flags = 0;
-	m->base = 0;
-	m->top = 0;
 	math_unmarked_init(&m->unmarked);
 	return m;
 }
 
+int
+math_share_constant(struct math_context *M) {
+	if (M->constant_n > 0)
+		return M->shared_constant;
+	M->shared_constant = 1;
+	return 1;
+}
+
+// maxpage is the initial size of the page table, it grows when any kind of page runs out
+static void
+ensure_page(struct math_context *M, int page) {
+	int maxpage = M->maxpage;
+	if (page < maxpage)
+		return;
+	assert(page < MAX_PAGE);
+	int newpage = maxpage * 2;
+	while (newpage <= page)
+		newpage *= 2;
+	if (newpage > MAX_PAGE)
+		newpage = MAX_PAGE;
+	M->p = (struct pages *)realloc(M->p, sizeof(struct pages) * newpage);
+	memset(M->p + maxpage, 0, sizeof(struct pages) * (newpage - maxpage));
+	M->maxpage = newpage;
+	++M->grow_n;
+}
+
 void
 math_set_flag(struct math_context *M, int flag_id, int v) {
 	assert(flag_id >=0 && flag_id < 32);
@@ -179,16 +302,16 @@ math_delete(struct math_context *M) {
 		if (M->p[i].constant == NULL) {
 			break;
 		}
-		free(M->p[i].constant);
+		release_page(M->p[i].constant);
 	}
-	for (i=0;i<maxpage;i++) {
-		free(M->p[i].transient);
+	for (i=0;i<M->transient_top;i++) {
+		release_page(M->p[i].transient);
 	}
 	for (i=0;i<maxpage;i++) {
 		if (M->p[i].marked == NULL) {
 			break;
 		}
-		free(M->p[i].marked);
+		release_page(M->p[i].marked);
 	}
 	for (i=0;i<maxpage;i++) {
 		if (M->p[i].count == NULL) {
@@ -206,18 +329,14 @@ math_memsize(struct math_context *M) {
 	size_t sz = sizeof(*M);
 	int i;
 	int maxpage = M->maxpage;
-	sz += sizeof(struct pages *) * maxpage;
+	sz += sizeof(struct pages) * maxpage;
 	for (i=0;i<maxpage;i++) {
 		if (M->p[i].constant == NULL) {
 			break;
 		}
 		sz += sizeof(struct page);
 	}
-	for (i=0;i<maxpage;i++) {
-		if (M->p[i].transient) {
-			sz += sizeof(struct page);
-		}
-	}
+	sz += sizeof(struct page) * M->transient_page;
 	for (i=0;i<maxpage;i++) {
 		if (M->p[i].marked == NULL) {
 			break;
@@ -234,52 +353,57 @@ math_memsize(struct math_context *M) {
 	return sz;
 }
 
-static void
-alloc_transient_page(struct math_context *M, int page_id) {
-	int top_page = M->top / PAGE_SIZE;
+static int inline
+frame_alive(struct math_context *M, int f) {
+	return (M->frame == f) || (M->last_frame == f);
+}
+
+// A transient page is taken by the current frame. It may hold vectors of the
+// last frame only when its tag is alive, so any other page with memory can be reused.
+static int
+next_transient_page(struct math_context *M) {
 	int i;
-	int from_page = 0;
-	if (page_id < top_page)
-		from_page = page_id + 1;
-	for (i = from_page; i < top_page; i++) {
-		struct page * p = M->p[i].transient;
-		if (p) {
-			// reuse old transient page
-			M->p[page_id].transient = p;
-			M->p[i].transient = NULL;
-			return;
+	int empty = -1;
+	for (i=0;i<M->transient_top;i++) {
+		struct pages *p = &M->p[i];
+		if (p->transient == NULL) {
+			if (empty < 0)
+				empty = i;
+		} else if (!frame_alive(M, p->transient_frame)) {
+			return i;
 		}
 	}
-	M->p[page_id].transient = (struct page *)malloc(sizeof(struct page));
+	if (empty < 0) {
+		empty = M->transient_top++;
+		ensure_page(M, empty);
+	}
+	M->p[empty].transient = new_page();
+	if (++M->transient_page > M->transient_peak)
+		M->transient_peak = M->transient_page;
+	return empty;
 }
 
 static void *
 allocvec(struct math_context *M, int size, int *index) {
+	assert(size <= PAGE_SIZE);
+	// n is the end of the last allocation, 0 means no current page
 	int n = M->n;
-	int rewind = n < M->top;
-	int page_id = n / PAGE_SIZE;
-	int next_page_id = (n + size - 1) / PAGE_SIZE;
-	int maxpage = M->maxpage;
-	if (next_page_id != page_id) {
-		page_id = next_page_id;
-		n = page_id * PAGE_SIZE;
-		assert(size <= PAGE_SIZE);
-	}
-	if (!rewind && page_id >= maxpage) {
-		page_id = 0;
-		n = 0;
-		rewind = 1;
-	}
-	if (M->p[page_id].transient == NULL) {
-		alloc_transient_page(M, page_id);
+	int page_id = 0;
+	int offset = PAGE_SIZE;
+	if (n > 0) {
+		page_id = (n - 1) / PAGE_SIZE;
+		offset = n - page_id * PAGE_SIZE;
 	}
-	*index = n;
-	M->n = n + size;
-	if (rewind) {
-		// transient pages overflow, too mant trabsient vectors
-		assert(M->n < M->top);
+	if (offset + size > PAGE_SIZE) {
+		page_id = next_transient_page(M);
+		offset = 0;
 	}
-	return M->p[page_id].transient->v[*index % PAGE_SIZE];
+	struct pages *p = &M->p[page_id];
+	p->transient_frame = M->frame;
+	*index = page_id * PAGE_SIZE + offset;
+	M->n = *index + size;
+	M->transient_n += size;
+	return p->transient->v[offset];
 }
 
 static inline int
@@ -374,11 +498,6 @@ math_ref_type_(struct math_context *M, struct math_id id) {
 	return r->type;
 }
 
-static int inline
-frame_alive(struct math_context *M, int f) {
-	return (M->frame == f) || (M->last_frame == f);
-}
-
 int
 math_valid(struct math_context *M, math_t id) {
 	union {
@@ -391,7 +510,7 @@ math_valid(struct math_context *M, math_t id) {
 	} else {
 		if (u.s.frame == 0) {
 			// constant
-			return u.s.index <= M->constant_n;
+			return u.s.index <= constant_count(M);
 		} else {
 			// marked
 			int page_id = u.s.index / PAGE_SIZE;
@@ -460,9 +579,11 @@ get_marked(struct math_context *M, int index) {
 
 static inline const float *
 get_constant(struct math_context *M, int index) {
-	assert(index < M->constant_n);
+	assert(index < constant_count(M));
 	int page_id = index / PAGE_SIZE;
 	index %= PAGE_SIZE;
+	if (M->shared_constant)
+		return shared_constant.page[page_id]->v[index];
 	return M->p[page_id].constant->v[index];
 }
 
@@ -570,15 +691,15 @@ math_init(struct math_context *M, math_t id) {
 
 static struct marked_freelist *
 new_marked_page(struct math_context *M) {
+	ensure_page(M, M->marked_page);
 	int maxpage = M->maxpage;
-	assert (M->marked_page < maxpage);
 	int page = M->marked_page++;
 	if (M->marked_page < maxpage) {
 		M->p[M->marked_page].marked = NULL;
 		M->p[M->marked_page].count = NULL;
 	}
 	assert(M->p[page].marked == NULL);
-	M->p[page].marked = (struct page *)malloc(sizeof(struct page));
+	M->p[page].marked = new_page();
 	assert(M->p[page].count == NULL);
 	M->p[page].count = (struct marked_count *)malloc(sizeof(struct marked_count));
 	memset(M->p[page].count, INVALID_MARK_COUNT, sizeof(struct marked_count));
@@ -626,10 +747,10 @@ alloc_vecarray(struct math_context *M, int vecsize) {
 
 static void
 prepare_constant_page(struct math_context *M, int page) {
+	ensure_page(M, page);
 	int maxpage = M->maxpage;
-	assert(page < maxpage);
 	if (M->p[page].constant == NULL) {
-		M->p[page].constant = (struct page *)malloc(sizeof(struct page));
+		M->p[page].constant = new_page();
 		if (page + 1 < maxpage) {
 			M->p[page+1].constant = NULL;
 		}
@@ -663,6 +784,95 @@ alloc_constant(struct math_context *M, const float *v, int n) {
 	return M->constant_n - n;
 }
 
+static uint32_t
+constant_hash(const float *v, int n) {
+	const uint8_t *ptr = (const uint8_t *)v;
+	size_t sz = n * 4 * sizeof(float);
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h = (h ^ ptr[i]) * 16777619u;
+	}
+	return h;
+}
+
+static void
+insert_shared_slot(struct constant_slot *slot, int cap, uint32_t hash, int index, int n) {
+	int i = hash & (cap - 1);
+	while (slot[i].n != 0) {
+		i = (i + 1) & (cap - 1);
+	}
+	slot[i].hash = hash;
+	slot[i].index = index;
+	slot[i].n = n;
+}
+
+// Same as alloc_constant, but on the process-wide store. The values are found
+// by a hash of the whole array instead of a scan. Returns -1 when the store is full.
+static int
+alloc_shared_constant(const float *v, int n) {
+	assert(n <= PAGE_SIZE);
+	uint32_t hash = constant_hash(v, n);
+	spin_lock(&shared_constant.lock);
+	int cap = shared_constant.slot_cap;
+	if (cap > 0) {
+		int i = hash & (cap - 1);
+		struct constant_slot *s;
+		while ((s = &shared_constant.slot[i])->n != 0) {
+			if (s->hash == hash && s->n == n) {
+				const float *vv = shared_constant.page[s->index / PAGE_SIZE]->v[s->index % PAGE_SIZE];
+				if (memcmp(v, vv, n * 4 * sizeof(float)) == 0) {
+					int index = s->index;
+					spin_unlock(&shared_constant.lock);
+					return index;
+				}
+			}
+			i = (i + 1) & (cap - 1);
+		}
+	}
+	int count = atomic_load_explicit(&shared_constant.n, memory_order_relaxed);
+	int page_id = count / PAGE_SIZE;
+	int index = count % PAGE_SIZE;
+	if (index + n > PAGE_SIZE) {
+		page_id++;
+		index = 0;
+	}
+	if (page_id >= SHARED_CONSTANT_PAGE) {
+		spin_unlock(&shared_constant.lock);
+		return -1;
+	}
+	if (shared_constant.page[page_id] == NULL) {
+		shared_constant.page[page_id] = (struct page *)malloc(sizeof(struct page));
+		if (shared_constant.page[page_id] == NULL) {
+			spin_unlock(&shared_constant.lock);
+			return -1;
+		}
+	}
+	memcpy(shared_constant.page[page_id]->v[index], v, n * 4 * sizeof(float));
+	index += page_id * PAGE_SIZE;
+
+	if ((shared_constant.slot_n + 1) * 2 > cap) {
+		int newcap = cap ? cap * 2 : 1024;
+		struct constant_slot *slot = (struct constant_slot *)malloc(sizeof(struct constant_slot) * newcap);
+		memset(slot, 0, sizeof(struct constant_slot) * newcap);
+		int i;
+		for (i=0;i<cap;i++) {
+			struct constant_slot *s = &shared_constant.slot[i];
+			if (s->n != 0)
+				insert_shared_slot(slot, newcap, s->hash, s->index, s->n);
+		}
+		free(shared_constant.slot);
+		shared_constant.slot = slot;
+		shared_constant.slot_cap = newcap;
+	}
+	insert_shared_slot(shared_constant.slot, shared_constant.slot_cap, hash, index, n);
+	++shared_constant.slot_n;
+
+	atomic_store_explicit(&shared_constant.n, index + n, memory_order_release);
+	spin_unlock(&shared_constant.lock);
+	return index;
+}
+
 static int
 is_identity(struct math_context *M, math_t v) {
 	int type = math_type(M, v);
@@ -689,18 +899,26 @@ math_constant(struct math_context *M, math_t v) {
 	}
 	int offset;
 	const float * ptr = math_value(M, v);
+	int n;
 	switch (type) {
 	case MATH_TYPE_MAT:
-		offset = alloc_constant(M, ptr, sz * 4);
+		n = sz * 4;
 		break;
 	case MATH_TYPE_VEC4:
 	case MATH_TYPE_QUAT:
-		offset = alloc_constant(M, ptr, sz);
+		n = sz;
 		break;
 	default:
 		assert(0);
 		return MATH_NULL;
 	}
+	if (M->shared_constant) {
+		offset = alloc_shared_constant(ptr, n);
+		if (offset < 0)
+			return MATH_NULL;
+	} else {
+		offset = alloc_constant(M, ptr, n);
+	}
 	union {
 		math_t id;
 		struct math_id s;
@@ -1055,6 +1273,31 @@ free_unmarked(struct math_context *M) {
 // 	return 1;
 // }
 
+// Release the transient pages not used in the last TRANSIENT_IDLE_FRAME frames,
+// a burst of transient vectors doesn't keep its pages forever.
+static void
+free_idle_transient(struct math_context *M, int frame_mask) {
+	int current = M->n > 0 ? (M->n - 1) / PAGE_SIZE : -1;
+	int top = 0;
+	int i;
+	for (i=0;i<M->transient_top;i++) {
+		struct pages *p = &M->p[i];
+		if (p->transient == NULL)
+			continue;
+		if (!frame_alive(M, p->transient_frame)
+			&& ((M->frame - p->transient_frame) & frame_mask) > TRANSIENT_IDLE_FRAME) {
+			release_page(p->transient);
+			p->transient = NULL;
+			--M->transient_page;
+			if (i == current)
+				M->n = 0;
+		} else {
+			top = i + 1;
+		}
+	}
+	M->transient_top = top;
+}
+
 void
 math_frame(struct math_context *M) {
 	union {
@@ -1067,28 +1310,32 @@ math_frame(struct math_context *M) {
 	if (M->frame > u.s.frame) {
 		M->frame = 0;
 	}
-	int i;
-	for (i=(M->n / PAGE_SIZE) + 1; i < M->maxpage; i ++) {
-		if (M->p[i].transient == NULL)
-			break;
-		free(M->p[i].transient);
-		M->p[i].transient = NULL;
-	}
+	M->last_n = M->transient_n;
+	M->transient_n = 0;
+	free_idle_transient(M, u.s.frame);
 	free_unmarked(M);
-	M->top = M->base;
-	M->base = M->n;
 //	assert(check_freelist(M));
 }
 
-int
+// The frame is kept in the high 32 bits, the page of a checkpoint may be
+// released or reused by another frame once math_frame is called.
+int64_t
 math_checkpoint(struct math_context *M) {
-	return M->n;
+	return ((int64_t)M->frame << 32) | (uint32_t)M->n;
 }
 
-void
-math_recover(struct math_context *M, int cp) {
-	assert(transient_used(M, M->n) >= transient_used(M, cp));
-	M->n = cp;
+int
+math_recover(struct math_context *M, int64_t cp) {
+	int n = (int)(uint32_t)cp;
+	if ((int)(cp >> 32) != M->frame)
+		return 0;
+	if (n > 0 && M->n > 0 && (n - 1) / PAGE_SIZE == (M->n - 1) / PAGE_SIZE) {
+		assert(M->n >= n);
+		M->transient_n -= M->n - n;
+	}
+	// The pages taken after the checkpoint are kept by the current frame
+	M->n = n;
+	return 1;
 }
 
 math_t
@@ -26,16 +26,21 @@ static const math_t MATH_NULL = { 0 };
 #define MATH_INFO_CONSTANT 5
 #define MATH_INFO_REF 6
 #define MATH_INFO_SLOT 7
+#define MATH_INFO_PAGE 8
+#define MATH_INFO_PEAK 9
+#define MATH_INFO_GROW 10
+#define MATH_INFO_POOL 11
 
 struct math_context * math_new(int maxpage);
 void math_delete(struct math_context *);
+int math_share_constant(struct math_context *);	// use the process-wide constant store, before any constant
 int math_info(struct math_context *, int what);
 void math_set_flag(struct math_context *, int flag_id, int v);
 int math_get_flag(struct math_context *, int flag_id);
 size_t math_memsize(struct math_context *);
 void math_frame(struct math_context *);
-int math_checkpoint(struct math_context *);
-void math_recover(struct math_context *, int cp);
+int64_t math_checkpoint(struct math_context *);
+int math_recover(struct math_context *, int64_t cp);	// 0 when cp was taken in another frame
 math_t math_import(struct math_context *, const float *v, int type, int size);
 math_t math_ref(struct math_context *, const float *v, int type, int size);
 math_t math_premark(struct math_context *, int type, int size);
@@ -61,7 +66,7 @@ int math_valid(struct math_context *, math_t id);
 int math_marked(struct math_context *, math_t id);
 void math_print(struct math_context *, math_t id);	// for debug only
 const char * math_typename(int type);
-math_t math_constant(struct math_context *, math_t);
+math_t math_constant(struct math_context *, math_t);	// MATH_NULL when the shared constant store is full
 math_t math_live(struct math_context *, math_t id);
 void math_refcount(struct math_context *, int delta);
 
@@ -0,0 +1,152 @@
+-- zset with integer members (player ids), same interface as zset.lua.
+-- Scores and timestamps are kept by the C side, indexed by member.
+local skiplist = require "skiplist.int"
+local snapshot = require "skiplist.snapshot"
+local shared = require "skiplist.shared"
+local mt = {}
+mt.__index = mt
+
+function mt:add(score, member, ts)
+    self.sl:add(score, member, ts)
+end
+
+function mt:rem(member)
+    self.sl:rem(member)
+end
+
+function mt:rem_range_by_score(min, max)
+    return self.sl:delete_by_score(min, max, self.delete_function)
+end
+
+function mt:count()
+    return self.sl:get_count()
+end
+
+function mt:_reverse_rank(r)
+    return self.sl:get_count() - r + 1
+end
+
+function mt:limit(count)
+    local total = self.sl:get_count()
+    if total <= count then
+        return 0
+    end
+    return self.sl:delete_by_rank(count + 1, total, self.delete_function)
+end
+
+function mt:rev_limit(count)
+    local total = self.sl:get_count()
+    if total <= count then
+        return 0
+    end
+    local from = self:_reverse_rank(count + 1)
+    local to   = self:_reverse_rank(total)
+    return self.sl:delete_by_rank(from, to, self.delete_function)
+end
+
+function mt:rev_range(r1, r2)
+    r1 = self:_reverse_rank(r1)
+    r2 = self:_reverse_rank(r2)
+    return self:range(r1, r2)
+end
+
+function mt:range(r1, r2)
+    if r1 < 1 then
+        r1 = 1
+    end
+
+    if r2 < 1 then
+        r2 = 1
+    end
+    return self.sl:get_rank_range(r1, r2)
+end
+
+function mt:rev_rank(member)
+    local r = self:rank(member)
+    if r then
+        return self:_reverse_rank(r)
+    end
+    return r
+end
+
+function mt:rank(member)
+    return self.sl:rank(member)
+end
+
+function mt:range_by_score(s1, s2)
+    return self.sl:get_score_range(s1, s2)
+end
+
+function mt:score(member)
+    return (self.sl:score(member))
+end
+
+function mt:member_by_rank(r)
+    return self.sl:get_member_by_rank(r)
+end
+
+function mt:member_by_rev_rank(r)
+    r = self:_reverse_rank(r)
+    if r > 0 then
+        return self.sl:get_member_by_rank(r)
+    end
+end
+
+-- entries in rank order, packed for M.bulk_load.
+-- Appends count entries from rank start (default all) to buffer when given
+-- and returns how many, returns a string otherwise.
+function mt:bulk_dump(buffer, start, count)
+    return self.sl:bulk_dump(buffer, start, count)
+end
+
+-- writes the board to path, dumped here in chunks that a background thread
+-- writes as they fill. Returns a writer with done() and wait(), see
+-- lua_skiplist_snapshot.cpp
+function mt:save(path)
+    return snapshot.save(path, self.sl, "int64")
+end
+
+-- publishes a read-only copy of the board under name for every service of
+-- the process, returns the new epoch. Call it at the interval readers need.
+function mt:publish(name)
+    return shared.publish(name, self.sl:bulk_dump(), "int64")
+end
+
+function mt:dump()
+    self.sl:dump()
+end
+
+local M = {}
+function M.new(delete_handler)
+    local obj = {}
+    obj.sl = skiplist.new()
+    obj.delete_function = delete_handler
+    return setmetatable(obj, mt)
+end
+
+-- zset from bulk_dump output, built in O(n) when records are in rank order
+function M.bulk_load(packed, delete_handler)
+    local obj = M.new(delete_handler)
+    obj.sl:bulk_load(packed)
+    return obj
+end
+
+-- zset from a file written by save, nil, err when it can not be read
+function M.restore(path, delete_handler)
+    local packed, err = snapshot.load(path, "int64")
+    if not packed then
+        return nil, err
+    end
+    local obj = M.bulk_load(packed, delete_handler)
+    packed:close()
+    return obj
+end
+
+-- read-only view of the board published under name, with the read methods of
+-- a zset: count, range, rev_range, rank, rev_rank, score, range_by_score,
+-- member_by_rank and member_by_rev_rank. It follows later publishes.
+function M.open_view(name)
+    return shared.open(name)
+end
+
+return M
@@ -1,4 +1,8 @@
 local skiplist = require "skiplist.c"
+-- B+tree engine with the same interface, better locality on large boards
+local btree = require "skiplist.btree"
+local snapshot = require "skiplist.snapshot"
+local shared = require "skiplist.shared"
 local mt = {}
 mt.__index = mt
 
@@ -8,7 +12,7 @@ function mt:add(score, member, ts)
         if old == score then
             return
         end
-        self.sl:delete(old, member)
+        self.sl:delete(old, member, self.ts[member])
     end
 
     self.sl:insert(score, member, ts)
@@ -107,14 +111,35 @@ function mt:member_by_rev_rank(r)
     end
 end
 
+-- entries in rank order, packed for M.bulk_load.
+-- Appends count entries from rank start (default all) to buffer when given
+-- and returns how many, returns a string otherwise.
+function mt:bulk_dump(buffer, start, count)
+    return self.sl:bulk_dump(buffer, start, count)
+end
+
+-- writes the board to path, dumped here in chunks that a background thread
+-- writes as they fill. Returns a writer with done() and wait(), see
+-- lua_skiplist_snapshot.cpp
+function mt:save(path)
+    return snapshot.save(path, self.sl, "string")
+end
+
+-- publishes a read-only copy of the board under name for every service of
+-- the process, returns the new epoch. Call it at the interval readers need.
+function mt:publish(name)
+    return shared.publish(name, self.sl:bulk_dump(), "string")
+end
+
 function mt:dump()
     self.sl:dump()
 end
 
 local M = {}
-function M.new(delete_handler)
+-- engine: "btree" for the B+tree, the skiplist otherwise
+function M.new(delete_handler, engine)
     local obj = {}
-    obj.sl = skiplist()
+    obj.sl = engine == "btree" and btree() or skiplist()
     obj.tbl = {}
     obj.ts = {}
     obj.delete_function = function(member)
@@ -126,4 +151,29 @@ function M.new(delete_handler)
     return setmetatable(obj, mt)
 end
 
+-- zset from bulk_dump output, built in O(n) when records are in rank order
+function M.bulk_load(packed, delete_handler, engine)
+    local obj = M.new(delete_handler, engine)
+    obj.sl:bulk_load(packed, obj.tbl, obj.ts)
+    return obj
+end
+
+-- zset from a file written by save, nil, err when it can not be read
+function M.restore(path, delete_handler, engine)
+    local packed, err = snapshot.load(path, "string")
+    if not packed then
+        return nil, err
+    end
+    local obj = M.bulk_load(packed, delete_handler, engine)
+    packed:close()
+    return obj
+end
+
+-- read-only view of the board published under name, with the read methods of
+-- a zset: count, range, rev_range, rank, rev_rank, score, range_by_score,
+-- member_by_rank and member_by_rev_rank. It follows later publishes.
+function M.open_view(name)
+    return shared.open(name)
+end
+
 return M
@@ -0,0 +1,408 @@
+//
+// Navmesh query benchmark: loads an MSET (static) or TSET (tile cache) file,
+// replays a query log and reports latency percentiles, a log2 latency
+// histogram and queries per second for each query type.
+//
+// usage: navmesh_bench <mesh> [options]
+//   -l <file>   replay a recorded query log instead of generating one
+//   -o <file>   record the generated log, for replay after a change
+//   -n <count>  generated queries (default 10000)
+//   -t <count>  threads, each replays the log on its own navmesh object (default 1)
+//   -s <seed>   seed of the generated mix (default 1)
+//   -a          rebuild tile cache tiles on the background worker (TSET)
+//
+// Log format, one query per line, '#' starts a comment:
+//   path   sx sy sz ex ey ez     find_straight_path
+//   circle x y z r               random_position_around_circle
+//   ray    sx sy sz ex ey ez     recast
+//   obstacle x y z r h           add_capsule_obstacle (TSET)
+//   update dt                    tile cache update (TSET)
+//   clear                        clear_all_obstacle (TSET)
+//
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "navmesh.hpp"
+
+namespace {
+
+constexpr int HISTOGRAM_BUCKETS = 32; // log2 of nanoseconds
+constexpr int MAX_GENERATED_OBSTACLES = 64;
+constexpr int POSITION_POOL = 1024;
+
+enum query_type { QUERY_PATH, QUERY_CIRCLE, QUERY_RAY, QUERY_OBSTACLE, QUERY_UPDATE, QUERY_CLEAR, QUERY_COUNT };
+
+const char* const QUERY_NAMES[QUERY_COUNT] = { "path", "circle", "ray", "obstacle", "update", "clear" };
+
+constexpr int QUERY_ARGS[QUERY_COUNT] = { 6, 4, 6, 5, 1, 0 };
+
+struct query {
+    query_type type;
+    float args[6];
+};
+
+struct bench_options {
+    std::string mesh;
+    std::string log;
+    std::string record;
+    int count = 10000;
+    int threads = 1;
+    unsigned seed = 1;
+    bool async = false;
+};
+
+// latencies in nanoseconds of one query type
+struct query_stats {
+    std::vector<int64_t> samples;
+    int64_t failed = 0;
+    int64_t total = 0;
+
+    void merge(const query_stats& other) {
+        samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+        failed += other.failed;
+        total += other.total;
+    }
+};
+
+using stats_set = std::array<query_stats, QUERY_COUNT>;
+
+bool parse_options(int argc, char** argv, bench_options& o) {
+    if (argc < 2)
+        return false;
+    o.mesh = argv[1];
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-a") {
+            o.async = true;
+        } else if (arg == "-l" && has_value) {
+            o.log = argv[++i];
+        } else if (arg == "-o" && has_value) {
+            o.record = argv[++i];
+        } else if (arg == "-n" && has_value) {
+            o.count = std::atoi(argv[++i]);
+        } else if (arg == "-t" && has_value) {
+            o.threads = std::atoi(argv[++i]);
+        } else if (arg == "-s" && has_value) {
+            o.seed = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            return false;
+        }
+    }
+    return o.count > 0 && o.threads > 0;
+}
+
+bool is_tset(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    int32_t magic = 0;
+    in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    return in && magic == pluto::navmesh::TILECACHESET_MAGIC;
+}
+
+bool load_log(const std::string& path, std::vector<query>& queries, std::string& err) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        err = "can not open " + path;
+        return false;
+    }
+
+    std::string line;
+    int lineno = 0;
+    while (std::getline(in, line)) {
+        ++lineno;
+        if (auto pos = line.find('#'); pos != std::string::npos)
+            line.erase(pos);
+        std::istringstream ss(line);
+        std::string name;
+        if (!(ss >> name))
+            continue;
+
+        auto iter = std::find_if(std::begin(QUERY_NAMES), std::end(QUERY_NAMES), [&](const char* n) {
+            return name == n;
+        });
+        if (iter == std::end(QUERY_NAMES)) {
+            err = path + ":" + std::to_string(lineno) + ": unknown query '" + name + "'";
+            return false;
+        }
+
+        query q {};
+        q.type = (query_type)(iter - std::begin(QUERY_NAMES));
+        for (int i = 0; i < QUERY_ARGS[q.type]; ++i) {
+            if (!(ss >> q.args[i])) {
+                err = path + ":" + std::to_string(lineno) + ": expected "
+                    + std::to_string(QUERY_ARGS[q.type]) + " numbers";
+                return false;
+            }
+        }
+        queries.push_back(q);
+    }
+    return true;
+}
+
+bool save_log(const std::string& path, const std::vector<query>& queries, std::string& err) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        err = "can not write " + path;
+        return false;
+    }
+    for (const auto& q: queries) {
+        fputs(QUERY_NAMES[q.type], fp);
+        for (int i = 0; i < QUERY_ARGS[q.type]; ++i)
+            fprintf(fp, " %.9g", q.args[i]);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    return true;
+}
+
+// Query mix over random points of the mesh: mostly paths and rays, and for a
+// tile cache a trickle of obstacles with updates until the tiles settle.
+bool generate_log(pluto::navmesh& nav, const bench_options& o, bool tset, std::vector<query>& queries) {
+    std::vector<std::array<float, 3>> points;
+    for (int i = 0; i < POSITION_POOL * 4 && (int)points.size() < POSITION_POOL; ++i) {
+        std::array<float, 3> p;
+        if (nav.random_position(p.data()))
+            points.push_back(p);
+    }
+    if (points.empty())
+        return false;
+
+    std::mt19937 rng(o.seed);
+    std::uniform_int_distribution<size_t> pick(0, points.size() - 1);
+    std::uniform_int_distribution<int> roll(0, 99);
+    std::uniform_real_distribution<float> radius(2.0f, 16.0f);
+
+    int obstacles = 0;
+    while ((int)queries.size() < o.count) {
+        const auto& a = points[pick(rng)];
+        const auto& b = points[pick(rng)];
+        int r = roll(rng);
+
+        query q {};
+        if (tset && r >= 90) {
+            if (obstacles >= MAX_GENERATED_OBSTACLES) {
+                q.type = QUERY_CLEAR;
+                obstacles = 0;
+            } else if (r >= 95) {
+                q.type = QUERY_OBSTACLE;
+                q.args[0] = a[0];
+                q.args[1] = a[1];
+                q.args[2] = a[2];
+                q.args[3] = 1.0f;
+                q.args[4] = 2.0f;
+                ++obstacles;
+            } else {
+                q.type = QUERY_UPDATE;
+                q.args[0] = 0.033f;
+            }
+        } else if (r < 45) {
+            q.type = QUERY_PATH;
+            std::copy(a.begin(), a.end(), q.args);
+            std::copy(b.begin(), b.end(), q.args + 3);
+        } else if (r < 60) {
+            q.type = QUERY_CIRCLE;
+            std::copy(a.begin(), a.end(), q.args);
+            q.args[3] = radius(rng);
+        } else {
+            q.type = QUERY_RAY;
+            std::copy(a.begin(), a.end(), q.args);
+            std::copy(b.begin(), b.end(), q.args + 3);
+        }
+        queries.push_back(q);
+    }
+    return true;
+}
+
+bool run_query(pluto::navmesh& nav, const query& q, std::vector<float>& path) {
+    const float* a = q.args;
+    float out[3];
+    switch (q.type) {
+        case QUERY_PATH:
+            path.clear();
+            return nav.find_straight_path(a[0], a[1], a[2], a[3], a[4], a[5], path);
+        case QUERY_CIRCLE:
+            return nav.random_position_around_circle(a[0], a[1], a[2], a[3], out);
+        case QUERY_RAY:
+            // the result is whether the ray is blocked, not success
+            nav.recast(a[0], a[1], a[2], a[3], a[4], a[5], out);
+            return true;
+        case QUERY_OBSTACLE:
+            return nav.add_capsule_obstacle(a[0], a[1], a[2], a[3], a[4]) != 0;
+        case QUERY_UPDATE:
+            nav.update(a[0]);
+            return true;
+        case QUERY_CLEAR:
+            nav.clear_all_obstacle();
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool open_navmesh(pluto::navmesh& nav, const bench_options& o, bool tset, std::string& err) {
+    if (tset) {
+        if (!nav.load_dynamic(o.mesh, err))
+            return false;
+        if (o.async && !nav.set_async_rebuild(true)) {
+            err = "async rebuild not available";
+            return false;
+        }
+    }
+    return true;
+}
+
+void replay(pluto::navmesh& nav, const std::vector<query>& queries, bool tset, stats_set& stats) {
+    std::vector<float> path;
+    for (const auto& q: queries) {
+        // tile cache queries have nothing to do on a static mesh
+        if (!tset && q.type >= QUERY_OBSTACLE)
+            continue;
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = run_query(nav, q, path);
+        auto diff = std::chrono::steady_clock::now() - start;
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(diff).count();
+
+        query_stats& s = stats[q.type];
+        s.samples.push_back(ns);
+        s.total += ns;
+        if (!ok)
+            ++s.failed;
+    }
+}
+
+int bucket_of(int64_t ns) {
+    int b = 0;
+    while (ns > 1 && b < HISTOGRAM_BUCKETS - 1) {
+        ns >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+double us(int64_t ns) {
+    return (double)ns / 1000.0;
+}
+
+void print_stats(const char* name, query_stats& s) {
+    if (s.samples.empty())
+        return;
+
+    std::sort(s.samples.begin(), s.samples.end());
+    auto pct = [&](double p) {
+        size_t i = (size_t)std::ceil(p * (double)s.samples.size());
+        return s.samples[std::clamp<size_t>(i, 1, s.samples.size()) - 1];
+    };
+    size_t n = s.samples.size();
+    double qps = s.total > 0 ? (double)n * 1e9 / (double)s.total : 0.0;
+    printf("%-9s %8zu %7lld %9.1f %9.1f %9.1f %9.1f %9.1f %10.0f\n",
+        name, n, (long long)s.failed, us(s.total / (int64_t)n), us(pct(0.5)), us(pct(0.9)),
+        us(pct(0.99)), us(s.samples.back()), qps);
+
+    std::array<size_t, HISTOGRAM_BUCKETS> hist {};
+    for (int64_t ns: s.samples)
+        ++hist[bucket_of(ns)];
+    size_t peak = *std::max_element(hist.begin(), hist.end());
+    for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+        if (0 == hist[b])
+            continue;
+        int bar = (int)((hist[b] * 40 + peak - 1) / peak);
+        printf("  < %9.1f us %8zu %s\n", us((int64_t)1 << (b + 1)), hist[b], std::string(bar, '#').c_str());
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench_options o;
+    if (!parse_options(argc, argv, o)) {
+        fprintf(stderr,
+            "usage: %s <mesh.mset|mesh.tset> [-l log] [-o record] [-n count] [-t threads] [-s seed] [-a]\n",
+            argv[0]);
+        return 1;
+    }
+
+    std::string err;
+    const bool tset = is_tset(o.mesh);
+    auto start = std::chrono::steady_clock::now();
+    if (!tset && !pluto::navmesh::load_static(o.mesh, err)) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+
+    // one object per thread, a static mesh is shared by all of them
+    std::vector<std::unique_ptr<pluto::navmesh>> navs;
+    for (int i = 0; i < o.threads; ++i) {
+        auto nav = std::make_unique<pluto::navmesh>(tset ? std::string() : o.mesh);
+        if (!open_navmesh(*nav, o, tset, err)) {
+            fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+        }
+        navs.push_back(std::move(nav));
+    }
+    auto loaded = std::chrono::steady_clock::now();
+
+    std::vector<query> queries;
+    if (!o.log.empty()) {
+        if (!load_log(o.log, queries, err)) {
+            fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+        }
+    } else if (!generate_log(*navs[0], o, tset, queries)) {
+        fprintf(stderr, "no walkable position on %s\n", o.mesh.c_str());
+        return 1;
+    }
+
+    if (!o.record.empty() && !save_log(o.record, queries, err)) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+
+    std::vector<stats_set> thread_stats(o.threads);
+    auto replay_start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (int i = 1; i < o.threads; ++i)
+        pool.emplace_back([&, i] { replay(*navs[i], queries, tset, thread_stats[i]); });
+    replay(*navs[0], queries, tset, thread_stats[0]);
+    for (auto& t: pool)
+        t.join();
+    auto done = std::chrono::steady_clock::now();
+
+    stats_set stats;
+    size_t total = 0;
+    for (const auto& ts: thread_stats) {
+        for (int i = 0; i < QUERY_COUNT; ++i)
+            stats[i].merge(ts[i]);
+    }
+    for (const auto& s: stats)
+        total += s.samples.size();
+
+    auto elapsed = [](auto a, auto b) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(b - a).count();
+    };
+    int64_t wall = elapsed(replay_start, done);
+
+    printf("mesh      %s (%s)\n", o.mesh.c_str(), tset ? "tset" : "mset");
+    printf("queries   %zu %s x %d threads%s\n", queries.size(), o.log.empty() ? "generated" : "replayed",
+        o.threads, o.async ? ", async rebuild" : "");
+    printf("load      %9.1f ms\n", us(elapsed(start, loaded)) / 1000.0);
+    printf("replay    %9.1f ms wall, %.0f queries/s\n", us(wall) / 1000.0,
+        wall > 0 ? (double)total * 1e9 / (double)wall : 0.0);
+    printf("\n%-9s %8s %7s %9s %9s %9s %9s %9s %10s\n",
+        "query", "count", "failed", "mean us", "p50 us", "p90 us", "p99 us", "max us", "qps/thread");
+    for (int i = 0; i < QUERY_COUNT; ++i)
+        print_stats(QUERY_NAMES[i], stats[i]);
+    return 0;
+}
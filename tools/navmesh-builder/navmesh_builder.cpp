@@ -0,0 +1,830 @@
+//
+// Offline navmesh builder: OBJ geometry + parameter file -> MSET (static) or
+// TSET (tile cache) files loadable by navmesh.load_static / nav:load_dynamic.
+//
+// usage: navmesh_builder <input.obj> <params.ini> <output> [--allow-partial]
+//
+// Tiles are built in parallel, one rcContext per worker thread. See
+// navmesh_builder.ini for the parameters and their defaults. When a tile
+// fails, the output is left as it was and the exit code is 2, unless
+// --allow-partial writes it without the failed tiles.
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#endif
+
+#include <Recast.h>
+
+#include "navmesh.hpp"
+
+namespace {
+
+constexpr int EXPECTED_LAYERS_PER_TILE = 4;
+constexpr int MAX_LAYERS = 32;
+
+using pluto::navmesh;
+
+struct build_params {
+    std::string format = "mset";
+    float cell_size = 0.3f;
+    float cell_height = 0.2f;
+    float agent_height = 2.0f;
+    float agent_radius = 0.6f;
+    float agent_max_climb = 0.9f;
+    float agent_max_slope = 45.0f;
+    float region_min_size = 8.0f;
+    float region_merge_size = 20.0f;
+    float edge_max_len = 12.0f;
+    float edge_max_error = 1.3f;
+    int verts_per_poly = 6;
+    float detail_sample_dist = 6.0f;
+    float detail_sample_max_error = 1.0f;
+    int tile_size = 48;
+    int max_obstacles = 128;
+    int threads = 0;
+};
+
+struct geometry {
+    std::vector<float> verts;
+    std::vector<int> tris;
+    float bmin[3];
+    float bmax[3];
+};
+
+// triangles overlapping each tile column (with border)
+struct tile_buckets {
+    int tw = 0;
+    int th = 0;
+    std::vector<std::vector<int>> tris;
+};
+
+// built data of one tile, several layers for TSET
+struct tile_result {
+    std::vector<std::pair<unsigned char*, int>> data;
+};
+
+// per stage time in microseconds, summed over threads
+struct build_report {
+    std::atomic<int64_t> rasterize { 0 };
+    std::atomic<int64_t> filter { 0 };
+    std::atomic<int64_t> regions { 0 };
+    std::atomic<int64_t> contours { 0 };
+    std::atomic<int64_t> polymesh { 0 };
+    std::atomic<int64_t> detail { 0 };
+    std::atomic<int64_t> create { 0 };
+    std::atomic<int> empty { 0 };
+    std::atomic<int> failed { 0 };
+};
+
+class stage_timer {
+public:
+    explicit stage_timer(std::atomic<int64_t>& total):
+        total_(total),
+        start_(std::chrono::steady_clock::now()) {}
+
+    ~stage_timer() {
+        auto diff = std::chrono::steady_clock::now() - start_;
+        total_ += std::chrono::duration_cast<std::chrono::microseconds>(diff).count();
+    }
+
+private:
+    std::atomic<int64_t>& total_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+template<typename T, void (*F)(T*)>
+struct unique_deleter {
+    void operator()(T* p) {
+        F(p);
+    }
+};
+
+using heightfield_ptr = std::unique_ptr<rcHeightfield, unique_deleter<rcHeightfield, rcFreeHeightField>>;
+using compact_ptr =
+    std::unique_ptr<rcCompactHeightfield, unique_deleter<rcCompactHeightfield, rcFreeCompactHeightfield>>;
+using contours_ptr = std::unique_ptr<rcContourSet, unique_deleter<rcContourSet, rcFreeContourSet>>;
+using polymesh_ptr = std::unique_ptr<rcPolyMesh, unique_deleter<rcPolyMesh, rcFreePolyMesh>>;
+using detail_ptr =
+    std::unique_ptr<rcPolyMeshDetail, unique_deleter<rcPolyMeshDetail, rcFreePolyMeshDetail>>;
+using layers_ptr =
+    std::unique_ptr<rcHeightfieldLayerSet, unique_deleter<rcHeightfieldLayerSet, rcFreeHeightfieldLayerSet>>;
+
+bool load_params(const std::string& path, build_params& p, std::string& err) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        err = "can not open " + path;
+        return false;
+    }
+
+    std::unordered_map<std::string, float*> floats = {
+        { "cell_size", &p.cell_size },
+        { "cell_height", &p.cell_height },
+        { "agent_height", &p.agent_height },
+        { "agent_radius", &p.agent_radius },
+        { "agent_max_climb", &p.agent_max_climb },
+        { "agent_max_slope", &p.agent_max_slope },
+        { "region_min_size", &p.region_min_size },
+        { "region_merge_size", &p.region_merge_size },
+        { "edge_max_len", &p.edge_max_len },
+        { "edge_max_error", &p.edge_max_error },
+        { "detail_sample_dist", &p.detail_sample_dist },
+        { "detail_sample_max_error", &p.detail_sample_max_error },
+    };
+    std::unordered_map<std::string, int*> ints = {
+        { "verts_per_poly", &p.verts_per_poly },
+        { "tile_size", &p.tile_size },
+        { "max_obstacles", &p.max_obstacles },
+        { "threads", &p.threads },
+    };
+
+    std::string line;
+    int lineno = 0;
+    while (std::getline(in, line)) {
+        ++lineno;
+        if (auto pos = line.find_first_of("#;"); pos != std::string::npos)
+            line.erase(pos);
+        auto eq = line.find('=');
+        if (eq == std::string::npos) {
+            if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                err = path + ":" + std::to_string(lineno) + ": expected key = value";
+                return false;
+            }
+            continue;
+        }
+
+        std::string key, value;
+        std::istringstream(line.substr(0, eq)) >> key;
+        std::istringstream(line.substr(eq + 1)) >> value;
+
+        if (key == "format") {
+            p.format = value;
+        } else if (auto f = floats.find(key); f != floats.end()) {
+            *f->second = std::strtof(value.c_str(), nullptr);
+        } else if (auto i = ints.find(key); i != ints.end()) {
+            *i->second = std::atoi(value.c_str());
+        } else {
+            err = path + ":" + std::to_string(lineno) + ": unknown key '" + key + "'";
+            return false;
+        }
+    }
+
+    if (p.format != "mset" && p.format != "tset") {
+        err = "format must be mset or tset";
+        return false;
+    }
+    if (p.tile_size <= 0 || p.cell_size <= 0.0f || p.cell_height <= 0.0f) {
+        err = "tile_size, cell_size and cell_height must be positive";
+        return false;
+    }
+    p.verts_per_poly = std::clamp(p.verts_per_poly, 3, DT_VERTS_PER_POLYGON);
+    return true;
+}
+
+// v and f records only, polygons are fan triangulated
+bool load_obj(const std::string& path, geometry& geom, std::string& err) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        err = "can not open " + path;
+        return false;
+    }
+
+    std::string line;
+    std::vector<int> face;
+    while (std::getline(in, line)) {
+        if (line.size() < 2)
+            continue;
+        if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+            float x = 0, y = 0, z = 0;
+            if (std::sscanf(line.c_str() + 1, "%f %f %f", &x, &y, &z) == 3) {
+                geom.verts.push_back(x);
+                geom.verts.push_back(y);
+                geom.verts.push_back(z);
+            }
+        } else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+            face.clear();
+            std::istringstream ss(line.substr(2));
+            std::string token;
+            int nverts = (int)geom.verts.size() / 3;
+            while (ss >> token) {
+                int vi = std::atoi(token.c_str()); // "v/vt/vn" -> v
+                vi = vi < 0 ? nverts + vi : vi - 1;
+                if (vi < 0 || vi >= nverts) {
+                    err = "bad face index in " + path;
+                    return false;
+                }
+                face.push_back(vi);
+            }
+            for (size_t i = 2; i < face.size(); ++i) {
+                geom.tris.push_back(face[0]);
+                geom.tris.push_back(face[i - 1]);
+                geom.tris.push_back(face[i]);
+            }
+        }
+    }
+
+    if (geom.tris.empty()) {
+        err = path + " has no faces";
+        return false;
+    }
+    rcCalcBounds(geom.verts.data(), (int)geom.verts.size() / 3, geom.bmin, geom.bmax);
+    return true;
+}
+
+rcConfig make_config(const build_params& p) {
+    rcConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.cs = p.cell_size;
+    cfg.ch = p.cell_height;
+    cfg.walkableSlopeAngle = p.agent_max_slope;
+    cfg.walkableHeight = (int)ceilf(p.agent_height / cfg.ch);
+    cfg.walkableClimb = (int)floorf(p.agent_max_climb / cfg.ch);
+    cfg.walkableRadius = (int)ceilf(p.agent_radius / cfg.cs);
+    cfg.maxEdgeLen = (int)(p.edge_max_len / p.cell_size);
+    cfg.maxSimplificationError = p.edge_max_error;
+    cfg.minRegionArea = (int)rcSqr(p.region_min_size);
+    cfg.mergeRegionArea = (int)rcSqr(p.region_merge_size);
+    cfg.maxVertsPerPoly = p.verts_per_poly;
+    cfg.tileSize = p.tile_size;
+    cfg.borderSize = cfg.walkableRadius + 3;
+    cfg.width = cfg.tileSize + cfg.borderSize * 2;
+    cfg.height = cfg.tileSize + cfg.borderSize * 2;
+    cfg.detailSampleDist = p.detail_sample_dist < 0.9f ? 0 : p.cell_size * p.detail_sample_dist;
+    cfg.detailSampleMaxError = p.cell_height * p.detail_sample_max_error;
+    return cfg;
+}
+
+void tile_bounds(const rcConfig& base, const geometry& geom, int tx, int ty, rcConfig& cfg) {
+    const float tcs = base.tileSize * base.cs;
+    cfg = base;
+    cfg.bmin[0] = geom.bmin[0] + tx * tcs;
+    cfg.bmin[1] = geom.bmin[1];
+    cfg.bmin[2] = geom.bmin[2] + ty * tcs;
+    cfg.bmax[0] = geom.bmin[0] + (tx + 1) * tcs;
+    cfg.bmax[1] = geom.bmax[1];
+    cfg.bmax[2] = geom.bmin[2] + (ty + 1) * tcs;
+    cfg.bmin[0] -= cfg.borderSize * cfg.cs;
+    cfg.bmin[2] -= cfg.borderSize * cfg.cs;
+    cfg.bmax[0] += cfg.borderSize * cfg.cs;
+    cfg.bmax[2] += cfg.borderSize * cfg.cs;
+}
+
+tile_buckets bucket_triangles(const rcConfig& base, const geometry& geom) {
+    tile_buckets b;
+    int gw = 0, gh = 0;
+    rcCalcGridSize(geom.bmin, geom.bmax, base.cs, &gw, &gh);
+    b.tw = (gw + base.tileSize - 1) / base.tileSize;
+    b.th = (gh + base.tileSize - 1) / base.tileSize;
+    b.tris.resize((size_t)b.tw * b.th);
+
+    const float tcs = base.tileSize * base.cs;
+    const float border = base.borderSize * base.cs;
+    const int ntris = (int)geom.tris.size() / 3;
+    for (int i = 0; i < ntris; ++i) {
+        float tmin[2] = { FLT_MAX, FLT_MAX };
+        float tmax[2] = { -FLT_MAX, -FLT_MAX };
+        for (int k = 0; k < 3; ++k) {
+            const float* v = &geom.verts[geom.tris[i * 3 + k] * 3];
+            tmin[0] = std::min(tmin[0], v[0]);
+            tmin[1] = std::min(tmin[1], v[2]);
+            tmax[0] = std::max(tmax[0], v[0]);
+            tmax[1] = std::max(tmax[1], v[2]);
+        }
+        int x0 = std::clamp((int)floorf((tmin[0] - border - geom.bmin[0]) / tcs), 0, b.tw - 1);
+        int x1 = std::clamp((int)floorf((tmax[0] + border - geom.bmin[0]) / tcs), 0, b.tw - 1);
+        int y0 = std::clamp((int)floorf((tmin[1] - border - geom.bmin[2]) / tcs), 0, b.th - 1);
+        int y1 = std::clamp((int)floorf((tmax[1] + border - geom.bmin[2]) / tcs), 0, b.th - 1);
+        for (int y = y0; y <= y1; ++y)
+            for (int x = x0; x <= x1; ++x)
+                b.tris[(size_t)y * b.tw + x].push_back(i);
+    }
+    return b;
+}
+
+// rasterize the tile's triangles into a compact heightfield
+compact_ptr build_compact(
+    rcContext& ctx,
+    const rcConfig& cfg,
+    const geometry& geom,
+    const std::vector<int>& tile_tris,
+    build_report& report
+) {
+    heightfield_ptr solid(rcAllocHeightfield());
+    if (!solid || !rcCreateHeightfield(&ctx, *solid, cfg.width, cfg.height, cfg.bmin, cfg.bmax, cfg.cs, cfg.ch))
+        return nullptr;
+
+    {
+        stage_timer t(report.rasterize);
+        std::vector<int> tris;
+        tris.reserve(tile_tris.size() * 3);
+        for (int i: tile_tris) {
+            tris.insert(tris.end(), &geom.tris[i * 3], &geom.tris[i * 3] + 3);
+        }
+        const int nverts = (int)geom.verts.size() / 3;
+        const int ntris = (int)tile_tris.size();
+        std::vector<unsigned char> areas(ntris, 0);
+        rcMarkWalkableTriangles(&ctx, cfg.walkableSlopeAngle, geom.verts.data(), nverts, tris.data(), ntris, areas.data());
+        if (!rcRasterizeTriangles(&ctx, geom.verts.data(), nverts, tris.data(), areas.data(), ntris, *solid, cfg.walkableClimb))
+            return nullptr;
+    }
+
+    compact_ptr chf(rcAllocCompactHeightfield());
+    {
+        stage_timer t(report.filter);
+        rcFilterLowHangingWalkableObstacles(&ctx, cfg.walkableClimb, *solid);
+        rcFilterLedgeSpans(&ctx, cfg.walkableHeight, cfg.walkableClimb, *solid);
+        rcFilterWalkableLowHeightSpans(&ctx, cfg.walkableHeight, *solid);
+        if (!chf || !rcBuildCompactHeightfield(&ctx, cfg.walkableHeight, cfg.walkableClimb, *solid, *chf))
+            return nullptr;
+        if (!rcErodeWalkableArea(&ctx, cfg.walkableRadius, *chf))
+            return nullptr;
+    }
+    return chf;
+}
+
+bool build_mset_tile(
+    rcContext& ctx,
+    const rcConfig& cfg,
+    const geometry& geom,
+    const std::vector<int>& tile_tris,
+    int tx,
+    int ty,
+    const build_params& p,
+    tile_result& out,
+    build_report& report
+) {
+    compact_ptr chf = build_compact(ctx, cfg, geom, tile_tris, report);
+    if (!chf)
+        return false;
+
+    {
+        stage_timer t(report.regions);
+        if (!rcBuildDistanceField(&ctx, *chf))
+            return false;
+        if (!rcBuildRegions(&ctx, *chf, cfg.borderSize, cfg.minRegionArea, cfg.mergeRegionArea))
+            return false;
+    }
+
+    contours_ptr cset(rcAllocContourSet());
+    {
+        stage_timer t(report.contours);
+        if (!cset || !rcBuildContours(&ctx, *chf, cfg.maxSimplificationError, cfg.maxEdgeLen, *cset))
+            return false;
+    }
+    if (cset->nconts == 0)
+        return true;
+
+    polymesh_ptr pmesh(rcAllocPolyMesh());
+    {
+        stage_timer t(report.polymesh);
+        if (!pmesh || !rcBuildPolyMesh(&ctx, *cset, cfg.maxVertsPerPoly, *pmesh))
+            return false;
+    }
+
+    detail_ptr dmesh(rcAllocPolyMeshDetail());
+    {
+        stage_timer t(report.detail);
+        if (!dmesh || !rcBuildPolyMeshDetail(&ctx, *pmesh, *chf, cfg.detailSampleDist, cfg.detailSampleMaxError, *dmesh))
+            return false;
+    }
+
+    if (pmesh->npolys == 0)
+        return true;
+
+    stage_timer t(report.create);
+    for (int i = 0; i < pmesh->npolys; ++i) {
+        if (pmesh->areas[i] == RC_WALKABLE_AREA)
+            pmesh->areas[i] = pluto::POLYAREA_GROUND;
+        if (pmesh->areas[i] == pluto::POLYAREA_GROUND)
+            pmesh->flags[i] = pluto::POLYFLAGS_WALK;
+    }
+
+    dtNavMeshCreateParams params;
+    memset(&params, 0, sizeof(params));
+    params.verts = pmesh->verts;
+    params.vertCount = pmesh->nverts;
+    params.polys = pmesh->polys;
+    params.polyAreas = pmesh->areas;
+    params.polyFlags = pmesh->flags;
+    params.polyCount = pmesh->npolys;
+    params.nvp = pmesh->nvp;
+    params.detailMeshes = dmesh->meshes;
+    params.detailVerts = dmesh->verts;
+    params.detailVertsCount = dmesh->nverts;
+    params.detailTris = dmesh->tris;
+    params.detailTriCount = dmesh->ntris;
+    params.walkableHeight = p.agent_height;
+    params.walkableRadius = p.agent_radius;
+    params.walkableClimb = p.agent_max_climb;
+    params.tileX = tx;
+    params.tileY = ty;
+    params.tileLayer = 0;
+    rcVcopy(params.bmin, pmesh->bmin);
+    rcVcopy(params.bmax, pmesh->bmax);
+    params.cs = cfg.cs;
+    params.ch = cfg.ch;
+    params.buildBvTree = true;
+
+    unsigned char* data = nullptr;
+    int size = 0;
+    if (!dtCreateNavMeshData(&params, &data, &size))
+        return false;
+    out.data.emplace_back(data, size);
+    return true;
+}
+
+bool build_tset_tile(
+    rcContext& ctx,
+    const rcConfig& cfg,
+    const geometry& geom,
+    const std::vector<int>& tile_tris,
+    int tx,
+    int ty,
+    tile_result& out,
+    build_report& report
+) {
+    compact_ptr chf = build_compact(ctx, cfg, geom, tile_tris, report);
+    if (!chf)
+        return false;
+
+    layers_ptr lset(rcAllocHeightfieldLayerSet());
+    {
+        stage_timer t(report.regions);
+        if (!lset || !rcBuildHeightfieldLayers(&ctx, *chf, cfg.borderSize, cfg.walkableHeight, *lset))
+            return false;
+    }
+
+    stage_timer t(report.create);
+    pluto::FastLZCompressor comp;
+    for (int i = 0; i < std::min(lset->nlayers, MAX_LAYERS); ++i) {
+        const rcHeightfieldLayer* layer = &lset->layers[i];
+
+        dtTileCacheLayerHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = DT_TILECACHE_MAGIC;
+        header.version = DT_TILECACHE_VERSION;
+        header.tx = tx;
+        header.ty = ty;
+        header.tlayer = i;
+        dtVcopy(header.bmin, layer->bmin);
+        dtVcopy(header.bmax, layer->bmax);
+        header.width = (unsigned char)layer->width;
+        header.height = (unsigned char)layer->height;
+        header.minx = (unsigned char)layer->minx;
+        header.maxx = (unsigned char)layer->maxx;
+        header.miny = (unsigned char)layer->miny;
+        header.maxy = (unsigned char)layer->maxy;
+        header.hmin = (unsigned short)layer->hmin;
+        header.hmax = (unsigned short)layer->hmax;
+
+        unsigned char* data = nullptr;
+        int size = 0;
+        dtStatus status = dtBuildTileCacheLayer(&comp, &header, layer->heights, layer->areas, layer->cons, &data, &size);
+        if (dtStatusFailed(status))
+            return false;
+        out.data.emplace_back(data, size);
+    }
+    return true;
+}
+
+void compute_mesh_params(const geometry& geom, const rcConfig& cfg, int tiles, dtNavMeshParams& params) {
+    int tileBits = std::min((int)dtIlog2(dtNextPow2(tiles)), 14);
+    int polyBits = 22 - tileBits;
+    memset(&params, 0, sizeof(params));
+    rcVcopy(params.orig, geom.bmin);
+    params.tileWidth = cfg.tileSize * cfg.cs;
+    params.tileHeight = cfg.tileSize * cfg.cs;
+    params.maxTiles = 1 << tileBits;
+    params.maxPolys = 1 << polyBits;
+}
+
+// Writes <path>.tmp and renames it over path once everything is written. A
+// server may map the old file (mapped_file.hpp), so it's never truncated in
+// place, and a short write never leaves a truncated asset behind.
+class file_writer {
+public:
+    explicit file_writer(const std::string& path)
+        : path_(path)
+        , tmp_(path + ".tmp") {}
+
+    file_writer(const file_writer&) = delete;
+    file_writer& operator=(const file_writer&) = delete;
+
+    ~file_writer() {
+        if (fp_) {
+            fclose(fp_);
+            std::remove(tmp_.c_str());
+        }
+    }
+
+    bool open(std::string& err) {
+        fp_ = fopen(tmp_.c_str(), "wb");
+        if (!fp_) {
+            err = "can not write " + tmp_;
+            return false;
+        }
+        return true;
+    }
+
+    void write(const void* data, size_t size) {
+        if (ok_ && size > 0 && fwrite(data, size, 1, fp_) != 1)
+            ok_ = false;
+    }
+
+    bool commit(std::string& err) {
+        FILE* fp = fp_;
+        fp_ = nullptr;
+        if (fclose(fp) != 0)
+            ok_ = false;
+        if (!ok_) {
+            std::remove(tmp_.c_str());
+            err = "write failed: " + tmp_;
+            return false;
+        }
+#ifdef _WIN32
+        bool renamed = MoveFileExA(tmp_.c_str(), path_.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        bool renamed = std::rename(tmp_.c_str(), path_.c_str()) == 0;
+#endif
+        if (!renamed) {
+            std::remove(tmp_.c_str());
+            err = "can not rename " + tmp_ + " to " + path_;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::string path_;
+    std::string tmp_;
+    FILE* fp_ = nullptr;
+    bool ok_ = true;
+};
+
+bool write_mset(const std::string& path, const dtNavMeshParams& params, std::vector<tile_result>& tiles, size_t& bytes, std::string& err) {
+    auto mesh = std::unique_ptr<dtNavMesh, unique_deleter<dtNavMesh, dtFreeNavMesh>>(dtAllocNavMesh());
+    if (!mesh || dtStatusFailed(mesh->init(&params))) {
+        err = "navmesh init failed";
+        return false;
+    }
+
+    for (auto& tile: tiles) {
+        for (auto& [data, size]: tile.data) {
+            if (dtStatusFailed(mesh->addTile(data, size, DT_TILE_FREE_DATA, 0, nullptr))) {
+                dtFree(data);
+                err = "addTile failed, raise tile_size or lower the poly count per tile";
+                return false;
+            }
+            data = nullptr;
+        }
+    }
+
+    file_writer out(path);
+    if (!out.open(err))
+        return false;
+
+    const dtNavMesh* cmesh = mesh.get();
+    navmesh::NavMeshSetHeader header;
+    header.magic = navmesh::NAVMESHSET_MAGIC;
+    header.version = navmesh::NAVMESHSET_VERSION;
+    header.numTiles = 0;
+    for (int i = 0; i < cmesh->getMaxTiles(); ++i) {
+        const dtMeshTile* tile = cmesh->getTile(i);
+        if (tile && tile->header && tile->dataSize)
+            header.numTiles++;
+    }
+    memcpy(&header.params, cmesh->getParams(), sizeof(dtNavMeshParams));
+    out.write(&header, sizeof(header));
+    bytes = sizeof(header);
+
+    for (int i = 0; i < cmesh->getMaxTiles(); ++i) {
+        const dtMeshTile* tile = cmesh->getTile(i);
+        if (!tile || !tile->header || !tile->dataSize)
+            continue;
+        navmesh::NavMeshTileHeader th;
+        th.tileRef = cmesh->getTileRef(tile);
+        th.dataSize = tile->dataSize;
+        out.write(&th, sizeof(th));
+        out.write(tile->data, tile->dataSize);
+        bytes += sizeof(th) + tile->dataSize;
+    }
+    return out.commit(err);
+}
+
+bool write_tset(
+    const std::string& path,
+    const dtNavMeshParams& meshParams,
+    const dtTileCacheParams& cacheParams,
+    std::vector<tile_result>& tiles,
+    size_t& bytes,
+    std::string& err
+) {
+    pluto::LinearAllocator talloc(32 * 1024);
+    pluto::FastLZCompressor tcomp;
+    pluto::MeshProcess tmproc;
+    auto tilecache = std::unique_ptr<dtTileCache, unique_deleter<dtTileCache, dtFreeTileCache>>(dtAllocTileCache());
+    if (!tilecache || dtStatusFailed(tilecache->init(&cacheParams, &talloc, &tcomp, &tmproc))) {
+        err = "tile cache init failed";
+        return false;
+    }
+
+    for (auto& tile: tiles) {
+        for (auto& [data, size]: tile.data) {
+            if (dtStatusFailed(tilecache->addTile(data, size, DT_COMPRESSEDTILE_FREE_DATA, nullptr))) {
+                dtFree(data);
+                err = "tile cache addTile failed";
+                return false;
+            }
+            data = nullptr;
+        }
+    }
+
+    file_writer out(path);
+    if (!out.open(err))
+        return false;
+
+    const dtTileCache* ccache = tilecache.get();
+    navmesh::TileCacheSetHeader header;
+    header.magic = navmesh::TILECACHESET_MAGIC;
+    header.version = navmesh::TILECACHESET_VERSION;
+    header.numTiles = 0;
+    for (int i = 0; i < ccache->getTileCount(); ++i) {
+        const dtCompressedTile* tile = ccache->getTile(i);
+        if (tile && tile->header && tile->dataSize)
+            header.numTiles++;
+    }
+    memcpy(&header.meshParams, &meshParams, sizeof(dtNavMeshParams));
+    memcpy(&header.cacheParams, &cacheParams, sizeof(dtTileCacheParams));
+    out.write(&header, sizeof(header));
+    bytes = sizeof(header);
+
+    for (int i = 0; i < ccache->getTileCount(); ++i) {
+        const dtCompressedTile* tile = ccache->getTile(i);
+        if (!tile || !tile->header || !tile->dataSize)
+            continue;
+        navmesh::TileCacheTileHeader th;
+        th.tileRef = tilecache->getTileRef(tile);
+        th.dataSize = tile->dataSize;
+        out.write(&th, sizeof(th));
+        out.write(tile->data, tile->dataSize);
+        bytes += sizeof(th) + tile->dataSize;
+    }
+    return out.commit(err);
+}
+
+double ms(int64_t us) {
+    return (double)us / 1000.0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const bool allow_partial = argc == 5 && strcmp(argv[4], "--allow-partial") == 0;
+    if (argc < 4 || (argc > 4 && !allow_partial)) {
+        fprintf(stderr, "usage: %s <input.obj> <params.ini> <output> [--allow-partial]\n", argv[0]);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string err;
+
+    build_params p;
+    if (!load_params(argv[2], p, err)) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+
+    geometry geom;
+    if (!load_obj(argv[1], geom, err)) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+    auto loaded = std::chrono::steady_clock::now();
+
+    const bool tset = p.format == "tset";
+    rcConfig base = make_config(p);
+    rcVcopy(base.bmin, geom.bmin);
+    rcVcopy(base.bmax, geom.bmax);
+    tile_buckets buckets = bucket_triangles(base, geom);
+
+    int threads = p.threads > 0 ? p.threads : (int)std::thread::hardware_concurrency();
+    threads = std::clamp(threads, 1, buckets.tw * buckets.th);
+
+    build_report report;
+    std::vector<tile_result> results((size_t)buckets.tw * buckets.th);
+    std::atomic<int> next { 0 };
+
+    auto worker = [&] {
+        rcContext ctx(false);
+        for (int i = next++; i < (int)results.size(); i = next++) {
+            const auto& tris = buckets.tris[i];
+            if (tris.empty()) {
+                ++report.empty;
+                continue;
+            }
+
+            int tx = i % buckets.tw;
+            int ty = i / buckets.tw;
+            rcConfig cfg;
+            tile_bounds(base, geom, tx, ty, cfg);
+
+            bool ok = tset ? build_tset_tile(ctx, cfg, geom, tris, tx, ty, results[i], report)
+                           : build_mset_tile(ctx, cfg, geom, tris, tx, ty, p, results[i], report);
+            if (!ok)
+                ++report.failed;
+            else if (results[i].data.empty())
+                ++report.empty;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& t: pool)
+        t.join();
+    auto built = std::chrono::steady_clock::now();
+
+    size_t layers = 0;
+    for (const auto& r: results)
+        layers += r.data.size();
+
+    size_t bytes = 0;
+    bool written = false;
+    if (report.failed > 0 && !allow_partial) {
+        err = std::to_string(report.failed.load()) + " tiles failed, " + argv[3] + " is not written (--allow-partial writes it)";
+    } else if (tset) {
+        dtTileCacheParams tcparams;
+        memset(&tcparams, 0, sizeof(tcparams));
+        rcVcopy(tcparams.orig, geom.bmin);
+        tcparams.cs = base.cs;
+        tcparams.ch = base.ch;
+        tcparams.width = base.tileSize;
+        tcparams.height = base.tileSize;
+        tcparams.walkableHeight = p.agent_height;
+        tcparams.walkableRadius = p.agent_radius;
+        tcparams.walkableClimb = p.agent_max_climb;
+        tcparams.maxSimplificationError = p.edge_max_error;
+        tcparams.maxTiles = buckets.tw * buckets.th * EXPECTED_LAYERS_PER_TILE;
+        tcparams.maxObstacles = p.max_obstacles;
+
+        dtNavMeshParams params;
+        compute_mesh_params(geom, base, tcparams.maxTiles, params);
+        written = write_tset(argv[3], params, tcparams, results, bytes, err);
+    } else {
+        dtNavMeshParams params;
+        compute_mesh_params(geom, base, buckets.tw * buckets.th, params);
+        written = write_mset(argv[3], params, results, bytes, err);
+    }
+
+    for (auto& r: results)
+        for (auto& d: r.data)
+            dtFree(d.first);
+
+    if (!written) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return report.failed > 0 ? 2 : 1;
+    }
+    auto done = std::chrono::steady_clock::now();
+
+    auto elapsed = [](auto a, auto b) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count();
+    };
+
+    printf("input      %s: %zu verts, %zu tris\n", argv[1], geom.verts.size() / 3, geom.tris.size() / 3);
+    printf("output     %s (%s): %zu bytes\n", argv[3], p.format.c_str(), bytes);
+    printf("tiles      %d x %d, %zu %s, %d empty, %d failed\n",
+        buckets.tw, buckets.th, layers, tset ? "layers" : "tiles", report.empty.load(), report.failed.load());
+    printf("threads    %d\n", threads);
+    printf("load       %8.1f ms\n", ms(elapsed(start, loaded)));
+    printf("build      %8.1f ms wall\n", ms(elapsed(loaded, built)));
+    printf("  rasterize %8.1f ms\n", ms(report.rasterize));
+    printf("  filter    %8.1f ms\n", ms(report.filter));
+    printf("  %s %8.1f ms\n", tset ? "layers   " : "regions  ", ms(report.regions));
+    if (!tset) {
+        printf("  contours  %8.1f ms\n", ms(report.contours));
+        printf("  polymesh  %8.1f ms\n", ms(report.polymesh));
+        printf("  detail    %8.1f ms\n", ms(report.detail));
+    }
+    printf("  %s %8.1f ms\n", tset ? "compress " : "create   ", ms(report.create));
+    printf("write      %8.1f ms\n", ms(elapsed(built, done)));
+    printf("total      %8.1f ms\n", ms(elapsed(start, done)));
+    return report.failed > 0 ? 2 : 0;
+}
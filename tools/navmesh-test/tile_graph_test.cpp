@@ -0,0 +1,240 @@
+//
+// tile_graph regression test: builds a 4x4 tile plane with Recast and checks
+// that every leg of an abstract path stays in one tile and can be walked by
+// findPath, also when the route follows two portals of one tile without
+// crossing the first one.
+//
+// usage: tile_graph_test, exits with 0 when all checks pass
+//
+#include <cstdio>
+#include <vector>
+
+#include <DetourNavMeshBuilder.h>
+#include <Recast.h>
+
+#include "tile_graph.hpp"
+
+namespace {
+
+constexpr float CELL_SIZE = 0.25f;
+constexpr float CELL_HEIGHT = 0.2f;
+constexpr int TILE_CELLS = 64; // 16 units per tile
+constexpr int TILES = 4;
+constexpr float SIZE = TILE_CELLS * CELL_SIZE * TILES;
+constexpr unsigned char COSTLY_AREA = 2;
+constexpr int MAX_POLYS = 2048;
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures; \
+        } \
+    } while (0)
+
+struct geometry {
+    std::vector<float> verts;
+    std::vector<int> tris;
+
+    void quad(float x0, float z0, float x1, float z1) {
+        const int b = (int)verts.size() / 3;
+        const float v[] = { x0, 0, z0, x1, 0, z0, x1, 0, z1, x0, 0, z1 };
+        const int t[] = { b, b + 2, b + 1, b, b + 3, b + 2 };
+        verts.insert(verts.end(), v, v + 12);
+        tris.insert(tris.end(), t, t + 6);
+    }
+};
+
+// a tile of the plane, the strip at x in [28, 32] of the first tile row is
+// COSTLY_AREA, so routes leaving it prefer the portal at x = 32
+bool build_tile(rcContext& ctx, const geometry& geom, int tx, int ty, dtNavMesh& mesh) {
+    rcConfig cfg {};
+    cfg.cs = CELL_SIZE;
+    cfg.ch = CELL_HEIGHT;
+    cfg.walkableSlopeAngle = 45.0f;
+    cfg.walkableHeight = 10;
+    cfg.walkableClimb = 2;
+    cfg.walkableRadius = 2;
+    cfg.maxEdgeLen = 48;
+    cfg.maxSimplificationError = 1.3f;
+    cfg.minRegionArea = 8;
+    cfg.mergeRegionArea = 20;
+    cfg.maxVertsPerPoly = 6;
+    cfg.detailSampleDist = 6.0f * CELL_SIZE;
+    cfg.detailSampleMaxError = CELL_HEIGHT;
+    cfg.tileSize = TILE_CELLS;
+    cfg.borderSize = cfg.walkableRadius + 3;
+    cfg.width = cfg.tileSize + cfg.borderSize * 2;
+    cfg.height = cfg.width;
+    const float tile_width = TILE_CELLS * CELL_SIZE;
+    const float border = cfg.borderSize * CELL_SIZE;
+    cfg.bmin[0] = tx * tile_width - border;
+    cfg.bmin[1] = -1.0f;
+    cfg.bmin[2] = ty * tile_width - border;
+    cfg.bmax[0] = (tx + 1) * tile_width + border;
+    cfg.bmax[1] = 10.0f;
+    cfg.bmax[2] = (ty + 1) * tile_width + border;
+
+    const int nverts = (int)geom.verts.size() / 3;
+    const int ntris = (int)geom.tris.size() / 3;
+    std::vector<unsigned char> areas(ntris, 0);
+    rcHeightfield* hf = rcAllocHeightfield();
+    rcCompactHeightfield* chf = rcAllocCompactHeightfield();
+    rcContourSet* cset = rcAllocContourSet();
+    rcPolyMesh* pmesh = rcAllocPolyMesh();
+    rcPolyMeshDetail* dmesh = rcAllocPolyMeshDetail();
+    bool ok = rcCreateHeightfield(&ctx, *hf, cfg.width, cfg.height, cfg.bmin, cfg.bmax, cfg.cs, cfg.ch);
+    if (ok) {
+        rcMarkWalkableTriangles(&ctx, cfg.walkableSlopeAngle, geom.verts.data(), nverts, geom.tris.data(), ntris, areas.data());
+        ok = rcRasterizeTriangles(&ctx, geom.verts.data(), nverts, geom.tris.data(), areas.data(), ntris, *hf, cfg.walkableClimb)
+            && rcBuildCompactHeightfield(&ctx, cfg.walkableHeight, cfg.walkableClimb, *hf, *chf)
+            && rcErodeWalkableArea(&ctx, cfg.walkableRadius, *chf);
+    }
+    if (ok) {
+        const float bmin[3] = { 28.0f, -1.0f, -1.0f };
+        const float bmax[3] = { 33.0f, 10.0f, 17.0f };
+        rcMarkBoxArea(&ctx, bmin, bmax, COSTLY_AREA, *chf);
+        ok = rcBuildDistanceField(&ctx, *chf)
+            && rcBuildRegions(&ctx, *chf, cfg.borderSize, cfg.minRegionArea, cfg.mergeRegionArea)
+            && rcBuildContours(&ctx, *chf, cfg.maxSimplificationError, cfg.maxEdgeLen, *cset)
+            && rcBuildPolyMesh(&ctx, *cset, cfg.maxVertsPerPoly, *pmesh)
+            && rcBuildPolyMeshDetail(&ctx, *pmesh, *chf, cfg.detailSampleDist, cfg.detailSampleMaxError, *dmesh);
+    }
+    if (ok && pmesh->npolys > 0) {
+        for (int i = 0; i < pmesh->npolys; ++i) {
+            if (pmesh->areas[i] == RC_WALKABLE_AREA)
+                pmesh->areas[i] = 0;
+            pmesh->flags[i] = 1;
+        }
+        dtNavMeshCreateParams params {};
+        params.verts = pmesh->verts;
+        params.vertCount = pmesh->nverts;
+        params.polys = pmesh->polys;
+        params.polyAreas = pmesh->areas;
+        params.polyFlags = pmesh->flags;
+        params.polyCount = pmesh->npolys;
+        params.nvp = pmesh->nvp;
+        params.detailMeshes = dmesh->meshes;
+        params.detailVerts = dmesh->verts;
+        params.detailVertsCount = dmesh->nverts;
+        params.detailTris = dmesh->tris;
+        params.detailTriCount = dmesh->ntris;
+        params.walkableHeight = cfg.walkableHeight * cfg.ch;
+        params.walkableRadius = cfg.walkableRadius * cfg.cs;
+        params.walkableClimb = cfg.walkableClimb * cfg.ch;
+        params.tileX = tx;
+        params.tileY = ty;
+        rcVcopy(params.bmin, pmesh->bmin);
+        rcVcopy(params.bmax, pmesh->bmax);
+        params.cs = cfg.cs;
+        params.ch = cfg.ch;
+        params.buildBvTree = true;
+        unsigned char* data = nullptr;
+        int size = 0;
+        ok = dtCreateNavMeshData(&params, &data, &size);
+        if (ok && dtStatusFailed(mesh.addTile(data, size, DT_TILE_FREE_DATA, 0, nullptr))) {
+            dtFree(data);
+            ok = false;
+        }
+    }
+    rcFreePolyMeshDetail(dmesh);
+    rcFreePolyMesh(pmesh);
+    rcFreeContourSet(cset);
+    rcFreeCompactHeightfield(chf);
+    rcFreeHeightField(hf);
+    return ok;
+}
+
+dtNavMesh* build_mesh() {
+    geometry geom;
+    geom.quad(0.0f, 0.0f, SIZE, SIZE);
+
+    dtNavMeshParams params {};
+    params.tileWidth = TILE_CELLS * CELL_SIZE;
+    params.tileHeight = params.tileWidth;
+    params.maxTiles = TILES * TILES;
+    params.maxPolys = 1 << 14;
+    dtNavMesh* mesh = dtAllocNavMesh();
+    if (nullptr == mesh || dtStatusFailed(mesh->init(&params))) {
+        dtFreeNavMesh(mesh);
+        return nullptr;
+    }
+    rcContext ctx(false);
+    for (int ty = 0; ty < TILES; ++ty) {
+        for (int tx = 0; tx < TILES; ++tx) {
+            if (!build_tile(ctx, geom, tx, ty, *mesh)) {
+                dtFreeNavMesh(mesh);
+                return nullptr;
+            }
+        }
+    }
+    return mesh;
+}
+
+// searches from start to end and checks the legs, returns the number of legs
+// that start in the tile the previous one ended in
+int check_route(const dtNavMesh& mesh, dtNavMeshQuery& query, const dtQueryFilter& filter, const pluto::tile_graph& graph, const float* start, const float* end) {
+    const float ext[3] = { 2.0f, 4.0f, 2.0f };
+    dtPolyRef startRef = 0;
+    dtPolyRef endRef = 0;
+    float spos[3];
+    float epos[3];
+    query.findNearestPoly(start, ext, &filter, &startRef, spos);
+    query.findNearestPoly(end, ext, &filter, &endRef, epos);
+    CHECK(startRef != 0 && endRef != 0);
+
+    std::vector<pluto::tile_graph::leg> legs;
+    CHECK(graph.search(mesh, filter, startRef, spos, endRef, epos, legs));
+    CHECK(!legs.empty() && legs.front().fromRef == startRef && legs.back().toRef == endRef);
+
+    int same_tile = 0;
+    dtPolyRef polys[MAX_POLYS];
+    for (size_t i = 0; i < legs.size(); ++i) {
+        const auto& l = legs[i];
+        CHECK(mesh.decodePolyIdTile(l.fromRef) == mesh.decodePolyIdTile(l.toRef));
+        int n = 0;
+        dtStatus status = query.findPath(l.fromRef, l.toRef, l.from, l.to, &filter, polys, &n, MAX_POLYS);
+        CHECK(dtStatusSucceed(status) && !dtStatusDetail(status, DT_PARTIAL_RESULT) && n > 0 && polys[n - 1] == l.toRef);
+        if (i > 0 && mesh.decodePolyIdTile(legs[i - 1].toRef) == mesh.decodePolyIdTile(l.fromRef))
+            ++same_tile;
+    }
+    return same_tile;
+}
+
+} // namespace
+
+int main() {
+    dtNavMesh* mesh = build_mesh();
+    if (nullptr == mesh) {
+        fprintf(stderr, "can't build the navmesh\n");
+        return 1;
+    }
+    dtNavMeshQuery query;
+    CHECK(dtStatusSucceed(query.init(mesh, 65535)));
+    dtQueryFilter filter;
+    filter.setAreaCost(COSTLY_AREA, 10.0f);
+    pluto::tile_graph graph;
+    CHECK(graph.build(*mesh, filter));
+    CHECK(graph.portal_count() > 0);
+
+    // from the costly strip to the second tile row, the route leaves the strip
+    // by the portal at x = 32 and follows the portals of the tile above it
+    const float start[3] = { 30.0f, 0.0f, 2.0f };
+    const float end[3] = { 32.5f, 0.0f, 32.5f };
+    CHECK(check_route(*mesh, query, filter, graph, start, end) > 0);
+
+    // across the whole plane
+    const float far_start[3] = { 2.0f, 0.0f, 2.0f };
+    const float far_end[3] = { 62.0f, 0.0f, 62.0f };
+    check_route(*mesh, query, filter, graph, far_start, far_end);
+
+    dtFreeNavMesh(mesh);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("ok");
+    return 0;
+}